@@ -0,0 +1,86 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__ACTIVITY_HISTOGRAM_HPP_
+#define ROSBAG2_STORAGE_MCAP__ACTIVITY_HISTOGRAM_HPP_
+
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <map>
+#include <optional>
+#include <string>
+
+namespace rosbag2_storage_mcap
+{
+/**
+ * Number of messages and bytes written on each topic, in fixed log time buckets. The writer
+ * records one for the whole file in a Metadata record, so the activity of a bag can be shown
+ * without reading its messages or indexes.
+ */
+class ActivityHistogram final
+{
+public:
+  /// Name of the Metadata record holding the histogram.
+  static constexpr const char * METADATA_NAME = "rosbag2_storage_mcap.activity_histogram";
+
+  struct Bucket
+  {
+    uint64_t message_count = 0;
+    uint64_t byte_count = 0;
+  };
+
+  struct Series
+  {
+    // By the log time at which they start, a multiple of the bucket duration; only buckets with
+    // messages are kept, so stray log times far from the others cost one bucket each.
+    std::map<mcap::Timestamp, Bucket> buckets;
+  };
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  explicit ActivityHistogram(mcap::Timestamp bucket_duration);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void add(const std::string & topic, mcap::Timestamp log_time, uint64_t bytes);
+
+  /**
+   * Add the messages counted by `other`, as when a file is appended to. Returns false, adding
+   * nothing, if `other` has another bucket duration.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  bool merge(const ActivityHistogram & other);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Timestamp bucket_duration() const;
+
+  /// Histogram of each topic which has at least one message.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const std::map<std::string, Series> & topics() const;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Metadata to_metadata() const;
+
+  /// Returns std::nullopt if `metadata` is not a valid histogram record.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static std::optional<ActivityHistogram> from_metadata(const mcap::Metadata & metadata);
+
+private:
+  mcap::Timestamp bucket_duration_;
+  std::map<std::string, Series> topics_;
+};
+
+}  // namespace rosbag2_storage_mcap
+
+#endif  // ROSBAG2_STORAGE_MCAP__ACTIVITY_HISTOGRAM_HPP_
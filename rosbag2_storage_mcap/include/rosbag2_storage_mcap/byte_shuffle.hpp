@@ -0,0 +1,56 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__BYTE_SHUFFLE_HPP_
+#define ROSBAG2_STORAGE_MCAP__BYTE_SHUFFLE_HPP_
+
+#include "visibility_control.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace rosbag2_storage_mcap::internal
+{
+/**
+ * Channel metadata key holding the element size the payloads of the channel were byte-shuffled
+ * with before being written.
+ */
+constexpr const char * BYTE_SHUFFLE_METADATA = "rosbag2_storage_mcap.byte_shuffle";
+
+/// Largest element size payloads can be shuffled with.
+constexpr uint32_t MAX_SHUFFLE_ELEMENT_SIZE = 16;
+
+/**
+ * Byte-shuffle `size` bytes from `input` to `output`, as Blosc does: the payload is seen as an
+ * array of `element_size`-byte elements, and the first byte of every element is written first,
+ * then the second byte of every element, and so on. The bytes of numeric arrays which vary
+ * slowly, such as the exponents of floats or the high bytes of depths, then end up next to each
+ * other and compress much better. Trailing bytes which do not fill an element are copied as is.
+ *
+ * Only whole payloads are shuffled: a numeric array at any offset in the payload keeps each byte
+ * of its elements in a single lane, so the serialized header around it does not need to be
+ * parsed.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+void byte_shuffle(const std::byte * input, uint64_t size, uint32_t element_size,
+                  std::byte * output);
+
+/// Reverse byte_shuffle().
+ROSBAG2_STORAGE_MCAP_PUBLIC
+void byte_unshuffle(const std::byte * input, uint64_t size, uint32_t element_size,
+                    std::byte * output);
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__BYTE_SHUFFLE_HPP_
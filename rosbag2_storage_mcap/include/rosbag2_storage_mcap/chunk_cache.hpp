@@ -0,0 +1,126 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__CHUNK_CACHE_HPP_
+#define ROSBAG2_STORAGE_MCAP__CHUNK_CACHE_HPP_
+
+#include "summary_cache.hpp"
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace rosbag2_storage_mcap::internal
+{
+/// The decompressed records section of a chunk, shared between all readers of that chunk.
+using ChunkRecords = std::shared_ptr<const mcap::ByteArray>;
+
+struct ChunkKey
+{
+  FileIdentity file;
+  uint64_t chunk_offset = 0;
+
+  bool operator==(const ChunkKey & other) const
+  {
+    return chunk_offset == other.chunk_offset && file == other.file;
+  }
+};
+
+struct ChunkKeyHash
+{
+  std::size_t operator()(const ChunkKey & key) const
+  {
+    std::size_t h = FileIdentityHash()(key.file);
+    return h ^ (std::hash<uint64_t>()(key.chunk_offset) + 0x9e3779b9 + (h << 6) + (h >> 2));
+  }
+};
+
+/**
+ * Thread-safe, process-wide cache of decompressed chunks, bounded by the total size of the
+ * decompressed data. Decompression is single-flight: when several readers ask for the same chunk
+ * at once, one of them decompresses it and the others wait for the result.
+ */
+class ChunkCache final
+{
+public:
+  using Loader = std::function<mcap::Status(mcap::ByteArray *)>;
+  /// Checks records which were cached by a loader that did not check them.
+  using Verifier = std::function<mcap::Status(const mcap::ByteArray &)>;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static ChunkCache & instance();
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  explicit ChunkCache(uint64_t capacity_bytes);
+
+  /// Grow the capacity to at least `capacity_bytes`. The capacity is never reduced.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void reserve(uint64_t capacity_bytes);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t capacity() const;
+
+  /// Total size of the decompressed chunks currently held.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t size() const;
+
+  /**
+   * Return the cached records for `key` in `records`, or call `load` to produce them. Failed
+   * loads are reported to every caller waiting on the same chunk, and are not cached.
+   *
+   * Callers passing `verify` must give a `load` which checks the records it produces. Cached
+   * records loaded without a check are passed to `verify` before they are returned, and are
+   * dropped from the cache if they fail it.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Status get_or_load(const ChunkKey & key, const Loader & load, ChunkRecords * records,
+                           const Verifier & verify = nullptr);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void clear();
+
+private:
+  using Result = std::pair<mcap::Status, ChunkRecords>;
+  struct Entry
+  {
+    ChunkKey key;
+    std::shared_future<Result> result;
+    // Zero until the load completes.
+    uint64_t bytes = 0;
+    // Whether the records were checked, by the loader or a Verifier.
+    bool verified = false;
+  };
+
+  // The entry of `key` if it holds `records`, rather than records loaded again after eviction.
+  std::list<Entry>::iterator find_locked(const ChunkKey & key, const ChunkRecords & records);
+  void evict_locked();
+
+  mutable std::mutex mutex_;
+  uint64_t capacity_;
+  uint64_t size_ = 0;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::unordered_map<ChunkKey, std::list<Entry>::iterator, ChunkKeyHash> index_;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__CHUNK_CACHE_HPP_
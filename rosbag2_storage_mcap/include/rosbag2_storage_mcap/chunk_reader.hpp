@@ -0,0 +1,274 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__CHUNK_READER_HPP_
+#define ROSBAG2_STORAGE_MCAP__CHUNK_READER_HPP_
+
+#include "chunk_cache.hpp"
+#include "message_index.hpp"
+#include "visibility_control.hpp"
+#include "worker_pool.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/**
+ * Read the Chunk record described by `chunk_index` from `data_source` and decompress its records
+ * section into `records`, using `frame_workers` as decompress_chunk() does. If set,
+ * `uncompressed_crc` receives the CRC-32 the writer recorded for the records, 0 if none.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status read_chunk_records(mcap::IReadable & data_source,
+                                const mcap::ChunkIndex & chunk_index, mcap::ByteArray * records,
+                                WorkerPool * frame_workers = nullptr,
+                                uint32_t * uncompressed_crc = nullptr);
+
+/**
+ * Read the CRC-32 the writer recorded for the records of the chunk described by `chunk_index`,
+ * 0 if none, without reading the records themselves.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status read_chunk_crc(mcap::IReadable & data_source, const mcap::ChunkIndex & chunk_index,
+                            uint32_t * uncompressed_crc);
+
+/// How the CRCs of the chunks read by a ChunkedMessageReader are checked.
+enum class ChunkCrcCheck
+{
+  // Not checked, for trusted data.
+  Skip,
+  // Checked on worker threads while the messages of the chunk are delivered; a mismatch stops
+  // the reader at a later call to next().
+  Background,
+  // Checked before any message of the chunk is delivered.
+  Inline,
+};
+
+/**
+ * Returns an error if the CRC-32 of the decompressed `records` of the chunk described by
+ * `chunk_index` is not `expected_crc`. An `expected_crc` of 0 means that the writer did not
+ * compute one, and always passes.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status check_chunk_crc(const mcap::ChunkIndex & chunk_index, const mcap::ByteArray & records,
+                             uint32_t expected_crc);
+
+struct ChunkCrcReport
+{
+  uint64_t chunk_count = 0;
+  // Chunks written without a CRC, which could only be checked to decompress.
+  uint64_t unchecked_chunk_count = 0;
+  // Offsets of the chunks which fail to decompress or do not match their CRC, in file order.
+  std::vector<uint64_t> corrupt_chunk_offsets;
+};
+
+/**
+ * Decompress every chunk in `chunk_indexes` and check it against its CRC. The chunks are split
+ * in file order into up to `thread_count` contiguous runs, each read sequentially by a thread of
+ * its own through the data source returned by `open_data_source` for the chunks of the run.
+ * Corrupt chunks are listed in `report`; an error is only returned if a chunk cannot be read.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status verify_chunk_crcs(
+  const std::vector<mcap::ChunkIndex> & chunk_indexes, size_t thread_count,
+  const std::function<std::unique_ptr<mcap::IReadable>(
+    const std::vector<const mcap::ChunkIndex *> &)> & open_data_source,
+  ChunkCrcReport * report);
+
+/// The still-compressed records section of a chunk, copied out of the data source.
+struct CompressedChunk
+{
+  std::string compression;
+  uint64_t uncompressed_size = 0;
+  // CRC-32 of the uncompressed records section, 0 if the writer did not compute it.
+  uint32_t uncompressed_crc = 0;
+  mcap::ByteArray data;
+};
+
+/**
+ * Read the Chunk record described by `chunk_index` from `data_source` and copy its compressed
+ * records section into `chunk`, so that it can be decompressed without holding on to the data
+ * source.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status read_compressed_chunk(mcap::IReadable & data_source,
+                                   const mcap::ChunkIndex & chunk_index, CompressedChunk * chunk);
+
+/**
+ * Decompress a records section compressed with `compression` ("", "zstd" or "lz4").
+ *
+ * A zstd records section may consist of several concatenated frames, which decode as a single
+ * stream. If `frame_workers` is set and find_zstd_frames() can place the frames, they are
+ * decompressed concurrently on the workers, so a single large chunk uses several cores.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status decompress_chunk(const std::string & compression, const std::byte * data,
+                              uint64_t compressed_size, uint64_t uncompressed_size,
+                              mcap::ByteArray * records, WorkerPool * frame_workers = nullptr);
+
+/**
+ * Parse the record starting at `offset` in a decompressed chunk records section.
+ * On success, `opcode` and `length` describe the record and `message` is filled in if the record
+ * is a Message. Returns false if the record is truncated.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+bool parse_chunk_record(const mcap::ByteArray & records, uint64_t offset, mcap::OpCode * opcode,
+                        uint64_t * length, mcap::Message * message);
+
+/**
+ * Returns true if the chunk described by `chunk_index` may contain a message in the time range
+ * [start_time, end_time] on a channel accepted by `channel_filter` (if set).
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+bool chunk_may_match(const mcap::ChunkIndex & chunk_index, mcap::Timestamp start_time,
+                     mcap::Timestamp end_time,
+                     const std::function<bool(mcap::ChannelId)> & channel_filter);
+
+/**
+ * Reads messages directly from the chunks of an MCAP file, using the Chunk Index records to
+ * locate them. Chunks which cannot contain a message in the requested time range or on a
+ * requested channel are skipped without being read or decompressed, which lets a seek start at
+ * the first relevant chunk instead of the start of the file.
+ *
+ * In log time order, chunks are loaded in order of their start (or end, in reverse) time and
+ * merged, so overlapping chunks are handled the same way as by mcap::LinearMessageView.
+ *
+ * With a worker pool, the chunks following the one being read are decompressed and indexed
+ * concurrently. Chunks are still merged in the same order on the calling thread, so the messages
+ * returned are exactly those returned without workers.
+ */
+class ChunkedMessageReader final
+{
+public:
+  using ReadOrder = mcap::ReadMessageOptions::ReadOrder;
+
+  struct Options
+  {
+    mcap::Timestamp start_time = 0;
+    mcap::Timestamp end_time = mcap::MaxTime;
+    // If set, only messages on channels for which this returns true are read.
+    std::function<bool(mcap::ChannelId)> channel_filter;
+    ReadOrder read_order = ReadOrder::FileOrder;
+    // If set, only the selected messages are read, and chunks with no selected message are
+    // skipped without being read.
+    std::shared_ptr<const MessageSelection> selection;
+    // Produces the decompressed records of a chunk, given a loader which reads and decompresses
+    // it from the data source. This may for example look the chunk up in a ChunkCache first.
+    // Called from the worker threads if `workers` is set. The verifier is set when the loader
+    // checks CRCs, and then checks records cached by readers which did not.
+    std::function<mcap::Status(const mcap::ChunkIndex &, const ChunkCache::Loader &,
+                               const ChunkCache::Verifier &, ChunkRecords *)>
+      load_chunk;
+    // If set, upcoming chunks are decompressed on these workers, up to two per worker ahead of
+    // the chunk being read. Reads from the data source are serialized.
+    std::shared_ptr<WorkerPool> workers;
+    // If set, the frames of chunks compressed as several zstd frames are decompressed on these
+    // workers. This must not be the same pool as `workers`, whose tasks wait for the frames.
+    std::shared_ptr<WorkerPool> frame_workers;
+    // How the CRC of each chunk is checked. Chunks which `load_chunk` finds in a cache are
+    // checked too, unless the cache records that they were checked when they were first read.
+    ChunkCrcCheck crc_check = ChunkCrcCheck::Skip;
+    // Workers checking CRCs with ChunkCrcCheck::Background, which checks inline without them.
+    // Up to two chunks per worker are kept alive while waiting for their check.
+    std::shared_ptr<WorkerPool> crc_workers;
+  };
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ChunkedMessageReader(mcap::IReadable & data_source,
+                       const std::vector<mcap::ChunkIndex> & chunk_indexes, Options options);
+
+  /// Waits for chunks still being decompressed on the workers.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ~ChunkedMessageReader();
+
+  ChunkedMessageReader(const ChunkedMessageReader &) = delete;
+  ChunkedMessageReader & operator=(const ChunkedMessageReader &) = delete;
+
+  /**
+   * Advance to the next message. Returns nullptr once all chunks have been read, or on error (see
+   * status()). The returned message and its data are valid until the next call.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const mcap::Message * next();
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const mcap::Status & status() const;
+
+  /// The chunks that will be read, in the order they are loaded.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const std::vector<const mcap::ChunkIndex *> & chunks() const;
+
+private:
+  struct LoadedChunk
+  {
+    // Position of this chunk in chunks_, used to break ties between chunks.
+    size_t order = 0;
+    ChunkRecords records;
+    // (log time, record offset) of the matching messages, in read order.
+    std::vector<std::pair<mcap::Timestamp, uint64_t>> messages;
+    size_t next = 0;
+    // CRC of the records still to be checked in the background, 0 if there is none.
+    uint32_t crc = 0;
+  };
+  struct MergeEntry
+  {
+    mcap::Timestamp log_time;
+    size_t order;
+    std::shared_ptr<LoadedChunk> chunk;
+  };
+
+  using LoadResult = std::pair<mcap::Status, std::shared_ptr<LoadedChunk>>;
+
+  LoadResult load_chunk(size_t order);
+  std::shared_ptr<LoadedChunk> take_next_chunk();
+  const mcap::Message * next_message();
+  void check_crc_in_background(const LoadedChunk & chunk);
+  // Wait for the oldest background CRC check, stopping the reader if it failed.
+  void finish_crc_check();
+  bool comes_before(mcap::Timestamp a, mcap::Timestamp b) const;
+  bool should_load_next_chunk() const;
+  const mcap::Message * parse_message(const LoadedChunk & chunk, uint64_t offset);
+
+  mcap::IReadable & data_source_;
+  Options options_;
+  std::vector<const mcap::ChunkIndex *> chunks_;
+  size_t next_chunk_ = 0;
+  // File order: the chunk being read.
+  std::shared_ptr<LoadedChunk> current_;
+  // Log time order: loaded chunks with messages remaining, as a heap on their next message.
+  std::vector<MergeEntry> heap_;
+  mcap::Message message_{};
+  mcap::Status status_{};
+  // Chunks submitted to the workers, starting at next_chunk_.
+  std::deque<std::future<LoadResult>> pending_;
+  size_t next_submitted_ = 0;
+  std::mutex data_source_mutex_;
+  std::atomic<bool> cancelled_{false};
+  // CRC checks submitted to options_.crc_workers, oldest first.
+  std::deque<std::future<mcap::Status>> crc_checks_;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__CHUNK_READER_HPP_
@@ -0,0 +1,41 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__CRC32_HPP_
+#define ROSBAG2_STORAGE_MCAP__CRC32_HPP_
+
+#include "visibility_control.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace rosbag2_storage_mcap::internal
+{
+/// Initial value of a running CRC-32, to be passed to crc32_update().
+constexpr uint32_t CRC32_INIT = 0xffffffff;
+
+/**
+ * Continue the running CRC-32 (the one used by MCAP, zlib and PNG) `crc` over `size` bytes at
+ * `data`, eight bytes at a time. The final CRC is the running CRC xor 0xffffffff.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+uint32_t crc32_update(uint32_t crc, const std::byte * data, size_t size);
+
+/// The CRC-32 of `size` bytes at `data`.
+ROSBAG2_STORAGE_MCAP_PUBLIC
+uint32_t crc32(const std::byte * data, size_t size);
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__CRC32_HPP_
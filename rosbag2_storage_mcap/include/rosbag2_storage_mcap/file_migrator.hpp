@@ -0,0 +1,95 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__FILE_MIGRATOR_HPP_
+#define ROSBAG2_STORAGE_MCAP__FILE_MIGRATOR_HPP_
+
+#include "visibility_control.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace rosbag2_storage_mcap::internal
+{
+/**
+ * Moves closed files from a fast scratch tier to their final location on a slower tier, on a
+ * background thread shared by every writer in the process. Each file is copied under a temporary
+ * name next to its destination and synced to the disk, the copy is read back (from the disk, its
+ * cached pages are dropped first) and checked against the CRC-32 of the source, and only then is it
+ * renamed into place, the rename synced and the source removed. A file therefore always exists in
+ * full on the disk of at least one tier. Failures are logged and leave the source in place.
+ */
+class FileMigrator final
+{
+public:
+  /// The migrator shared by the whole process. Pending migrations finish before the process exits.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static FileMigrator & instance();
+
+  /// Finishes the pending migrations.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ~FileMigrator();
+
+  FileMigrator(const FileMigrator &) = delete;
+  FileMigrator & operator=(const FileMigrator &) = delete;
+
+  /**
+   * Queue moving `source` to `destination`, creating its directory if needed. Migrations run one
+   * at a time, in the order they were queued, copying at most `max_rate` bytes per second (0 for
+   * no limit).
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void migrate(const std::string & source, const std::string & destination, uint64_t max_rate);
+
+  /// Total size of the files waiting to be migrated or being migrated.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t backlog_bytes() const;
+
+  /// Block until the backlog is smaller than `max_bytes` bytes.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void wait_for_backlog_below(uint64_t max_bytes);
+
+  /// Block until every queued migration has finished.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void wait_until_idle();
+
+private:
+  struct Job
+  {
+    std::string source;
+    std::string destination;
+    uint64_t max_rate;
+    uint64_t size;
+  };
+
+  FileMigrator();
+  void run();
+  // Returns an error message, or an empty string on success.
+  static std::string move_file(const Job & job);
+
+  mutable std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<Job> jobs_;
+  uint64_t backlog_bytes_ = 0;
+  bool busy_ = false;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__FILE_MIGRATOR_HPP_
@@ -0,0 +1,166 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__FILE_SET_HPP_
+#define ROSBAG2_STORAGE_MCAP__FILE_SET_HPP_
+
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/**
+ * The member files of a recording spread over several MCAP files, either striped (every member
+ * holds a share of the messages of every topic) or sharded by topic. The primary file, which is
+ * the one rosbag2 knows about, holds no messages; it lists the member files in a Metadata record,
+ * and each member is a complete MCAP file that can also be read on its own.
+ */
+struct FileSetManifest
+{
+  /// Name of the Metadata record holding the manifest.
+  static constexpr const char * METADATA_NAME = "rosbag2_storage_mcap.file_set";
+
+  // Paths of the member files. Relative paths are relative to the directory of the primary file.
+  std::vector<std::string> files;
+  // Sharded recordings: for each file, the regular expression of the topics assigned to it, empty
+  // for files that only receive topics assigned by load. Empty for striped recordings.
+  std::vector<std::string> topic_patterns;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Metadata to_metadata() const;
+
+  /// Returns std::nullopt if `metadata` is not a valid manifest record.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static std::optional<FileSetManifest> from_metadata(const mcap::Metadata & metadata);
+};
+
+/// How messages are spread over the member files of a striped recording.
+enum class FileAssignment
+{
+  // Cycle through the files, moving to the next one after a chunk worth of messages.
+  RoundRobin,
+  // After a chunk worth of messages, move to the file with the fewest bytes waiting to be written.
+  LeastLoaded,
+};
+
+/**
+ * Writes several MCAP files concurrently, each with its own writer, compression context and
+ * thread. Messages are queued for the thread of their file and written in the order they were
+ * queued; write() blocks while a file has `max_queued_bytes` of messages waiting.
+ *
+ * Schemas, and channels added to every file, are added to the files in the same order, so they
+ * have the same ids in all of them.
+ */
+class ParallelFileWriter final
+{
+public:
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  explicit ParallelFileWriter(uint64_t max_queued_bytes);
+
+  /// Closes the files, writing the messages still queued.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ~ParallelFileWriter();
+
+  ParallelFileWriter(const ParallelFileWriter &) = delete;
+  ParallelFileWriter & operator=(const ParallelFileWriter &) = delete;
+
+  /// Open one file per path and start their threads. Must be called once, before anything else.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Status open(const std::vector<std::string> & paths,
+                    const mcap::McapWriterOptions & options);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  size_t file_count() const;
+
+  /// Add `schema` to every file, setting its id.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void add_schema(mcap::Schema & schema);
+
+  /// Add `channel` to every file, setting its id.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void add_channel(mcap::Channel & channel);
+
+  /// Add `channel` to file `file` only, setting its id in that file.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void add_channel(size_t file, mcap::Channel & channel);
+
+  /**
+   * Queue `message` to be written to file `file`, in a chunk of its own if `own_chunk` is set.
+   * `data_owner` keeps the message data alive until it is written. Returns the first error of
+   * that file's thread so far, if any, without queueing.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Status write(size_t file, const mcap::Message & message,
+                     std::shared_ptr<const void> data_owner, bool own_chunk = false);
+
+  /// The file with the fewest bytes of messages waiting to be written, the first one on ties.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  size_t least_loaded() const;
+
+  /// Total size of the files so far.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t size() const;
+
+  /// Size of file `file` so far.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t file_size(size_t file) const;
+
+  /// Write the queued messages, close the files and return the first error of any file.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Status close();
+
+private:
+  struct QueuedMessage
+  {
+    mcap::Message message;
+    std::shared_ptr<const void> data_owner;
+    bool own_chunk = false;
+  };
+
+  struct File
+  {
+    mcap::McapWriter writer;
+    // Held while the writer is used, by the file's thread and by add_schema() / add_channel().
+    std::mutex writer_mutex;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<QueuedMessage> queue;
+    uint64_t queued_bytes = 0;
+    mcap::Status status;
+    bool closing = false;
+    std::atomic<uint64_t> size{0};
+    std::thread thread;
+  };
+
+  void run(File & file);
+
+  uint64_t max_queued_bytes_;
+  std::vector<std::unique_ptr<File>> files_;
+  bool closed_ = false;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__FILE_SET_HPP_
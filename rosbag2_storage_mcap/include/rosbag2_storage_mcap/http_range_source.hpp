@@ -0,0 +1,143 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__HTTP_RANGE_SOURCE_HPP_
+#define ROSBAG2_STORAGE_MCAP__HTTP_RANGE_SOURCE_HPP_
+
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/// True if `uri` is an http:// or https:// URL rather than a file path.
+ROSBAG2_STORAGE_MCAP_PUBLIC
+bool is_http_url(const std::string & uri);
+
+/**
+ * A remote file read over HTTP Range requests, in fixed-size blocks. Blocks are kept in an
+ * in-memory LRU cache and, optionally, in an on-disk cache which persists across processes, so
+ * only the parts of the file actually read are ever downloaded, and only once. Consecutive
+ * missing blocks are fetched with a single request. Ranges announced with prefetch() are
+ * downloaded on a background thread.
+ *
+ * Every range is requested on the condition that the file is still the version (ETag or
+ * Last-Modified time) found when it was opened. Reads of a file replaced on the server since then
+ * fail rather than mix blocks of both files.
+ *
+ * Sources are shared: every reader of the same version of the same URL in the process uses the
+ * same source and cache. All methods are thread-safe.
+ */
+class HttpRangeSource final
+{
+public:
+  struct Options
+  {
+    // Size of the blocks the file is downloaded and cached in.
+    uint64_t block_size = 1024 * 1024;
+    // Bytes of blocks kept in memory.
+    uint64_t memory_cache_size = 256 * 1024 * 1024;
+    // Directory of the on-disk block cache. Empty disables it. The cache is never pruned. Files
+    // whose server reports neither an ETag nor a Last-Modified time are not cached on disk.
+    std::string cache_directory;
+  };
+
+  /**
+   * Connect to `url` and find the size and version of the file, then reuse the source already
+   * open for that version of `url` in this process, whose options then apply, if there is one.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static mcap::Status open_shared(const std::string & url, const Options & options,
+                                  std::shared_ptr<HttpRangeSource> & source);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ~HttpRangeSource();
+
+  HttpRangeSource(const HttpRangeSource &) = delete;
+  HttpRangeSource & operator=(const HttpRangeSource &) = delete;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t size() const;
+
+  /// The ETag of the file, or its Last-Modified time if it has none. May be empty.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const std::string & version() const;
+
+  /// Copy `length` bytes at `offset` to `output`. Returns false if they could not be fetched.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  bool read(uint64_t offset, uint64_t length, std::byte * output);
+
+  /// Download the blocks covering `length` bytes at `offset` in the background.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void prefetch(uint64_t offset, uint64_t length);
+
+  /// Number of HTTP requests made so far.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t request_count() const;
+
+private:
+  using Block = std::shared_ptr<const std::vector<std::byte>>;
+
+  HttpRangeSource(std::string url, Options options);
+  mcap::Status connect();
+  // The block at `index`, fetching it together with the missing blocks after it up to `last`.
+  // Returns nullptr if it could not be fetched.
+  Block get_block(uint64_t index, uint64_t last);
+  // Fetch blocks [first, last] from the disk cache or the server, nullptr for failed blocks.
+  std::vector<Block> load_blocks(uint64_t first, uint64_t last);
+  mcap::Status fetch(uint64_t offset, uint64_t length, std::vector<std::byte> & body,
+                     std::unordered_map<std::string, std::string> * headers);
+  uint64_t block_length(uint64_t index) const;
+  std::string block_cache_path(uint64_t index) const;
+  void run_prefetch();
+
+  const std::string url_;
+  const Options options_;
+  uint64_t size_ = 0;
+  std::string version_;
+  std::string cache_directory_;
+  std::atomic<uint64_t> request_count_{0};
+
+  mutable std::mutex mutex_;
+  std::condition_variable condition_;
+  // Most recently used block first.
+  std::list<uint64_t> lru_;
+  std::unordered_map<uint64_t, std::pair<Block, std::list<uint64_t>::iterator>> blocks_;
+  uint64_t cached_bytes_ = 0;
+  std::unordered_set<uint64_t> in_flight_;
+  // Block ranges [first, last] waiting to be prefetched.
+  std::deque<std::pair<uint64_t, uint64_t>> prefetch_queue_;
+  // Idle curl handles, reused so that connections are kept alive between requests.
+  std::vector<void *> idle_handles_;
+  bool stopping_ = false;
+  std::thread prefetch_thread_;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__HTTP_RANGE_SOURCE_HPP_
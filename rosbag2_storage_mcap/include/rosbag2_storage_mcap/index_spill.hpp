@@ -0,0 +1,223 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__INDEX_SPILL_HPP_
+#define ROSBAG2_STORAGE_MCAP__INDEX_SPILL_HPP_
+
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <array>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/**
+ * The output of an mcap::McapWriter, through which it writes an MCAP file whose chunk indexes do
+ * not stay in memory until the file is closed.
+ *
+ * mcap::McapWriter keeps a ChunkIndex, with the offsets of the message indexes of every channel
+ * in the chunk, for each chunk it has written, so its memory grows with the length of the
+ * recording. The McapWriter is therefore opened with chunking disabled (see writer_options()),
+ * and this groups the Schema, Channel and Message records it receives into chunks itself, with
+ * the chunking options of the file. Once more than `memory_limit` bytes of chunk indexes have
+ * accumulated they are appended to a temporary file in `spill_directory`; when the McapWriter
+ * closes, the summary it wrote is rewritten with the chunk indexes copied back from there and
+ * fresh statistics, summary offsets and CRCs.
+ *
+ * Other records, such as attachments and metadata, are written to the file as they come, so
+ * size() and the offsets the McapWriter records for them are those of the file.
+ *
+ * Since it rewrites the summary anyway, it can also continue an existing file (see
+ * open_append()), merging the summary of the file into that of the McapWriter.
+ */
+class SpillingChunkWriter final : public mcap::IWritable
+{
+public:
+  /// Chunk index bytes held in memory before they are spilled, by default.
+  static constexpr uint64_t DEFAULT_MEMORY_LIMIT = 1024 * 1024;
+
+  /// Options to open the McapWriter writing to this with, for a file written with `options`.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static mcap::McapWriterOptions writer_options(const mcap::McapWriterOptions & options);
+
+  /**
+   * With zstd compression and a `frame_size`, chunks larger than `frame_size` are compressed as
+   * several frames of at most `frame_size` uncompressed bytes each (see compress_zstd_frames()),
+   * which readers can decompress in parallel.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  SpillingChunkWriter(const mcap::McapWriterOptions & options, std::string spill_directory,
+                      uint64_t memory_limit = DEFAULT_MEMORY_LIMIT, uint64_t frame_size = 0);
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ~SpillingChunkWriter() override;
+
+  /// What a file continued by open_append() already holds.
+  struct ExistingFile
+  {
+    // By increasing id, from 1.
+    std::vector<mcap::SchemaPtr> schemas;
+    std::vector<mcap::ChannelPtr> channels;
+    // Empty if the file has no Statistics record, which the merged summary then leaves out too.
+    std::optional<mcap::Statistics> statistics;
+    // The Metadata records named in the `replaced_metadata` of open_append(), in file order.
+    std::vector<mcap::Metadata> metadata;
+  };
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Status open(const std::string & filename);
+
+  /**
+   * Continue the MCAP file `filename`: its summary and footer, or an incomplete record left at its
+   * end by a crash, are cut off, and new records are written after its data section. The summary
+   * written at close also indexes the chunks, attachments and metadata of the file, and its
+   * statistics add up both. The chunk indexes of a file without a summary are recovered with the
+   * offsets of the message indexes following each chunk, except for a chunk cut off by a crash.
+   *
+   * The McapWriter must then be given the schemas and channels of `existing`, in order, before
+   * any other, so that it assigns them the ids they have in the file; the file is refused if
+   * those ids do not run from 1 without gaps. The data section CRC is not written, since it would
+   * need the file to be read in full.
+   *
+   * Metadata records named in `replaced_metadata` are returned in `existing` and left out of the
+   * merged metadata index, for the caller to write them again updated; the old records stay in
+   * the data section, unindexed.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Status open_append(const std::string & filename, ExistingFile & existing,
+                           const std::set<std::string> & replaced_metadata = {});
+
+  /// Write the records received since the last chunk as a chunk, if there are any.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void close_chunk();
+
+  /**
+   * Write `message`, on a channel already added to the McapWriter, as a chunk of its own, after
+   * closing the chunk being filled. The chunk is stored uncompressed and written straight from
+   * the buffer of the message, unless the options force compression, in which case it is
+   * compressed like any other chunk. The message is counted in the statistics of the summary.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Status write_chunk(const mcap::Message & message);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void handleWrite(const std::byte * data, uint64_t size) override;
+
+  /// Write the summary and close the file; called by McapWriter::close().
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void end() override;
+
+  /// Bytes written to the file, not counting the records of the chunk being filled.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t size() const override;
+
+  /// Bytes of chunk indexes appended to the temporary file so far.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t spilled_size() const;
+
+  /// The first error met spilling the chunk indexes, which are then kept in memory instead.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const mcap::Status & status() const;
+
+private:
+  // The opcode and length which start every record.
+  static constexpr size_t PREFIX_SIZE = 9;
+  // The channel id, sequence and log time which start a Message record.
+  static constexpr size_t MESSAGE_HEAD_SIZE = 14;
+
+  // Like mcap::FileWriter, but can also continue an existing file.
+  class File final : public mcap::IWritable
+  {
+  public:
+    ~File() override;
+    mcap::Status open(const std::string & filename, uint64_t offset);
+    void handleWrite(const std::byte * data, uint64_t size) override;
+    void end() override;
+    uint64_t size() const override;
+
+  private:
+    std::FILE * file_ = nullptr;
+    uint64_t size_ = 0;
+  };
+
+  mcap::Status open_file(const std::string & filename, uint64_t offset);
+  void add_index(const mcap::ChunkIndex & index);
+  // Write the opcode and fields of a Chunk record up to its records, which the caller writes next,
+  // and return its index. finish_chunk() then completes the index and writes the message indexes.
+  mcap::ChunkIndex write_chunk_header(const std::string & compression, uint64_t uncompressed_size,
+                                      uint32_t uncompressed_crc, uint64_t compressed_size);
+  void finish_chunk(mcap::ChunkIndex & index);
+  void start_record();
+  void finish_record();
+  void spill_indexes();
+  void write_summary();
+  void merge_statistics(mcap::Statistics & statistics) const;
+
+  mcap::McapWriterOptions options_;
+  std::string spill_directory_;
+  uint64_t memory_limit_;
+  uint64_t frame_size_;
+  File file_;
+  std::string spill_path_;
+  std::FILE * spill_file_ = nullptr;
+  uint64_t spilled_size_ = 0;
+  mcap::Status status_;
+  bool open_ = false;
+
+  // Parsing of the records received from the McapWriter.
+  uint64_t magic_remaining_ = 8;
+  std::array<std::byte, PREFIX_SIZE> prefix_{};
+  size_t prefix_size_ = 0;
+  uint64_t record_remaining_ = 0;
+  enum class Destination { File, Chunk, Discard } destination_ = Destination::File;
+  std::array<std::byte, MESSAGE_HEAD_SIZE> message_head_{};
+  size_t message_head_size_ = 0;
+  uint64_t record_offset_ = 0;
+  bool in_summary_ = false;
+
+  // The chunk being filled.
+  std::unique_ptr<mcap::IChunkWriter> chunk_;
+  mcap::Timestamp chunk_start_time_ = mcap::MaxTime;
+  mcap::Timestamp chunk_end_time_ = 0;
+  std::unordered_map<mcap::ChannelId, mcap::MessageIndex> message_indexes_;
+  mcap::ByteArray chunk_header_;
+  // The records of the chunk compressed as several zstd frames.
+  mcap::ByteArray frames_;
+
+  // Serialized ChunkIndex records not spilled yet, and the number of chunks written.
+  mcap::ByteArray indexes_;
+  uint32_t chunk_count_ = 0;
+  // Messages given to write_chunk(), which the McapWriter has not counted.
+  mcap::Statistics direct_statistics_{};
+  // Everything the McapWriter wrote after its DataEnd record.
+  mcap::ByteArray summary_;
+
+  // Files continued by open_append(): their statistics, and their attachment and metadata index
+  // records by opcode.
+  bool appending_ = false;
+  std::optional<mcap::Statistics> existing_statistics_;
+  std::map<mcap::OpCode, mcap::ByteArray> existing_indexes_;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__INDEX_SPILL_HPP_
@@ -0,0 +1,404 @@
+// Copyright 2022, Amazon.com Inc or its Affiliates. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__MCAP_STORAGE_HPP_
+#define ROSBAG2_STORAGE_MCAP__MCAP_STORAGE_HPP_
+
+#include "activity_histogram.hpp"
+#include "byte_shuffle.hpp"
+#include "chunk_reader.hpp"
+#include "file_set.hpp"
+#include "index_spill.hpp"
+#include "message_definition_cache.hpp"
+#include "message_index.hpp"
+#include "payload_codec.hpp"
+#include "payload_dedup.hpp"
+#include "rcutils/time.h"
+#include "read_planner.hpp"
+#include "rosbag2_storage/storage_interfaces/read_write_interface.hpp"
+#include "split_handoff.hpp"
+#include "summary_cache.hpp"
+#include "visibility_control.hpp"
+#include "worker_pool.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_plugins
+{
+// Options for reading, loaded from the same storage config file as the writer options.
+struct McapReaderOptions
+{
+  // Chunks needed by a read are fetched in large sequential reads, merging chunks separated by
+  // at most readCoalesceGap bytes into reads of up to readMaxCoalescedSize bytes.
+  uint64_t readCoalesceGap = 1024 * 1024;
+  uint64_t readMaxCoalescedSize = 32 * 1024 * 1024;
+  // Number of upcoming reads to announce to the OS ahead of use.
+  uint64_t readAheadCount = 2;
+  // Release the OS page cache behind the read cursor.
+  bool dropPageCacheBehind = false;
+  // Size in bytes of a decompressed chunk cache shared by all readers in the process.
+  // Readers of the same file then decompress each chunk only once. 0 disables the cache.
+  uint64_t sharedChunkCacheSize = 0;
+  // Number of threads decompressing upcoming chunks while messages are read. 0 decompresses
+  // chunks on the reading thread.
+  uint64_t decodeThreads = 0;
+  // Number of threads decompressing the frames of chunks written as several zstd frames. 0
+  // decompresses each chunk as a single stream.
+  uint64_t frameDecodeThreads = 0;
+  // How the CRCs of chunks are checked as they are read: Skip, Background (on a thread of its
+  // own, stopping the read shortly after a corrupt chunk) or Inline (before delivering any message
+  // of the chunk). Chunks written without a CRC are never checked.
+  rosbag2_storage_mcap::internal::ChunkCrcCheck chunkCrcCheck =
+    rosbag2_storage_mcap::internal::ChunkCrcCheck::Skip;
+  // Downsampling: deliver at most downsampleMaxRate messages per second on each topic, and/or
+  // only every downsampleEveryNth message. Messages are picked from the message indexes before
+  // any chunk is decompressed. 0 disables each.
+  double downsampleMaxRate = 0;
+  uint64_t downsampleEveryNth = 0;
+  // http:// and https:// URIs: the file is downloaded in blocks of httpBlockSize bytes, keeping
+  // up to httpMemoryCacheSize bytes of blocks in memory and, if httpCacheDirectory is set, all
+  // downloaded blocks on disk.
+  uint64_t httpBlockSize = 1024 * 1024;
+  uint64_t httpMemoryCacheSize = 256 * 1024 * 1024;
+  std::string httpCacheDirectory;
+};
+
+/**
+ * A storage implementation for the MCAP file format.
+ */
+class MCAPStorage : public rosbag2_storage::storage_interfaces::ReadWriteInterface
+{
+public:
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  MCAPStorage();
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ~MCAPStorage() override;
+
+  /** BaseIOInterface **/
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+  void open(const rosbag2_storage::StorageOptions & storage_options,
+            rosbag2_storage::storage_interfaces::IOFlag io_flag =
+              rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE) override;
+  void open(const std::string & uri, rosbag2_storage::storage_interfaces::IOFlag io_flag =
+                                       rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE);
+#else
+  void open(const std::string & uri,
+            rosbag2_storage::storage_interfaces::IOFlag io_flag =
+              rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE) override;
+#endif
+
+  /** BaseInfoInterface **/
+  rosbag2_storage::BagMetadata get_metadata() override;
+  std::string get_relative_file_path() const override;
+  uint64_t get_bagfile_size() const override;
+  std::string get_storage_identifier() const override;
+
+  /** BaseReadInterface **/
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_SET_READ_ORDER
+  void set_read_order(const rosbag2_storage::ReadOrder &) override;
+#endif
+  bool has_next() override;
+  std::shared_ptr<rosbag2_storage::SerializedBagMessage> read_next() override;
+  std::vector<rosbag2_storage::TopicMetadata> get_all_topics_and_types() override;
+
+  /** ReadOnlyInterface **/
+  void set_filter(const rosbag2_storage::StorageFilter & storage_filter) override;
+  void reset_filter() override;
+#ifdef ROSBAG2_STORAGE_MCAP_OVERRIDE_SEEK_METHOD
+  void seek(const rcutils_time_point_value_t & time_stamp) override;
+#else
+  void seek(const rcutils_time_point_value_t & timestamp);
+#endif
+
+  /** ReadWriteInterface **/
+  uint64_t get_minimum_split_file_size() const override;
+
+  /** BaseWriteInterface **/
+  void write(std::shared_ptr<const rosbag2_storage::SerializedBagMessage> msg) override;
+  void write(
+    const std::vector<std::shared_ptr<const rosbag2_storage::SerializedBagMessage>> & msg) override;
+  void create_topic(const rosbag2_storage::TopicMetadata & topic) override;
+  void remove_topic(const rosbag2_storage::TopicMetadata & topic) override;
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_UPDATE_METADATA
+  void update_metadata(const rosbag2_storage::BagMetadata &) override;
+#endif
+
+  /** Index queries **/
+  // These are answered from the Chunk Index and Message Index records alone, without reading or
+  // decompressing any message, and do not move the read position. The first query on a topic
+  // loads the log times of its messages; later queries on the same topic search memory only.
+  // Time ranges are inclusive. They throw std::runtime_error if the file is not open for reading
+  // or has no message indexes.
+  struct IndexedTopicStats
+  {
+    uint64_t message_count = 0;
+    // Log times of the first and last message in the range; 0 if there is none.
+    rcutils_time_point_value_t first_time = 0;
+    rcutils_time_point_value_t last_time = 0;
+  };
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  IndexedTopicStats get_indexed_topic_stats(
+    const std::string & topic, rcutils_time_point_value_t start_time = 0,
+    rcutils_time_point_value_t end_time = std::numeric_limits<rcutils_time_point_value_t>::max());
+
+  /**
+   * Number of messages on `topic` in consecutive buckets of `bucket_duration` nanoseconds, the
+   * first starting at `start_time` and the last containing `end_time`.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::vector<uint64_t> get_indexed_message_histogram(const std::string & topic,
+                                                      rcutils_time_point_value_t start_time,
+                                                      rcutils_time_point_value_t end_time,
+                                                      rcutils_duration_value_t bucket_duration);
+
+  /**
+   * Messages on `topic` with ordinals in [first, first + count), counting from 0 in the order
+   * they were written, which is log time order for recordings. Fewer messages are returned if the
+   * range extends past the last message. Only the chunks containing the requested messages are
+   * decompressed; the most recently used one is kept for the next call, and chunks are shared
+   * through the process-wide chunk cache when sharedChunkCacheSize is set. On sharded recordings
+   * the messages are read from the shard holding the topic; striped recordings, which spread
+   * every topic over several files, are not supported.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::vector<std::shared_ptr<rosbag2_storage::SerializedBagMessage>> read_messages_by_ordinal(
+    const std::string & topic, uint64_t first, uint64_t count = 1);
+
+  /**
+   * The per-topic activity histogram recorded by the writer, read from its Metadata record.
+   * Returns std::nullopt if the file has none, for example if it was written with
+   * activityHistogramBucketDuration set to 0 or by another writer.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::optional<rosbag2_storage_mcap::ActivityHistogram> get_activity_histogram();
+
+  /** Raw chunks **/
+  // These give access to the chunks of the file as stored, so that they can be forwarded to
+  // another MCAP file or machine without being decompressed and compressed again. They do not
+  // move the read position, and throw std::runtime_error if the file is not open for reading or
+  // is a striped or sharded recording.
+  struct RawChunk
+  {
+    // The Chunk Index record of the chunk: its offset and length in the file, the log time range
+    // of its messages, the offsets of its Message Index records by channel, its compression and
+    // its compressed and uncompressed sizes.
+    mcap::ChunkIndex index;
+    // CRC-32 of the uncompressed records, 0 if the writer did not compute it.
+    uint32_t uncompressed_crc = 0;
+    // The records section exactly as stored, compressed with index.compression.
+    mcap::ByteArray data;
+  };
+
+  /**
+   * Call `visitor` with each chunk which may hold messages passing the storage filter with log
+   * times in [start_time, end_time], in file order, until it returns false. Chunks are selected
+   * from the chunk index, so they may also hold other messages. The chunks are read with the
+   * same coalesced reads as messages. Files written without chunking have no chunks.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void read_raw_chunks(
+    const std::function<bool(const RawChunk &)> & visitor,
+    rcutils_time_point_value_t start_time = 0,
+    rcutils_time_point_value_t end_time = std::numeric_limits<rcutils_time_point_value_t>::max());
+
+  using ChunkIntegrityReport = rosbag2_storage_mcap::internal::ChunkCrcReport;
+
+  /**
+   * Decompress every chunk of the file and check it against the CRC recorded by the writer,
+   * reading contiguous runs of chunks on up to `thread_count` threads, by default one per core.
+   * Chunks which fail to decompress are reported as corrupt too.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ChunkIntegrityReport verify_chunk_crcs(size_t thread_count = 0);
+
+  /// The schemas of the file, by the ids messages in its chunks refer to them with.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const std::unordered_map<mcap::SchemaId, mcap::SchemaPtr> & get_mcap_schemas();
+
+  /// The channels of the file, by the ids messages in its chunks refer to them with.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const std::unordered_map<mcap::ChannelId, mcap::ChannelPtr> & get_mcap_channels();
+
+private:
+  void open_impl(const std::string & uri, const std::string & preset_profile,
+                 rosbag2_storage::storage_interfaces::IOFlag io_flag,
+                 const std::string & storage_config_uri);
+
+  void reset_iterator(rcutils_time_point_value_t start_time = 0);
+  // Empty if the storage filter lets every topic through.
+  std::function<bool(std::string_view)> make_topic_filter() const;
+  void check_raw_chunks_supported();
+  void plan_reads(mcap::Timestamp start_time,
+                  const std::function<bool(mcap::ChannelId)> & channel_filter,
+                  const rosbag2_storage_mcap::internal::MessageSelection * selection);
+  bool read_and_enqueue_message();
+  // The payload of `message`, expanded if it is a reference to a repeated payload.
+  std::shared_ptr<rcutils_uint8_array_t> read_payload(const mcap::Message & message);
+  // The payload of `message` as written by the recorder, unshuffled and decoded.
+  std::shared_ptr<rcutils_uint8_array_t> decode_payload(const mcap::Message & message);
+  std::shared_ptr<rcutils_uint8_array_t> find_referenced_payload(
+    mcap::ChannelId channel_id, const rosbag2_storage_mcap::internal::PayloadReference & reference);
+  void ensure_summary_read();
+  void read_mcap_summary();
+  mcap::Statistics derive_statistics(const rosbag2_storage_mcap::internal::ParsedSummary & summary);
+  mcap::IReadable & index_source();
+  std::vector<std::shared_ptr<const rosbag2_storage_mcap::internal::MessageTimeline>>
+  load_timelines(const std::string & topic);
+  rosbag2_storage_mcap::internal::ChunkRecords load_indexed_chunk(
+    const mcap::ChunkIndex & chunk_index);
+  void open_file_set_members(const std::string & storage_config_uri);
+  rosbag2_storage::BagMetadata get_file_set_metadata();
+  size_t select_stripe(uint64_t message_size);
+  size_t select_shard(const std::string & topic);
+  // Add the schemas and channels of a file being appended to, or of the previous split file, with
+  // the ids they have there; their topics are created by create_topic().
+  void restore_topics(const std::vector<mcap::SchemaPtr> & schemas,
+                      const std::vector<mcap::ChannelPtr> & channels);
+  // Count the appended messages in the activity histogram records of the file, if it has any.
+  void continue_activity_histogram(const std::vector<mcap::Metadata> & records);
+
+  std::optional<rosbag2_storage::storage_interfaces::IOFlag> opened_as_;
+  std::string relative_path_;
+
+  std::shared_ptr<rosbag2_storage::SerializedBagMessage> next_;
+
+  rosbag2_storage::BagMetadata metadata_{};
+  // Everything write() needs to know about a topic, so that each message costs one lookup. The
+  // topic's metadata itself, including its QoS profiles, is only kept by the MCAP writer.
+  struct WriterTopic
+  {
+    mcap::ChannelId channel_id = 0;
+    // The channel repeated payloads are written to as references; 0 unless deduplicated.
+    mcap::ChannelId reference_channel_id = 0;
+    // Byte shuffle element size; 0 unless byte-shuffled.
+    uint32_t shuffle_element_size = 0;
+    std::shared_ptr<const rosbag2_storage_mcap::PayloadCodec> codec;
+    // Member file of a sharded recording.
+    size_t file = 0;
+    uint64_t message_count = 0;
+    // Set by remove_topic(), and for restored topics until they are created; the channel is kept
+    // in case the topic is created (again).
+    bool removed = false;
+  };
+  std::unordered_map<std::string, WriterTopic> topics_;
+  std::unordered_map<std::string, mcap::SchemaId> schema_ids_;  // datatype -> schema_id
+  // Restored topics: datatype, serialization format and offered QoS profiles. Created with
+  // others, they get a new channel.
+  std::unordered_map<std::string, std::tuple<std::string, std::string, std::string>>
+    restored_types_;
+  // Schemas and channels added to this file, left to the next split file when it is closed; only
+  // collected when there is a single output file.
+  std::optional<rosbag2_storage_mcap::internal::SplitTopics> file_topics_;
+  // Whether the topics of the previous split file are still to be restored.
+  bool take_previous_split_ = false;
+  rosbag2_storage::StorageFilter storage_filter_{};
+  mcap::ReadMessageOptions::ReadOrder read_order_ =
+    mcap::ReadMessageOptions::ReadOrder::LogTimeOrder;
+
+  McapReaderOptions read_options_{};
+  std::unique_ptr<rosbag2_storage_mcap::internal::PlannedFileReader> data_source_;
+  std::unique_ptr<mcap::McapReader> mcap_reader_;
+  std::shared_ptr<const rosbag2_storage_mcap::internal::ParsedSummary> summary_;
+  rosbag2_storage_mcap::internal::FileIdentity file_identity_;
+  std::unique_ptr<mcap::LinearMessageView> linear_view_;
+  std::unique_ptr<mcap::LinearMessageView::Iterator> linear_iterator_;
+  std::shared_ptr<rosbag2_storage_mcap::internal::WorkerPool> decode_workers_;
+  std::shared_ptr<rosbag2_storage_mcap::internal::WorkerPool> frame_decode_workers_;
+  std::shared_ptr<rosbag2_storage_mcap::internal::WorkerPool> crc_check_workers_;
+  std::unique_ptr<rosbag2_storage_mcap::internal::ChunkedMessageReader> chunked_reader_;
+
+  // Output of mcap_writer_ when it spills its chunk indexes, appends, frames chunks or writes
+  // large messages as their own chunks; must outlive it.
+  std::unique_ptr<rosbag2_storage_mcap::internal::SpillingChunkWriter> spilling_writer_;
+  std::unique_ptr<mcap::McapWriter> mcap_writer_;
+  std::optional<rosbag2_storage_mcap::ActivityHistogram> activity_histogram_;
+  // Messages of at least this size are written in a chunk of their own; 0 disables.
+  uint64_t large_message_threshold_ = 0;
+  // Topics whose repeated payloads are written as references.
+  std::vector<std::regex> dedup_patterns_;
+  rosbag2_storage_mcap::internal::PayloadDeduplicator payload_deduplicator_;
+  // Byte-shuffled payloads: element size by message type.
+  std::map<std::string, uint32_t> byte_shuffle_types_;
+  // Payloads encoded with a codec: codec name and codec by message type.
+  using NamedCodec =
+    std::pair<std::string, std::shared_ptr<const rosbag2_storage_mcap::PayloadCodec>>;
+  std::unordered_map<std::string, NamedCodec> schema_codecs_;
+  std::shared_ptr<std::vector<std::byte>> encode_buffer_;
+  std::shared_ptr<std::vector<std::byte>> shuffle_buffer_;
+  // Striped recordings: messages go to the member files, a chunk worth of messages at a time.
+  // Sharded recordings: messages go to the member file of their topic.
+  std::unique_ptr<rosbag2_storage_mcap::internal::ParallelFileWriter> file_set_writer_;
+  rosbag2_storage_mcap::internal::FileAssignment stripe_assignment_ =
+    rosbag2_storage_mcap::internal::FileAssignment::RoundRobin;
+  uint64_t stripe_size_ = 0;
+  size_t current_stripe_ = 0;
+  uint64_t current_stripe_bytes_ = 0;
+  std::vector<std::regex> shard_patterns_;
+  // Number of topics assigned to each shard; empty unless sharded.
+  std::vector<size_t> shard_topic_counts_;
+  // Tiered recordings: files written to the scratch directory, as (scratch path, final path)
+  // pairs, moved to their final path in the background once closed.
+  std::vector<std::pair<std::string, std::string>> scratch_files_;
+  uint64_t migration_max_rate_ = 0;
+  // Striped or sharded recordings being read: one reader per member file, merged by log time.
+  // Only the members holding a topic which passes the filter are read.
+  std::vector<std::unique_ptr<MCAPStorage>> file_set_members_;
+  std::vector<MCAPStorage *> selected_members_;
+  rosbag2_storage_mcap::internal::MessageDefinitionCache msgdef_cache_{};
+
+  bool mcap_reader_has_summary_ = false;
+
+  // Element size of each channel whose payloads were byte-shuffled.
+  std::unordered_map<mcap::ChannelId, uint32_t> shuffled_channels_;
+  // The codec of each channel whose payloads were encoded with one.
+  std::unordered_map<mcap::ChannelId, std::shared_ptr<const rosbag2_storage_mcap::PayloadCodec>>
+    channel_codecs_;
+  std::vector<std::byte> unshuffle_buffer_;
+  std::vector<std::byte> decode_buffer_;
+  // Deduplicated topics being read: the channel of the topic each reference channel refers to,
+  // and the last payload read on each such channel, with its log time.
+  std::unordered_map<mcap::ChannelId, mcap::ChannelId> reference_channels_;
+  std::unordered_map<mcap::ChannelId,
+                     std::pair<mcap::Timestamp, std::shared_ptr<rcutils_uint8_array_t>>>
+    last_payloads_;
+
+  // Index queries read through their own file handle, so they never disturb the read plan.
+  std::unique_ptr<rosbag2_storage_mcap::internal::PlannedFileReader> index_source_;
+  std::unordered_map<mcap::ChannelId,
+                     std::shared_ptr<const rosbag2_storage_mcap::internal::MessageTimeline>>
+    timelines_;
+  std::unordered_map<std::string,
+                     std::shared_ptr<const rosbag2_storage_mcap::internal::MessageOrdinalIndex>>
+    ordinal_indexes_;
+  // The chunk most recently decompressed for an index query, by chunk offset.
+  std::pair<uint64_t, rosbag2_storage_mcap::internal::ChunkRecords> last_indexed_chunk_;
+};
+
+}  // namespace rosbag2_storage_plugins
+
+#endif  // ROSBAG2_STORAGE_MCAP__MCAP_STORAGE_HPP_
@@ -0,0 +1,164 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__MESSAGE_INDEX_HPP_
+#define ROSBAG2_STORAGE_MCAP__MESSAGE_INDEX_HPP_
+
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/**
+ * Read and parse the Message Index record at `offset` in `data_source`.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status read_message_index(mcap::IReadable & data_source, uint64_t offset,
+                                mcap::MessageIndex * message_index);
+
+/// Offsets of messages in the decompressed records of each chunk, keyed by chunk start offset.
+/// The offsets of each chunk are sorted.
+using MessageSelection = std::unordered_map<uint64_t, std::vector<uint64_t>>;
+
+struct DownsampleOptions
+{
+  // Keep at most this many messages per second on each channel. 0 keeps all.
+  double max_rate = 0;
+  // Keep only every Nth message on each channel, starting with the first. 0 or 1 keeps all.
+  uint64_t every_nth = 0;
+};
+
+/**
+ * Select a subset of the messages with a log time of at least `start_time` on the channels
+ * accepted by `channel_filter` (all if unset), using only the Message Index records. Messages of
+ * each channel are considered in log time order: every Nth one is kept, and of those, the ones
+ * logged at least 1 / max_rate seconds after the previous kept one.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status select_messages(mcap::IReadable & data_source,
+                             const std::vector<mcap::ChunkIndex> & chunk_indexes,
+                             mcap::Timestamp start_time,
+                             const std::function<bool(mcap::ChannelId)> & channel_filter,
+                             const DownsampleOptions & options, MessageSelection * selection);
+
+/**
+ * Compute the message counts and time range of a file from its Chunk Index and Message Index
+ * records, for files written without a Statistics record. Chunks without Message Index records
+ * are decompressed to count their messages. The chunks are split between up to `thread_count`
+ * threads, each reading through its own data source returned by `open_data_source`.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status derive_statistics(
+  const std::vector<mcap::ChunkIndex> & chunk_indexes, size_t thread_count,
+  const std::function<std::unique_ptr<mcap::IReadable>()> & open_data_source,
+  mcap::Statistics * statistics);
+
+/**
+ * The log times of every message on one channel, loaded from the Message Index records of the
+ * chunks containing it. Counts and time ranges are then answered by binary search, without
+ * reading or decompressing any chunk.
+ */
+class MessageTimeline final
+{
+public:
+  /// Load the timeline of `channel_id`. Only chunks listing the channel in their index are read.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static mcap::Status load(mcap::IReadable & data_source,
+                           const std::vector<mcap::ChunkIndex> & chunk_indexes,
+                           mcap::ChannelId channel_id, MessageTimeline * timeline);
+
+  /// Number of messages with a log time in [start_time, end_time].
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t count(mcap::Timestamp start_time, mcap::Timestamp end_time) const;
+
+  /// First and last log times in [start_time, end_time], if there is any message in it.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::optional<mcap::Timestamp> first(mcap::Timestamp start_time,
+                                       mcap::Timestamp end_time) const;
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::optional<mcap::Timestamp> last(mcap::Timestamp start_time, mcap::Timestamp end_time) const;
+
+  /**
+   * Add the number of messages in each bucket to `buckets`. Bucket i covers log times
+   * [start_time + i * bucket_duration, start_time + (i + 1) * bucket_duration), cut off after
+   * `end_time`.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void add_to_histogram(mcap::Timestamp start_time, mcap::Timestamp end_time,
+                        mcap::Timestamp bucket_duration, std::vector<uint64_t> * buckets) const;
+
+  /// All log times, sorted.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const std::vector<mcap::Timestamp> & log_times() const;
+
+private:
+  std::vector<mcap::Timestamp>::const_iterator lower(mcap::Timestamp time) const;
+  std::vector<mcap::Timestamp>::const_iterator upper(mcap::Timestamp time) const;
+
+  std::vector<mcap::Timestamp> log_times_;
+};
+
+/**
+ * Maps the ordinal of a message among the messages on a set of channels, counted in file order,
+ * to the chunk containing it. Only the number of messages of each chunk is kept, derived from
+ * the lengths of its Message Index records, so finding a message is a binary search followed by
+ * reading the Message Index records of a single chunk.
+ */
+class MessageOrdinalIndex final
+{
+public:
+  struct ChunkOrdinals
+  {
+    const mcap::ChunkIndex * chunk = nullptr;
+    // Ordinal of the first message of the chunk on the indexed channels.
+    uint64_t first_ordinal = 0;
+    uint64_t count = 0;
+  };
+
+  /// Index the messages on `channel_ids` in the chunks of `chunk_indexes`, which must outlive it.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static mcap::Status load(mcap::IReadable & data_source,
+                           const std::vector<mcap::ChunkIndex> & chunk_indexes,
+                           const std::vector<mcap::ChannelId> & channel_ids,
+                           MessageOrdinalIndex * index);
+
+  /// Number of indexed messages.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t size() const;
+
+  /// The chunk containing message `ordinal`, which must be less than size().
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const ChunkOrdinals & find(uint64_t ordinal) const;
+
+  /// Offsets in the decompressed records of `chunk` of the indexed messages, in file order.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Status read_message_offsets(mcap::IReadable & data_source, const ChunkOrdinals & chunk,
+                                    std::vector<uint64_t> * offsets) const;
+
+private:
+  std::vector<mcap::ChannelId> channel_ids_;
+  // Chunks containing indexed messages, in file order.
+  std::vector<ChunkOrdinals> chunks_;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__MESSAGE_INDEX_HPP_
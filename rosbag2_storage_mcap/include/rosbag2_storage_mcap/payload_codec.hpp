@@ -0,0 +1,84 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__PAYLOAD_CODEC_HPP_
+#define ROSBAG2_STORAGE_MCAP__PAYLOAD_CODEC_HPP_
+
+#include "visibility_control.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace rosbag2_storage_mcap
+{
+/**
+ * Encodes the payloads of messages of a schema before they are written, and decodes them back
+ * when they are read, for example with a lossless image compressor. Each payload is encoded on
+ * its own: reads may start at any message, after a seek, in reverse or by ordinal, so a payload
+ * cannot depend on the messages before it.
+ *
+ * A codec is shared by every reader and writer in the process, possibly from several threads at
+ * once, so encode() and decode() must be thread-safe.
+ */
+class PayloadCodec
+{
+public:
+  virtual ~PayloadCodec() = default;
+
+  /// Encode the `size`-byte payload at `data` into `encoded`. Returns false on failure.
+  virtual bool encode(const std::byte * data, size_t size,
+                      std::vector<std::byte> & encoded) const = 0;
+
+  /// Decode a payload encoded by encode() into `decoded`. Returns false if it is invalid.
+  virtual bool decode(const std::byte * data, size_t size,
+                      std::vector<std::byte> & decoded) const = 0;
+};
+
+/**
+ * The payload codecs available to this plugin, by name. Libraries providing codecs register them
+ * when they are loaded; the writer selects them by schema name through the payloadCodecs option
+ * and records the name of the codec in the metadata of each channel using it, from which the
+ * reader finds the decoder.
+ */
+class PayloadCodecRegistry final
+{
+public:
+  /// Channel metadata key holding the name of the codec the payloads of the channel use.
+  static constexpr const char * METADATA_KEY = "rosbag2_storage_mcap.codec";
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static PayloadCodecRegistry & instance();
+
+  /// Register `codec` as `name`, replacing any codec already registered with that name.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void add(const std::string & name, std::shared_ptr<const PayloadCodec> codec);
+
+  /// The codec registered as `name`, or nullptr if there is none.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::shared_ptr<const PayloadCodec> find(const std::string & name) const;
+
+private:
+  PayloadCodecRegistry() = default;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<const PayloadCodec>> codecs_;
+};
+
+}  // namespace rosbag2_storage_mcap
+
+#endif  // ROSBAG2_STORAGE_MCAP__PAYLOAD_CODEC_HPP_
@@ -0,0 +1,94 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__PAYLOAD_DEDUP_HPP_
+#define ROSBAG2_STORAGE_MCAP__PAYLOAD_DEDUP_HPP_
+
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/**
+ * Message encoding of the channels holding payload references. Each deduplicated topic has one
+ * such channel next to its own, with the same topic name and no schema; readers which do not
+ * know about it skip it as a channel in an unknown encoding.
+ */
+constexpr const char * PAYLOAD_REFERENCE_ENCODING = "rosbag2_storage_mcap.payload_reference";
+
+/// Size of an encoded PayloadReference: its log time then its hash, little-endian.
+constexpr size_t PAYLOAD_REFERENCE_SIZE = 16;
+
+/**
+ * Stands for a message whose payload is the same as that of an earlier message of its topic:
+ * the first message with that payload, identified by its log time and the hash of its payload.
+ */
+struct PayloadReference
+{
+  mcap::Timestamp log_time = 0;
+  uint64_t hash = 0;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::array<std::byte, PAYLOAD_REFERENCE_SIZE> encode() const;
+
+  /// Returns std::nullopt if `data` is not an encoded reference.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static std::optional<PayloadReference> decode(const std::byte * data, uint64_t size);
+};
+
+/**
+ * A fast non-cryptographic 64-bit hash of a message payload (MurmurHash64A). Payloads with equal
+ * hashes are still compared byte for byte before being deduplicated.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+uint64_t hash_payload(const std::byte * data, uint64_t size);
+
+/**
+ * Finds messages whose payload repeats the previous message of their topic, as nodes which
+ * republish the same state at a fixed rate produce. Only the last payload of each topic is kept,
+ * so memory use is bounded by one message per topic.
+ */
+class PayloadDeduplicator final
+{
+public:
+  /**
+   * If the payload of `message` is the same as that of the previous message added for `topic`,
+   * returns a reference to the first of the run of messages with that payload. Otherwise the
+   * payload is remembered and std::nullopt is returned. Payloads no larger than a reference are
+   * never deduplicated.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::optional<PayloadReference> add(const std::string & topic, const mcap::Message & message);
+
+private:
+  struct LastPayload
+  {
+    PayloadReference reference;
+    std::vector<std::byte> data;
+  };
+
+  std::unordered_map<std::string, LastPayload> last_payloads_;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__PAYLOAD_DEDUP_HPP_
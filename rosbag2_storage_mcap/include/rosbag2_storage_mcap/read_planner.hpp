@@ -0,0 +1,124 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__READ_PLANNER_HPP_
+#define ROSBAG2_STORAGE_MCAP__READ_PLANNER_HPP_
+
+#include "http_range_source.hpp"
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+struct ByteRange
+{
+  uint64_t offset = 0;
+  uint64_t length = 0;
+
+  uint64_t end() const
+  {
+    return offset + length;
+  }
+};
+
+/**
+ * Sort `ranges` and merge those separated by at most `max_gap` bytes, as long as the merged range
+ * does not grow beyond `max_length`. Ranges which are already longer than `max_length` are kept
+ * as they are.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+std::vector<ByteRange> coalesce_ranges(std::vector<ByteRange> ranges, uint64_t max_gap,
+                                       uint64_t max_length);
+
+/**
+ * An mcap::IReadable over a file which serves reads from a plan of byte ranges that will be
+ * needed, typically the chunks selected by a time range and topic filter.
+ * Nearby ranges are coalesced so that each is fetched with one large sequential read, the next
+ * ranges in the direction of travel are announced to the kernel ahead of use, and optionally the
+ * page cache is released behind the cursor. Reads outside of the plan are passed straight
+ * through to the file.
+ *
+ * The file may also be an http:// or https:// URL, read through an HttpRangeSource: ranges are
+ * then prefetched into its block cache instead of the page cache.
+ */
+class PlannedFileReader final : public mcap::IReadable
+{
+public:
+  struct Options
+  {
+    // Merge planned ranges separated by no more than this many bytes.
+    uint64_t coalesce_gap = 1024 * 1024;
+    // Do not merge ranges beyond this size.
+    uint64_t max_coalesced_size = 32 * 1024 * 1024;
+    // Number of upcoming ranges to prefetch with POSIX_FADV_WILLNEED.
+    size_t read_ahead = 2;
+    // Release the page cache of each range once it has been read, with POSIX_FADV_DONTNEED.
+    bool drop_behind = false;
+    // Options of the HttpRangeSource used for URLs.
+    HttpRangeSource::Options http;
+  };
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  explicit PlannedFileReader(Options options);
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ~PlannedFileReader() override;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::Status open(const std::string & path);
+
+  /**
+   * Replace the read plan. Ranges are coalesced according to the options; passing an empty
+   * plan makes every read go straight to the file.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void set_plan(std::vector<ByteRange> ranges);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  const std::vector<ByteRange> & plan() const;
+
+  /// The version of a remote file, see HttpRangeSource::version(); empty for local files.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::string version() const;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t size() const override;
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  uint64_t read(std::byte ** output, uint64_t offset, uint64_t size) override;
+
+private:
+  bool fill_buffer(uint64_t offset, uint64_t length);
+  void enter_range(size_t index);
+  void advise(const ByteRange & range, bool will_need);
+
+  Options options_;
+  std::FILE * file_ = nullptr;
+  std::shared_ptr<HttpRangeSource> http_;
+  uint64_t size_ = 0;
+  std::vector<ByteRange> plan_;
+  // Index into plan_ of the range currently held in buffer_, if any.
+  size_t current_range_ = SIZE_MAX;
+  mcap::ByteArray buffer_;
+  uint64_t buffer_offset_ = 0;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__READ_PLANNER_HPP_
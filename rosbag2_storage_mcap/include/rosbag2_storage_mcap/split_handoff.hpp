@@ -0,0 +1,93 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef ROSBAG2_STORAGE_MCAP__SPLIT_HANDOFF_HPP_
+#define ROSBAG2_STORAGE_MCAP__SPLIT_HANDOFF_HPP_
+
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/// Schemas and channels of a file, by increasing id.
+struct SplitTopics
+{
+  std::vector<mcap::SchemaPtr> schemas;
+  std::vector<mcap::ChannelPtr> channels;
+};
+
+/**
+ * Process-wide handoff of the schemas and channels of each file of a split recording to the next
+ * one. rosbag2 names the files of a recording `<name>_0`, `<name>_1`, ... and creates every topic
+ * again in each new file; the topics a file `<name>_N` is closed with are left here, and taken by
+ * the file `<name>_N+1` of the same directory, which then has their schemas without looking up
+ * any message definition, and exactly as they were in the previous file.
+ *
+ * Only the topics of the last file of each recording are kept. Since a closing file cannot tell
+ * whether the recording goes on, those of the last file of a recording are only dropped once a
+ * later file of the recording is opened, or once MAX_RECORDINGS recordings have left topics more
+ * recently.
+ */
+class SplitHandoff final
+{
+public:
+  /// Recordings whose topics are kept; those of the least recently closed file are dropped first.
+  static constexpr size_t MAX_RECORDINGS = 16;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static SplitHandoff & instance();
+
+  /**
+   * Leave the topics of the closed file `path` for the next file, if it is named like a split
+   * file. Schemas no channel refers to are dropped, and the rest are renumbered from 1, so that
+   * the next file can give them the same ids.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void put(const std::string & path, const SplitTopics & topics);
+
+  /// Take the topics left by the file preceding `path` in its recording; null if there are none.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::shared_ptr<const SplitTopics> take(const std::string & path);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void clear();
+
+private:
+  struct Entry
+  {
+    // The split index of the file which left the topics.
+    uint64_t split_index = 0;
+    // Order of the put() calls, to drop the oldest entry.
+    uint64_t sequence = 0;
+    std::shared_ptr<const SplitTopics> topics;
+  };
+
+  std::mutex mutex_;
+  // By directory and name without the split index.
+  std::unordered_map<std::string, Entry> entries_;
+  uint64_t next_sequence_ = 0;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__SPLIT_HANDOFF_HPP_
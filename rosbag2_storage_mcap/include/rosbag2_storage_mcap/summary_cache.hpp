@@ -0,0 +1,134 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__SUMMARY_CACHE_HPP_
+#define ROSBAG2_STORAGE_MCAP__SUMMARY_CACHE_HPP_
+
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/**
+ * Identifies one version of a file on disk: a file rewritten in place gets a new identity as long
+ * as its size or modification time changes.
+ */
+struct FileIdentity
+{
+  std::string path;
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  // Remote files: the ETag or Last-Modified time reported by the server.
+  std::string version;
+
+  /// Throws std::filesystem::filesystem_error if the file cannot be inspected.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static FileIdentity of(const std::string & path);
+
+  bool operator==(const FileIdentity & other) const
+  {
+    return path == other.path && size == other.size && mtime == other.mtime &&
+           version == other.version;
+  }
+};
+
+struct FileIdentityHash
+{
+  std::size_t operator()(const FileIdentity & id) const
+  {
+    std::size_t h = std::hash<std::string>()(id.path);
+    h ^= std::hash<uint64_t>()(id.size) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    h ^= std::hash<int64_t>()(id.mtime) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    h ^= std::hash<std::string>()(id.version) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    return h;
+  }
+};
+
+/**
+ * An immutable copy of the parsed summary section of an MCAP file, which can be shared between
+ * any number of readers of that file.
+ */
+struct ParsedSummary
+{
+  std::unordered_map<mcap::SchemaId, mcap::SchemaPtr> schemas;
+  std::unordered_map<mcap::ChannelId, mcap::ChannelPtr> channels;
+  std::vector<mcap::ChunkIndex> chunk_indexes;
+  std::multimap<std::string, mcap::MetadataIndex> metadata_indexes;
+  std::optional<mcap::Statistics> statistics;
+  // True if every chunk holding messages has Message Index records, which are needed for indexed
+  // reading; the chunks of a file recovered without its summary may not.
+  bool has_message_indexes = false;
+
+  /// Copy the summary of a reader on which readSummary() has been called.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static std::shared_ptr<ParsedSummary> from_reader(const mcap::McapReader & reader);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::SchemaPtr schema(mcap::SchemaId id) const;
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  mcap::ChannelPtr channel(mcap::ChannelId id) const;
+};
+
+/**
+ * Process-wide cache of parsed summaries, keyed by file identity. The first reader of a file
+ * parses its summary; later readers of the same unchanged file, including readers opened
+ * concurrently while it is being parsed, share the result.
+ */
+class SummaryCache final
+{
+public:
+  using Loader = std::function<std::shared_ptr<const ParsedSummary>()>;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  static SummaryCache & instance();
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  explicit SummaryCache(size_t capacity);
+
+  /**
+   * Return the cached summary for `file`, or call `load` to parse it. Exceptions thrown by
+   * `load` are propagated to every caller waiting on the same file, and nothing is cached.
+   */
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  std::shared_ptr<const ParsedSummary> get_or_load(const FileIdentity & file, const Loader & load);
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void clear();
+
+private:
+  using Entry = std::shared_future<std::shared_ptr<const ParsedSummary>>;
+
+  std::mutex mutex_;
+  size_t capacity_;
+  // Most recently used first.
+  std::list<std::pair<FileIdentity, Entry>> entries_;
+  std::unordered_map<FileIdentity, decltype(entries_)::iterator, FileIdentityHash> index_;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__SUMMARY_CACHE_HPP_
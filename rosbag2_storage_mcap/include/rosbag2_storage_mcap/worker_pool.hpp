@@ -0,0 +1,76 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROSBAG2_STORAGE_MCAP__WORKER_POOL_HPP_
+#define ROSBAG2_STORAGE_MCAP__WORKER_POOL_HPP_
+
+#include "visibility_control.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/**
+ * A fixed set of threads running submitted tasks in submission order.
+ */
+class WorkerPool final
+{
+public:
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  explicit WorkerPool(size_t thread_count);
+
+  /// Tasks which have not started yet are dropped; their futures report std::broken_promise.
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool & operator=(const WorkerPool &) = delete;
+
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  size_t size() const;
+
+  template <typename F>
+  std::future<std::invoke_result_t<F>> submit(F && task)
+  {
+    auto packaged =
+      std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(task));
+    auto future = packaged->get_future();
+    enqueue([packaged]() { (*packaged)(); });
+    return future;
+  }
+
+private:
+  ROSBAG2_STORAGE_MCAP_PUBLIC
+  void enqueue(std::function<void()> task);
+  void run();
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__WORKER_POOL_HPP_
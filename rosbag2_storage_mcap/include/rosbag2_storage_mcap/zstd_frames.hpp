@@ -0,0 +1,63 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef ROSBAG2_STORAGE_MCAP__ZSTD_FRAMES_HPP_
+#define ROSBAG2_STORAGE_MCAP__ZSTD_FRAMES_HPP_
+
+#include "visibility_control.hpp"
+
+#include <mcap/mcap.hpp>
+
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+/// A zstd frame of a chunk records section, and where it decompresses to.
+struct ZstdFrame
+{
+  uint64_t compressed_offset = 0;
+  uint64_t compressed_size = 0;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+/**
+ * Compress `size` bytes at `data` into `output` as zstd frames of at most `frame_size`
+ * uncompressed bytes each, which decode as a single stream. When there are several, they are
+ * preceded by a frame index in a skippable frame, which zstd decoders ignore, so that readers
+ * can find the frames without walking their headers. A `frame_size` of 0 writes a single frame.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+mcap::Status compress_zstd_frames(const std::byte * data, uint64_t size, uint64_t frame_size,
+                                  mcap::CompressionLevel level, mcap::ByteArray * output);
+
+/// Read the frame index written by compress_zstd_frames(); false if there is none.
+ROSBAG2_STORAGE_MCAP_PUBLIC
+bool read_zstd_frame_index(const std::byte * data, uint64_t compressed_size,
+                           std::vector<ZstdFrame> * frames);
+
+/**
+ * Find the frames of a zstd records section decompressing to `uncompressed_size` bytes, from its
+ * frame index or else from the frame headers. Returns false if it has a single frame, or if a
+ * frame does not record its decompressed size, since it then cannot be placed in the output
+ * before the frames preceding it are decompressed.
+ */
+ROSBAG2_STORAGE_MCAP_PUBLIC
+bool find_zstd_frames(const std::byte * data, uint64_t compressed_size,
+                      uint64_t uncompressed_size, std::vector<ZstdFrame> * frames);
+
+}  // namespace rosbag2_storage_mcap::internal
+
+#endif  // ROSBAG2_STORAGE_MCAP__ZSTD_FRAMES_HPP_
@@ -0,0 +1,165 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/activity_histogram.hpp"
+
+#include <string>
+#include <utility>
+
+namespace rosbag2_storage_mcap
+{
+// Metadata layout: BUCKET_DURATION_KEY holds the bucket duration in nanoseconds, and every other
+// key is a topic name whose value is a comma-separated list of "<start time>:<count>/<bytes>"
+// buckets. The start time is left out of a bucket which directly follows the previous one.
+static const char BUCKET_DURATION_KEY[] = "bucket_duration";
+
+// Parse a decimal number at `pos` in `text`, advancing `pos` past it.
+static bool parse_uint(const std::string & text, size_t * pos, uint64_t * value)
+{
+  const size_t start = *pos;
+  *value = 0;
+  while (*pos < text.size() && text[*pos] >= '0' && text[*pos] <= '9') {
+    *value = *value * 10 + uint64_t(text[*pos] - '0');
+    ++*pos;
+  }
+  return *pos > start;
+}
+
+static bool expect_char(const std::string & text, size_t * pos, char c)
+{
+  if (*pos >= text.size() || text[*pos] != c) {
+    return false;
+  }
+  ++*pos;
+  return true;
+}
+
+ActivityHistogram::ActivityHistogram(mcap::Timestamp bucket_duration)
+    : bucket_duration_(bucket_duration)
+{
+}
+
+void ActivityHistogram::add(const std::string & topic, mcap::Timestamp log_time, uint64_t bytes)
+{
+  auto & bucket = topics_[topic].buckets[log_time - log_time % bucket_duration_];
+  bucket.message_count++;
+  bucket.byte_count += bytes;
+}
+
+bool ActivityHistogram::merge(const ActivityHistogram & other)
+{
+  if (other.bucket_duration_ != bucket_duration_) {
+    return false;
+  }
+  for (const auto & [topic, series] : other.topics_) {
+    auto & buckets = topics_[topic].buckets;
+    for (const auto & [start, bucket] : series.buckets) {
+      buckets[start].message_count += bucket.message_count;
+      buckets[start].byte_count += bucket.byte_count;
+    }
+  }
+  return true;
+}
+
+mcap::Timestamp ActivityHistogram::bucket_duration() const
+{
+  return bucket_duration_;
+}
+
+const std::map<std::string, ActivityHistogram::Series> & ActivityHistogram::topics() const
+{
+  return topics_;
+}
+
+mcap::Metadata ActivityHistogram::to_metadata() const
+{
+  mcap::Metadata metadata;
+  metadata.name = METADATA_NAME;
+  metadata.metadata[BUCKET_DURATION_KEY] = std::to_string(bucket_duration_);
+  for (const auto & [topic, series] : topics_) {
+    std::string value;
+    mcap::Timestamp next_start = 0;
+    for (const auto & [start, bucket] : series.buckets) {
+      if (!value.empty()) {
+        value += ',';
+      }
+      if (value.empty() || start != next_start) {
+        value += std::to_string(start) + ":";
+      }
+      value += std::to_string(bucket.message_count) + "/" + std::to_string(bucket.byte_count);
+      next_start = start + bucket_duration_;
+    }
+    metadata.metadata[topic] = std::move(value);
+  }
+  return metadata;
+}
+
+std::optional<ActivityHistogram> ActivityHistogram::from_metadata(const mcap::Metadata & metadata)
+{
+  if (metadata.name != METADATA_NAME) {
+    return std::nullopt;
+  }
+  const auto duration_it = metadata.metadata.find(BUCKET_DURATION_KEY);
+  if (duration_it == metadata.metadata.end()) {
+    return std::nullopt;
+  }
+  size_t pos = 0;
+  uint64_t bucket_duration = 0;
+  if (!parse_uint(duration_it->second, &pos, &bucket_duration) || bucket_duration == 0) {
+    return std::nullopt;
+  }
+
+  ActivityHistogram histogram{bucket_duration};
+  for (const auto & [key, value] : metadata.metadata) {
+    if (key == BUCKET_DURATION_KEY) {
+      continue;
+    }
+    Series series;
+    pos = 0;
+    mcap::Timestamp start = 0;
+    bool first = true;
+    while (pos < value.size() || first) {
+      if (!first && !expect_char(value, &pos, ',')) {
+        return std::nullopt;
+      }
+      Bucket bucket;
+      if (!parse_uint(value, &pos, &bucket.message_count)) {
+        return std::nullopt;
+      }
+      if (expect_char(value, &pos, ':')) {
+        start = bucket.message_count;
+        if (start % bucket_duration != 0 || !parse_uint(value, &pos, &bucket.message_count)) {
+          return std::nullopt;
+        }
+      } else if (first) {
+        return std::nullopt;
+      }
+      if (!expect_char(value, &pos, '/') || !parse_uint(value, &pos, &bucket.byte_count)) {
+        return std::nullopt;
+      }
+      // Empty buckets are accepted, as written by earlier versions, but not kept.
+      if (bucket.message_count > 0) {
+        series.buckets[start] = bucket;
+      }
+      start += bucket_duration;
+      first = false;
+    }
+    if (!series.buckets.empty()) {
+      histogram.topics_.emplace(key, std::move(series));
+    }
+  }
+  return histogram;
+}
+
+}  // namespace rosbag2_storage_mcap
@@ -0,0 +1,93 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/byte_shuffle.hpp"
+
+#include <cstring>
+
+namespace rosbag2_storage_mcap::internal
+{
+// With the element size known at compile time, the inner loop is unrolled and each output lane
+// is written sequentially.
+template <uint32_t ElementSize>
+static void shuffle_elements(const std::byte * input, uint64_t count, std::byte * output)
+{
+  for (uint64_t i = 0; i < count; ++i) {
+    for (uint32_t j = 0; j < ElementSize; ++j) {
+      output[j * count + i] = input[i * ElementSize + j];
+    }
+  }
+}
+
+template <uint32_t ElementSize>
+static void unshuffle_elements(const std::byte * input, uint64_t count, std::byte * output)
+{
+  for (uint64_t i = 0; i < count; ++i) {
+    for (uint32_t j = 0; j < ElementSize; ++j) {
+      output[i * ElementSize + j] = input[j * count + i];
+    }
+  }
+}
+
+template <bool Shuffle>
+static void transpose(const std::byte * input, uint64_t size, uint32_t element_size,
+                      std::byte * output)
+{
+  if (element_size < 2) {
+    std::memcpy(output, input, size);
+    return;
+  }
+  const uint64_t count = size / element_size;
+  switch (element_size) {
+    case 2:
+      Shuffle ? shuffle_elements<2>(input, count, output)
+              : unshuffle_elements<2>(input, count, output);
+      break;
+    case 4:
+      Shuffle ? shuffle_elements<4>(input, count, output)
+              : unshuffle_elements<4>(input, count, output);
+      break;
+    case 8:
+      Shuffle ? shuffle_elements<8>(input, count, output)
+              : unshuffle_elements<8>(input, count, output);
+      break;
+    default:
+      for (uint64_t i = 0; i < count; ++i) {
+        for (uint32_t j = 0; j < element_size; ++j) {
+          if (Shuffle) {
+            output[j * count + i] = input[i * element_size + j];
+          } else {
+            output[i * element_size + j] = input[j * count + i];
+          }
+        }
+      }
+      break;
+  }
+  const uint64_t shuffled = count * element_size;
+  std::memcpy(output + shuffled, input + shuffled, size - shuffled);
+}
+
+void byte_shuffle(const std::byte * input, uint64_t size, uint32_t element_size,
+                  std::byte * output)
+{
+  transpose<true>(input, size, element_size, output);
+}
+
+void byte_unshuffle(const std::byte * input, uint64_t size, uint32_t element_size,
+                    std::byte * output)
+{
+  transpose<false>(input, size, element_size, output);
+}
+
+}  // namespace rosbag2_storage_mcap::internal
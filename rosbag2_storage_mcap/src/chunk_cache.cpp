@@ -0,0 +1,163 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/chunk_cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <utility>
+
+namespace rosbag2_storage_mcap::internal
+{
+ChunkCache & ChunkCache::instance()
+{
+  // Disabled until a reader asks for a shared cache.
+  static ChunkCache cache{0};
+  return cache;
+}
+
+ChunkCache::ChunkCache(uint64_t capacity_bytes)
+    : capacity_(capacity_bytes)
+{
+}
+
+void ChunkCache::reserve(uint64_t capacity_bytes)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = std::max(capacity_, capacity_bytes);
+}
+
+uint64_t ChunkCache::capacity() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return capacity_;
+}
+
+uint64_t ChunkCache::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+mcap::Status ChunkCache::get_or_load(const ChunkKey & key, const Loader & load,
+                                     ChunkRecords * records, const Verifier & verify)
+{
+  std::promise<Result> promise;
+  std::shared_future<Result> result;
+  bool loading = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = index_.find(key);
+    if (it != index_.end()) {
+      entries_.splice(entries_.begin(), entries_, it->second);
+      result = it->second->result;
+    } else {
+      result = promise.get_future().share();
+      entries_.push_front(Entry{key, result, 0, static_cast<bool>(verify)});
+      index_[key] = entries_.begin();
+      loading = true;
+    }
+  }
+
+  if (loading) {
+    auto loaded = std::make_shared<mcap::ByteArray>();
+    mcap::Status status = load(loaded.get());
+    const uint64_t bytes = loaded->size();
+    promise.set_value(std::make_pair(status, status.ok() ? std::move(loaded) : nullptr));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = index_.find(key);
+    if (it != index_.end()) {
+      if (status.ok()) {
+        it->second->bytes = bytes;
+        size_ += bytes;
+        evict_locked();
+      } else {
+        entries_.erase(it->second);
+        index_.erase(it);
+      }
+    }
+  }
+
+  const Result & value = result.get();
+  *records = value.second;
+  if (loading || !verify || !value.first.ok()) {
+    return value.first;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = find_locked(key, value.second);
+    if (it != entries_.end() && it->verified) {
+      return value.first;
+    }
+  }
+  // Checked outside the lock; callers verifying the same records at once each check them.
+  mcap::Status status = verify(*value.second);
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = find_locked(key, value.second);
+  if (it != entries_.end()) {
+    if (status.ok()) {
+      it->verified = true;
+    } else {
+      size_ -= it->bytes;
+      index_.erase(it->key);
+      entries_.erase(it);
+    }
+  }
+  if (!status.ok()) {
+    *records = nullptr;
+  }
+  return status;
+}
+
+std::list<ChunkCache::Entry>::iterator ChunkCache::find_locked(const ChunkKey & key,
+                                                              const ChunkRecords & records)
+{
+  const auto it = index_.find(key);
+  // An entry still loading holds other records, and must not be waited for under the lock.
+  if (it == index_.end() ||
+      it->second->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready ||
+      it->second->result.get().second != records) {
+    return entries_.end();
+  }
+  return it->second;
+}
+
+void ChunkCache::evict_locked()
+{
+  // Evict least recently used chunks. Chunks still held by a reader stay alive through their
+  // shared pointer; the cache only stops tracking them.
+  auto it = entries_.end();
+  while (size_ > capacity_ && it != entries_.begin()) {
+    --it;
+    if (it->bytes == 0) {
+      continue;
+    }
+    size_ -= it->bytes;
+    index_.erase(it->key);
+    it = entries_.erase(it);
+  }
+}
+
+void ChunkCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  index_.clear();
+  size_ = 0;
+}
+
+}  // namespace rosbag2_storage_mcap::internal
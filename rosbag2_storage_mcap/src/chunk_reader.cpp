@@ -0,0 +1,650 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/chunk_reader.hpp"
+
+#include "rosbag2_storage_mcap/crc32.hpp"
+#include "rosbag2_storage_mcap/zstd_frames.hpp"
+
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+// Opcode (1 byte) followed by the record length (8 bytes)
+static constexpr uint64_t RECORD_PREFIX_LENGTH = 9;
+// channel_id (2) + sequence (4) + log_time (8) + publish_time (8)
+static constexpr uint64_t MESSAGE_HEADER_LENGTH = 22;
+// message_start_time (8) + message_end_time (8) + uncompressed_size (8)
+static constexpr uint64_t CHUNK_CRC_OFFSET = 24;
+
+static uint64_t read_uint(const std::byte * data, size_t width)
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < width; ++i) {
+    value |= uint64_t(data[i]) << (8 * i);
+  }
+  return value;
+}
+
+static mcap::Status read_chunk(mcap::IReadable & data_source, const mcap::ChunkIndex & chunk_index,
+                               mcap::Chunk * chunk)
+{
+  mcap::Record record;
+  auto status = mcap::McapReader::ReadRecord(data_source, chunk_index.chunkStartOffset, &record);
+  if (!status.ok()) {
+    return status;
+  }
+  if (record.opcode != mcap::OpCode::Chunk) {
+    return mcap::Status{mcap::StatusCode::InvalidChunkOffset,
+                        "expected a Chunk record at offset " +
+                          std::to_string(chunk_index.chunkStartOffset)};
+  }
+  return mcap::McapReader::ParseChunk(record, chunk);
+}
+
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+// Decompress a zstd records section made of several concatenated frames, one frame per task on
+// `workers`. Returns false without decompressing anything if find_zstd_frames() cannot place
+// the frames.
+static bool decompress_zstd_frames(const std::byte * data, uint64_t compressed_size,
+                                   uint64_t uncompressed_size, WorkerPool & workers,
+                                   mcap::ByteArray * records, mcap::Status * status)
+{
+  std::vector<ZstdFrame> frames;
+  if (!find_zstd_frames(data, compressed_size, uncompressed_size, &frames)) {
+    return false;
+  }
+
+  records->resize(uncompressed_size);
+  std::vector<std::future<size_t>> results;
+  results.reserve(frames.size());
+  for (const ZstdFrame & frame : frames) {
+    results.push_back(workers.submit([data, records, frame]() {
+      return ZSTD_decompress(records->data() + frame.offset, frame.size,
+                             data + frame.compressed_offset, frame.compressed_size);
+    }));
+  }
+  *status = mcap::Status{};
+  for (size_t i = 0; i < results.size(); ++i) {
+    const size_t result = results[i].get();
+    if (status->ok() && (ZSTD_isError(result) || result != frames[i].size)) {
+      *status = mcap::Status{mcap::StatusCode::DecompressionFailed,
+                             "zstd frame at offset " +
+                               std::to_string(frames[i].compressed_offset) +
+                               " failed to decompress"};
+    }
+  }
+  return true;
+}
+#endif
+
+mcap::Status read_chunk_records(mcap::IReadable & data_source,
+                                const mcap::ChunkIndex & chunk_index, mcap::ByteArray * records,
+                                WorkerPool * frame_workers, uint32_t * uncompressed_crc)
+{
+  mcap::Chunk chunk;
+  auto status = read_chunk(data_source, chunk_index, &chunk);
+  if (!status.ok()) {
+    return status;
+  }
+  if (uncompressed_crc) {
+    *uncompressed_crc = chunk.uncompressedCrc;
+  }
+  return decompress_chunk(chunk.compression, chunk.records, chunk.compressedSize,
+                          chunk.uncompressedSize, records, frame_workers);
+}
+
+mcap::Status read_chunk_crc(mcap::IReadable & data_source, const mcap::ChunkIndex & chunk_index,
+                            uint32_t * uncompressed_crc)
+{
+  std::byte * header = nullptr;
+  if (data_source.read(&header, chunk_index.chunkStartOffset,
+                       RECORD_PREFIX_LENGTH + CHUNK_CRC_OFFSET + 4) !=
+        RECORD_PREFIX_LENGTH + CHUNK_CRC_OFFSET + 4 ||
+      mcap::OpCode(header[0]) != mcap::OpCode::Chunk) {
+    return mcap::Status{mcap::StatusCode::InvalidChunkOffset,
+                        "expected a Chunk record at offset " +
+                          std::to_string(chunk_index.chunkStartOffset)};
+  }
+  *uncompressed_crc = uint32_t(read_uint(header + RECORD_PREFIX_LENGTH + CHUNK_CRC_OFFSET, 4));
+  return mcap::Status{};
+}
+
+mcap::Status read_compressed_chunk(mcap::IReadable & data_source,
+                                   const mcap::ChunkIndex & chunk_index, CompressedChunk * chunk)
+{
+  mcap::Chunk parsed;
+  auto status = read_chunk(data_source, chunk_index, &parsed);
+  if (!status.ok()) {
+    return status;
+  }
+  chunk->compression = parsed.compression;
+  chunk->uncompressed_size = parsed.uncompressedSize;
+  chunk->uncompressed_crc = parsed.uncompressedCrc;
+  chunk->data.assign(parsed.records, parsed.records + parsed.compressedSize);
+  return mcap::Status{};
+}
+
+mcap::Status decompress_chunk(const std::string & compression, const std::byte * data,
+                              uint64_t compressed_size, uint64_t uncompressed_size,
+                              mcap::ByteArray * records, WorkerPool * frame_workers)
+{
+  if (compression.empty()) {
+    records->assign(data, data + compressed_size);
+    return mcap::Status{};
+  } else if (compression == "zstd") {
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+    mcap::Status status;
+    if (frame_workers && decompress_zstd_frames(data, compressed_size, uncompressed_size,
+                                                *frame_workers, records, &status)) {
+      return status;
+    }
+#endif
+    return mcap::ZStdReader::DecompressAll(data, compressed_size, uncompressed_size, records);
+  } else if (compression == "lz4") {
+    mcap::LZ4Reader lz4_reader;
+    return lz4_reader.decompressAll(data, compressed_size, uncompressed_size, records);
+  }
+  return mcap::Status{mcap::StatusCode::UnrecognizedCompression,
+                      "unsupported chunk compression: " + compression};
+}
+
+bool parse_chunk_record(const mcap::ByteArray & records, uint64_t offset, mcap::OpCode * opcode,
+                        uint64_t * length, mcap::Message * message)
+{
+  if (records.size() < RECORD_PREFIX_LENGTH || offset > records.size() - RECORD_PREFIX_LENGTH) {
+    return false;
+  }
+  const std::byte * data = records.data() + offset;
+  *opcode = mcap::OpCode(data[0]);
+  *length = read_uint(data + 1, 8);
+  if (*length > records.size() - offset - RECORD_PREFIX_LENGTH) {
+    return false;
+  }
+  if (*opcode != mcap::OpCode::Message) {
+    return true;
+  }
+  if (*length < MESSAGE_HEADER_LENGTH) {
+    return false;
+  }
+  data += RECORD_PREFIX_LENGTH;
+  message->channelId = mcap::ChannelId(read_uint(data, 2));
+  message->sequence = uint32_t(read_uint(data + 2, 4));
+  message->logTime = read_uint(data + 6, 8);
+  message->publishTime = read_uint(data + 14, 8);
+  message->dataSize = *length - MESSAGE_HEADER_LENGTH;
+  message->data = data + MESSAGE_HEADER_LENGTH;
+  return true;
+}
+
+bool chunk_may_match(const mcap::ChunkIndex & chunk_index, mcap::Timestamp start_time,
+                     mcap::Timestamp end_time,
+                     const std::function<bool(mcap::ChannelId)> & channel_filter)
+{
+  if (chunk_index.messageEndTime < start_time || chunk_index.messageStartTime > end_time) {
+    return false;
+  }
+  // Without message indexes we cannot tell which channels a chunk contains.
+  if (!channel_filter || chunk_index.messageIndexOffsets.empty()) {
+    return true;
+  }
+  return std::any_of(chunk_index.messageIndexOffsets.begin(),
+                     chunk_index.messageIndexOffsets.end(),
+                     [&](const auto & entry) { return channel_filter(entry.first); });
+}
+
+mcap::Status check_chunk_crc(const mcap::ChunkIndex & chunk_index, const mcap::ByteArray & records,
+                             uint32_t expected_crc)
+{
+  if (expected_crc == 0) {
+    return mcap::Status{};
+  }
+  const uint32_t crc = crc32(records.data(), records.size());
+  if (crc != expected_crc) {
+    return mcap::Status{mcap::StatusCode::InvalidRecord,
+                        "chunk at offset " + std::to_string(chunk_index.chunkStartOffset) +
+                          " failed its CRC check (expected " + std::to_string(expected_crc) +
+                          ", computed " + std::to_string(crc) + ")"};
+  }
+  return mcap::Status{};
+}
+
+mcap::Status verify_chunk_crcs(
+  const std::vector<mcap::ChunkIndex> & chunk_indexes, size_t thread_count,
+  const std::function<std::unique_ptr<mcap::IReadable>(
+    const std::vector<const mcap::ChunkIndex *> &)> & open_data_source,
+  ChunkCrcReport * report)
+{
+  std::vector<const mcap::ChunkIndex *> chunks;
+  chunks.reserve(chunk_indexes.size());
+  for (const auto & chunk_index : chunk_indexes) {
+    chunks.push_back(&chunk_index);
+  }
+  std::sort(chunks.begin(), chunks.end(), [](const auto * a, const auto * b) {
+    return a->chunkStartOffset < b->chunkStartOffset;
+  });
+
+  struct Partial
+  {
+    mcap::Status status;
+    uint64_t unchecked = 0;
+    std::vector<uint64_t> corrupt;
+  };
+  thread_count = std::max<size_t>(1, std::min(thread_count, chunks.size()));
+  std::vector<Partial> partials(thread_count);
+  auto verify_run = [&](size_t run) {
+    auto & partial = partials[run];
+    const std::vector<const mcap::ChunkIndex *> run_chunks(
+      chunks.begin() + chunks.size() * run / thread_count,
+      chunks.begin() + chunks.size() * (run + 1) / thread_count);
+    auto data_source = open_data_source(run_chunks);
+    if (!data_source) {
+      partial.status = mcap::Status{mcap::StatusCode::OpenFailed, "failed to open data source"};
+      return;
+    }
+    mcap::ByteArray records;
+    for (const auto * chunk_index : run_chunks) {
+      uint32_t crc = 0;
+      const auto status = read_chunk_records(*data_source, *chunk_index, &records, nullptr, &crc);
+      switch (status.code) {
+        case mcap::StatusCode::Success:
+          break;
+        // The chunk was read but its contents do not hold together.
+        case mcap::StatusCode::InvalidRecord:
+        case mcap::StatusCode::InvalidChunkOffset:
+        case mcap::StatusCode::DecompressionFailed:
+        case mcap::StatusCode::DecompressionSizeMismatch:
+          partial.corrupt.push_back(chunk_index->chunkStartOffset);
+          continue;
+        default:
+          partial.status = status;
+          return;
+      }
+      if (crc == 0) {
+        partial.unchecked++;
+      } else if (!check_chunk_crc(*chunk_index, records, crc).ok()) {
+        partial.corrupt.push_back(chunk_index->chunkStartOffset);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; ++i) {
+    threads.emplace_back(verify_run, i);
+  }
+  verify_run(0);
+  for (auto & thread : threads) {
+    thread.join();
+  }
+
+  *report = ChunkCrcReport{};
+  report->chunk_count = chunks.size();
+  for (const auto & partial : partials) {
+    if (!partial.status.ok()) {
+      return partial.status;
+    }
+    report->unchecked_chunk_count += partial.unchecked;
+    report->corrupt_chunk_offsets.insert(report->corrupt_chunk_offsets.end(),
+                                         partial.corrupt.begin(), partial.corrupt.end());
+  }
+  return mcap::Status{};
+}
+
+ChunkedMessageReader::ChunkedMessageReader(mcap::IReadable & data_source,
+                                           const std::vector<mcap::ChunkIndex> & chunk_indexes,
+                                           Options options)
+    : data_source_(data_source)
+    , options_(std::move(options))
+{
+  for (const auto & chunk_index : chunk_indexes) {
+    if (options_.selection &&
+        options_.selection->find(chunk_index.chunkStartOffset) == options_.selection->end()) {
+      continue;
+    }
+    if (chunk_may_match(chunk_index, options_.start_time, options_.end_time,
+                        options_.channel_filter)) {
+      chunks_.push_back(&chunk_index);
+    }
+  }
+  switch (options_.read_order) {
+    case ReadOrder::FileOrder:
+      std::sort(chunks_.begin(), chunks_.end(), [](const auto * a, const auto * b) {
+        return a->chunkStartOffset < b->chunkStartOffset;
+      });
+      break;
+    case ReadOrder::LogTimeOrder:
+      std::sort(chunks_.begin(), chunks_.end(), [](const auto * a, const auto * b) {
+        return std::tie(a->messageStartTime, a->chunkStartOffset) <
+               std::tie(b->messageStartTime, b->chunkStartOffset);
+      });
+      break;
+    case ReadOrder::ReverseLogTimeOrder:
+      std::sort(chunks_.begin(), chunks_.end(), [](const auto * a, const auto * b) {
+        return std::tie(a->messageEndTime, a->chunkStartOffset) >
+               std::tie(b->messageEndTime, b->chunkStartOffset);
+      });
+      break;
+  }
+}
+
+ChunkedMessageReader::~ChunkedMessageReader()
+{
+  cancelled_ = true;
+  for (auto & pending : pending_) {
+    pending.wait();
+  }
+  for (auto & crc_check : crc_checks_) {
+    crc_check.wait();
+  }
+}
+
+const std::vector<const mcap::ChunkIndex *> & ChunkedMessageReader::chunks() const
+{
+  return chunks_;
+}
+
+const mcap::Status & ChunkedMessageReader::status() const
+{
+  return status_;
+}
+
+bool ChunkedMessageReader::comes_before(mcap::Timestamp a, mcap::Timestamp b) const
+{
+  return options_.read_order == ReadOrder::ReverseLogTimeOrder ? a > b : a < b;
+}
+
+ChunkedMessageReader::LoadResult ChunkedMessageReader::load_chunk(size_t order)
+{
+  const mcap::ChunkIndex & chunk_index = *chunks_[order];
+  const bool check_inline =
+    options_.crc_check == ChunkCrcCheck::Inline ||
+    (options_.crc_check == ChunkCrcCheck::Background && !options_.crc_workers);
+  // The CRC recorded for the records, if they are read from the data source rather than found
+  // in a cache.
+  uint32_t crc = 0;
+  bool loaded = false;
+  ChunkCache::Loader read_and_decompress = [this, &chunk_index, check_inline, &crc,
+                                            &loaded](mcap::ByteArray * records) {
+    loaded = true;
+    mcap::Status status;
+    if (!options_.workers) {
+      status = read_chunk_records(data_source_, chunk_index, records,
+                                  options_.frame_workers.get(), &crc);
+    } else {
+      // Only the read is serialized; workers decompress concurrently.
+      CompressedChunk compressed;
+      {
+        std::lock_guard<std::mutex> lock(data_source_mutex_);
+        status = read_compressed_chunk(data_source_, chunk_index, &compressed);
+        if (!status.ok()) {
+          return status;
+        }
+      }
+      crc = compressed.uncompressed_crc;
+      status = decompress_chunk(compressed.compression, compressed.data.data(),
+                                compressed.data.size(), compressed.uncompressed_size, records,
+                                options_.frame_workers.get());
+    }
+    // Checking before the loader returns keeps a corrupt chunk out of the cache.
+    if (status.ok() && check_inline) {
+      status = check_chunk_crc(chunk_index, *records, crc);
+    }
+    return status;
+  };
+
+  // Reads the recorded CRC of records found in a cache, since the reader which cached them may
+  // not have checked them.
+  auto read_recorded_crc = [this, &chunk_index](uint32_t * recorded_crc) {
+    std::lock_guard<std::mutex> lock(data_source_mutex_);
+    return read_chunk_crc(data_source_, chunk_index, recorded_crc);
+  };
+  ChunkCache::Verifier verify;
+  if (check_inline) {
+    verify = [&chunk_index, &read_recorded_crc](const mcap::ByteArray & records) {
+      uint32_t recorded_crc = 0;
+      auto status = read_recorded_crc(&recorded_crc);
+      return status.ok() ? check_chunk_crc(chunk_index, records, recorded_crc) : status;
+    };
+  }
+
+  LoadResult result;
+  auto & [status, chunk] = result;
+  chunk = std::make_shared<LoadedChunk>();
+  chunk->order = order;
+  if (options_.load_chunk) {
+    status = options_.load_chunk(chunk_index, read_and_decompress, verify, &chunk->records);
+    if (status.ok() && !loaded && !check_inline &&
+        options_.crc_check == ChunkCrcCheck::Background) {
+      status = read_recorded_crc(&crc);
+    }
+  } else {
+    auto records = std::make_shared<mcap::ByteArray>();
+    status = read_and_decompress(records.get());
+    chunk->records = std::move(records);
+  }
+  if (!status.ok()) {
+    chunk = nullptr;
+    return result;
+  }
+  if (!check_inline && options_.crc_check == ChunkCrcCheck::Background) {
+    chunk->crc = crc;
+  }
+
+  const mcap::ByteArray & records = *chunk->records;
+  if (options_.selection) {
+    // Only the selected records need to be parsed.
+    for (const uint64_t offset : options_.selection->at(chunk_index.chunkStartOffset)) {
+      mcap::OpCode opcode;
+      uint64_t length = 0;
+      mcap::Message message;
+      if (!parse_chunk_record(records, offset, &opcode, &length, &message) ||
+          opcode != mcap::OpCode::Message) {
+        status = mcap::Status{mcap::StatusCode::InvalidRecord,
+                              "invalid message index entry in chunk at offset " +
+                                std::to_string(chunk_index.chunkStartOffset)};
+        chunk = nullptr;
+        return result;
+      }
+      if (message.logTime <= options_.end_time) {
+        chunk->messages.emplace_back(message.logTime, offset);
+      }
+    }
+  } else {
+    uint64_t offset = 0;
+    while (offset < records.size()) {
+      mcap::OpCode opcode;
+      uint64_t length = 0;
+      mcap::Message message;
+      if (!parse_chunk_record(records, offset, &opcode, &length, &message)) {
+        status = mcap::Status{mcap::StatusCode::InvalidRecord,
+                              "truncated record in chunk at offset " +
+                                std::to_string(chunk_index.chunkStartOffset)};
+        chunk = nullptr;
+        return result;
+      }
+      if (opcode == mcap::OpCode::Message && message.logTime >= options_.start_time &&
+          message.logTime <= options_.end_time &&
+          (!options_.channel_filter || options_.channel_filter(message.channelId))) {
+        chunk->messages.emplace_back(message.logTime, offset);
+      }
+      offset += RECORD_PREFIX_LENGTH + length;
+    }
+  }
+
+  if (options_.read_order == ReadOrder::LogTimeOrder) {
+    std::stable_sort(chunk->messages.begin(), chunk->messages.end(),
+                     [](const auto & a, const auto & b) { return a.first < b.first; });
+  } else if (options_.read_order == ReadOrder::ReverseLogTimeOrder) {
+    std::reverse(chunk->messages.begin(), chunk->messages.end());
+    std::stable_sort(chunk->messages.begin(), chunk->messages.end(),
+                     [](const auto & a, const auto & b) { return a.first > b.first; });
+  }
+  return result;
+}
+
+std::shared_ptr<ChunkedMessageReader::LoadedChunk> ChunkedMessageReader::take_next_chunk()
+{
+  const size_t order = next_chunk_++;
+  LoadResult result;
+  if (!options_.workers) {
+    result = load_chunk(order);
+  } else {
+    // Keep the workers busy with the chunks following this one.
+    const size_t window = 2 * std::max<size_t>(options_.workers->size(), 1);
+    next_submitted_ = std::max(next_submitted_, order);
+    while (next_submitted_ < chunks_.size() && next_submitted_ < order + window) {
+      const size_t submitted = next_submitted_++;
+      pending_.push_back(options_.workers->submit([this, submitted]() {
+        return cancelled_ ? LoadResult{} : load_chunk(submitted);
+      }));
+    }
+    result = pending_.front().get();
+    pending_.pop_front();
+  }
+  status_ = result.first;
+  if (result.second && result.second->crc != 0) {
+    check_crc_in_background(*result.second);
+  }
+  // Report the background checks which have completed since the last chunk.
+  while (status_.ok() && !crc_checks_.empty() &&
+         crc_checks_.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+    finish_crc_check();
+  }
+  return status_.ok() ? std::move(result.second) : nullptr;
+}
+
+void ChunkedMessageReader::check_crc_in_background(const LoadedChunk & chunk)
+{
+  // Bound the number of chunks kept alive by their checks.
+  const size_t window = 2 * std::max<size_t>(options_.crc_workers->size(), 1);
+  while (crc_checks_.size() >= window) {
+    finish_crc_check();
+  }
+  crc_checks_.push_back(options_.crc_workers->submit(
+    [chunk_index = chunks_[chunk.order], records = chunk.records, crc = chunk.crc]() {
+      return check_chunk_crc(*chunk_index, *records, crc);
+    }));
+}
+
+void ChunkedMessageReader::finish_crc_check()
+{
+  auto status = crc_checks_.front().get();
+  crc_checks_.pop_front();
+  if (status_.ok() && !status.ok()) {
+    status_ = std::move(status);
+  }
+}
+
+const mcap::Message * ChunkedMessageReader::parse_message(const LoadedChunk & chunk,
+                                                          uint64_t offset)
+{
+  mcap::OpCode opcode;
+  uint64_t length = 0;
+  parse_chunk_record(*chunk.records, offset, &opcode, &length, &message_);
+  return &message_;
+}
+
+bool ChunkedMessageReader::should_load_next_chunk() const
+{
+  if (next_chunk_ >= chunks_.size()) {
+    return false;
+  }
+  if (heap_.empty()) {
+    return true;
+  }
+  // A chunk must be loaded before emitting a message if it may contain an earlier message.
+  const auto * chunk_index = chunks_[next_chunk_];
+  const mcap::Timestamp chunk_first = options_.read_order == ReadOrder::ReverseLogTimeOrder
+                                        ? chunk_index->messageEndTime
+                                        : chunk_index->messageStartTime;
+  return !comes_before(heap_.front().log_time, chunk_first);
+}
+
+const mcap::Message * ChunkedMessageReader::next()
+{
+  const mcap::Message * message = next_message();
+  // Report a CRC mismatch in the last chunks before reporting the end of the messages.
+  while (message == nullptr && status_.ok() && !crc_checks_.empty()) {
+    finish_crc_check();
+  }
+  return message;
+}
+
+const mcap::Message * ChunkedMessageReader::next_message()
+{
+  if (!status_.ok()) {
+    return nullptr;
+  }
+
+  if (options_.read_order == ReadOrder::FileOrder) {
+    while (!current_ || current_->next >= current_->messages.size()) {
+      if (next_chunk_ >= chunks_.size()) {
+        return nullptr;
+      }
+      current_ = take_next_chunk();
+      if (!current_) {
+        return nullptr;
+      }
+    }
+    return parse_message(*current_, current_->messages[current_->next++].second);
+  }
+
+  // Heap ordering: the entry that must be emitted first is at the front.
+  const auto heap_compare = [this](const MergeEntry & a, const MergeEntry & b) {
+    if (a.log_time != b.log_time) {
+      return comes_before(b.log_time, a.log_time);
+    }
+    return a.order > b.order;
+  };
+
+  while (should_load_next_chunk()) {
+    auto chunk = take_next_chunk();
+    if (!chunk) {
+      return nullptr;
+    }
+    if (!chunk->messages.empty()) {
+      heap_.push_back({chunk->messages.front().first, chunk->order, std::move(chunk)});
+      std::push_heap(heap_.begin(), heap_.end(), heap_compare);
+    }
+  }
+  if (heap_.empty()) {
+    return nullptr;
+  }
+
+  std::pop_heap(heap_.begin(), heap_.end(), heap_compare);
+  MergeEntry entry = std::move(heap_.back());
+  heap_.pop_back();
+  const uint64_t offset = entry.chunk->messages[entry.chunk->next++].second;
+  // Keep the chunk alive until the next call, since the returned message points into it.
+  current_ = entry.chunk;
+  if (entry.chunk->next < entry.chunk->messages.size()) {
+    entry.log_time = entry.chunk->messages[entry.chunk->next].first;
+    heap_.push_back(std::move(entry));
+    std::push_heap(heap_.begin(), heap_.end(), heap_compare);
+  }
+  return parse_message(*current_, offset);
+}
+
+}  // namespace rosbag2_storage_mcap::internal
@@ -0,0 +1,68 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/crc32.hpp"
+
+#include <array>
+
+namespace rosbag2_storage_mcap::internal
+{
+using CrcTables = std::array<std::array<uint32_t, 256>, 8>;
+
+// tables[0] is the classic byte-at-a-time table; tables[k] advances a byte k more positions, so
+// that eight bytes can be folded in with eight independent lookups.
+static const CrcTables & crc_tables()
+{
+  static const CrcTables tables = []() {
+    CrcTables tables{};
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t value = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        value = (value >> 1) ^ ((value & 1) ? 0xEDB88320u : 0u);
+      }
+      tables[0][i] = value;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (size_t k = 1; k < tables.size(); ++k) {
+        const uint32_t previous = tables[k - 1][i];
+        tables[k][i] = (previous >> 8) ^ tables[0][previous & 0xff];
+      }
+    }
+    return tables;
+  }();
+  return tables;
+}
+
+uint32_t crc32_update(uint32_t crc, const std::byte * data, size_t size)
+{
+  const auto & t = crc_tables();
+  for (; size >= 8; size -= 8, data += 8) {
+    const uint32_t low = crc ^ (uint32_t(data[0]) | uint32_t(data[1]) << 8 |
+                                uint32_t(data[2]) << 16 | uint32_t(data[3]) << 24);
+    crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^
+          t[4][low >> 24] ^ t[3][uint8_t(data[4])] ^ t[2][uint8_t(data[5])] ^
+          t[1][uint8_t(data[6])] ^ t[0][uint8_t(data[7])];
+  }
+  for (; size > 0; --size, ++data) {
+    crc = t[0][(crc ^ uint8_t(*data)) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+uint32_t crc32(const std::byte * data, size_t size)
+{
+  return crc32_update(CRC32_INIT, data, size) ^ 0xffffffff;
+}
+
+}  // namespace rosbag2_storage_mcap::internal
@@ -0,0 +1,248 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/file_migrator.hpp"
+
+#include "rcutils/logging_macros.h"
+#include "rosbag2_storage_mcap/crc32.hpp"
+
+#ifdef _WIN32
+  #include <io.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+static constexpr size_t COPY_BLOCK_SIZE = 1024 * 1024;
+
+// CRC-32 of the whole file at `path`, or std::nullopt if it cannot be read.
+static std::optional<uint32_t> file_crc32(const std::filesystem::path & path)
+{
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return std::nullopt;
+  }
+  std::vector<char> buffer(COPY_BLOCK_SIZE);
+  uint32_t crc = CRC32_INIT;
+  while (in.read(buffer.data(), std::streamsize(buffer.size())) || in.gcount() > 0) {
+    crc = crc32_update(crc, reinterpret_cast<const std::byte *>(buffer.data()),
+                       size_t(in.gcount()));
+  }
+  if (in.bad()) {
+    return std::nullopt;
+  }
+  return crc ^ 0xffffffff;
+}
+
+// Flushes `file` and waits until its contents are on the disk.
+static bool sync_file(std::FILE * file)
+{
+  if (std::fflush(file) != 0) {
+    return false;
+  }
+#ifdef _WIN32
+  return _commit(_fileno(file)) == 0;
+#else
+  return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Makes the entries of the directory `path`, e.g. a rename into it, durable. Windows has no
+// equivalent, the rename is durable once the file it renames is.
+static bool sync_directory(const std::filesystem::path & path)
+{
+#ifdef _WIN32
+  (void)path;
+  return true;
+#else
+  const int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return false;
+  }
+  const bool synced = fsync(fd) == 0;
+  close(fd);
+  return synced;
+#endif
+}
+
+// Evicts the (already synced) pages of `path` from the page cache, so that reading it back checks
+// what is on the disk rather than what was just written to memory.
+static void drop_cached_pages(const std::filesystem::path & path)
+{
+#ifdef POSIX_FADV_DONTNEED
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+#else
+  (void)path;
+#endif
+}
+
+FileMigrator & FileMigrator::instance()
+{
+  static FileMigrator migrator;
+  return migrator;
+}
+
+FileMigrator::FileMigrator()
+    : thread_([this]() { run(); })
+{
+}
+
+FileMigrator::~FileMigrator()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  condition_.notify_all();
+  thread_.join();
+}
+
+void FileMigrator::migrate(const std::string & source, const std::string & destination,
+                           uint64_t max_rate)
+{
+  std::error_code error;
+  const auto size = std::filesystem::file_size(source, error);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back({source, destination, max_rate, error ? 0 : uint64_t(size)});
+    backlog_bytes_ += jobs_.back().size;
+  }
+  condition_.notify_all();
+}
+
+uint64_t FileMigrator::backlog_bytes() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return backlog_bytes_;
+}
+
+void FileMigrator::wait_for_backlog_below(uint64_t max_bytes)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  condition_.wait(lock, [&]() { return backlog_bytes_ < max_bytes || backlog_bytes_ == 0; });
+}
+
+void FileMigrator::wait_until_idle()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  condition_.wait(lock, [this]() { return jobs_.empty() && !busy_; });
+}
+
+void FileMigrator::run()
+{
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+      // Pending migrations are finished even when stopping, so no file is left on scratch.
+      if (jobs_.empty()) {
+        return;
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+      busy_ = true;
+    }
+    const auto error = move_file(job);
+    if (!error.empty()) {
+      RCUTILS_LOG_ERROR_NAMED("rosbag2_storage_mcap", "failed to move %s to %s: %s",
+                              job.source.c_str(), job.destination.c_str(), error.c_str());
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      backlog_bytes_ -= job.size;
+      busy_ = false;
+    }
+    condition_.notify_all();
+  }
+}
+
+std::string FileMigrator::move_file(const Job & job)
+{
+  const std::filesystem::path destination(job.destination);
+  const std::filesystem::path partial(job.destination + ".part");
+  std::error_code error;
+  std::filesystem::create_directories(destination.parent_path(), error);
+
+  uint32_t crc = CRC32_INIT;
+  {
+    std::ifstream in(job.source, std::ios::binary);
+    if (!in) {
+      return "cannot open source";
+    }
+    std::FILE * out = std::fopen(partial.string().c_str(), "wb");
+    if (!out) {
+      return "cannot create " + partial.string();
+    }
+    std::vector<char> buffer(COPY_BLOCK_SIZE);
+    uint64_t copied = 0;
+    const auto start = std::chrono::steady_clock::now();
+    bool written = true;
+    while (written &&
+           (in.read(buffer.data(), std::streamsize(buffer.size())) || in.gcount() > 0)) {
+      const auto count = size_t(in.gcount());
+      crc = crc32_update(crc, reinterpret_cast<const std::byte *>(buffer.data()), count);
+      written = std::fwrite(buffer.data(), 1, count, out) == count;
+      copied += count;
+      if (written && job.max_rate > 0) {
+        // Stay under the rate limit on average since the start of the copy.
+        std::this_thread::sleep_until(
+          start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(double(copied) / double(job.max_rate))));
+      }
+    }
+    // The source is removed below, so the copy must be on the disk, not only in the page cache.
+    written = written && sync_file(out);
+    written = std::fclose(out) == 0 && written;
+    if (in.bad()) {
+      std::filesystem::remove(partial, error);
+      return "read failed";
+    }
+    if (!written) {
+      std::filesystem::remove(partial, error);
+      return "write failed";
+    }
+  }
+
+  drop_cached_pages(partial);
+  if (file_crc32(partial) != (crc ^ 0xffffffff)) {
+    std::filesystem::remove(partial, error);
+    return "copy does not match the CRC of the source";
+  }
+  std::filesystem::rename(partial, destination, error);
+  if (error) {
+    return error.message();
+  }
+  if (!sync_directory(destination.parent_path())) {
+    return "cannot sync " + destination.parent_path().string() + ", keeping the source";
+  }
+  std::filesystem::remove(job.source, error);
+  return {};
+}
+
+}  // namespace rosbag2_storage_mcap::internal
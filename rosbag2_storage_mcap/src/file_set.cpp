@@ -0,0 +1,242 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/file_set.hpp"
+
+#include <exception>
+#include <string>
+#include <utility>
+
+namespace rosbag2_storage_mcap::internal
+{
+// Metadata layout: FILE_COUNT_KEY holds the number of member files, FILE_KEY_PREFIX followed by
+// the index of a member holds its path, and the same key followed by TOPICS_KEY_SUFFIX holds its
+// topic pattern, if any.
+static const char FILE_COUNT_KEY[] = "file_count";
+static const char FILE_KEY_PREFIX[] = "file.";
+static const char TOPICS_KEY_SUFFIX[] = ".topics";
+
+mcap::Metadata FileSetManifest::to_metadata() const
+{
+  mcap::Metadata metadata;
+  metadata.name = METADATA_NAME;
+  metadata.metadata[FILE_COUNT_KEY] = std::to_string(files.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    metadata.metadata[FILE_KEY_PREFIX + std::to_string(i)] = files[i];
+    if (i < topic_patterns.size()) {
+      metadata.metadata[FILE_KEY_PREFIX + std::to_string(i) + TOPICS_KEY_SUFFIX] =
+        topic_patterns[i];
+    }
+  }
+  return metadata;
+}
+
+std::optional<FileSetManifest> FileSetManifest::from_metadata(const mcap::Metadata & metadata)
+{
+  if (metadata.name != METADATA_NAME) {
+    return std::nullopt;
+  }
+  const auto count_it = metadata.metadata.find(FILE_COUNT_KEY);
+  if (count_it == metadata.metadata.end()) {
+    return std::nullopt;
+  }
+  size_t file_count = 0;
+  try {
+    file_count = std::stoul(count_it->second);
+  } catch (const std::exception &) {
+    return std::nullopt;
+  }
+  FileSetManifest manifest;
+  for (size_t i = 0; i < file_count; ++i) {
+    const std::string file_key = FILE_KEY_PREFIX + std::to_string(i);
+    const auto file_it = metadata.metadata.find(file_key);
+    if (file_it == metadata.metadata.end()) {
+      return std::nullopt;
+    }
+    manifest.files.push_back(file_it->second);
+    const auto topics_it = metadata.metadata.find(file_key + TOPICS_KEY_SUFFIX);
+    if (topics_it != metadata.metadata.end()) {
+      manifest.topic_patterns.resize(file_count);
+      manifest.topic_patterns[i] = topics_it->second;
+    }
+  }
+  return manifest;
+}
+
+ParallelFileWriter::ParallelFileWriter(uint64_t max_queued_bytes)
+    : max_queued_bytes_(max_queued_bytes)
+{
+}
+
+ParallelFileWriter::~ParallelFileWriter()
+{
+  close();
+}
+
+mcap::Status ParallelFileWriter::open(const std::vector<std::string> & paths,
+                                      const mcap::McapWriterOptions & options)
+{
+  for (const auto & path : paths) {
+    auto file = std::make_unique<File>();
+    auto status = file->writer.open(path, options);
+    if (!status.ok()) {
+      return status;
+    }
+    files_.push_back(std::move(file));
+  }
+  for (auto & file : files_) {
+    file->thread = std::thread([this, &file = *file]() { run(file); });
+  }
+  return mcap::Status{};
+}
+
+size_t ParallelFileWriter::file_count() const
+{
+  return files_.size();
+}
+
+void ParallelFileWriter::add_schema(mcap::Schema & schema)
+{
+  for (auto & file : files_) {
+    std::lock_guard<std::mutex> lock(file->writer_mutex);
+    file->writer.addSchema(schema);
+  }
+}
+
+void ParallelFileWriter::add_channel(mcap::Channel & channel)
+{
+  for (auto & file : files_) {
+    std::lock_guard<std::mutex> lock(file->writer_mutex);
+    file->writer.addChannel(channel);
+  }
+}
+
+void ParallelFileWriter::add_channel(size_t index, mcap::Channel & channel)
+{
+  File & file = *files_.at(index);
+  std::lock_guard<std::mutex> lock(file.writer_mutex);
+  file.writer.addChannel(channel);
+}
+
+mcap::Status ParallelFileWriter::write(size_t index, const mcap::Message & message,
+                                       std::shared_ptr<const void> data_owner, bool own_chunk)
+{
+  File & file = *files_.at(index);
+  {
+    std::unique_lock<std::mutex> lock(file.mutex);
+    file.condition.wait(lock, [&]() {
+      return !file.status.ok() || file.queue.empty() || file.queued_bytes < max_queued_bytes_;
+    });
+    if (!file.status.ok()) {
+      return file.status;
+    }
+    file.queue.push_back({message, std::move(data_owner), own_chunk});
+    file.queued_bytes += message.dataSize;
+  }
+  file.condition.notify_all();
+  return mcap::Status{};
+}
+
+size_t ParallelFileWriter::least_loaded() const
+{
+  size_t best = 0;
+  uint64_t best_queued_bytes = 0;
+  for (size_t i = 0; i < files_.size(); ++i) {
+    std::lock_guard<std::mutex> lock(files_[i]->mutex);
+    if (i == 0 || files_[i]->queued_bytes < best_queued_bytes) {
+      best = i;
+      best_queued_bytes = files_[i]->queued_bytes;
+    }
+  }
+  return best;
+}
+
+uint64_t ParallelFileWriter::size() const
+{
+  uint64_t size = 0;
+  for (const auto & file : files_) {
+    size += file->size;
+  }
+  return size;
+}
+
+uint64_t ParallelFileWriter::file_size(size_t file) const
+{
+  return files_.at(file)->size;
+}
+
+mcap::Status ParallelFileWriter::close()
+{
+  if (closed_) {
+    return mcap::Status{};
+  }
+  closed_ = true;
+  for (auto & file : files_) {
+    {
+      std::lock_guard<std::mutex> lock(file->mutex);
+      file->closing = true;
+    }
+    file->condition.notify_all();
+  }
+  mcap::Status status;
+  for (auto & file : files_) {
+    if (file->thread.joinable()) {
+      file->thread.join();
+    }
+    file->writer.close();
+    if (status.ok() && !file->status.ok()) {
+      status = file->status;
+    }
+  }
+  return status;
+}
+
+void ParallelFileWriter::run(File & file)
+{
+  while (true) {
+    QueuedMessage queued;
+    {
+      std::unique_lock<std::mutex> lock(file.mutex);
+      file.condition.wait(lock, [&]() { return file.closing || !file.queue.empty(); });
+      if (file.queue.empty()) {
+        return;
+      }
+      queued = std::move(file.queue.front());
+      file.queue.pop_front();
+    }
+    mcap::Status status;
+    {
+      std::lock_guard<std::mutex> lock(file.writer_mutex);
+      if (queued.own_chunk) {
+        file.writer.closeLastChunk();
+      }
+      status = file.writer.write(queued.message);
+      if (queued.own_chunk) {
+        file.writer.closeLastChunk();
+      }
+      const auto * data_sink = file.writer.dataSink();
+      file.size = data_sink ? data_sink->size() : 0;
+    }
+    {
+      std::lock_guard<std::mutex> lock(file.mutex);
+      file.queued_bytes -= queued.message.dataSize;
+      if (file.status.ok() && !status.ok()) {
+        file.status = status;
+      }
+    }
+    file.condition.notify_all();
+  }
+}
+
+}  // namespace rosbag2_storage_mcap::internal
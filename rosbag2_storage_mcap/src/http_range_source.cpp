@@ -0,0 +1,482 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/http_range_source.hpp"
+
+#include "rcutils/logging_macros.h"
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <random>
+#include <sstream>
+
+namespace rosbag2_storage_mcap::internal
+{
+// Prefetches queued beyond this are dropped, oldest first; they are stale after a seek anyway.
+static constexpr size_t MAX_QUEUED_PREFETCHES = 16;
+
+bool is_http_url(const std::string & uri)
+{
+  return uri.rfind("http://", 0) == 0 || uri.rfind("https://", 0) == 0;
+}
+
+struct Download
+{
+  std::vector<std::byte> * body;
+  // More bytes than this abort the transfer, e.g. a whole file sent instead of a range.
+  uint64_t limit;
+};
+
+static size_t append_body(char * data, size_t size, size_t count, void * user_data)
+{
+  auto * download = static_cast<Download *>(user_data);
+  if (download->body->size() + size * count > download->limit) {
+    return 0;
+  }
+  const auto * bytes = reinterpret_cast<const std::byte *>(data);
+  download->body->insert(download->body->end(), bytes, bytes + size * count);
+  return size * count;
+}
+
+// Collects "Name: value" header lines, with lower-cased names. Headers of redirect responses
+// are overwritten by those of the final response.
+static size_t collect_header(char * data, size_t size, size_t count, void * user_data)
+{
+  auto * headers = static_cast<std::unordered_map<std::string, std::string> *>(user_data);
+  const std::string line(data, size * count);
+  const auto colon = line.find(':');
+  if (colon != std::string::npos) {
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return char(std::tolower(c)); });
+    const auto value_start = line.find_first_not_of(" \t", colon + 1);
+    const auto value_end = line.find_last_not_of(" \t\r\n");
+    (*headers)[name] = value_start == std::string::npos || value_end < value_start
+                         ? std::string()
+                         : line.substr(value_start, value_end - value_start + 1);
+  }
+  return size * count;
+}
+
+static uint64_t fnv1a(const std::string & text)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (const unsigned char c : text) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+mcap::Status HttpRangeSource::open_shared(const std::string & url, const Options & options,
+                                          std::shared_ptr<HttpRangeSource> & source)
+{
+  static std::mutex registry_mutex;
+  // Keyed by URL and version, so that a file replaced on the server gets a new source and cache
+  // rather than the blocks of the file it replaced.
+  static std::unordered_map<std::string, std::weak_ptr<HttpRangeSource>> registry;
+
+  std::shared_ptr<HttpRangeSource> opened(new HttpRangeSource(url, options));
+  const auto status = opened->connect();
+  if (!status.ok()) {
+    return status;
+  }
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (auto it = registry.begin(); it != registry.end();) {
+    it = it->second.expired() ? registry.erase(it) : std::next(it);
+  }
+  auto & shared = registry[url + "\n" + opened->version()];
+  source = shared.lock();
+  if (!source) {
+    shared = opened;
+    source = std::move(opened);
+  }
+  return mcap::Status{};
+}
+
+HttpRangeSource::HttpRangeSource(std::string url, Options options)
+    : url_(std::move(url))
+    , options_(std::move(options))
+{
+  static std::once_flag curl_initialized;
+  std::call_once(curl_initialized, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+  prefetch_thread_ = std::thread([this]() { run_prefetch(); });
+}
+
+HttpRangeSource::~HttpRangeSource()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  condition_.notify_all();
+  prefetch_thread_.join();
+  for (void * handle : idle_handles_) {
+    curl_easy_cleanup(static_cast<CURL *>(handle));
+  }
+}
+
+uint64_t HttpRangeSource::size() const
+{
+  return size_;
+}
+
+const std::string & HttpRangeSource::version() const
+{
+  return version_;
+}
+
+uint64_t HttpRangeSource::request_count() const
+{
+  return request_count_;
+}
+
+mcap::Status HttpRangeSource::connect()
+{
+  if (options_.block_size == 0) {
+    return mcap::Status{mcap::StatusCode::OpenFailed, "HTTP block size must not be 0"};
+  }
+  // A one byte range request both checks that ranges are supported and returns the file size,
+  // in "Content-Range: bytes 0-0/<size>".
+  std::vector<std::byte> body;
+  std::unordered_map<std::string, std::string> headers;
+  auto status = fetch(0, 1, body, &headers);
+  if (!status.ok()) {
+    return mcap::Status{mcap::StatusCode::OpenFailed, status.message};
+  }
+  const auto content_range = headers.find("content-range");
+  const auto slash =
+    content_range == headers.end() ? std::string::npos : content_range->second.rfind('/');
+  const mcap::Status no_size{mcap::StatusCode::OpenFailed,
+                             url_ + ": server did not report the size"};
+  if (slash == std::string::npos) {
+    return no_size;
+  }
+  try {
+    size_ = std::stoull(content_range->second.substr(slash + 1));
+  } catch (const std::exception &) {
+    return no_size;
+  }
+  const auto etag = headers.find("etag");
+  const auto last_modified = headers.find("last-modified");
+  if (etag != headers.end()) {
+    version_ = etag->second;
+  } else if (last_modified != headers.end()) {
+    version_ = last_modified->second;
+  }
+
+  if (!options_.cache_directory.empty() && version_.empty()) {
+    RCUTILS_LOG_WARN_NAMED("rosbag2_storage_mcap",
+                           "not caching %s on disk: the server reports no ETag or Last-Modified",
+                           url_.c_str());
+  } else if (!options_.cache_directory.empty()) {
+    // Cached blocks are only reused for the same version of the same file.
+    std::ostringstream key;
+    key << std::hex << std::setw(16) << std::setfill('0')
+        << fnv1a(url_ + "\n" + version_ + "\n" + std::to_string(size_) + "\n" +
+                 std::to_string(options_.block_size));
+    cache_directory_ = (std::filesystem::path(options_.cache_directory) / key.str()).string();
+    std::error_code error;
+    std::filesystem::create_directories(cache_directory_, error);
+    if (error) {
+      RCUTILS_LOG_WARN_NAMED("rosbag2_storage_mcap", "not caching %s on disk: %s", url_.c_str(),
+                             error.message().c_str());
+      cache_directory_.clear();
+    }
+  }
+  return mcap::Status{};
+}
+
+bool HttpRangeSource::read(uint64_t offset, uint64_t length, std::byte * output)
+{
+  if (length == 0) {
+    return true;
+  }
+  if (offset > size_ || length > size_ - offset) {
+    return false;
+  }
+  const uint64_t first = offset / options_.block_size;
+  const uint64_t last = (offset + length - 1) / options_.block_size;
+  for (uint64_t index = first; index <= last; ++index) {
+    const Block block = get_block(index, last);
+    if (!block) {
+      return false;
+    }
+    const uint64_t block_start = index * options_.block_size;
+    const uint64_t from = std::max(offset, block_start);
+    const uint64_t to = std::min(offset + length, block_start + uint64_t(block->size()));
+    std::memcpy(output + (from - offset), block->data() + (from - block_start), to - from);
+  }
+  return true;
+}
+
+void HttpRangeSource::prefetch(uint64_t offset, uint64_t length)
+{
+  if (length == 0 || offset >= size_) {
+    return;
+  }
+  length = std::min(length, size_ - offset);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prefetch_queue_.emplace_back(offset / options_.block_size,
+                                 (offset + length - 1) / options_.block_size);
+    while (prefetch_queue_.size() > MAX_QUEUED_PREFETCHES) {
+      prefetch_queue_.pop_front();
+    }
+  }
+  condition_.notify_all();
+}
+
+HttpRangeSource::Block HttpRangeSource::get_block(uint64_t index, uint64_t last)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    const auto it = blocks_.find(index);
+    if (it != blocks_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.second);
+      return it->second.first;
+    }
+    if (in_flight_.count(index) == 0) {
+      break;
+    }
+    condition_.wait(lock);
+  }
+  // Fetch the missing blocks after this one too, without outgrowing the memory cache.
+  const uint64_t max_run =
+    std::max<uint64_t>(1, options_.memory_cache_size / options_.block_size / 2);
+  uint64_t end = index;
+  in_flight_.insert(index);
+  while (end < last && end - index + 1 < max_run && blocks_.count(end + 1) == 0 &&
+         in_flight_.count(end + 1) == 0) {
+    in_flight_.insert(++end);
+  }
+  lock.unlock();
+  const auto loaded = load_blocks(index, end);
+  lock.lock();
+  for (uint64_t i = index; i <= end; ++i) {
+    in_flight_.erase(i);
+    const Block & block = loaded[i - index];
+    if (block && blocks_.count(i) == 0) {
+      lru_.push_front(i);
+      blocks_.emplace(i, std::make_pair(block, lru_.begin()));
+      cached_bytes_ += block->size();
+    }
+  }
+  while (cached_bytes_ > options_.memory_cache_size && lru_.size() > 1) {
+    const auto evicted = blocks_.find(lru_.back());
+    cached_bytes_ -= evicted->second.first->size();
+    blocks_.erase(evicted);
+    lru_.pop_back();
+  }
+  lock.unlock();
+  condition_.notify_all();
+  return loaded.front();
+}
+
+std::vector<HttpRangeSource::Block> HttpRangeSource::load_blocks(uint64_t first, uint64_t last)
+{
+  std::vector<Block> loaded(last - first + 1);
+  if (!cache_directory_.empty()) {
+    for (uint64_t i = first; i <= last; ++i) {
+      std::ifstream in(block_cache_path(i), std::ios::binary);
+      if (!in) {
+        continue;
+      }
+      auto block = std::make_shared<std::vector<std::byte>>(block_length(i));
+      in.read(reinterpret_cast<char *>(block->data()), std::streamsize(block->size()));
+      if (uint64_t(in.gcount()) == block->size() && in.peek() == EOF) {
+        loaded[i - first] = std::move(block);
+      }
+    }
+  }
+
+  // Fetch each run of blocks missing from the disk cache with a single request.
+  for (uint64_t run_start = first; run_start <= last;) {
+    if (loaded[run_start - first]) {
+      ++run_start;
+      continue;
+    }
+    uint64_t run_end = run_start;
+    while (run_end < last && !loaded[run_end + 1 - first]) {
+      ++run_end;
+    }
+    const uint64_t offset = run_start * options_.block_size;
+    const uint64_t length = run_end * options_.block_size + block_length(run_end) - offset;
+    std::vector<std::byte> body;
+    const auto status = fetch(offset, length, body, nullptr);
+    if (!status.ok()) {
+      RCUTILS_LOG_ERROR_NAMED("rosbag2_storage_mcap", "%s", status.message.c_str());
+    } else {
+      for (uint64_t i = run_start; i <= run_end; ++i) {
+        const auto begin = body.begin() + std::ptrdiff_t((i - run_start) * options_.block_size);
+        auto block =
+          std::make_shared<std::vector<std::byte>>(begin, begin + std::ptrdiff_t(block_length(i)));
+        if (!cache_directory_.empty()) {
+          // Write under a unique name and rename, so concurrent readers never see partial blocks.
+          const auto path = block_cache_path(i);
+          const auto temporary = path + "." + std::to_string(std::random_device{}()) + ".tmp";
+          {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(block->data()),
+                      std::streamsize(block->size()));
+          }
+          std::error_code error;
+          std::filesystem::rename(temporary, path, error);
+          if (error) {
+            std::filesystem::remove(temporary, error);
+          }
+        }
+        loaded[i - first] = std::move(block);
+      }
+    }
+    run_start = run_end + 1;
+  }
+  return loaded;
+}
+
+mcap::Status HttpRangeSource::fetch(uint64_t offset, uint64_t length,
+                                    std::vector<std::byte> & body,
+                                    std::unordered_map<std::string, std::string> * headers)
+{
+  CURL * curl = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_handles_.empty()) {
+      curl = static_cast<CURL *>(idle_handles_.back());
+      idle_handles_.pop_back();
+    }
+  }
+  if (curl) {
+    // Keeps the open connections of the handle.
+    curl_easy_reset(curl);
+  } else {
+    curl = curl_easy_init();
+    if (!curl) {
+      return mcap::Status{mcap::StatusCode::ReadFailed, "failed to initialize libcurl"};
+    }
+  }
+
+  const std::string range = std::to_string(offset) + "-" + std::to_string(offset + length - 1);
+  body.clear();
+  body.reserve(length);
+  Download download{&body, length};
+  std::unordered_map<std::string, std::string> response_headers;
+  if (!headers) {
+    headers = &response_headers;
+  }
+  // Once connect() found the version of the file, every range is requested on the condition that
+  // the file is still that version, so that a file replaced on the server fails the read instead
+  // of mixing its blocks with those of the file it replaced. Weak ETags never match If-Match;
+  // the ETag of the response is compared below instead.
+  const bool etag_version = !version_.empty() && (version_.front() == '"' ||
+                                                  version_.rfind("W/", 0) == 0);
+  curl_slist * conditions = nullptr;
+  if (etag_version && version_.front() == '"') {
+    conditions = curl_slist_append(conditions, ("If-Match: " + version_).c_str());
+  } else if (!version_.empty() && !etag_version) {
+    conditions = curl_slist_append(conditions, ("If-Unmodified-Since: " + version_).c_str());
+  }
+  curl_easy_setopt(curl, CURLOPT_URL, url_.c_str());
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, conditions);
+  curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, append_body);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &download);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, collect_header);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, headers);
+  ++request_count_;
+  const CURLcode result = curl_easy_perform(curl);
+  long response_code = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+  curl_slist_free_all(conditions);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_handles_.push_back(curl);
+  }
+
+  if (!version_.empty()) {
+    // A failed precondition, or the whole file sent instead of the range, means that the file is
+    // no longer the version that was opened; so does a 206 response of another version.
+    const auto current = headers->find(etag_version ? "etag" : "last-modified");
+    if (response_code == 412 || response_code == 200 ||
+        (response_code == 206 && current != headers->end() && current->second != version_)) {
+      return mcap::Status{mcap::StatusCode::ReadFailed,
+                          url_ + ": the file changed on the server since it was opened (" +
+                            version_ + ")"};
+    }
+  }
+  // The body of a 200 response exceeds the range and aborts the transfer.
+  if (result != CURLE_OK && response_code != 200) {
+    return mcap::Status{mcap::StatusCode::ReadFailed,
+                        url_ + ": " + curl_easy_strerror(result)};
+  }
+  if (response_code != 206) {
+    return mcap::Status{mcap::StatusCode::ReadFailed,
+                        url_ + ": server does not support range requests (HTTP " +
+                          std::to_string(response_code) + ")"};
+  }
+  if (body.size() != length) {
+    return mcap::Status{mcap::StatusCode::ReadFailed,
+                        url_ + ": expected " + std::to_string(length) + " bytes at offset " +
+                          std::to_string(offset) + ", received " + std::to_string(body.size())};
+  }
+  return mcap::Status{};
+}
+
+uint64_t HttpRangeSource::block_length(uint64_t index) const
+{
+  return std::min(options_.block_size, size_ - index * options_.block_size);
+}
+
+std::string HttpRangeSource::block_cache_path(uint64_t index) const
+{
+  return (std::filesystem::path(cache_directory_) / (std::to_string(index) + ".block")).string();
+}
+
+void HttpRangeSource::run_prefetch()
+{
+  while (true) {
+    std::pair<uint64_t, uint64_t> range;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return stopping_ || !prefetch_queue_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      range = prefetch_queue_.front();
+      prefetch_queue_.pop_front();
+    }
+    for (uint64_t index = range.first; index <= range.second; ++index) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+          return;
+        }
+      }
+      get_block(index, range.second);
+    }
+  }
+}
+
+}  // namespace rosbag2_storage_mcap::internal
@@ -0,0 +1,763 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/index_spill.hpp"
+
+#include "rosbag2_storage_mcap/crc32.hpp"
+#include "rosbag2_storage_mcap/zstd_frames.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+namespace
+{
+// Serializes records into a byte array.
+class ByteArrayWriter final : public mcap::IWritable
+{
+public:
+  explicit ByteArrayWriter(mcap::ByteArray & buffer)
+      : buffer_(buffer)
+  {
+  }
+
+  void handleWrite(const std::byte * data, uint64_t size) override
+  {
+    buffer_.insert(buffer_.end(), data, data + size);
+  }
+
+  void end() override {}
+
+  uint64_t size() const override
+  {
+    return buffer_.size();
+  }
+
+private:
+  mcap::ByteArray & buffer_;
+};
+
+template <typename T>
+void append_le(mcap::ByteArray & buffer, T value)
+{
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    buffer.push_back(std::byte(uint64_t(value) >> (8 * i)));
+  }
+}
+
+template <typename T>
+T read_le(const std::byte * data)
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    value |= uint64_t(data[i]) << (8 * i);
+  }
+  return T(value);
+}
+
+// Adds the messages, attachments, metadata and channel message counts of `other` to `statistics`.
+void add_statistics(mcap::Statistics & statistics, const mcap::Statistics & other)
+{
+  if (other.messageCount > 0) {
+    if (statistics.messageCount > 0) {
+      statistics.messageStartTime = std::min(statistics.messageStartTime, other.messageStartTime);
+      statistics.messageEndTime = std::max(statistics.messageEndTime, other.messageEndTime);
+    } else {
+      statistics.messageStartTime = other.messageStartTime;
+      statistics.messageEndTime = other.messageEndTime;
+    }
+  }
+  statistics.messageCount += other.messageCount;
+  statistics.attachmentCount += other.attachmentCount;
+  statistics.metadataCount += other.metadataCount;
+  for (const auto & [channel_id, count] : other.channelMessageCounts) {
+    statistics.channelMessageCounts[channel_id] += count;
+  }
+}
+
+std::string compression_name(mcap::Compression compression)
+{
+  switch (compression) {
+    case mcap::Compression::Lz4:
+      return "lz4";
+    case mcap::Compression::Zstd:
+      return "zstd";
+    default:
+      return "";
+  }
+}
+}  // namespace
+
+mcap::McapWriterOptions SpillingChunkWriter::writer_options(
+  const mcap::McapWriterOptions & options)
+{
+  mcap::McapWriterOptions writer_options = options;
+  writer_options.noChunking = true;
+  return writer_options;
+}
+
+SpillingChunkWriter::SpillingChunkWriter(const mcap::McapWriterOptions & options,
+                                         std::string spill_directory, uint64_t memory_limit,
+                                         uint64_t frame_size)
+    : options_(options)
+    , spill_directory_(std::move(spill_directory))
+    , memory_limit_(memory_limit)
+    , frame_size_(options.compression == mcap::Compression::Zstd ? frame_size : 0)
+{
+  switch (options_.compression) {
+    case mcap::Compression::Lz4:
+      chunk_ = std::make_unique<mcap::LZ4Writer>(options_.compressionLevel, options_.chunkSize);
+      break;
+    case mcap::Compression::Zstd:
+      // Framed chunks are compressed by close_chunk() instead.
+      if (frame_size_ > 0) {
+        chunk_ = std::make_unique<mcap::BufferWriter>();
+      } else {
+        chunk_ = std::make_unique<mcap::ZStdWriter>(options_.compressionLevel, options_.chunkSize);
+      }
+      break;
+    default:
+      chunk_ = std::make_unique<mcap::BufferWriter>();
+      break;
+  }
+  chunk_->crcEnabled = !options_.noChunkCRC;
+}
+
+SpillingChunkWriter::~SpillingChunkWriter()
+{
+  if (spill_file_) {
+    std::fclose(spill_file_);
+    std::remove(spill_path_.c_str());
+  }
+}
+
+SpillingChunkWriter::File::~File()
+{
+  end();
+}
+
+mcap::Status SpillingChunkWriter::File::open(const std::string & filename, uint64_t offset)
+{
+  if (offset > 0) {
+    std::error_code error;
+    std::filesystem::resize_file(filename, offset, error);
+    if (error) {
+      return mcap::Status(mcap::StatusCode::OpenFailed,
+                          "failed to truncate " + filename + ": " + error.message());
+    }
+  }
+  file_ = std::fopen(filename.c_str(), offset > 0 ? "ab" : "wb");
+  if (!file_) {
+    return mcap::Status(mcap::StatusCode::OpenFailed, "failed to open " + filename);
+  }
+  size_ = offset;
+  return mcap::StatusCode::Success;
+}
+
+void SpillingChunkWriter::File::handleWrite(const std::byte * data, uint64_t size)
+{
+  std::fwrite(data, 1, size, file_);
+  size_ += size;
+}
+
+void SpillingChunkWriter::File::end()
+{
+  if (file_) {
+    std::fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+uint64_t SpillingChunkWriter::File::size() const
+{
+  return size_;
+}
+
+mcap::Status SpillingChunkWriter::open(const std::string & filename)
+{
+  return open_file(filename, 0);
+}
+
+mcap::Status SpillingChunkWriter::open_append(const std::string & filename,
+                                              ExistingFile & existing,
+                                              const std::set<std::string> & replaced_metadata)
+{
+  mcap::McapReader reader;
+  auto status = reader.open(filename);
+  if (status.ok()) {
+    status = reader.readSummary(mcap::ReadSummaryMethod::AllowFallbackScan);
+  }
+  if (!status.ok()) {
+    return mcap::Status(status.code, "cannot append to " + filename + ": " + status.message);
+  }
+
+  // A complete file ends with its DataEnd record, the summary, the footer and the magic; the
+  // records of an incomplete one are followed until the first which cannot be read.
+  constexpr uint64_t DATA_END_SIZE = PREFIX_SIZE + 4;
+  constexpr uint64_t FOOTER_SIZE = PREFIX_SIZE + 8 + 8 + 4;
+  auto & source = *reader.dataSource();
+  std::optional<uint64_t> data_end;
+  mcap::Record record;
+  const auto & footer = reader.footer();
+  if (footer && source.size() >= 8 + FOOTER_SIZE + DATA_END_SIZE) {
+    const uint64_t summary_end =
+      footer->summaryStart != 0 ? footer->summaryStart : source.size() - 8 - FOOTER_SIZE;
+    if (summary_end >= 8 + DATA_END_SIZE &&
+        mcap::McapReader::ReadRecord(source, summary_end - DATA_END_SIZE, &record).ok() &&
+        record.opcode == mcap::OpCode::DataEnd) {
+      data_end = summary_end - DATA_END_SIZE;
+    }
+  }
+  if (!data_end) {
+    data_end = 8;
+    while (mcap::McapReader::ReadRecord(source, *data_end, &record).ok() &&
+           record.opcode != mcap::OpCode::DataEnd && record.opcode != mcap::OpCode::Footer) {
+      *data_end += record.recordSize();
+    }
+  }
+
+  // The McapWriter numbers schemas and channels from 1 in the order they are added.
+  existing = ExistingFile{};
+  for (const auto & [id, schema] : reader.schemas()) {
+    existing.schemas.push_back(schema);
+  }
+  for (const auto & [id, channel] : reader.channels()) {
+    existing.channels.push_back(channel);
+  }
+  std::sort(existing.schemas.begin(), existing.schemas.end(),
+            [](const auto & a, const auto & b) { return a->id < b->id; });
+  std::sort(existing.channels.begin(), existing.channels.end(),
+            [](const auto & a, const auto & b) { return a->id < b->id; });
+  for (size_t i = 0; i < existing.schemas.size(); ++i) {
+    if (existing.schemas[i]->id != i + 1) {
+      return mcap::Status(mcap::StatusCode::InvalidSchemaId,
+                          "cannot append to " + filename + ": its schema ids have gaps");
+    }
+  }
+  for (size_t i = 0; i < existing.channels.size(); ++i) {
+    if (existing.channels[i]->id != i + 1) {
+      return mcap::Status(mcap::StatusCode::InvalidChannelId,
+                          "cannot append to " + filename + ": its channel ids have gaps");
+    }
+  }
+  existing.statistics = reader.statistics();
+  std::vector<mcap::MetadataIndex> replaced_indexes;
+  for (const auto & name : replaced_metadata) {
+    const auto range = reader.metadataIndexes().equal_range(name);
+    for (auto it = range.first; it != range.second; ++it) {
+      replaced_indexes.push_back(it->second);
+    }
+  }
+  std::sort(replaced_indexes.begin(), replaced_indexes.end(),
+            [](const auto & a, const auto & b) { return a.offset < b.offset; });
+  for (const auto & index : replaced_indexes) {
+    mcap::Metadata metadata;
+    status = mcap::McapReader::ReadRecord(source, index.offset, &record);
+    if (status.ok()) {
+      status = mcap::McapReader::ParseMetadata(record, &metadata);
+    }
+    if (!status.ok()) {
+      return mcap::Status(status.code, "cannot append to " + filename + ": " + status.message);
+    }
+    existing.metadata.push_back(std::move(metadata));
+  }
+
+  // The chunk indexes recovered by scanning a file without a summary have no message index
+  // offsets; they are those of the MessageIndex records following each chunk. A chunk whose
+  // records run into an incomplete one left by a crash may be missing some, and stays without.
+  std::vector<mcap::ChunkIndex> chunk_indexes = reader.chunkIndexes();
+  for (auto & index : chunk_indexes) {
+    if (index.messageIndexLength > 0) {
+      continue;
+    }
+    std::byte * chunk_prefix = nullptr;
+    if (source.read(&chunk_prefix, index.chunkStartOffset, PREFIX_SIZE) != PREFIX_SIZE) {
+      continue;
+    }
+    std::unordered_map<mcap::ChannelId, mcap::ByteOffset> offsets;
+    const uint64_t start =
+      index.chunkStartOffset + PREFIX_SIZE + read_le<uint64_t>(chunk_prefix + 1);
+    index.chunkLength = start - index.chunkStartOffset;
+    uint64_t offset = start;
+    while (offset < *data_end && mcap::McapReader::ReadRecord(source, offset, &record).ok() &&
+           record.opcode == mcap::OpCode::MessageIndex && record.dataSize >= 2) {
+      offsets.emplace(read_le<mcap::ChannelId>(record.data), offset);
+      offset += record.recordSize();
+    }
+    const bool complete = offset < *data_end || offset == source.size() ||
+                          mcap::McapReader::ReadRecord(source, offset, &record).ok();
+    if (!offsets.empty() && complete) {
+      index.messageIndexOffsets.insert(offsets.begin(), offsets.end());
+      index.messageIndexLength = offset - start;
+    }
+  }
+  mcap::ByteArray attachment_indexes;
+  if (!options_.noAttachmentIndex) {
+    ByteArrayWriter indexes(attachment_indexes);
+    for (const auto & [name, index] : reader.attachmentIndexes()) {
+      mcap::McapWriter::write(indexes, index);
+    }
+  }
+  mcap::ByteArray metadata_indexes;
+  if (!options_.noMetadataIndex) {
+    ByteArrayWriter indexes(metadata_indexes);
+    for (const auto & [name, index] : reader.metadataIndexes()) {
+      if (replaced_metadata.count(name) == 0) {
+        mcap::McapWriter::write(indexes, index);
+      }
+    }
+  }
+  // The file is cut off at the end of its data section, which the reader must not read past.
+  reader.close();
+
+  status = open_file(filename, *data_end);
+  if (!status.ok()) {
+    return status;
+  }
+  appending_ = true;
+  existing_statistics_ = existing.statistics;
+  for (const auto & index : chunk_indexes) {
+    add_index(index);
+  }
+  existing_indexes_[mcap::OpCode::AttachmentIndex] = std::move(attachment_indexes);
+  existing_indexes_[mcap::OpCode::MetadataIndex] = std::move(metadata_indexes);
+  return status;
+}
+
+mcap::Status SpillingChunkWriter::open_file(const std::string & filename, uint64_t offset)
+{
+  auto status = file_.open(filename, offset);
+  if (!status.ok()) {
+    return status;
+  }
+  // The data section CRC covers the whole data section, not only what is appended.
+  file_.crcEnabled = options_.enableDataCRC && offset == 0;
+  const std::filesystem::path path(filename);
+  const auto directory =
+    spill_directory_.empty() ? path.parent_path() : std::filesystem::path(spill_directory_);
+  spill_path_ = (directory / (path.filename().string() + ".chunk_index.tmp")).string();
+  open_ = true;
+  return status;
+}
+
+void SpillingChunkWriter::add_index(const mcap::ChunkIndex & index)
+{
+  if (!options_.noChunkIndex && !options_.noSummary) {
+    ByteArrayWriter indexes(indexes_);
+    mcap::McapWriter::write(indexes, index);
+    if (indexes_.size() > memory_limit_) {
+      spill_indexes();
+    }
+  }
+  ++chunk_count_;
+}
+
+void SpillingChunkWriter::close_chunk()
+{
+  if (chunk_->empty()) {
+    return;
+  }
+  chunk_->end();
+  const uint64_t uncompressed_size = chunk_->size();
+  const uint32_t uncompressed_crc = options_.noChunkCRC ? 0 : chunk_->crc();
+  std::string compression = compression_name(options_.compression);
+  const std::byte * records = chunk_->compressedData();
+  uint64_t compressed_size = chunk_->compressedSize();
+  if (frame_size_ > 0) {
+    const auto status = compress_zstd_frames(chunk_->data(), uncompressed_size, frame_size_,
+                                             options_.compressionLevel, &frames_);
+    if (status.ok()) {
+      records = frames_.data();
+      compressed_size = frames_.size();
+    } else {
+      // Stored uncompressed rather than lost.
+      compression.clear();
+      records = chunk_->data();
+      compressed_size = uncompressed_size;
+    }
+  }
+  if (!compression.empty() && !options_.forceCompression && compressed_size >= uncompressed_size) {
+    compression.clear();
+    records = chunk_->data();
+    compressed_size = uncompressed_size;
+  }
+
+  auto index =
+    write_chunk_header(compression, uncompressed_size, uncompressed_crc, compressed_size);
+  file_.write(records, compressed_size);
+  finish_chunk(index);
+  chunk_->clear();
+}
+
+mcap::Status SpillingChunkWriter::write_chunk(const mcap::Message & message)
+{
+  if (!open_ || in_summary_) {
+    return mcap::Status(mcap::StatusCode::NotOpen, "the file is not open for writing");
+  }
+  close_chunk();
+
+  // The Message record as the McapWriter would write it.
+  mcap::ByteArray head;
+  append_le(head, uint8_t(mcap::OpCode::Message));
+  append_le(head, uint64_t(2 + 4 + 8 + 8 + message.dataSize));
+  append_le(head, message.channelId);
+  append_le(head, message.sequence);
+  append_le(head, message.logTime);
+  append_le(head, message.publishTime);
+  chunk_start_time_ = message.logTime;
+  chunk_end_time_ = message.logTime;
+  if (!options_.noMessageIndex) {
+    auto & message_index = message_indexes_[message.channelId];
+    message_index.channelId = message.channelId;
+    message_index.records.emplace_back(message.logTime, 0);
+  }
+  mcap::Statistics statistics{};
+  statistics.messageCount = 1;
+  statistics.messageStartTime = message.logTime;
+  statistics.messageEndTime = message.logTime;
+  statistics.channelMessageCounts[message.channelId] = 1;
+  add_statistics(direct_statistics_, statistics);
+
+  if (options_.forceCompression && options_.compression != mcap::Compression::None) {
+    // Compressed like any other chunk, which needs the records in one buffer.
+    chunk_->write(head.data(), head.size());
+    chunk_->write(message.data, message.dataSize);
+    close_chunk();
+    return mcap::Status{};
+  }
+  const uint64_t uncompressed_size = head.size() + message.dataSize;
+  uint32_t uncompressed_crc = 0;
+  if (!options_.noChunkCRC) {
+    uncompressed_crc = crc32_update(CRC32_INIT, head.data(), head.size());
+    uncompressed_crc =
+      crc32_update(uncompressed_crc, message.data, size_t(message.dataSize)) ^ 0xffffffff;
+  }
+  auto index = write_chunk_header("", uncompressed_size, uncompressed_crc, uncompressed_size);
+  file_.write(head.data(), head.size());
+  file_.write(message.data, message.dataSize);
+  finish_chunk(index);
+  return mcap::Status{};
+}
+
+mcap::ChunkIndex SpillingChunkWriter::write_chunk_header(const std::string & compression,
+                                                         uint64_t uncompressed_size,
+                                                         uint32_t uncompressed_crc,
+                                                         uint64_t compressed_size)
+{
+  mcap::ChunkIndex index;
+  index.messageStartTime = chunk_start_time_;
+  index.messageEndTime = chunk_end_time_;
+  index.chunkStartOffset = file_.size();
+  index.compression = compression;
+  index.compressedSize = compressed_size;
+  index.uncompressedSize = uncompressed_size;
+
+  chunk_header_.clear();
+  append_le(chunk_header_, uint8_t(mcap::OpCode::Chunk));
+  append_le(chunk_header_, uint64_t(8 + 8 + 8 + 4 + 4 + compression.size() + 8 + compressed_size));
+  append_le(chunk_header_, chunk_start_time_);
+  append_le(chunk_header_, chunk_end_time_);
+  append_le(chunk_header_, uncompressed_size);
+  append_le(chunk_header_, uncompressed_crc);
+  append_le(chunk_header_, uint32_t(compression.size()));
+  const auto * name = reinterpret_cast<const std::byte *>(compression.data());
+  chunk_header_.insert(chunk_header_.end(), name, name + compression.size());
+  append_le(chunk_header_, compressed_size);
+  file_.write(chunk_header_.data(), chunk_header_.size());
+  return index;
+}
+
+void SpillingChunkWriter::finish_chunk(mcap::ChunkIndex & index)
+{
+  index.chunkLength = file_.size() - index.chunkStartOffset;
+  const uint64_t message_index_start = file_.size();
+  for (auto & [channel_id, message_index] : message_indexes_) {
+    if (!message_index.records.empty()) {
+      index.messageIndexOffsets.emplace(channel_id, file_.size());
+      mcap::McapWriter::write(file_, message_index);
+      message_index.records.clear();
+    }
+  }
+  index.messageIndexLength = file_.size() - message_index_start;
+
+  add_index(index);
+  chunk_start_time_ = mcap::MaxTime;
+  chunk_end_time_ = 0;
+}
+
+void SpillingChunkWriter::spill_indexes()
+{
+  if (!status_.ok()) {
+    return;
+  }
+  if (!spill_file_) {
+    spill_file_ = std::fopen(spill_path_.c_str(), "w+b");
+    if (!spill_file_) {
+      status_ = mcap::Status(mcap::StatusCode::OpenFailed, "failed to create " + spill_path_ +
+                                                             ", keeping chunk indexes in memory");
+      return;
+    }
+  }
+  if (std::fwrite(indexes_.data(), 1, indexes_.size(), spill_file_) != indexes_.size()) {
+    // The records which were written are still in the file, at the end of which the rest would
+    // have gone; drop the partial write so that the summary can still be rebuilt from memory.
+    std::fseek(spill_file_, long(spilled_size_), SEEK_SET);
+    status_ = mcap::Status(mcap::StatusCode::OpenFailed, "failed to write to " + spill_path_ +
+                                                           ", keeping chunk indexes in memory");
+    return;
+  }
+  spilled_size_ += indexes_.size();
+  indexes_.clear();
+}
+
+void SpillingChunkWriter::handleWrite(const std::byte * data, uint64_t size)
+{
+  while (size > 0) {
+    uint64_t count = 0;
+    if (in_summary_) {
+      summary_.insert(summary_.end(), data, data + size);
+      return;
+    } else if (magic_remaining_ > 0) {
+      count = std::min(size, magic_remaining_);
+      if (!appending_) {
+        file_.write(data, count);
+      }
+      magic_remaining_ -= count;
+    } else if (prefix_size_ < PREFIX_SIZE) {
+      count = std::min<uint64_t>(size, PREFIX_SIZE - prefix_size_);
+      std::memcpy(prefix_.data() + prefix_size_, data, count);
+      prefix_size_ += count;
+      if (prefix_size_ == PREFIX_SIZE) {
+        start_record();
+        if (record_remaining_ == 0) {
+          finish_record();
+        }
+      }
+    } else {
+      count = std::min(size, record_remaining_);
+      if (destination_ == Destination::Chunk) {
+        if (message_head_size_ < MESSAGE_HEAD_SIZE) {
+          const size_t head = std::min<uint64_t>(count, MESSAGE_HEAD_SIZE - message_head_size_);
+          std::memcpy(message_head_.data() + message_head_size_, data, head);
+          message_head_size_ += head;
+        }
+        chunk_->write(data, count);
+      } else if (destination_ == Destination::File) {
+        file_.write(data, count);
+      }
+      record_remaining_ -= count;
+      if (record_remaining_ == 0) {
+        finish_record();
+      }
+    }
+    data += count;
+    size -= count;
+  }
+}
+
+void SpillingChunkWriter::start_record()
+{
+  const auto opcode = mcap::OpCode(prefix_[0]);
+  record_remaining_ = read_le<uint64_t>(prefix_.data() + 1);
+  switch (opcode) {
+    case mcap::OpCode::Schema:
+    case mcap::OpCode::Channel:
+    case mcap::OpCode::Message:
+      destination_ = Destination::Chunk;
+      record_offset_ = chunk_->size();
+      // Only Message records need their head, to be indexed; skip it for the others.
+      message_head_size_ = opcode == mcap::OpCode::Message ? 0 : MESSAGE_HEAD_SIZE;
+      chunk_->write(prefix_.data(), prefix_.size());
+      break;
+    case mcap::OpCode::DataEnd:
+      // The CRC of the data section of the McapWriter is not that of the file.
+      destination_ = Destination::Discard;
+      break;
+    case mcap::OpCode::Header:
+      destination_ = appending_ ? Destination::Discard : Destination::File;
+      if (!appending_) {
+        file_.write(prefix_.data(), prefix_.size());
+      }
+      break;
+    default:
+      destination_ = Destination::File;
+      file_.write(prefix_.data(), prefix_.size());
+      break;
+  }
+}
+
+void SpillingChunkWriter::finish_record()
+{
+  const auto opcode = mcap::OpCode(prefix_[0]);
+  prefix_size_ = 0;
+  if (opcode == mcap::OpCode::DataEnd) {
+    close_chunk();
+    const uint32_t data_crc = file_.crcEnabled ? file_.crc() : 0;
+    mcap::McapWriter::write(file_, mcap::DataEnd{data_crc});
+    in_summary_ = true;
+    return;
+  }
+  if (opcode != mcap::OpCode::Message || message_head_size_ < MESSAGE_HEAD_SIZE) {
+    return;
+  }
+  const auto channel_id = read_le<mcap::ChannelId>(message_head_.data());
+  const auto log_time = read_le<mcap::Timestamp>(message_head_.data() + 2 + 4);
+  chunk_start_time_ = std::min(chunk_start_time_, log_time);
+  chunk_end_time_ = std::max(chunk_end_time_, log_time);
+  if (!options_.noMessageIndex) {
+    auto & message_index = message_indexes_[channel_id];
+    message_index.channelId = channel_id;
+    message_index.records.emplace_back(log_time, record_offset_);
+  }
+  if (chunk_->size() >= options_.chunkSize) {
+    close_chunk();
+  }
+}
+
+void SpillingChunkWriter::end()
+{
+  if (!open_) {
+    return;
+  }
+  close_chunk();
+  write_summary();
+  file_.end();
+  open_ = false;
+  if (spill_file_) {
+    std::fclose(spill_file_);
+    spill_file_ = nullptr;
+    std::remove(spill_path_.c_str());
+  }
+}
+
+void SpillingChunkWriter::write_summary()
+{
+  // The records of the summary of the McapWriter up to its summary offsets, grouped by opcode,
+  // with those of the file appended to.
+  std::vector<std::pair<mcap::OpCode, mcap::ByteArray>> records;
+  const auto group = [&](mcap::OpCode opcode) -> mcap::ByteArray & {
+    for (auto & [group_opcode, group_records] : records) {
+      if (group_opcode == opcode) {
+        return group_records;
+      }
+    }
+    return records.emplace_back(opcode, mcap::ByteArray()).second;
+  };
+  for (size_t offset = 0; offset + PREFIX_SIZE <= summary_.size();) {
+    const auto opcode = mcap::OpCode(summary_[offset]);
+    const auto length = read_le<uint64_t>(summary_.data() + offset + 1);
+    if (opcode == mcap::OpCode::SummaryOffset || opcode == mcap::OpCode::Footer ||
+        offset + PREFIX_SIZE + length > summary_.size()) {
+      break;
+    }
+    mcap::Statistics statistics;
+    const mcap::Record record{opcode, length, summary_.data() + offset + PREFIX_SIZE};
+    if (opcode == mcap::OpCode::Statistics &&
+        mcap::McapReader::ParseStatistics(record, &statistics).ok()) {
+      // Statistics cannot be merged with those of a file which has none.
+      if (!appending_ || existing_statistics_) {
+        merge_statistics(statistics);
+        ByteArrayWriter output(group(opcode));
+        mcap::McapWriter::write(output, statistics);
+      }
+    } else {
+      auto & output = group(opcode);
+      output.insert(output.end(), summary_.data() + offset,
+                    summary_.data() + offset + PREFIX_SIZE + length);
+    }
+    offset += PREFIX_SIZE + length;
+  }
+  for (auto & [opcode, existing_records] : existing_indexes_) {
+    if (!existing_records.empty()) {
+      auto & output = group(opcode);
+      output.insert(output.end(), existing_records.begin(), existing_records.end());
+    }
+  }
+  mcap::ByteArray().swap(summary_);
+
+  std::vector<mcap::SummaryOffset> summary_offsets;
+  const uint64_t summary_start = file_.size();
+  file_.resetCrc();
+  file_.crcEnabled = !options_.noSummaryCRC;
+  for (const auto & [opcode, group_records] : records) {
+    summary_offsets.push_back(mcap::SummaryOffset{opcode, file_.size(), group_records.size()});
+    file_.write(group_records.data(), group_records.size());
+  }
+  records.clear();
+
+  if (spilled_size_ > 0 || !indexes_.empty()) {
+    const uint64_t group_start = file_.size();
+    if (spill_file_) {
+      std::fflush(spill_file_);
+      std::fseek(spill_file_, 0, SEEK_SET);
+      mcap::ByteArray buffer(std::min<uint64_t>(spilled_size_, 1024 * 1024));
+      for (uint64_t remaining = spilled_size_; remaining > 0;) {
+        const size_t count =
+          std::fread(buffer.data(), 1, std::min<uint64_t>(remaining, buffer.size()), spill_file_);
+        if (count == 0) {
+          status_ = mcap::Status(mcap::StatusCode::ReadFailed, "failed to read " + spill_path_);
+          break;
+        }
+        file_.write(buffer.data(), count);
+        remaining -= count;
+      }
+    }
+    file_.write(indexes_.data(), indexes_.size());
+    mcap::ByteArray().swap(indexes_);
+    summary_offsets.push_back(
+      mcap::SummaryOffset{mcap::OpCode::ChunkIndex, group_start, file_.size() - group_start});
+  }
+
+  uint64_t summary_offset_start = 0;
+  if (!options_.noSummaryOffsets && !summary_offsets.empty()) {
+    summary_offset_start = file_.size();
+    for (const auto & summary_offset : summary_offsets) {
+      mcap::McapWriter::write(file_, summary_offset);
+    }
+  }
+  mcap::McapWriter::write(
+    file_, mcap::Footer(summary_offsets.empty() ? 0 : summary_start, summary_offset_start),
+    !options_.noSummaryCRC);
+  mcap::McapWriter::writeMagic(file_);
+}
+
+void SpillingChunkWriter::merge_statistics(mcap::Statistics & statistics) const
+{
+  statistics.chunkCount = chunk_count_;
+  add_statistics(statistics, direct_statistics_);
+  if (existing_statistics_) {
+    add_statistics(statistics, *existing_statistics_);
+  }
+}
+
+uint64_t SpillingChunkWriter::size() const
+{
+  return file_.size();
+}
+
+uint64_t SpillingChunkWriter::spilled_size() const
+{
+  return spilled_size_;
+}
+
+const mcap::Status & SpillingChunkWriter::status() const
+{
+  return status_;
+}
+
+}  // namespace rosbag2_storage_mcap::internal
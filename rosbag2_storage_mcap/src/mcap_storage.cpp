@@ -15,8 +15,8 @@
 #include "rcutils/logging_macros.h"
 #include "rosbag2_storage/metadata_io.hpp"
 #include "rosbag2_storage/ros_helper.hpp"
-#include "rosbag2_storage/storage_interfaces/read_write_interface.hpp"
-#include "rosbag2_storage_mcap/message_definition_cache.hpp"
+#include "rosbag2_storage_mcap/file_migrator.hpp"
+#include "rosbag2_storage_mcap/mcap_storage.hpp"
 
 #ifdef ROSBAG2_STORAGE_MCAP_HAS_YAML_HPP
   #include "rosbag2_storage/yaml.hpp"
@@ -39,16 +39,23 @@
 #include <mcap/mcap.hpp>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
 #include <filesystem>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
 #include <optional>
+#include <regex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
-#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_FILTER_TOPIC_REGEX
-  #include <regex>
-#endif
 
 #define DECLARE_YAML_VALUE_MAP(KEY_TYPE, VALUE_TYPE, ...)                   \
   template <>                                                               \
@@ -88,6 +95,56 @@ struct McapWriterOptions : mcap::McapWriterOptions
       : mcap::McapWriterOptions("ros2")
   {
   }
+
+  // Duration in nanoseconds of the buckets of the activity histogram written at close.
+  // 0 disables the histogram.
+  uint64_t activityHistogramBucketDuration = 0;
+  // Striped recording: write the messages to one member file in each of these directories,
+  // each on its own thread, instead of to the bag file itself. Relative directories are relative
+  // to the bag directory. Empty writes a single file.
+  std::vector<std::string> stripeDirectories;
+  rosbag2_storage_mcap::internal::FileAssignment stripeAssignment =
+    rosbag2_storage_mcap::internal::FileAssignment::RoundRobin;
+  // Sharded recording: write the messages to this many member files, each on its own thread,
+  // with every topic in exactly one of them. Topics matching the Nth regular expression of
+  // shardTopics go to the Nth file; other topics are spread by load. When stripeDirectories is
+  // also set, it only chooses where the files are written. 0 writes a single file.
+  uint64_t shardCount = 0;
+  std::vector<std::string> shardTopics;
+  // Tiered recording: write the bag file, and the member files stored under the bag directory,
+  // to this directory, then move each one to the bag directory in the background once closed.
+  // Relative directories are relative to the bag directory. Empty writes in place.
+  std::string scratchDirectory;
+  // Bytes per second at which closed files are copied out of scratchDirectory. 0 is unlimited.
+  uint64_t migrationMaxRate = 0;
+  // Opening a file waits while more than this many bytes are still waiting to be moved out of
+  // scratch, which bounds scratch usage to about this plus the size of one split. 0 never waits.
+  uint64_t scratchMaxBacklog = 0;
+  // Messages of at least this many bytes are written in a chunk of their own, so that large,
+  // usually incompressible payloads such as images do not share chunks with small messages.
+  // 0 disables.
+  uint64_t largeMessageThreshold = 0;
+  // With zstd compression, chunks larger than this many bytes are compressed as several zstd
+  // frames of at most this size, which readers with frameDecodeThreads decompress in parallel.
+  // Not supported with striped or sharded recording. 0 compresses each chunk as one frame.
+  uint64_t chunkFrameSize = 0;
+  // Chunk indexes are written to a temporary file as the recording goes, once more than 1 MiB of
+  // them has accumulated, and copied into the summary when the file is closed, instead of being
+  // kept in memory until then. Not supported with striped or sharded recording.
+  bool spillIndexes = false;
+  // Directory of the temporary file, relative to the bag directory if relative. Empty uses the
+  // directory the file is written to.
+  std::string indexSpillDirectory;
+  // Messages on topics matching one of these regular expressions whose payload is the same as
+  // that of the previous message of the topic are written as a 16-byte reference to the first
+  // message of the run instead. Readers of this plugin expand them back transparently.
+  std::vector<std::string> deduplicateTopics;
+  // Payloads of messages of these types are byte-shuffled with the given element size, from 2 to
+  // 16 bytes, before being written, so that numeric arrays compress better.
+  std::map<std::string, uint32_t> byteShuffle;
+  // Payloads of messages of these types are encoded with the payload codec registered with the
+  // given name. A payload which is also byte-shuffled is shuffled after being encoded.
+  std::map<std::string, std::string> payloadCodecs;
 };
 }  // namespace
 
@@ -115,6 +172,16 @@ DECLARE_YAML_VALUE_MAP(mcap::CompressionLevel, std::string,
                         {mcap::CompressionLevel::Slow, "Slow"},
                         {mcap::CompressionLevel::Slowest, "Slowest"}});
 
+DECLARE_YAML_VALUE_MAP(rosbag2_storage_mcap::internal::FileAssignment, std::string,
+                       {{rosbag2_storage_mcap::internal::FileAssignment::RoundRobin, "RoundRobin"},
+                        {rosbag2_storage_mcap::internal::FileAssignment::LeastLoaded,
+                         "LeastLoaded"}});
+
+DECLARE_YAML_VALUE_MAP(rosbag2_storage_mcap::internal::ChunkCrcCheck, std::string,
+                       {{rosbag2_storage_mcap::internal::ChunkCrcCheck::Skip, "Skip"},
+                        {rosbag2_storage_mcap::internal::ChunkCrcCheck::Background, "Background"},
+                        {rosbag2_storage_mcap::internal::ChunkCrcCheck::Inline, "Inline"}});
+
 template <>
 struct convert<McapWriterOptions>
 {
@@ -140,6 +207,47 @@ struct convert<McapWriterOptions>
     optional_assign<bool>(node, "noChunkIndex", o.noChunkIndex);
     optional_assign<bool>(node, "noStatistics", o.noStatistics);
     optional_assign<bool>(node, "noSummaryOffsets", o.noSummaryOffsets);
+    optional_assign<uint64_t>(node, "activityHistogramBucketDuration",
+                              o.activityHistogramBucketDuration);
+    optional_assign<std::vector<std::string>>(node, "stripeDirectories", o.stripeDirectories);
+    optional_assign<rosbag2_storage_mcap::internal::FileAssignment>(node, "stripeAssignment",
+                                                                    o.stripeAssignment);
+    optional_assign<uint64_t>(node, "shardCount", o.shardCount);
+    optional_assign<std::vector<std::string>>(node, "shardTopics", o.shardTopics);
+    optional_assign<std::string>(node, "scratchDirectory", o.scratchDirectory);
+    optional_assign<uint64_t>(node, "migrationMaxRate", o.migrationMaxRate);
+    optional_assign<uint64_t>(node, "scratchMaxBacklog", o.scratchMaxBacklog);
+    optional_assign<uint64_t>(node, "largeMessageThreshold", o.largeMessageThreshold);
+    optional_assign<uint64_t>(node, "chunkFrameSize", o.chunkFrameSize);
+    optional_assign<bool>(node, "spillIndexes", o.spillIndexes);
+    optional_assign<std::string>(node, "indexSpillDirectory", o.indexSpillDirectory);
+    optional_assign<std::vector<std::string>>(node, "deduplicateTopics", o.deduplicateTopics);
+    optional_assign<std::map<std::string, uint32_t>>(node, "byteShuffle", o.byteShuffle);
+    optional_assign<std::map<std::string, std::string>>(node, "payloadCodecs", o.payloadCodecs);
+    return true;
+  }
+};
+
+template <>
+struct convert<rosbag2_storage_plugins::McapReaderOptions>
+{
+  // NOTE: when updating this struct, also update documentation in README.md
+  static bool decode(const Node & node, rosbag2_storage_plugins::McapReaderOptions & o)
+  {
+    optional_assign<uint64_t>(node, "readCoalesceGap", o.readCoalesceGap);
+    optional_assign<uint64_t>(node, "readMaxCoalescedSize", o.readMaxCoalescedSize);
+    optional_assign<uint64_t>(node, "readAheadCount", o.readAheadCount);
+    optional_assign<bool>(node, "dropPageCacheBehind", o.dropPageCacheBehind);
+    optional_assign<uint64_t>(node, "sharedChunkCacheSize", o.sharedChunkCacheSize);
+    optional_assign<uint64_t>(node, "decodeThreads", o.decodeThreads);
+    optional_assign<uint64_t>(node, "frameDecodeThreads", o.frameDecodeThreads);
+    optional_assign<rosbag2_storage_mcap::internal::ChunkCrcCheck>(node, "chunkCrcCheck",
+                                                                   o.chunkCrcCheck);
+    optional_assign<double>(node, "downsampleMaxRate", o.downsampleMaxRate);
+    optional_assign<uint64_t>(node, "downsampleEveryNth", o.downsampleEveryNth);
+    optional_assign<uint64_t>(node, "httpBlockSize", o.httpBlockSize);
+    optional_assign<uint64_t>(node, "httpMemoryCacheSize", o.httpMemoryCacheSize);
+    optional_assign<std::string>(node, "httpCacheDirectory", o.httpCacheDirectory);
     return true;
   }
 };
@@ -151,103 +259,46 @@ using mcap::ByteOffset;
 using time_point = std::chrono::time_point<std::chrono::high_resolution_clock>;
 static const char FILE_EXTENSION[] = ".mcap";
 static const char LOG_NAME[] = "rosbag2_storage_mcap";
+// Threads reading chunk indexes when deriving statistics for a file without them.
+static constexpr size_t MAX_STATISTICS_THREADS = 8;
+// Bytes of messages queued for each member file of a striped or sharded recording before write()
+// blocks.
+static constexpr uint64_t MAX_QUEUED_BYTES_PER_FILE = 64 * 1024 * 1024;
+// Opcode and length preceding each record in a chunk.
+static constexpr uint64_t RECORD_PREFIX_LENGTH = 9;
 
 static void OnProblem(const mcap::Status & status)
 {
   RCUTILS_LOG_ERROR_NAMED(LOG_NAME, "%s", status.message.c_str());
 }
 
-/**
- * A storage implementation for the MCAP file format.
- */
-class MCAPStorage : public rosbag2_storage::storage_interfaces::ReadWriteInterface
+static mcap::Metadata read_metadata_record(mcap::IReadable & data_source, uint64_t offset)
 {
-public:
-  MCAPStorage();
-  ~MCAPStorage() override;
-
-  /** BaseIOInterface **/
-#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
-  void open(const rosbag2_storage::StorageOptions & storage_options,
-            rosbag2_storage::storage_interfaces::IOFlag io_flag =
-              rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE) override;
-  void open(const std::string & uri, rosbag2_storage::storage_interfaces::IOFlag io_flag =
-                                       rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE);
-#else
-  void open(const std::string & uri,
-            rosbag2_storage::storage_interfaces::IOFlag io_flag =
-              rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE) override;
-#endif
-
-  /** BaseInfoInterface **/
-  rosbag2_storage::BagMetadata get_metadata() override;
-  std::string get_relative_file_path() const override;
-  uint64_t get_bagfile_size() const override;
-  std::string get_storage_identifier() const override;
-
-  /** BaseReadInterface **/
-#ifdef ROSBAG2_STORAGE_MCAP_HAS_SET_READ_ORDER
-  void set_read_order(const rosbag2_storage::ReadOrder &) override;
-#endif
-  bool has_next() override;
-  std::shared_ptr<rosbag2_storage::SerializedBagMessage> read_next() override;
-  std::vector<rosbag2_storage::TopicMetadata> get_all_topics_and_types() override;
-
-  /** ReadOnlyInterface **/
-  void set_filter(const rosbag2_storage::StorageFilter & storage_filter) override;
-  void reset_filter() override;
-#ifdef ROSBAG2_STORAGE_MCAP_OVERRIDE_SEEK_METHOD
-  void seek(const rcutils_time_point_value_t & time_stamp) override;
-#else
-  void seek(const rcutils_time_point_value_t & timestamp);
-#endif
-
-  /** ReadWriteInterface **/
-  uint64_t get_minimum_split_file_size() const override;
-
-  /** BaseWriteInterface **/
-  void write(std::shared_ptr<const rosbag2_storage::SerializedBagMessage> msg) override;
-  void write(
-    const std::vector<std::shared_ptr<const rosbag2_storage::SerializedBagMessage>> & msg) override;
-  void create_topic(const rosbag2_storage::TopicMetadata & topic) override;
-  void remove_topic(const rosbag2_storage::TopicMetadata & topic) override;
-#ifdef ROSBAG2_STORAGE_MCAP_HAS_UPDATE_METADATA
-  void update_metadata(const rosbag2_storage::BagMetadata &) override;
-#endif
-
-private:
-  void open_impl(const std::string & uri, const std::string & preset_profile,
-                 rosbag2_storage::storage_interfaces::IOFlag io_flag,
-                 const std::string & storage_config_uri);
-
-  void reset_iterator(rcutils_time_point_value_t start_time = 0);
-  bool read_and_enqueue_message();
-  void ensure_summary_read();
-
-  std::optional<rosbag2_storage::storage_interfaces::IOFlag> opened_as_;
-  std::string relative_path_;
-
-  std::shared_ptr<rosbag2_storage::SerializedBagMessage> next_;
-
-  rosbag2_storage::BagMetadata metadata_{};
-  std::unordered_map<std::string, rosbag2_storage::TopicInformation> topics_;
-  std::unordered_map<std::string, mcap::SchemaId> schema_ids_;    // datatype -> schema_id
-  std::unordered_map<std::string, mcap::ChannelId> channel_ids_;  // topic -> channel_id
-  rosbag2_storage::StorageFilter storage_filter_{};
-  mcap::ReadMessageOptions::ReadOrder read_order_ =
-    mcap::ReadMessageOptions::ReadOrder::LogTimeOrder;
-
-  std::unique_ptr<std::ifstream> input_;
-  std::unique_ptr<mcap::FileStreamReader> data_source_;
-  std::unique_ptr<mcap::McapReader> mcap_reader_;
-  std::unique_ptr<mcap::LinearMessageView> linear_view_;
-  std::unique_ptr<mcap::LinearMessageView::Iterator> linear_iterator_;
-
-  std::unique_ptr<mcap::McapWriter> mcap_writer_;
-  rosbag2_storage_mcap::internal::MessageDefinitionCache msgdef_cache_{};
+  mcap::Record record;
+  auto status = mcap::McapReader::ReadRecord(data_source, offset, &record);
+  mcap::Metadata metadata;
+  if (status.ok()) {
+    status = mcap::McapReader::ParseMetadata(record, &metadata);
+  }
+  if (!status.ok()) {
+    throw std::runtime_error(status.message);
+  }
+  return metadata;
+}
 
-  bool has_read_summary_ = false;
-};
+static rosbag2_storage_mcap::internal::PlannedFileReader::Options planner_options_for(
+  const McapReaderOptions & read_options)
+{
+  rosbag2_storage_mcap::internal::PlannedFileReader::Options options;
+  options.coalesce_gap = read_options.readCoalesceGap;
+  options.max_coalesced_size = read_options.readMaxCoalescedSize;
+  options.read_ahead = size_t(read_options.readAheadCount);
+  options.drop_behind = read_options.dropPageCacheBehind;
+  options.http.block_size = read_options.httpBlockSize;
+  options.http.memory_cache_size = read_options.httpMemoryCacheSize;
+  options.http.cache_directory = read_options.httpCacheDirectory;
+  return options;
+}
 
 MCAPStorage::MCAPStorage()
 {
@@ -257,14 +308,46 @@ MCAPStorage::MCAPStorage()
 
 MCAPStorage::~MCAPStorage()
 {
+  chunked_reader_.reset();
   if (mcap_reader_) {
     mcap_reader_->close();
   }
-  if (input_) {
-    input_->close();
+  if (file_set_writer_) {
+    const auto status = file_set_writer_->close();
+    if (!status.ok()) {
+      OnProblem(status);
+    }
   }
   if (mcap_writer_) {
+    if (activity_histogram_) {
+      const auto status = mcap_writer_->write(activity_histogram_->to_metadata());
+      if (!status.ok()) {
+        OnProblem(status);
+      }
+    }
     mcap_writer_->close();
+    if (spilling_writer_ && !spilling_writer_->status().ok()) {
+      OnProblem(spilling_writer_->status());
+    }
+    if (file_topics_) {
+      // Only the current channels of the topics still recorded go on to the next file.
+      rosbag2_storage_mcap::internal::SplitTopics topics;
+      topics.schemas = std::move(file_topics_->schemas);
+      for (auto & channel : file_topics_->channels) {
+        const auto topic_it = topics_.find(channel->topic);
+        if (topic_it != topics_.end() && !topic_it->second.removed &&
+            (topic_it->second.channel_id == channel->id ||
+             topic_it->second.reference_channel_id == channel->id)) {
+          topics.channels.push_back(std::move(channel));
+        }
+      }
+      rosbag2_storage_mcap::internal::SplitHandoff::instance().put(relative_path_, topics);
+    }
+  }
+  // Members first, so the bag file only reaches its final path once the whole set is there.
+  for (const auto & [scratch_path, final_path] : scratch_files_) {
+    rosbag2_storage_mcap::internal::FileMigrator::instance().migrate(scratch_path, final_path,
+                                                                     migration_max_rate_);
   }
 }
 
@@ -311,21 +394,44 @@ void MCAPStorage::open_impl(const std::string & uri, const std::string & preset_
   switch (io_flag) {
     case rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY: {
       relative_path_ = uri;
-      input_ = std::make_unique<std::ifstream>(relative_path_, std::ios::binary);
-      data_source_ = std::make_unique<mcap::FileStreamReader>(*input_);
+      if (!storage_config_uri.empty()) {
+        YAML::Node yaml_node = YAML::LoadFile(storage_config_uri);
+        YAML::convert<McapReaderOptions>::decode(yaml_node, read_options_);
+      }
+      data_source_ = std::make_unique<rosbag2_storage_mcap::internal::PlannedFileReader>(
+        planner_options_for(read_options_));
+      auto status = data_source_->open(relative_path_);
+      if (!status.ok()) {
+        throw std::runtime_error(status.message);
+      }
       mcap_reader_ = std::make_unique<mcap::McapReader>();
-      auto status = mcap_reader_->open(*data_source_);
+      status = mcap_reader_->open(*data_source_);
       if (!status.ok()) {
         throw std::runtime_error(status.message);
       }
+      open_file_set_members(storage_config_uri);
+      if (read_options_.decodeThreads > 0 && file_set_members_.empty()) {
+        decode_workers_ = std::make_shared<rosbag2_storage_mcap::internal::WorkerPool>(
+          size_t(read_options_.decodeThreads));
+      }
+      if (read_options_.frameDecodeThreads > 0 && file_set_members_.empty()) {
+        frame_decode_workers_ = std::make_shared<rosbag2_storage_mcap::internal::WorkerPool>(
+          size_t(read_options_.frameDecodeThreads));
+      }
+      using rosbag2_storage_mcap::internal::ChunkCrcCheck;
+      if (read_options_.chunkCrcCheck == ChunkCrcCheck::Background && file_set_members_.empty()) {
+        crc_check_workers_ = std::make_shared<rosbag2_storage_mcap::internal::WorkerPool>(1);
+      }
       reset_iterator();
       break;
     }
     case rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE:
     case rosbag2_storage::storage_interfaces::IOFlag::APPEND: {
-      // APPEND does not seem to be used; treat it the same as READ_WRITE
-      io_flag = rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE;
+      // APPEND continues the file if it exists, and otherwise creates it like READ_WRITE.
       relative_path_ = uri + FILE_EXTENSION;
+      const bool append = io_flag == rosbag2_storage::storage_interfaces::IOFlag::APPEND &&
+                          std::filesystem::exists(relative_path_);
+      io_flag = rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE;
 
       mcap_writer_ = std::make_unique<mcap::McapWriter>();
       McapWriterOptions options;
@@ -343,10 +449,168 @@ void MCAPStorage::open_impl(const std::string & uri, const std::string & preset_
         YAML::convert<McapWriterOptions>::decode(yaml_node, options);
       }
 
-      auto status = mcap_writer_->open(relative_path_, options);
+      // The bag file is reported at its final path from the start; only the file being written
+      // lives in the scratch directory until it is moved there.
+      std::filesystem::path write_path(relative_path_);
+      if (!options.scratchDirectory.empty() && !append) {
+        std::filesystem::path scratch(options.scratchDirectory);
+        if (scratch.is_relative()) {
+          scratch = write_path.parent_path() / scratch;
+        }
+        std::error_code error;
+        std::filesystem::create_directories(scratch, error);
+        write_path = scratch / write_path.filename();
+        migration_max_rate_ = options.migrationMaxRate;
+        if (options.scratchMaxBacklog > 0) {
+          rosbag2_storage_mcap::internal::FileMigrator::instance().wait_for_backlog_below(
+            options.scratchMaxBacklog);
+        }
+      }
+
+      // A single output file hands its topics on to the next split file, and takes those of the
+      // previous one unless it already has its own.
+      if (options.shardCount == 0 && options.stripeDirectories.empty()) {
+        file_topics_.emplace();
+        take_previous_split_ = !append;
+      }
+
+      mcap::Status status;
+      // Appending, framed chunks and large messages go through the same writer, which merges the
+      // summary of the file with that of the messages appended and writes large messages as
+      // chunks straight from their buffers; its indexes only spill with spillIndexes.
+      using rosbag2_storage_mcap::internal::SpillingChunkWriter;
+      const bool file_set = options.shardCount > 0 || !options.stripeDirectories.empty();
+      const bool spill_indexes = options.spillIndexes && !options.noChunking;
+      const bool frame_chunks = options.chunkFrameSize > 0 && !options.noChunking &&
+                                options.compression == mcap::Compression::Zstd;
+      const bool large_messages =
+        options.largeMessageThreshold > 0 && !options.noChunking && !file_set;
+      if (append || spill_indexes || frame_chunks || large_messages) {
+        if (file_set) {
+          throw std::runtime_error("spillIndexes, chunkFrameSize and appending cannot be used with "
+                                   "striped or sharded recording");
+        }
+        if (options.noChunking) {
+          throw std::runtime_error("appending to an MCAP file requires chunking");
+        }
+        std::filesystem::path spill_directory(options.indexSpillDirectory);
+        if (!spill_directory.empty() && spill_directory.is_relative()) {
+          spill_directory = std::filesystem::path(relative_path_).parent_path() / spill_directory;
+        }
+        spilling_writer_ = std::make_unique<SpillingChunkWriter>(
+          options, spill_directory.string(),
+          options.spillIndexes ? SpillingChunkWriter::DEFAULT_MEMORY_LIMIT
+                               : std::numeric_limits<uint64_t>::max(),
+          options.chunkFrameSize);
+        // The activity histogram of the file is continued rather than written a second time.
+        SpillingChunkWriter::ExistingFile existing;
+        status = append ? spilling_writer_->open_append(
+                            write_path.string(), existing,
+                            {rosbag2_storage_mcap::ActivityHistogram::METADATA_NAME})
+                        : spilling_writer_->open(write_path.string());
+        if (status.ok()) {
+          mcap_writer_->open(*spilling_writer_, SpillingChunkWriter::writer_options(options));
+          restore_topics(existing.schemas, existing.channels);
+          if (existing.statistics && existing.statistics->messageCount > 0) {
+            const auto & stats = *existing.statistics;
+            metadata_.message_count = stats.messageCount;
+            metadata_.starting_time = time_point(std::chrono::nanoseconds(stats.messageStartTime));
+            metadata_.duration =
+              std::chrono::nanoseconds(stats.messageEndTime - stats.messageStartTime);
+          }
+          continue_activity_histogram(existing.metadata);
+        }
+      } else {
+        status = mcap_writer_->open(write_path.string(), options);
+      }
       if (!status.ok()) {
         throw std::runtime_error(status.message);
       }
+      if (!activity_histogram_ && options.activityHistogramBucketDuration > 0) {
+        activity_histogram_.emplace(options.activityHistogramBucketDuration);
+      }
+      if (!options.noChunking) {
+        large_message_threshold_ = options.largeMessageThreshold;
+      }
+
+      if (options.shardTopics.size() > options.shardCount) {
+        throw std::runtime_error("shardTopics has more entries than shardCount");
+      }
+      if (!options.deduplicateTopics.empty()) {
+        // References are resolved within their own file, found through the chunk index.
+        if (options.noChunking || (!options.stripeDirectories.empty() && options.shardCount == 0)) {
+          throw std::runtime_error(
+            "deduplicateTopics requires chunking and cannot be used with striped recording");
+        }
+        for (const auto & pattern : options.deduplicateTopics) {
+          dedup_patterns_.emplace_back(pattern);
+        }
+      }
+      for (const auto & [type, element_size] : options.byteShuffle) {
+        if (element_size < 2 ||
+            element_size > rosbag2_storage_mcap::internal::MAX_SHUFFLE_ELEMENT_SIZE) {
+          throw std::runtime_error("byteShuffle element size of " + type +
+                                   " must be between 2 and 16");
+        }
+      }
+      byte_shuffle_types_ = options.byteShuffle;
+      for (const auto & [type, codec_name] : options.payloadCodecs) {
+        auto codec = rosbag2_storage_mcap::PayloadCodecRegistry::instance().find(codec_name);
+        if (!codec) {
+          throw std::runtime_error("payload codec " + codec_name + " of " + type +
+                                   " is not registered");
+        }
+        schema_codecs_.emplace(type, std::make_pair(codec_name, std::move(codec)));
+      }
+      const size_t file_count =
+        options.shardCount > 0 ? size_t(options.shardCount) : options.stripeDirectories.size();
+      if (file_count > 0) {
+        // The bag file only lists the member files; each member is a complete MCAP file.
+        const std::filesystem::path bag_path(relative_path_);
+        rosbag2_storage_mcap::internal::FileSetManifest manifest;
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < file_count; ++i) {
+          std::filesystem::path file =
+            bag_path.stem().string() + "." + std::to_string(i) + FILE_EXTENSION;
+          if (!options.stripeDirectories.empty()) {
+            const auto & directory =
+              options.stripeDirectories[i % options.stripeDirectories.size()];
+            file = std::filesystem::path(directory) / file;
+          }
+          auto path = file.is_relative() ? bag_path.parent_path() / file : file;
+          if (file.is_relative() && write_path != bag_path) {
+            const auto scratch_path = write_path.parent_path() / file;
+            scratch_files_.emplace_back(scratch_path.string(), path.string());
+            path = scratch_path;
+          }
+          std::error_code error;
+          std::filesystem::create_directories(path.parent_path(), error);
+          manifest.files.push_back(file.string());
+          paths.push_back(path.string());
+        }
+        if (options.shardCount > 0) {
+          manifest.topic_patterns = options.shardTopics;
+          manifest.topic_patterns.resize(file_count);
+          for (const auto & pattern : options.shardTopics) {
+            shard_patterns_.emplace_back(pattern);
+          }
+          shard_topic_counts_.assign(file_count, 0);
+        }
+        file_set_writer_ = std::make_unique<rosbag2_storage_mcap::internal::ParallelFileWriter>(
+          MAX_QUEUED_BYTES_PER_FILE);
+        status = file_set_writer_->open(paths, options);
+        if (status.ok()) {
+          status = mcap_writer_->write(manifest.to_metadata());
+        }
+        if (!status.ok()) {
+          throw std::runtime_error(status.message);
+        }
+        stripe_assignment_ = options.stripeAssignment;
+        stripe_size_ = options.chunkSize;
+      }
+      if (write_path != std::filesystem::path(relative_path_)) {
+        scratch_files_.emplace_back(write_path.string(), relative_path_);
+      }
       break;
     }
   }
@@ -357,6 +621,9 @@ void MCAPStorage::open_impl(const std::string & uri, const std::string & preset_
 /** BaseInfoInterface **/
 rosbag2_storage::BagMetadata MCAPStorage::get_metadata()
 {
+  if (!file_set_members_.empty()) {
+    return get_file_set_metadata();
+  }
   ensure_summary_read();
 
   metadata_.version = 2;
@@ -365,18 +632,31 @@ rosbag2_storage::BagMetadata MCAPStorage::get_metadata()
   metadata_.relative_file_paths = {get_relative_file_path()};
 
   // Fill out summary metadata from the Statistics record
-  const mcap::Statistics & stats = mcap_reader_->statistics().value();
+  const mcap::Statistics & stats = summary_->statistics.value();
   metadata_.message_count = stats.messageCount;
   metadata_.duration = std::chrono::nanoseconds(stats.messageEndTime - stats.messageStartTime);
   metadata_.starting_time = time_point(std::chrono::nanoseconds(stats.messageStartTime));
 
+  // References to repeated payloads count as messages of their topic.
+  std::unordered_map<mcap::ChannelId, uint64_t> reference_counts;
+  for (const auto & [reference_channel_id, topic_channel_id] : reference_channels_) {
+    const auto count_it = stats.channelMessageCounts.find(reference_channel_id);
+    if (count_it != stats.channelMessageCounts.end()) {
+      reference_counts[topic_channel_id] += count_it->second;
+    }
+  }
+
   // Build a list of topic information along with per-topic message counts
   metadata_.topics_with_message_count.clear();
-  for (const auto & [channel_id, channel_ptr] : mcap_reader_->channels()) {
+  metadata_.topics_with_message_count.reserve(summary_->channels.size());
+  for (const auto & [channel_id, channel_ptr] : summary_->channels) {
     const mcap::Channel & channel = *channel_ptr;
+    if (reference_channels_.count(channel_id) > 0) {
+      continue;
+    }
 
     // Look up the Schema for this topic
-    const auto schema_ptr = mcap_reader_->schema(channel.schemaId);
+    const auto schema_ptr = summary_->schema(channel.schemaId);
     if (!schema_ptr) {
       throw std::runtime_error("Could not find schema for topic " + channel.topic);
     }
@@ -400,8 +680,12 @@ rosbag2_storage::BagMetadata MCAPStorage::get_metadata()
     } else {
       topic_info.message_count = 0;
     }
+    const auto reference_count_it = reference_counts.find(channel_id);
+    if (reference_count_it != reference_counts.end()) {
+      topic_info.message_count += reference_count_it->second;
+    }
 
-    metadata_.topics_with_message_count.push_back(topic_info);
+    metadata_.topics_with_message_count.push_back(std::move(topic_info));
   }
 
   return metadata_;
@@ -415,13 +699,21 @@ std::string MCAPStorage::get_relative_file_path() const
 uint64_t MCAPStorage::get_bagfile_size() const
 {
   if (opened_as_ == rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY) {
-    return data_source_ ? data_source_->size() : 0;
+    uint64_t size = data_source_ ? data_source_->size() : 0;
+    for (const auto & member : file_set_members_) {
+      size += member->get_bagfile_size();
+    }
+    return size;
   } else {
     if (!mcap_writer_) {
       return 0;
     }
     const auto * data_sink = mcap_writer_->dataSink();
-    return data_sink ? data_sink->size() : 0;
+    uint64_t size = data_sink ? data_sink->size() : 0;
+    if (file_set_writer_) {
+      size += file_set_writer_->size();
+    }
+    return size;
   }
 }
 
@@ -433,12 +725,55 @@ std::string MCAPStorage::get_storage_identifier() const
 /** BaseReadInterface **/
 bool MCAPStorage::read_and_enqueue_message()
 {
+  // Already have popped and queued the next message.
+  if (next_ != nullptr) {
+    return true;
+  }
+
+  if (!file_set_members_.empty()) {
+    // Take the earliest (latest in reverse order) next message of any member, the first member
+    // on ties.
+    const bool reverse = read_order_ == mcap::ReadMessageOptions::ReadOrder::ReverseLogTimeOrder;
+    MCAPStorage * next_member = nullptr;
+    for (auto * member : selected_members_) {
+      if (!member->has_next()) {
+        continue;
+      }
+      const auto time_stamp = member->next_->time_stamp;
+      if (!next_member || (reverse ? time_stamp > next_member->next_->time_stamp
+                                   : time_stamp < next_member->next_->time_stamp)) {
+        next_member = member;
+      }
+    }
+    if (!next_member) {
+      return false;
+    }
+    next_ = next_member->read_next();
+    return true;
+  }
+
   // The recording has not been opened.
-  if (!linear_iterator_) {
+  if (!linear_iterator_ && !chunked_reader_) {
     return false;
   }
-  // Already have popped and queued the next message.
-  if (next_ != nullptr) {
+
+  if (chunked_reader_) {
+    const mcap::Message * message = chunked_reader_->next();
+    if (message == nullptr) {
+      if (!chunked_reader_->status().ok()) {
+        OnProblem(chunked_reader_->status());
+      }
+      return false;
+    }
+    const auto channel = summary_->channel(message->channelId);
+    if (!channel) {
+      throw std::runtime_error("Could not find channel " + std::to_string(message->channelId));
+    }
+    auto msg = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+    msg->time_stamp = rcutils_time_point_value_t(message->logTime);
+    msg->topic_name = channel->topic;
+    msg->serialized_data = read_payload(*message);
+    next_ = msg;
     return true;
   }
 
@@ -453,8 +788,7 @@ bool MCAPStorage::read_and_enqueue_message()
   auto msg = std::make_shared<rosbag2_storage::SerializedBagMessage>();
   msg->time_stamp = rcutils_time_point_value_t(messageView.message.logTime);
   msg->topic_name = messageView.channel->topic;
-  msg->serialized_data = rosbag2_storage::make_serialized_message(messageView.message.data,
-                                                                  messageView.message.dataSize);
+  msg->serialized_data = read_payload(messageView.message);
 
   // enqueue this message to be used
   next_ = msg;
@@ -463,14 +797,219 @@ bool MCAPStorage::read_and_enqueue_message()
   return true;
 }
 
+std::shared_ptr<rcutils_uint8_array_t> MCAPStorage::read_payload(const mcap::Message & message)
+{
+  if (reference_channels_.empty()) {
+    return decode_payload(message);
+  }
+  const auto reference_channel_it = reference_channels_.find(message.channelId);
+  if (reference_channel_it == reference_channels_.end()) {
+    auto payload = decode_payload(message);
+    const auto last_payload_it = last_payloads_.find(message.channelId);
+    if (last_payload_it != last_payloads_.end()) {
+      last_payload_it->second = {message.logTime, payload};
+    }
+    return payload;
+  }
+
+  const auto reference = rosbag2_storage_mcap::internal::PayloadReference::decode(
+    message.data, message.dataSize);
+  if (!reference) {
+    throw std::runtime_error("invalid payload reference at log time " +
+                             std::to_string(message.logTime));
+  }
+  // Usually the referenced message was the last one read on its channel. After a seek, or when
+  // reading in reverse, it is looked up in the chunks around its log time.
+  const mcap::ChannelId channel_id = reference_channel_it->second;
+  auto & [log_time, payload] = last_payloads_[channel_id];
+  if (!payload || log_time != reference->log_time ||
+      rosbag2_storage_mcap::internal::hash_payload(
+        reinterpret_cast<const std::byte *>(payload->buffer), payload->buffer_length) !=
+        reference->hash) {
+    payload = find_referenced_payload(channel_id, *reference);
+    log_time = reference->log_time;
+  }
+  return rosbag2_storage::make_serialized_message(payload->buffer, payload->buffer_length);
+}
+
+std::shared_ptr<rcutils_uint8_array_t> MCAPStorage::decode_payload(const mcap::Message & message)
+{
+  const auto shuffle_it = shuffled_channels_.find(message.channelId);
+  const auto codec_it = channel_codecs_.find(message.channelId);
+  if (codec_it == channel_codecs_.end()) {
+    if (shuffle_it == shuffled_channels_.end()) {
+      return rosbag2_storage::make_serialized_message(message.data, message.dataSize);
+    }
+    auto payload = rosbag2_storage::make_empty_serialized_message(message.dataSize);
+    rosbag2_storage_mcap::internal::byte_unshuffle(message.data, message.dataSize,
+                                                   shuffle_it->second,
+                                                   reinterpret_cast<std::byte *>(payload->buffer));
+    payload->buffer_length = message.dataSize;
+    return payload;
+  }
+
+  const std::byte * data = message.data;
+  if (shuffle_it != shuffled_channels_.end()) {
+    unshuffle_buffer_.resize(message.dataSize);
+    rosbag2_storage_mcap::internal::byte_unshuffle(message.data, message.dataSize,
+                                                   shuffle_it->second, unshuffle_buffer_.data());
+    data = unshuffle_buffer_.data();
+  }
+  decode_buffer_.clear();
+  if (!codec_it->second->decode(data, message.dataSize, decode_buffer_)) {
+    throw std::runtime_error("failed to decode message at log time " +
+                             std::to_string(message.logTime) + " on topic " +
+                             summary_->channels.at(message.channelId)->topic);
+  }
+  return rosbag2_storage::make_serialized_message(decode_buffer_.data(), decode_buffer_.size());
+}
+
+std::shared_ptr<rcutils_uint8_array_t> MCAPStorage::find_referenced_payload(
+  mcap::ChannelId channel_id, const rosbag2_storage_mcap::internal::PayloadReference & reference)
+{
+  const auto channel_filter = [channel_id](mcap::ChannelId id) { return id == channel_id; };
+  for (const auto & chunk_index : summary_->chunk_indexes) {
+    if (!rosbag2_storage_mcap::internal::chunk_may_match(chunk_index, reference.log_time,
+                                                         reference.log_time, channel_filter)) {
+      continue;
+    }
+    const auto records = load_indexed_chunk(chunk_index);
+    mcap::OpCode opcode;
+    uint64_t length = 0;
+    mcap::Message message;
+    for (uint64_t offset = 0; rosbag2_storage_mcap::internal::parse_chunk_record(
+           *records, offset, &opcode, &length, &message);
+         offset += RECORD_PREFIX_LENGTH + length) {
+      if (opcode != mcap::OpCode::Message || message.channelId != channel_id ||
+          message.logTime != reference.log_time) {
+        continue;
+      }
+      auto payload = decode_payload(message);
+      if (rosbag2_storage_mcap::internal::hash_payload(
+            reinterpret_cast<const std::byte *>(payload->buffer), payload->buffer_length) ==
+          reference.hash) {
+        return payload;
+      }
+    }
+  }
+  throw std::runtime_error("could not find the message at log time " +
+                           std::to_string(reference.log_time) + " on topic " +
+                           summary_->channels.at(channel_id)->topic +
+                           " referred to by a deduplicated message");
+}
+
 void MCAPStorage::reset_iterator(rcutils_time_point_value_t start_time)
 {
-  ensure_summary_read();
   mcap::ReadMessageOptions options;
   options.startTime = mcap::Timestamp(start_time);
   options.readOrder = read_order_;
+  options.topicFilter = make_topic_filter();
+
+  if (!file_set_members_.empty()) {
+    // Members without any topic passing the filter, such as the other shards of a sharded
+    // recording, are not read at all.
+    next_.reset();
+    selected_members_.clear();
+    for (auto & member : file_set_members_) {
+      const auto & channels = member->summary_->channels;
+      if (options.topicFilter &&
+          std::none_of(channels.begin(), channels.end(), [&](const auto & entry) {
+            return options.topicFilter(entry.second->topic);
+          })) {
+        continue;
+      }
+      member->storage_filter_ = storage_filter_;
+      member->reset_iterator(start_time);
+      selected_members_.push_back(member.get());
+    }
+    return;
+  }
+
+  ensure_summary_read();
+  next_.reset();
+  // Stop any chunk decoding still in progress before the read plan changes.
+  chunked_reader_.reset();
+
+  std::function<bool(mcap::ChannelId)> channel_filter;
+  if (options.topicFilter) {
+    std::unordered_set<mcap::ChannelId> channel_ids;
+    for (const auto & [channel_id, channel_ptr] : summary_->channels) {
+      if (options.topicFilter(channel_ptr->topic)) {
+        channel_ids.insert(channel_id);
+      }
+    }
+    channel_filter = [channel_ids = std::move(channel_ids)](mcap::ChannelId id) {
+      return channel_ids.find(id) != channel_ids.end();
+    };
+  }
+
+  // Downsampled reads pick their messages from the message indexes, so that chunks without a
+  // picked message are never read.
+  std::shared_ptr<const rosbag2_storage_mcap::internal::MessageSelection> selection;
+  if ((read_options_.downsampleMaxRate > 0 || read_options_.downsampleEveryNth > 1) &&
+      !summary_->chunk_indexes.empty()) {
+    if (summary_->has_message_indexes) {
+      rosbag2_storage_mcap::internal::DownsampleOptions downsample;
+      downsample.max_rate = read_options_.downsampleMaxRate;
+      downsample.every_nth = read_options_.downsampleEveryNth;
+      auto selected = std::make_shared<rosbag2_storage_mcap::internal::MessageSelection>();
+      const auto status = rosbag2_storage_mcap::internal::select_messages(
+        *data_source_, summary_->chunk_indexes, options.startTime, channel_filter, downsample,
+        selected.get());
+      if (!status.ok()) {
+        throw std::runtime_error(status.message);
+      }
+      selection = std::move(selected);
+    } else {
+      RCUTILS_LOG_WARN_NAMED(LOG_NAME,
+                             "downsampling requires message indices, reading all messages");
+    }
+  }
+  plan_reads(options.startTime, channel_filter, selection.get());
+
+  // Read chunked files directly through the chunk index, so that a seek can jump to the first
+  // chunk which may contain the start time rather than decoding every record before it, and so
+  // that a summary shared with other readers is enough to read the file.
+  if (!summary_->chunk_indexes.empty()) {
+    rosbag2_storage_mcap::internal::ChunkedMessageReader::Options chunk_options;
+    chunk_options.start_time = options.startTime;
+    chunk_options.channel_filter = std::move(channel_filter);
+    chunk_options.read_order = read_order_;
+    chunk_options.selection = std::move(selection);
+    if (read_options_.sharedChunkCacheSize > 0) {
+      auto & cache = rosbag2_storage_mcap::internal::ChunkCache::instance();
+      cache.reserve(read_options_.sharedChunkCacheSize);
+      using rosbag2_storage_mcap::internal::ChunkCache;
+      chunk_options.load_chunk =
+        [this, &cache](const mcap::ChunkIndex & chunk_index, const ChunkCache::Loader & load,
+                       const ChunkCache::Verifier & verify,
+                       rosbag2_storage_mcap::internal::ChunkRecords * out) {
+          return cache.get_or_load({file_identity_, chunk_index.chunkStartOffset}, load, out,
+                                   verify);
+        };
+    }
+    chunk_options.workers = decode_workers_;
+    chunk_options.frame_workers = frame_decode_workers_;
+    chunk_options.crc_check = read_options_.chunkCrcCheck;
+    chunk_options.crc_workers = crc_check_workers_;
+    linear_iterator_.reset();
+    linear_view_.reset();
+    chunked_reader_ = std::make_unique<rosbag2_storage_mcap::internal::ChunkedMessageReader>(
+      *data_source_, summary_->chunk_indexes, std::move(chunk_options));
+    return;
+  }
+
+  chunked_reader_.reset();
+  linear_view_ =
+    std::make_unique<mcap::LinearMessageView>(mcap_reader_->readMessages(OnProblem, options));
+  linear_iterator_ = std::make_unique<mcap::LinearMessageView::Iterator>(linear_view_->begin());
+}
+
+std::function<bool(std::string_view)> MCAPStorage::make_topic_filter() const
+{
+  std::function<bool(std::string_view)> topic_filter;
   if (!storage_filter_.topics.empty()) {
-    options.topicFilter = [this](std::string_view topic) {
+    topic_filter = [this](std::string_view topic) {
       for (const auto & match_topic : storage_filter_.topics) {
         if (match_topic == topic) {
           return true;
@@ -481,7 +1020,7 @@ void MCAPStorage::reset_iterator(rcutils_time_point_value_t start_time)
   }
 #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_FILTER_TOPIC_REGEX
   if (!storage_filter_.topics_regex.empty()) {
-    options.topicFilter = [this](std::string_view topic) {
+    topic_filter = [this](std::string_view topic) {
       std::smatch m;
       std::string topic_string(topic);
       std::regex re(storage_filter_.topics_regex);
@@ -489,33 +1028,178 @@ void MCAPStorage::reset_iterator(rcutils_time_point_value_t start_time)
     };
   }
 #endif
-  linear_view_ =
-    std::make_unique<mcap::LinearMessageView>(mcap_reader_->readMessages(OnProblem, options));
-  linear_iterator_ = std::make_unique<mcap::LinearMessageView::Iterator>(linear_view_->begin());
+  return topic_filter;
 }
 
-void MCAPStorage::ensure_summary_read()
+void MCAPStorage::plan_reads(mcap::Timestamp start_time,
+                             const std::function<bool(mcap::ChannelId)> & channel_filter,
+                             const rosbag2_storage_mcap::internal::MessageSelection * selection)
 {
-  if (!has_read_summary_) {
-    const auto status = mcap_reader_->readSummary(mcap::ReadSummaryMethod::AllowFallbackScan);
+  // Tell the data source which chunks the next reads will need, so nearby chunks are fetched
+  // together in large sequential reads instead of one seek per chunk.
+  std::vector<rosbag2_storage_mcap::internal::ByteRange> ranges;
+  for (const auto & chunk_index : summary_->chunk_indexes) {
+    if (selection && selection->find(chunk_index.chunkStartOffset) == selection->end()) {
+      continue;
+    }
+    if (rosbag2_storage_mcap::internal::chunk_may_match(chunk_index, start_time, mcap::MaxTime,
+                                                        channel_filter)) {
+      ranges.push_back({chunk_index.chunkStartOffset, chunk_index.chunkLength});
+    }
+  }
+  data_source_->set_plan(std::move(ranges));
+}
 
+void MCAPStorage::read_mcap_summary()
+{
+  const auto status = mcap_reader_->readSummary(mcap::ReadSummaryMethod::AllowFallbackScan);
+  if (!status.ok()) {
+    throw std::runtime_error(status.message);
+  }
+  mcap_reader_has_summary_ = true;
+}
+
+mcap::Statistics MCAPStorage::derive_statistics(
+  const rosbag2_storage_mcap::internal::ParsedSummary & summary)
+{
+  // Files written without a Statistics record (noStatistics) are summarized from their indexes,
+  // reading the indexes of several chunks in parallel.
+  mcap::Statistics statistics;
+  if (!summary.chunk_indexes.empty()) {
+    const size_t thread_count =
+      std::min<size_t>(MAX_STATISTICS_THREADS, std::max(1u, std::thread::hardware_concurrency()));
+    const auto status = rosbag2_storage_mcap::internal::derive_statistics(
+      summary.chunk_indexes, thread_count,
+      [this]() -> std::unique_ptr<mcap::IReadable> {
+        auto data_source = std::make_unique<rosbag2_storage_mcap::internal::PlannedFileReader>(
+          rosbag2_storage_mcap::internal::PlannedFileReader::Options{});
+        if (!data_source->open(relative_path_).ok()) {
+          return nullptr;
+        }
+        return data_source;
+      },
+      &statistics);
     if (!status.ok()) {
       throw std::runtime_error(status.message);
     }
-    // check if message indexes are present, if not, read in file order.
-    bool message_indexes_found = false;
-    for (const auto & ci : mcap_reader_->chunkIndexes()) {
-      if (ci.messageIndexLength > 0) {
-        message_indexes_found = true;
-        break;
+  } else {
+    // Without chunks there is no index to use; count the messages.
+    mcap::ReadMessageOptions options;
+    options.readOrder = mcap::ReadMessageOptions::ReadOrder::FileOrder;
+    statistics.messageStartTime = std::numeric_limits<mcap::Timestamp>::max();
+    for (const auto & message_view : mcap_reader_->readMessages(OnProblem, options)) {
+      const auto & message = message_view.message;
+      statistics.messageCount++;
+      statistics.channelMessageCounts[message.channelId]++;
+      statistics.messageStartTime = std::min(statistics.messageStartTime, message.logTime);
+      statistics.messageEndTime = std::max(statistics.messageEndTime, message.logTime);
+    }
+    if (statistics.messageCount == 0) {
+      statistics.messageStartTime = 0;
+    }
+  }
+  statistics.schemaCount = uint16_t(summary.schemas.size());
+  statistics.channelCount = uint32_t(summary.channels.size());
+  return statistics;
+}
+
+void MCAPStorage::ensure_summary_read()
+{
+  if (summary_) {
+    return;
+  }
+  // Summaries are shared by every reader of the same unmodified file in this process, so opening
+  // a file again (e.g. rosbag2 info followed by play, or one reader per topic) does not parse it
+  // again.
+  if (rosbag2_storage_mcap::internal::is_http_url(relative_path_)) {
+    // A remote file is identified by its URL, size and ETag or Last-Modified time. Without
+    // either, a file replaced by one of the same size could not be told apart, so it is not
+    // shared with other readers.
+    file_identity_ = {relative_path_, data_source_->size(), 0, data_source_->version()};
+    if (file_identity_.version.empty()) {
+      static std::atomic<uint64_t> unversioned_reader_count{0};
+      file_identity_.version = "unversioned " + std::to_string(++unversioned_reader_count);
+    }
+  } else {
+    file_identity_ = rosbag2_storage_mcap::internal::FileIdentity::of(relative_path_);
+  }
+  summary_ = rosbag2_storage_mcap::internal::SummaryCache::instance().get_or_load(
+    file_identity_, [this]() {
+      read_mcap_summary();
+      auto summary = rosbag2_storage_mcap::internal::ParsedSummary::from_reader(*mcap_reader_);
+      if (!summary->statistics) {
+        summary->statistics = derive_statistics(*summary);
       }
+      return std::shared_ptr<const rosbag2_storage_mcap::internal::ParsedSummary>(
+        std::move(summary));
+    });
+  // Files without chunks are read through mcap::LinearMessageView, which needs the summary
+  // loaded into our own reader.
+  if (summary_->chunk_indexes.empty() && !mcap_reader_has_summary_) {
+    read_mcap_summary();
+  }
+
+  // check if message indexes are present, if not, read in file order. The bag file of a striped
+  // recording has no messages; its members are checked when they are opened.
+  const bool is_file_set = summary_->metadata_indexes.count(
+                             rosbag2_storage_mcap::internal::FileSetManifest::METADATA_NAME) > 0;
+  if (!summary_->has_message_indexes && !is_file_set) {
+    RCUTILS_LOG_WARN_NAMED(LOG_NAME,
+                           "no message indices found, falling back to reading in file order");
+    read_order_ = mcap::ReadMessageOptions::ReadOrder::FileOrder;
+  }
+
+  for (const auto & [channel_id, channel] : summary_->channels) {
+    const auto shuffle_it =
+      channel->metadata.find(rosbag2_storage_mcap::internal::BYTE_SHUFFLE_METADATA);
+    if (shuffle_it == channel->metadata.end()) {
+      continue;
     }
-    if (!message_indexes_found) {
-      RCUTILS_LOG_WARN_NAMED(LOG_NAME,
-                             "no message indices found, falling back to reading in file order");
-      read_order_ = mcap::ReadMessageOptions::ReadOrder::FileOrder;
+    const auto element_size = std::strtoul(shuffle_it->second.c_str(), nullptr, 10);
+    if (element_size == 0 ||
+        element_size > rosbag2_storage_mcap::internal::MAX_SHUFFLE_ELEMENT_SIZE) {
+      throw std::runtime_error("invalid byte shuffle element size \"" + shuffle_it->second +
+                               "\" on topic " + channel->topic);
+    }
+    shuffled_channels_.emplace(channel_id, uint32_t(element_size));
+  }
+  for (const auto & [channel_id, channel] : summary_->channels) {
+    const auto codec_it =
+      channel->metadata.find(rosbag2_storage_mcap::PayloadCodecRegistry::METADATA_KEY);
+    if (codec_it == channel->metadata.end()) {
+      continue;
+    }
+    auto codec = rosbag2_storage_mcap::PayloadCodecRegistry::instance().find(codec_it->second);
+    if (!codec) {
+      throw std::runtime_error("payload codec " + codec_it->second + " of topic " +
+                               channel->topic + " is not registered");
+    }
+    channel_codecs_.emplace(channel_id, std::move(codec));
+  }
+
+  // Messages on the reference channel of a deduplicated topic are read as the payload they refer
+  // to on the channel of the topic.
+  std::vector<std::pair<mcap::ChannelId, const std::string *>> reference_channels;
+  for (const auto & [channel_id, channel] : summary_->channels) {
+    if (channel->messageEncoding == rosbag2_storage_mcap::internal::PAYLOAD_REFERENCE_ENCODING) {
+      reference_channels.emplace_back(channel_id, &channel->topic);
+    }
+  }
+  if (reference_channels.empty()) {
+    return;
+  }
+  std::unordered_map<std::string_view, mcap::ChannelId> topic_channels;
+  for (const auto & [channel_id, channel] : summary_->channels) {
+    if (channel->messageEncoding != rosbag2_storage_mcap::internal::PAYLOAD_REFERENCE_ENCODING) {
+      topic_channels.emplace(channel->topic, channel_id);
+    }
+  }
+  for (const auto & [channel_id, topic] : reference_channels) {
+    const auto topic_it = topic_channels.find(*topic);
+    if (topic_it != topic_channels.end()) {
+      reference_channels_.emplace(channel_id, topic_it->second);
+      last_payloads_[topic_it->second];
     }
-    has_read_summary_ = true;
   }
 }
 
@@ -542,6 +1226,16 @@ void MCAPStorage::set_read_order(const rosbag2_storage::ReadOrder & read_order)
       throw std::runtime_error("PublishedTimestamp read order not yet implemented in ROS 2");
       break;
   }
+  if (!file_set_members_.empty()) {
+    for (auto & member : file_set_members_) {
+      member->set_read_order(read_order);
+    }
+    if (next_read_order != read_order_) {
+      read_order_ = next_read_order;
+      next_.reset();
+    }
+    return;
+  }
   if (next_read_order != read_order_) {
     read_order_ = next_read_order;
     reset_iterator();
@@ -551,7 +1245,7 @@ void MCAPStorage::set_read_order(const rosbag2_storage::ReadOrder & read_order)
 
 bool MCAPStorage::has_next()
 {
-  if (!linear_iterator_) {
+  if (!linear_iterator_ && !chunked_reader_ && file_set_members_.empty()) {
     return false;
   }
   // Have already verified next message and enqueued it for use.
@@ -575,8 +1269,9 @@ std::vector<rosbag2_storage::TopicMetadata> MCAPStorage::get_all_topics_and_type
 {
   auto metadata = get_metadata();
   std::vector<rosbag2_storage::TopicMetadata> out;
-  for (const auto & topic : metadata.topics_with_message_count) {
-    out.push_back(topic.topic_metadata);
+  out.reserve(metadata.topics_with_message_count.size());
+  for (auto & topic : metadata.topics_with_message_count) {
+    out.push_back(std::move(topic.topic_metadata));
   }
   return out;
 }
@@ -608,19 +1303,13 @@ uint64_t MCAPStorage::get_minimum_split_file_size() const
 void MCAPStorage::write(std::shared_ptr<const rosbag2_storage::SerializedBagMessage> msg)
 {
   const auto topic_it = topics_.find(msg->topic_name);
-  if (topic_it == topics_.end()) {
+  if (topic_it == topics_.end() || topic_it->second.removed) {
     throw std::runtime_error{"Unknown message topic \"" + msg->topic_name + "\""};
   }
-
-  // Get Channel reference
-  const auto channel_it = channel_ids_.find(msg->topic_name);
-  if (channel_it == channel_ids_.end()) {
-    // This should never happen since we adding channel on topic creation
-    throw std::runtime_error{"Channel reference not found for topic: \"" + msg->topic_name + "\""};
-  }
+  WriterTopic & topic = topic_it->second;
 
   mcap::Message mcap_msg;
-  mcap_msg.channelId = channel_it->second;
+  mcap_msg.channelId = topic.channel_id;
   mcap_msg.sequence = 0;
   if (msg->time_stamp < 0) {
     RCUTILS_LOG_WARN_NAMED(LOG_NAME, "Invalid message timestamp %ld", msg->time_stamp);
@@ -629,16 +1318,73 @@ void MCAPStorage::write(std::shared_ptr<const rosbag2_storage::SerializedBagMess
   mcap_msg.publishTime = mcap_msg.logTime;
   mcap_msg.dataSize = msg->serialized_data->buffer_length;
   mcap_msg.data = reinterpret_cast<const std::byte *>(msg->serialized_data->buffer);
-  const auto status = mcap_writer_->write(mcap_msg);
+  std::shared_ptr<const void> data_owner = msg;
+  if (topic.reference_channel_id != 0) {
+    if (const auto reference = payload_deduplicator_.add(msg->topic_name, mcap_msg)) {
+      auto reference_data = std::make_shared<
+        const std::array<std::byte, rosbag2_storage_mcap::internal::PAYLOAD_REFERENCE_SIZE>>(
+        reference->encode());
+      mcap_msg.channelId = topic.reference_channel_id;
+      mcap_msg.data = reference_data->data();
+      mcap_msg.dataSize = reference_data->size();
+      data_owner = std::move(reference_data);
+    }
+  }
+  // The writer copies the message before write() returns, so the buffers of the transformed
+  // payload are reused, unless the message is queued for a file set.
+  auto output_buffer = [this](std::shared_ptr<std::vector<std::byte>> & buffer)
+    -> std::vector<std::byte> & {
+    if (!buffer || file_set_writer_) {
+      buffer = std::make_shared<std::vector<std::byte>>();
+    }
+    return *buffer;
+  };
+  if (topic.codec && mcap_msg.channelId == topic.channel_id) {
+    auto & encoded = output_buffer(encode_buffer_);
+    encoded.clear();
+    if (!topic.codec->encode(mcap_msg.data, mcap_msg.dataSize, encoded)) {
+      throw std::runtime_error{"Failed to encode message on topic \"" + msg->topic_name + "\""};
+    }
+    mcap_msg.data = encoded.data();
+    mcap_msg.dataSize = encoded.size();
+    data_owner = encode_buffer_;
+  }
+  if (topic.shuffle_element_size != 0 && mcap_msg.channelId == topic.channel_id) {
+    auto & shuffled = output_buffer(shuffle_buffer_);
+    shuffled.resize(mcap_msg.dataSize);
+    rosbag2_storage_mcap::internal::byte_shuffle(mcap_msg.data, mcap_msg.dataSize,
+                                                 topic.shuffle_element_size, shuffled.data());
+    mcap_msg.data = shuffled.data();
+    data_owner = shuffle_buffer_;
+  }
+  const bool own_chunk =
+    large_message_threshold_ > 0 && mcap_msg.dataSize >= large_message_threshold_;
+  mcap::Status status;
+  if (file_set_writer_) {
+    const size_t file =
+      shard_topic_counts_.empty() ? select_stripe(mcap_msg.dataSize) : topic.file;
+    status = file_set_writer_->write(file, mcap_msg, data_owner, own_chunk);
+  } else if (own_chunk) {
+    // Not copied into a chunk buffer, nor compressed unless forceCompression is set.
+    status = spilling_writer_->write_chunk(mcap_msg);
+  } else {
+    status = mcap_writer_->write(mcap_msg);
+  }
   if (!status.ok()) {
     throw std::runtime_error{std::string{"Failed to write "} +
                              std::to_string(msg->serialized_data->buffer_length) +
                              " byte message to MCAP file: " + status.message};
   }
 
+  if (activity_histogram_) {
+    // The traffic of the topic, before deduplication, payload codecs and byte shuffling.
+    activity_histogram_->add(msg->topic_name, mcap_msg.logTime,
+                             msg->serialized_data->buffer_length);
+  }
+
   /// Update metadata
   // Increment individual topic message count
-  topic_it->second.message_count++;
+  topic.message_count++;
   // Increment global message count
   metadata_.message_count++;
   // Determine recording duration
@@ -646,6 +1392,44 @@ void MCAPStorage::write(std::shared_ptr<const rosbag2_storage::SerializedBagMess
   metadata_.duration = std::max(metadata_.duration, message_time - metadata_.starting_time);
 }
 
+size_t MCAPStorage::select_stripe(uint64_t message_size)
+{
+  // Each stripe receives a chunk worth of messages at a time, so that stripes are written in
+  // whole chunks and a chunk never mixes messages from far apart in time.
+  if (current_stripe_bytes_ >= stripe_size_) {
+    current_stripe_bytes_ = 0;
+    if (stripe_assignment_ == rosbag2_storage_mcap::internal::FileAssignment::LeastLoaded) {
+      current_stripe_ = file_set_writer_->least_loaded();
+    } else {
+      current_stripe_ = (current_stripe_ + 1) % file_set_writer_->file_count();
+    }
+  }
+  current_stripe_bytes_ += message_size;
+  return current_stripe_;
+}
+
+size_t MCAPStorage::select_shard(const std::string & topic)
+{
+  const auto pattern_it =
+    std::find_if(shard_patterns_.begin(), shard_patterns_.end(),
+                 [&](const std::regex & pattern) { return std::regex_match(topic, pattern); });
+  size_t shard = 0;
+  if (pattern_it != shard_patterns_.end()) {
+    shard = size_t(pattern_it - shard_patterns_.begin());
+  } else {
+    // Other topics go to the smallest file so far, or the one with the fewest topics, which
+    // spreads them evenly when they are all created before the first message is written.
+    for (size_t i = 1; i < shard_topic_counts_.size(); ++i) {
+      if (std::make_pair(file_set_writer_->file_size(i), shard_topic_counts_[i]) <
+          std::make_pair(file_set_writer_->file_size(shard), shard_topic_counts_[shard])) {
+        shard = i;
+      }
+    }
+  }
+  shard_topic_counts_[shard]++;
+  return shard;
+}
+
 void MCAPStorage::write(
   const std::vector<std::shared_ptr<const rosbag2_storage::SerializedBagMessage>> & msgs)
 {
@@ -656,17 +1440,41 @@ void MCAPStorage::write(
 
 void MCAPStorage::create_topic(const rosbag2_storage::TopicMetadata & topic)
 {
-  auto topic_info = rosbag2_storage::TopicInformation{topic, 0};
-  const auto topic_it = topics_.find(topic.name);
-  if (topic_it == topics_.end()) {
-    topics_.emplace(topic.name, topic_info);
-  } else {
-    RCUTILS_LOG_WARN_NAMED(LOG_NAME, "Topic with name: %s already exist!", topic.name.c_str());
-    return;
+  if (take_previous_split_) {
+    // rosbag2 only creates the topics of a new split file once the previous one is closed.
+    take_previous_split_ = false;
+    const auto previous =
+      rosbag2_storage_mcap::internal::SplitHandoff::instance().take(relative_path_);
+    if (previous) {
+      restore_topics(previous->schemas, previous->channels);
+    }
+  }
+  const auto [topic_it, inserted] = topics_.try_emplace(topic.name);
+  WriterTopic & writer_topic = topic_it->second;
+  if (!inserted) {
+    if (!writer_topic.removed) {
+      RCUTILS_LOG_WARN_NAMED(LOG_NAME, "Topic with name: %s already exist!", topic.name.c_str());
+      return;
+    }
+    // A topic created again after being removed, or a restored topic created with the same type,
+    // serialization format and QoS profiles, keeps its channel.
+    const auto restored_it = restored_types_.find(topic.name);
+    if (restored_it == restored_types_.end() ||
+        restored_it->second ==
+          std::make_tuple(topic.type, topic.serialization_format, topic.offered_qos_profiles)) {
+      writer_topic.removed = false;
+      writer_topic.message_count = 0;
+      return;
+    }
+    restored_types_.erase(restored_it);
+    writer_topic = WriterTopic{};
+  }
+  if (!shard_topic_counts_.empty()) {
+    writer_topic.file = select_shard(topic.name);
   }
 
   // Create Schema for topic if it doesn't exist yet
-  const auto & datatype = topic_info.topic_metadata.type;
+  const auto & datatype = topic.type;
   const auto schema_it = schema_ids_.find(datatype);
   mcap::SchemaId schema_id;
   if (schema_it == schema_ids_.end()) {
@@ -686,30 +1494,130 @@ void MCAPStorage::create_topic(const rosbag2_storage::TopicMetadata & topic)
                               datatype.c_str(), err.what());
       schema.encoding = "";
     }
-    mcap_writer_->addSchema(schema);
+    if (file_set_writer_) {
+      file_set_writer_->add_schema(schema);
+    } else {
+      mcap_writer_->addSchema(schema);
+    }
     schema_ids_.emplace(datatype, schema.id);
     schema_id = schema.id;
+    if (file_topics_) {
+      file_topics_->schemas.push_back(std::make_shared<mcap::Schema>(std::move(schema)));
+    }
   } else {
     schema_id = schema_it->second;
   }
 
-  // Create Channel for topic if it doesn't exist yet
-  const auto channel_it = channel_ids_.find(topic.name);
-  if (channel_it == channel_ids_.end()) {
-    mcap::Channel channel;
-    channel.topic = topic.name;
-    channel.messageEncoding = topic_info.topic_metadata.serialization_format;
-    channel.schemaId = schema_id;
-    channel.metadata.emplace("offered_qos_profiles",
-                             topic_info.topic_metadata.offered_qos_profiles);
+  auto add_channel = [&](mcap::Channel & channel) {
+    if (!shard_topic_counts_.empty()) {
+      // Each topic is only in its own shard.
+      file_set_writer_->add_channel(writer_topic.file, channel);
+    } else if (file_set_writer_) {
+      file_set_writer_->add_channel(channel);
+    } else {
+      mcap_writer_->addChannel(channel);
+    }
+    if (file_topics_) {
+      file_topics_->channels.push_back(std::make_shared<mcap::Channel>(channel));
+    }
+  };
+
+  mcap::Channel channel;
+  channel.topic = topic.name;
+  channel.messageEncoding = topic.serialization_format;
+  channel.schemaId = schema_id;
+  channel.metadata.emplace("offered_qos_profiles", topic.offered_qos_profiles);
+  const auto shuffle_it = byte_shuffle_types_.find(datatype);
+  if (shuffle_it != byte_shuffle_types_.end()) {
+    channel.metadata.emplace(rosbag2_storage_mcap::internal::BYTE_SHUFFLE_METADATA,
+                             std::to_string(shuffle_it->second));
+    writer_topic.shuffle_element_size = shuffle_it->second;
+  }
+  const auto codec_it = schema_codecs_.find(datatype);
+  if (codec_it != schema_codecs_.end()) {
+    channel.metadata.emplace(rosbag2_storage_mcap::PayloadCodecRegistry::METADATA_KEY,
+                             codec_it->second.first);
+    writer_topic.codec = codec_it->second.second;
+  }
+  add_channel(channel);
+  writer_topic.channel_id = channel.id;
+
+  // Repeated payloads of deduplicated topics are written to a channel of their own.
+  const auto matches_topic = [&](const std::regex & pattern) {
+    return std::regex_match(topic.name, pattern);
+  };
+  if (std::any_of(dedup_patterns_.begin(), dedup_patterns_.end(), matches_topic)) {
+    mcap::Channel reference_channel;
+    reference_channel.topic = topic.name;
+    reference_channel.messageEncoding = rosbag2_storage_mcap::internal::PAYLOAD_REFERENCE_ENCODING;
+    reference_channel.schemaId = 0;
+    add_channel(reference_channel);
+    writer_topic.reference_channel_id = reference_channel.id;
+  }
+}
+
+void MCAPStorage::restore_topics(const std::vector<mcap::SchemaPtr> & schemas,
+                                 const std::vector<mcap::ChannelPtr> & channels)
+{
+  // The MCAP writer numbers schemas and channels in the order they are added, so adding those of
+  // the file first gives them back their ids.
+  std::unordered_map<mcap::SchemaId, std::string> schema_names;
+  for (const auto & restored_schema : schemas) {
+    mcap::Schema schema = *restored_schema;
+    mcap_writer_->addSchema(schema);
+    if (schema.id != restored_schema->id) {
+      throw std::runtime_error("could not restore schema " + schema.name);
+    }
+    schema_ids_.emplace(schema.name, schema.id);
+    schema_names.emplace(schema.id, schema.name);
+    if (file_topics_) {
+      file_topics_->schemas.push_back(restored_schema);
+    }
+  }
+  for (const auto & restored_channel : channels) {
+    mcap::Channel channel = *restored_channel;
     mcap_writer_->addChannel(channel);
-    channel_ids_.emplace(topic.name, channel.id);
+    if (channel.id != restored_channel->id) {
+      throw std::runtime_error("could not restore the channel of topic " + channel.topic);
+    }
+    if (file_topics_) {
+      file_topics_->channels.push_back(restored_channel);
+    }
+    // Restored topics wait to be created, like removed topics.
+    WriterTopic & topic = topics_[channel.topic];
+    topic.removed = true;
+    if (channel.messageEncoding == rosbag2_storage_mcap::internal::PAYLOAD_REFERENCE_ENCODING) {
+      topic.reference_channel_id = channel.id;
+      continue;
+    }
+    topic.channel_id = channel.id;
+    const auto qos_it = channel.metadata.find("offered_qos_profiles");
+    restored_types_[channel.topic] = {
+      schema_names[channel.schemaId], channel.messageEncoding,
+      qos_it != channel.metadata.end() ? qos_it->second : std::string()};
+    const auto shuffle_it =
+      channel.metadata.find(rosbag2_storage_mcap::internal::BYTE_SHUFFLE_METADATA);
+    if (shuffle_it != channel.metadata.end()) {
+      topic.shuffle_element_size = uint32_t(std::strtoul(shuffle_it->second.c_str(), nullptr, 10));
+    }
+    const auto codec_it =
+      channel.metadata.find(rosbag2_storage_mcap::PayloadCodecRegistry::METADATA_KEY);
+    if (codec_it != channel.metadata.end()) {
+      topic.codec = rosbag2_storage_mcap::PayloadCodecRegistry::instance().find(codec_it->second);
+      if (!topic.codec) {
+        throw std::runtime_error("payload codec " + codec_it->second + " of topic " +
+                                 channel.topic + " is not registered");
+      }
+    }
   }
 }
 
 void MCAPStorage::remove_topic(const rosbag2_storage::TopicMetadata & topic)
 {
-  topics_.erase(topic.name);
+  const auto topic_it = topics_.find(topic.name);
+  if (topic_it != topics_.end()) {
+    topic_it->second.removed = true;
+  }
 }
 
 #ifdef ROSBAG2_STORAGE_MCAP_HAS_UPDATE_METADATA
@@ -723,6 +1631,470 @@ void MCAPStorage::update_metadata(const rosbag2_storage::BagMetadata & bag_metad
 }
 #endif
 
+/** Index queries **/
+mcap::IReadable & MCAPStorage::index_source()
+{
+  if (opened_as_ != rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY) {
+    throw std::runtime_error("index queries require a file opened for reading");
+  }
+  ensure_summary_read();
+  if (!index_source_) {
+    auto index_source = std::make_unique<rosbag2_storage_mcap::internal::PlannedFileReader>(
+      rosbag2_storage_mcap::internal::PlannedFileReader::Options{});
+    const auto status = index_source->open(relative_path_);
+    if (!status.ok()) {
+      throw std::runtime_error(status.message);
+    }
+    index_source_ = std::move(index_source);
+  }
+  return *index_source_;
+}
+
+std::vector<std::shared_ptr<const rosbag2_storage_mcap::internal::MessageTimeline>>
+MCAPStorage::load_timelines(const std::string & topic)
+{
+  auto & data_source = index_source();
+  if (!summary_->has_message_indexes) {
+    throw std::runtime_error("index queries require an MCAP file with message indexes");
+  }
+  std::vector<std::shared_ptr<const rosbag2_storage_mcap::internal::MessageTimeline>> timelines;
+  for (const auto & [channel_id, channel] : summary_->channels) {
+    if (channel->topic != topic) {
+      continue;
+    }
+    auto & timeline = timelines_[channel_id];
+    if (!timeline) {
+      auto loaded = std::make_shared<rosbag2_storage_mcap::internal::MessageTimeline>();
+      const auto status = rosbag2_storage_mcap::internal::MessageTimeline::load(
+        data_source, summary_->chunk_indexes, channel_id, loaded.get());
+      if (!status.ok()) {
+        throw std::runtime_error(status.message);
+      }
+      timeline = std::move(loaded);
+    }
+    timelines.push_back(timeline);
+  }
+  return timelines;
+}
+
+MCAPStorage::IndexedTopicStats MCAPStorage::get_indexed_topic_stats(
+  const std::string & topic, rcutils_time_point_value_t start_time,
+  rcutils_time_point_value_t end_time)
+{
+  IndexedTopicStats stats;
+  if (end_time < 0 || end_time < start_time) {
+    return stats;
+  }
+  if (!file_set_members_.empty()) {
+    for (auto & member : file_set_members_) {
+      const auto member_stats = member->get_indexed_topic_stats(topic, start_time, end_time);
+      if (member_stats.message_count == 0) {
+        continue;
+      }
+      if (stats.message_count == 0 || member_stats.first_time < stats.first_time) {
+        stats.first_time = member_stats.first_time;
+      }
+      if (stats.message_count == 0 || member_stats.last_time > stats.last_time) {
+        stats.last_time = member_stats.last_time;
+      }
+      stats.message_count += member_stats.message_count;
+    }
+    return stats;
+  }
+  const auto start = mcap::Timestamp(std::max<rcutils_time_point_value_t>(start_time, 0));
+  const auto end = mcap::Timestamp(end_time);
+  std::optional<mcap::Timestamp> first;
+  std::optional<mcap::Timestamp> last;
+  for (const auto & timeline : load_timelines(topic)) {
+    stats.message_count += timeline->count(start, end);
+    const auto timeline_first = timeline->first(start, end);
+    if (timeline_first && (!first || *timeline_first < *first)) {
+      first = timeline_first;
+    }
+    const auto timeline_last = timeline->last(start, end);
+    if (timeline_last && (!last || *timeline_last > *last)) {
+      last = timeline_last;
+    }
+  }
+  stats.first_time = rcutils_time_point_value_t(first.value_or(0));
+  stats.last_time = rcutils_time_point_value_t(last.value_or(0));
+  return stats;
+}
+
+std::vector<uint64_t> MCAPStorage::get_indexed_message_histogram(
+  const std::string & topic, rcutils_time_point_value_t start_time,
+  rcutils_time_point_value_t end_time, rcutils_duration_value_t bucket_duration)
+{
+  if (bucket_duration <= 0) {
+    throw std::invalid_argument("histogram bucket duration must be positive");
+  }
+  start_time = std::max<rcutils_time_point_value_t>(start_time, 0);
+  if (end_time < start_time) {
+    return {};
+  }
+  const auto bucket_count = uint64_t(end_time - start_time) / uint64_t(bucket_duration) + 1;
+  std::vector<uint64_t> buckets(bucket_count, 0);
+  if (!file_set_members_.empty()) {
+    for (auto & member : file_set_members_) {
+      const auto member_buckets =
+        member->get_indexed_message_histogram(topic, start_time, end_time, bucket_duration);
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        buckets[i] += member_buckets[i];
+      }
+    }
+    return buckets;
+  }
+  for (const auto & timeline : load_timelines(topic)) {
+    timeline->add_to_histogram(mcap::Timestamp(start_time), mcap::Timestamp(end_time),
+                               mcap::Timestamp(bucket_duration), &buckets);
+  }
+  return buckets;
+}
+
+rosbag2_storage_mcap::internal::ChunkRecords MCAPStorage::load_indexed_chunk(
+  const mcap::ChunkIndex & chunk_index)
+{
+  if (last_indexed_chunk_.second && last_indexed_chunk_.first == chunk_index.chunkStartOffset) {
+    return last_indexed_chunk_.second;
+  }
+  auto & data_source = index_source();
+  // Chunks read through the indexes are checked inline whenever reads check CRCs at all.
+  const bool check_crc =
+    read_options_.chunkCrcCheck != rosbag2_storage_mcap::internal::ChunkCrcCheck::Skip;
+  auto read_and_decompress = [&](mcap::ByteArray * records) {
+    uint32_t crc = 0;
+    auto status = rosbag2_storage_mcap::internal::read_chunk_records(data_source, chunk_index,
+                                                                     records, nullptr, &crc);
+    if (status.ok() && check_crc) {
+      status = rosbag2_storage_mcap::internal::check_chunk_crc(chunk_index, *records, crc);
+    }
+    return status;
+  };
+  rosbag2_storage_mcap::internal::ChunkCache::Verifier verify;
+  if (check_crc) {
+    verify = [&](const mcap::ByteArray & records) {
+      uint32_t crc = 0;
+      auto status = rosbag2_storage_mcap::internal::read_chunk_crc(data_source, chunk_index, &crc);
+      if (!status.ok()) {
+        return status;
+      }
+      return rosbag2_storage_mcap::internal::check_chunk_crc(chunk_index, records, crc);
+    };
+  }
+  rosbag2_storage_mcap::internal::ChunkRecords records;
+  mcap::Status status;
+  if (read_options_.sharedChunkCacheSize > 0) {
+    auto & cache = rosbag2_storage_mcap::internal::ChunkCache::instance();
+    cache.reserve(read_options_.sharedChunkCacheSize);
+    status = cache.get_or_load({file_identity_, chunk_index.chunkStartOffset},
+                               read_and_decompress, &records, verify);
+  } else {
+    auto owned = std::make_shared<mcap::ByteArray>();
+    status = read_and_decompress(owned.get());
+    records = std::move(owned);
+  }
+  if (!status.ok()) {
+    throw std::runtime_error(status.message);
+  }
+  last_indexed_chunk_ = {chunk_index.chunkStartOffset, records};
+  return records;
+}
+
+std::vector<std::shared_ptr<rosbag2_storage::SerializedBagMessage>>
+MCAPStorage::read_messages_by_ordinal(const std::string & topic, uint64_t first, uint64_t count)
+{
+  if (!file_set_members_.empty()) {
+    MCAPStorage * topic_member = nullptr;
+    for (auto & member : file_set_members_) {
+      const auto & channels = member->summary_->channels;
+      if (std::any_of(channels.begin(), channels.end(),
+                      [&](const auto & entry) { return entry.second->topic == topic; })) {
+        if (topic_member) {
+          throw std::runtime_error("reading messages by ordinal requires the topic to be in a "
+                                   "single file, but " +
+                                   topic + " is striped over several");
+        }
+        topic_member = member.get();
+      }
+    }
+    if (!topic_member) {
+      return {};
+    }
+    return topic_member->read_messages_by_ordinal(topic, first, count);
+  }
+  auto & data_source = index_source();
+  if (!summary_->has_message_indexes) {
+    throw std::runtime_error("index queries require an MCAP file with message indexes");
+  }
+  auto & index = ordinal_indexes_[topic];
+  if (!index) {
+    std::vector<mcap::ChannelId> channel_ids;
+    for (const auto & [channel_id, channel] : summary_->channels) {
+      if (channel->topic == topic) {
+        channel_ids.push_back(channel_id);
+      }
+    }
+    auto loaded = std::make_shared<rosbag2_storage_mcap::internal::MessageOrdinalIndex>();
+    const auto status = rosbag2_storage_mcap::internal::MessageOrdinalIndex::load(
+      data_source, summary_->chunk_indexes, channel_ids, loaded.get());
+    if (!status.ok()) {
+      throw std::runtime_error(status.message);
+    }
+    index = std::move(loaded);
+  }
+
+  std::vector<std::shared_ptr<rosbag2_storage::SerializedBagMessage>> messages;
+  const uint64_t end = std::min(index->size(), first + std::min(count, index->size()));
+  std::vector<uint64_t> offsets;
+  for (uint64_t ordinal = first; ordinal < end;) {
+    const auto & chunk = index->find(ordinal);
+    auto status = index->read_message_offsets(data_source, chunk, &offsets);
+    if (!status.ok()) {
+      throw std::runtime_error(status.message);
+    }
+    const auto records = load_indexed_chunk(*chunk.chunk);
+    const uint64_t chunk_end = std::min(end, chunk.first_ordinal + chunk.count);
+    for (; ordinal < chunk_end; ++ordinal) {
+      mcap::OpCode opcode;
+      uint64_t length = 0;
+      mcap::Message message;
+      if (!rosbag2_storage_mcap::internal::parse_chunk_record(
+            *records, offsets[ordinal - chunk.first_ordinal], &opcode, &length, &message) ||
+          opcode != mcap::OpCode::Message) {
+        throw std::runtime_error("invalid message index entry in chunk at offset " +
+                                 std::to_string(chunk.chunk->chunkStartOffset));
+      }
+      auto msg = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+      msg->time_stamp = rcutils_time_point_value_t(message.logTime);
+      msg->topic_name = topic;
+      msg->serialized_data = read_payload(message);
+      messages.push_back(std::move(msg));
+    }
+  }
+  return messages;
+}
+
+// Merge the histogram records of a file into one, in file order. Files appended to by earlier
+// versions hold one record per appended part, which only counts the messages of that part.
+static std::optional<rosbag2_storage_mcap::ActivityHistogram> merge_activity_histograms(
+  const std::vector<mcap::Metadata> & records)
+{
+  std::optional<rosbag2_storage_mcap::ActivityHistogram> merged;
+  for (const auto & record : records) {
+    auto histogram = rosbag2_storage_mcap::ActivityHistogram::from_metadata(record);
+    if (!histogram) {
+      continue;
+    }
+    if (!merged) {
+      merged = std::move(histogram);
+    } else if (!merged->merge(*histogram)) {
+      RCUTILS_LOG_WARN_NAMED(LOG_NAME,
+                             "ignoring an activity histogram whose bucket duration differs from "
+                             "that of the first");
+    }
+  }
+  return merged;
+}
+
+void MCAPStorage::continue_activity_histogram(const std::vector<mcap::Metadata> & records)
+{
+  // Kept in the bucket duration of the file even if another is configured, or none.
+  activity_histogram_ = merge_activity_histograms(records);
+}
+
+std::optional<rosbag2_storage_mcap::ActivityHistogram> MCAPStorage::get_activity_histogram()
+{
+  auto & data_source = index_source();
+  std::vector<const mcap::MetadataIndex *> indexes;
+  const auto range =
+    summary_->metadata_indexes.equal_range(rosbag2_storage_mcap::ActivityHistogram::METADATA_NAME);
+  for (auto it = range.first; it != range.second; ++it) {
+    indexes.push_back(&it->second);
+  }
+  std::sort(indexes.begin(), indexes.end(),
+            [](const auto * a, const auto * b) { return a->offset < b->offset; });
+  std::vector<mcap::Metadata> records;
+  for (const auto * index : indexes) {
+    records.push_back(read_metadata_record(data_source, index->offset));
+  }
+  return merge_activity_histograms(records);
+}
+
+/** Raw chunks **/
+void MCAPStorage::check_raw_chunks_supported()
+{
+  if (opened_as_ != rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY) {
+    throw std::runtime_error("reading raw chunks requires a file opened for reading");
+  }
+  if (!file_set_members_.empty()) {
+    throw std::runtime_error(
+      "reading raw chunks is not supported on striped or sharded recordings");
+  }
+  ensure_summary_read();
+}
+
+void MCAPStorage::read_raw_chunks(const std::function<bool(const RawChunk &)> & visitor,
+                                  rcutils_time_point_value_t start_time,
+                                  rcutils_time_point_value_t end_time)
+{
+  check_raw_chunks_supported();
+  std::function<bool(mcap::ChannelId)> channel_filter;
+  if (const auto topic_filter = make_topic_filter()) {
+    std::unordered_set<mcap::ChannelId> channel_ids;
+    for (const auto & [channel_id, channel] : summary_->channels) {
+      if (topic_filter(channel->topic)) {
+        channel_ids.insert(channel_id);
+      }
+    }
+    channel_filter = [channel_ids = std::move(channel_ids)](mcap::ChannelId id) {
+      return channel_ids.find(id) != channel_ids.end();
+    };
+  }
+
+  std::vector<const mcap::ChunkIndex *> chunks;
+  std::vector<rosbag2_storage_mcap::internal::ByteRange> ranges;
+  for (const auto & chunk_index : summary_->chunk_indexes) {
+    if (rosbag2_storage_mcap::internal::chunk_may_match(chunk_index, mcap::Timestamp(start_time),
+                                                        mcap::Timestamp(end_time),
+                                                        channel_filter)) {
+      chunks.push_back(&chunk_index);
+      ranges.push_back({chunk_index.chunkStartOffset, chunk_index.chunkLength});
+    }
+  }
+  std::sort(chunks.begin(), chunks.end(), [](const auto * a, const auto * b) {
+    return a->chunkStartOffset < b->chunkStartOffset;
+  });
+
+  // A reader of its own, so the read plan of the message iterator is left alone.
+  rosbag2_storage_mcap::internal::PlannedFileReader data_source(planner_options_for(read_options_));
+  auto status = data_source.open(relative_path_);
+  if (!status.ok()) {
+    throw std::runtime_error(status.message);
+  }
+  data_source.set_plan(std::move(ranges));
+  for (const auto * chunk_index : chunks) {
+    rosbag2_storage_mcap::internal::CompressedChunk compressed;
+    status = rosbag2_storage_mcap::internal::read_compressed_chunk(data_source, *chunk_index,
+                                                                   &compressed);
+    if (!status.ok()) {
+      throw std::runtime_error(status.message);
+    }
+    RawChunk chunk;
+    chunk.index = *chunk_index;
+    chunk.uncompressed_crc = compressed.uncompressed_crc;
+    chunk.data = std::move(compressed.data);
+    if (!visitor(chunk)) {
+      return;
+    }
+  }
+}
+
+MCAPStorage::ChunkIntegrityReport MCAPStorage::verify_chunk_crcs(size_t thread_count)
+{
+  check_raw_chunks_supported();
+  if (thread_count == 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  ChunkIntegrityReport report;
+  const auto status = rosbag2_storage_mcap::internal::verify_chunk_crcs(
+    summary_->chunk_indexes, thread_count,
+    [this](const std::vector<const mcap::ChunkIndex *> & chunks)
+      -> std::unique_ptr<mcap::IReadable> {
+      auto data_source = std::make_unique<rosbag2_storage_mcap::internal::PlannedFileReader>(
+        planner_options_for(read_options_));
+      if (!data_source->open(relative_path_).ok()) {
+        return nullptr;
+      }
+      std::vector<rosbag2_storage_mcap::internal::ByteRange> ranges;
+      for (const auto * chunk_index : chunks) {
+        ranges.push_back({chunk_index->chunkStartOffset, chunk_index->chunkLength});
+      }
+      data_source->set_plan(std::move(ranges));
+      return data_source;
+    },
+    &report);
+  if (!status.ok()) {
+    throw std::runtime_error(status.message);
+  }
+  return report;
+}
+
+const std::unordered_map<mcap::SchemaId, mcap::SchemaPtr> & MCAPStorage::get_mcap_schemas()
+{
+  check_raw_chunks_supported();
+  return summary_->schemas;
+}
+
+const std::unordered_map<mcap::ChannelId, mcap::ChannelPtr> & MCAPStorage::get_mcap_channels()
+{
+  check_raw_chunks_supported();
+  return summary_->channels;
+}
+
+/** Striped recordings **/
+void MCAPStorage::open_file_set_members(const std::string & storage_config_uri)
+{
+  ensure_summary_read();
+  const auto it =
+    summary_->metadata_indexes.find(rosbag2_storage_mcap::internal::FileSetManifest::METADATA_NAME);
+  if (it == summary_->metadata_indexes.end()) {
+    return;
+  }
+  const auto manifest = rosbag2_storage_mcap::internal::FileSetManifest::from_metadata(
+    read_metadata_record(*data_source_, it->second.offset));
+  if (!manifest) {
+    throw std::runtime_error("invalid file set manifest in " + relative_path_);
+  }
+  const auto directory = std::filesystem::path(relative_path_).parent_path();
+  for (const auto & file : manifest->files) {
+    std::filesystem::path path(file);
+    if (path.is_relative()) {
+      path = directory / path;
+    }
+    auto member = std::make_unique<MCAPStorage>();
+    member->open_impl(path.string(), "", rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY,
+                      storage_config_uri);
+    file_set_members_.push_back(std::move(member));
+  }
+}
+
+rosbag2_storage::BagMetadata MCAPStorage::get_file_set_metadata()
+{
+  metadata_.version = 2;
+  metadata_.storage_identifier = get_storage_identifier();
+  metadata_.bag_size = get_bagfile_size();
+  metadata_.relative_file_paths = {get_relative_file_path()};
+  metadata_.message_count = 0;
+  metadata_.topics_with_message_count.clear();
+
+  std::optional<time_point> start;
+  std::optional<time_point> end;
+  std::unordered_map<std::string, size_t> topic_positions;
+  for (auto & member : file_set_members_) {
+    const auto member_metadata = member->get_metadata();
+    if (member_metadata.message_count > 0) {
+      const auto member_end = member_metadata.starting_time + member_metadata.duration;
+      start = start ? std::min(*start, member_metadata.starting_time)
+                    : member_metadata.starting_time;
+      end = end ? std::max(*end, member_end) : member_end;
+    }
+    metadata_.message_count += member_metadata.message_count;
+    for (const auto & topic_info : member_metadata.topics_with_message_count) {
+      const auto [position, inserted] = topic_positions.emplace(
+        topic_info.topic_metadata.name, metadata_.topics_with_message_count.size());
+      if (inserted) {
+        metadata_.topics_with_message_count.push_back(topic_info);
+      } else {
+        metadata_.topics_with_message_count[position->second].message_count +=
+          topic_info.message_count;
+      }
+    }
+  }
+  metadata_.starting_time = start.value_or(time_point{});
+  metadata_.duration = start ? *end - *start : std::chrono::nanoseconds(0);
+  return metadata_;
+}
+
 }  // namespace rosbag2_storage_plugins
 
 #include "pluginlib/class_list_macros.hpp"  // NOLINT
@@ -0,0 +1,407 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/message_index.hpp"
+
+#include "rosbag2_storage_mcap/chunk_reader.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+// Opcode (1 byte) followed by the record length (8 bytes)
+static constexpr uint64_t RECORD_PREFIX_LENGTH = 9;
+// channel_id (2) + byte length of the records array (4)
+static constexpr uint64_t MESSAGE_INDEX_HEADER_LENGTH = 6;
+// log_time (8) + offset (8)
+static constexpr uint64_t MESSAGE_INDEX_ENTRY_LENGTH = 16;
+
+// Number of entries in the Message Index record at `offset`, from its length alone.
+static mcap::Status read_message_index_count(mcap::IReadable & data_source, uint64_t offset,
+                                             uint64_t * count)
+{
+  std::byte * prefix = nullptr;
+  if (data_source.read(&prefix, offset, RECORD_PREFIX_LENGTH) != RECORD_PREFIX_LENGTH ||
+      mcap::OpCode(prefix[0]) != mcap::OpCode::MessageIndex) {
+    return mcap::Status{mcap::StatusCode::InvalidRecord,
+                        "expected a Message Index record at offset " + std::to_string(offset)};
+  }
+  uint64_t length = 0;
+  for (size_t i = 0; i < 8; ++i) {
+    length |= uint64_t(prefix[1 + i]) << (8 * i);
+  }
+  if (length < MESSAGE_INDEX_HEADER_LENGTH) {
+    return mcap::Status{mcap::StatusCode::InvalidRecord,
+                        "truncated Message Index record at offset " + std::to_string(offset)};
+  }
+  *count = (length - MESSAGE_INDEX_HEADER_LENGTH) / MESSAGE_INDEX_ENTRY_LENGTH;
+  return mcap::Status{};
+}
+
+mcap::Status read_message_index(mcap::IReadable & data_source, uint64_t offset,
+                                mcap::MessageIndex * message_index)
+{
+  mcap::Record record;
+  auto status = mcap::McapReader::ReadRecord(data_source, offset, &record);
+  if (!status.ok()) {
+    return status;
+  }
+  if (record.opcode != mcap::OpCode::MessageIndex) {
+    return mcap::Status{mcap::StatusCode::InvalidRecord,
+                        "expected a Message Index record at offset " + std::to_string(offset)};
+  }
+  return mcap::McapReader::ParseMessageIndex(record, *message_index);
+}
+
+mcap::Status select_messages(mcap::IReadable & data_source,
+                             const std::vector<mcap::ChunkIndex> & chunk_indexes,
+                             mcap::Timestamp start_time,
+                             const std::function<bool(mcap::ChannelId)> & channel_filter,
+                             const DownsampleOptions & options, MessageSelection * selection)
+{
+  struct Entry
+  {
+    mcap::Timestamp log_time;
+    uint64_t chunk_offset;
+    uint64_t record_offset;
+  };
+  std::unordered_map<mcap::ChannelId, std::vector<Entry>> channels;
+  for (const auto & chunk_index : chunk_indexes) {
+    if (chunk_index.messageEndTime < start_time) {
+      continue;
+    }
+    for (const auto & [channel_id, message_index_offset] : chunk_index.messageIndexOffsets) {
+      if (channel_filter && !channel_filter(channel_id)) {
+        continue;
+      }
+      mcap::MessageIndex message_index;
+      auto status = read_message_index(data_source, message_index_offset, &message_index);
+      if (!status.ok()) {
+        return status;
+      }
+      auto & entries = channels[channel_id];
+      for (const auto & [log_time, record_offset] : message_index.records) {
+        if (log_time >= start_time) {
+          entries.push_back({log_time, chunk_index.chunkStartOffset, record_offset});
+        }
+      }
+    }
+  }
+
+  const auto min_interval =
+    options.max_rate > 0 ? mcap::Timestamp(1e9 / options.max_rate) : mcap::Timestamp(0);
+  const uint64_t every_nth = std::max<uint64_t>(options.every_nth, 1);
+  selection->clear();
+  for (auto & [channel_id, entries] : channels) {
+    (void)channel_id;
+    std::sort(entries.begin(), entries.end(), [](const Entry & a, const Entry & b) {
+      return std::tie(a.log_time, a.chunk_offset, a.record_offset) <
+             std::tie(b.log_time, b.chunk_offset, b.record_offset);
+    });
+    std::optional<mcap::Timestamp> last_kept;
+    for (size_t i = 0; i < entries.size(); i += every_nth) {
+      const auto & entry = entries[i];
+      if (last_kept && entry.log_time - *last_kept < min_interval) {
+        continue;
+      }
+      last_kept = entry.log_time;
+      (*selection)[entry.chunk_offset].push_back(entry.record_offset);
+    }
+  }
+  for (auto & [chunk_offset, offsets] : *selection) {
+    (void)chunk_offset;
+    std::sort(offsets.begin(), offsets.end());
+  }
+  return mcap::Status{};
+}
+
+// Add the number of messages on each channel of a chunk to `counts`, and their total to `total`.
+static mcap::Status count_chunk_messages(mcap::IReadable & data_source,
+                                         const mcap::ChunkIndex & chunk_index,
+                                         std::unordered_map<mcap::ChannelId, uint64_t> * counts,
+                                         uint64_t * total)
+{
+  if (!chunk_index.messageIndexOffsets.empty()) {
+    for (const auto & [channel_id, message_index_offset] : chunk_index.messageIndexOffsets) {
+      uint64_t count = 0;
+      auto status = read_message_index_count(data_source, message_index_offset, &count);
+      if (!status.ok()) {
+        return status;
+      }
+      (*counts)[channel_id] += count;
+      *total += count;
+    }
+    return mcap::Status{};
+  }
+
+  mcap::ByteArray records;
+  auto status = read_chunk_records(data_source, chunk_index, &records);
+  if (!status.ok()) {
+    return status;
+  }
+  uint64_t offset = 0;
+  while (offset < records.size()) {
+    mcap::OpCode opcode;
+    uint64_t length = 0;
+    mcap::Message message;
+    if (!parse_chunk_record(records, offset, &opcode, &length, &message)) {
+      return mcap::Status{mcap::StatusCode::InvalidRecord,
+                          "truncated record in chunk at offset " +
+                            std::to_string(chunk_index.chunkStartOffset)};
+    }
+    if (opcode == mcap::OpCode::Message) {
+      (*counts)[message.channelId]++;
+      (*total)++;
+    }
+    offset += RECORD_PREFIX_LENGTH + length;
+  }
+  return mcap::Status{};
+}
+
+mcap::Status derive_statistics(
+  const std::vector<mcap::ChunkIndex> & chunk_indexes, size_t thread_count,
+  const std::function<std::unique_ptr<mcap::IReadable>()> & open_data_source,
+  mcap::Statistics * statistics)
+{
+  struct Partial
+  {
+    mcap::Status status;
+    std::unordered_map<mcap::ChannelId, uint64_t> counts;
+    uint64_t total = 0;
+    mcap::Timestamp start_time = std::numeric_limits<mcap::Timestamp>::max();
+    mcap::Timestamp end_time = 0;
+  };
+  thread_count = std::max<size_t>(1, std::min(thread_count, chunk_indexes.size()));
+  std::vector<Partial> partials(thread_count);
+  auto count_every_nth_chunk = [&](size_t first) {
+    auto & partial = partials[first];
+    auto data_source = open_data_source();
+    if (!data_source) {
+      partial.status = mcap::Status{mcap::StatusCode::OpenFailed, "failed to open data source"};
+      return;
+    }
+    for (size_t i = first; i < chunk_indexes.size(); i += thread_count) {
+      const auto & chunk_index = chunk_indexes[i];
+      const uint64_t previous_total = partial.total;
+      partial.status =
+        count_chunk_messages(*data_source, chunk_index, &partial.counts, &partial.total);
+      if (!partial.status.ok()) {
+        return;
+      }
+      // Empty chunks have no meaningful time range.
+      if (partial.total > previous_total) {
+        partial.start_time = std::min(partial.start_time, chunk_index.messageStartTime);
+        partial.end_time = std::max(partial.end_time, chunk_index.messageEndTime);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; ++i) {
+    threads.emplace_back(count_every_nth_chunk, i);
+  }
+  count_every_nth_chunk(0);
+  for (auto & thread : threads) {
+    thread.join();
+  }
+
+  *statistics = mcap::Statistics{};
+  statistics->chunkCount = uint32_t(chunk_indexes.size());
+  statistics->messageStartTime = std::numeric_limits<mcap::Timestamp>::max();
+  for (const auto & partial : partials) {
+    if (!partial.status.ok()) {
+      return partial.status;
+    }
+    for (const auto & [channel_id, count] : partial.counts) {
+      statistics->channelMessageCounts[channel_id] += count;
+    }
+    statistics->messageCount += partial.total;
+    statistics->messageStartTime = std::min(statistics->messageStartTime, partial.start_time);
+    statistics->messageEndTime = std::max(statistics->messageEndTime, partial.end_time);
+  }
+  if (statistics->messageCount == 0) {
+    statistics->messageStartTime = 0;
+  }
+  return mcap::Status{};
+}
+
+mcap::Status MessageTimeline::load(mcap::IReadable & data_source,
+                                   const std::vector<mcap::ChunkIndex> & chunk_indexes,
+                                   mcap::ChannelId channel_id, MessageTimeline * timeline)
+{
+  timeline->log_times_.clear();
+  for (const auto & chunk_index : chunk_indexes) {
+    const auto it = chunk_index.messageIndexOffsets.find(channel_id);
+    if (it == chunk_index.messageIndexOffsets.end()) {
+      continue;
+    }
+    mcap::MessageIndex message_index;
+    auto status = read_message_index(data_source, it->second, &message_index);
+    if (!status.ok()) {
+      return status;
+    }
+    for (const auto & [log_time, offset] : message_index.records) {
+      (void)offset;
+      timeline->log_times_.push_back(log_time);
+    }
+  }
+  std::sort(timeline->log_times_.begin(), timeline->log_times_.end());
+  return mcap::Status{};
+}
+
+std::vector<mcap::Timestamp>::const_iterator MessageTimeline::lower(mcap::Timestamp time) const
+{
+  return std::lower_bound(log_times_.begin(), log_times_.end(), time);
+}
+
+std::vector<mcap::Timestamp>::const_iterator MessageTimeline::upper(mcap::Timestamp time) const
+{
+  return std::upper_bound(log_times_.begin(), log_times_.end(), time);
+}
+
+uint64_t MessageTimeline::count(mcap::Timestamp start_time, mcap::Timestamp end_time) const
+{
+  if (end_time < start_time) {
+    return 0;
+  }
+  return uint64_t(upper(end_time) - lower(start_time));
+}
+
+std::optional<mcap::Timestamp> MessageTimeline::first(mcap::Timestamp start_time,
+                                                      mcap::Timestamp end_time) const
+{
+  const auto it = lower(start_time);
+  if (it == log_times_.end() || *it > end_time) {
+    return std::nullopt;
+  }
+  return *it;
+}
+
+std::optional<mcap::Timestamp> MessageTimeline::last(mcap::Timestamp start_time,
+                                                     mcap::Timestamp end_time) const
+{
+  const auto it = upper(end_time);
+  if (it == log_times_.begin() || *std::prev(it) < start_time) {
+    return std::nullopt;
+  }
+  return *std::prev(it);
+}
+
+void MessageTimeline::add_to_histogram(mcap::Timestamp start_time, mcap::Timestamp end_time,
+                                       mcap::Timestamp bucket_duration,
+                                       std::vector<uint64_t> * buckets) const
+{
+  if (end_time < start_time) {
+    return;
+  }
+  auto begin = lower(start_time);
+  const auto stop = upper(end_time);
+  for (size_t i = 0; i < buckets->size() && begin < stop; ++i) {
+    const mcap::Timestamp bucket_end = start_time + (i + 1) * bucket_duration;
+    const auto end = bucket_end > end_time ? stop : lower(bucket_end);
+    (*buckets)[i] += uint64_t(end - begin);
+    begin = end;
+  }
+}
+
+const std::vector<mcap::Timestamp> & MessageTimeline::log_times() const
+{
+  return log_times_;
+}
+
+mcap::Status MessageOrdinalIndex::load(mcap::IReadable & data_source,
+                                       const std::vector<mcap::ChunkIndex> & chunk_indexes,
+                                       const std::vector<mcap::ChannelId> & channel_ids,
+                                       MessageOrdinalIndex * index)
+{
+  index->channel_ids_ = channel_ids;
+  index->chunks_.clear();
+  for (const auto & chunk_index : chunk_indexes) {
+    ChunkOrdinals chunk{&chunk_index, 0, 0};
+    for (const auto channel_id : channel_ids) {
+      const auto it = chunk_index.messageIndexOffsets.find(channel_id);
+      if (it == chunk_index.messageIndexOffsets.end()) {
+        continue;
+      }
+      uint64_t count = 0;
+      auto status = read_message_index_count(data_source, it->second, &count);
+      if (!status.ok()) {
+        return status;
+      }
+      chunk.count += count;
+    }
+    if (chunk.count > 0) {
+      index->chunks_.push_back(chunk);
+    }
+  }
+  std::sort(index->chunks_.begin(), index->chunks_.end(), [](const auto & a, const auto & b) {
+    return a.chunk->chunkStartOffset < b.chunk->chunkStartOffset;
+  });
+  uint64_t ordinal = 0;
+  for (auto & chunk : index->chunks_) {
+    chunk.first_ordinal = ordinal;
+    ordinal += chunk.count;
+  }
+  return mcap::Status{};
+}
+
+uint64_t MessageOrdinalIndex::size() const
+{
+  return chunks_.empty() ? 0 : chunks_.back().first_ordinal + chunks_.back().count;
+}
+
+const MessageOrdinalIndex::ChunkOrdinals & MessageOrdinalIndex::find(uint64_t ordinal) const
+{
+  const auto it = std::upper_bound(
+    chunks_.begin(), chunks_.end(), ordinal,
+    [](uint64_t value, const ChunkOrdinals & chunk) { return value < chunk.first_ordinal; });
+  return *std::prev(it);
+}
+
+mcap::Status MessageOrdinalIndex::read_message_offsets(mcap::IReadable & data_source,
+                                                       const ChunkOrdinals & chunk,
+                                                       std::vector<uint64_t> * offsets) const
+{
+  offsets->clear();
+  for (const auto channel_id : channel_ids_) {
+    const auto it = chunk.chunk->messageIndexOffsets.find(channel_id);
+    if (it == chunk.chunk->messageIndexOffsets.end()) {
+      continue;
+    }
+    mcap::MessageIndex message_index;
+    auto status = read_message_index(data_source, it->second, &message_index);
+    if (!status.ok()) {
+      return status;
+    }
+    for (const auto & [log_time, offset] : message_index.records) {
+      (void)log_time;
+      offsets->push_back(offset);
+    }
+  }
+  std::sort(offsets->begin(), offsets->end());
+  if (offsets->size() != chunk.count) {
+    return mcap::Status{mcap::StatusCode::InvalidRecord,
+                        "inconsistent Message Index records for chunk at offset " +
+                          std::to_string(chunk.chunk->chunkStartOffset)};
+  }
+  return mcap::Status{};
+}
+
+}  // namespace rosbag2_storage_mcap::internal
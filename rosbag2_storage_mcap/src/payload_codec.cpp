@@ -0,0 +1,40 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/payload_codec.hpp"
+
+#include <utility>
+
+namespace rosbag2_storage_mcap
+{
+PayloadCodecRegistry & PayloadCodecRegistry::instance()
+{
+  static PayloadCodecRegistry registry;
+  return registry;
+}
+
+void PayloadCodecRegistry::add(const std::string & name, std::shared_ptr<const PayloadCodec> codec)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  codecs_[name] = std::move(codec);
+}
+
+std::shared_ptr<const PayloadCodec> PayloadCodecRegistry::find(const std::string & name) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = codecs_.find(name);
+  return it == codecs_.end() ? nullptr : it->second;
+}
+
+}  // namespace rosbag2_storage_mcap
@@ -0,0 +1,99 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/payload_dedup.hpp"
+
+#include <cstring>
+
+namespace rosbag2_storage_mcap::internal
+{
+static uint64_t read_uint64(const std::byte * data)
+{
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | uint64_t(data[i]);
+  }
+  return value;
+}
+
+static void write_uint64(uint64_t value, std::byte * data)
+{
+  for (int i = 0; i < 8; ++i) {
+    data[i] = std::byte(value >> (8 * i));
+  }
+}
+
+std::array<std::byte, PAYLOAD_REFERENCE_SIZE> PayloadReference::encode() const
+{
+  std::array<std::byte, PAYLOAD_REFERENCE_SIZE> data;
+  write_uint64(log_time, data.data());
+  write_uint64(hash, data.data() + 8);
+  return data;
+}
+
+std::optional<PayloadReference> PayloadReference::decode(const std::byte * data, uint64_t size)
+{
+  if (size != PAYLOAD_REFERENCE_SIZE) {
+    return std::nullopt;
+  }
+  return PayloadReference{read_uint64(data), read_uint64(data + 8)};
+}
+
+uint64_t hash_payload(const std::byte * data, uint64_t size)
+{
+  constexpr uint64_t m = 0xc6a4a7935bd1e995ULL;
+  constexpr int r = 47;
+  uint64_t h = 0x5bd1e9955bd1e995ULL ^ (size * m);
+  const uint64_t word_count = size / 8;
+  for (uint64_t i = 0; i < word_count; ++i) {
+    uint64_t k = read_uint64(data + 8 * i);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  const uint64_t tail = size % 8;
+  if (tail > 0) {
+    uint64_t k = 0;
+    for (uint64_t i = tail; i > 0; --i) {
+      k = (k << 8) | uint64_t(data[8 * word_count + i - 1]);
+    }
+    h ^= k;
+    h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+std::optional<PayloadReference> PayloadDeduplicator::add(const std::string & topic,
+                                                         const mcap::Message & message)
+{
+  if (message.dataSize <= PAYLOAD_REFERENCE_SIZE) {
+    return std::nullopt;
+  }
+  const uint64_t hash = hash_payload(message.data, message.dataSize);
+  auto & last = last_payloads_[topic];
+  if (last.reference.hash == hash && last.data.size() == message.dataSize &&
+      std::memcmp(last.data.data(), message.data, message.dataSize) == 0) {
+    return last.reference;
+  }
+  last.reference = {message.logTime, hash};
+  last.data.assign(message.data, message.data + message.dataSize);
+  return std::nullopt;
+}
+
+}  // namespace rosbag2_storage_mcap::internal
@@ -0,0 +1,206 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/read_planner.hpp"
+
+#ifndef _WIN32
+  #include <fcntl.h>
+#endif
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+static int seek_file(std::FILE * file, uint64_t offset)
+{
+#ifdef _WIN32
+  return _fseeki64(file, int64_t(offset), SEEK_SET);
+#else
+  return fseeko(file, off_t(offset), SEEK_SET);
+#endif
+}
+
+std::vector<ByteRange> coalesce_ranges(std::vector<ByteRange> ranges, uint64_t max_gap,
+                                       uint64_t max_length)
+{
+  std::sort(ranges.begin(), ranges.end(), [](const ByteRange & a, const ByteRange & b) {
+    return a.offset < b.offset;
+  });
+  std::vector<ByteRange> coalesced;
+  for (const auto & range : ranges) {
+    if (!coalesced.empty()) {
+      auto & last = coalesced.back();
+      const uint64_t merged_end = std::max(last.end(), range.end());
+      if (range.offset <= last.end() + max_gap && merged_end - last.offset <= max_length) {
+        last.length = merged_end - last.offset;
+        continue;
+      }
+    }
+    coalesced.push_back(range);
+  }
+  return coalesced;
+}
+
+PlannedFileReader::PlannedFileReader(Options options)
+    : options_(std::move(options))
+{
+}
+
+PlannedFileReader::~PlannedFileReader()
+{
+  if (file_) {
+    std::fclose(file_);
+  }
+}
+
+mcap::Status PlannedFileReader::open(const std::string & path)
+{
+  if (is_http_url(path)) {
+    const auto status = HttpRangeSource::open_shared(path, options_.http, http_);
+    if (status.ok()) {
+      size_ = http_->size();
+    }
+    return status;
+  }
+  file_ = std::fopen(path.c_str(), "rb");
+  if (!file_) {
+    return mcap::Status{mcap::StatusCode::OpenFailed, "failed to open \"" + path + "\""};
+  }
+  std::fseek(file_, 0, SEEK_END);
+#ifdef _WIN32
+  size_ = uint64_t(_ftelli64(file_));
+#else
+  size_ = uint64_t(ftello(file_));
+#endif
+  return mcap::Status{};
+}
+
+void PlannedFileReader::set_plan(std::vector<ByteRange> ranges)
+{
+  plan_ = coalesce_ranges(std::move(ranges), options_.coalesce_gap, options_.max_coalesced_size);
+  current_range_ = SIZE_MAX;
+}
+
+const std::vector<ByteRange> & PlannedFileReader::plan() const
+{
+  return plan_;
+}
+
+std::string PlannedFileReader::version() const
+{
+  return http_ ? http_->version() : std::string();
+}
+
+uint64_t PlannedFileReader::size() const
+{
+  return size_;
+}
+
+uint64_t PlannedFileReader::read(std::byte ** output, uint64_t offset, uint64_t size)
+{
+  if ((!file_ && !http_) || offset >= size_) {
+    return 0;
+  }
+  size = std::min(size, size_ - offset);
+
+  const bool buffered =
+    offset >= buffer_offset_ && offset + size <= buffer_offset_ + uint64_t(buffer_.size());
+  if (!buffered) {
+    // Find the planned range covering this read, if any.
+    auto it =
+      std::upper_bound(plan_.begin(), plan_.end(), offset,
+                       [](uint64_t o, const ByteRange & range) { return o < range.offset; });
+    if (it != plan_.begin() && offset + size <= std::prev(it)->end()) {
+      const size_t index = size_t(std::distance(plan_.begin(), it) - 1);
+      const ByteRange & range = plan_[index];
+      if (!fill_buffer(range.offset, std::min(range.length, size_ - range.offset))) {
+        return 0;
+      }
+      enter_range(index);
+    } else {
+      current_range_ = SIZE_MAX;
+      if (!fill_buffer(offset, size)) {
+        return 0;
+      }
+    }
+  }
+  *output = buffer_.data() + (offset - buffer_offset_);
+  return size;
+}
+
+bool PlannedFileReader::fill_buffer(uint64_t offset, uint64_t length)
+{
+  buffer_.resize(length);
+  buffer_offset_ = offset;
+  if (http_) {
+    if (!http_->read(offset, length, buffer_.data())) {
+      buffer_.clear();
+      return false;
+    }
+    return true;
+  }
+  if (seek_file(file_, offset) != 0 ||
+      std::fread(buffer_.data(), 1, length, file_) != length) {
+    buffer_.clear();
+    return false;
+  }
+  return true;
+}
+
+void PlannedFileReader::enter_range(size_t index)
+{
+  const bool backwards = current_range_ != SIZE_MAX && index < current_range_;
+  current_range_ = index;
+  // The whole range is now in memory, so its page cache is no longer needed.
+  if (options_.drop_behind) {
+    advise(plan_[index], false);
+  }
+  for (size_t i = 1; i <= options_.read_ahead; ++i) {
+    if (backwards) {
+      if (i > index) {
+        break;
+      }
+      advise(plan_[index - i], true);
+    } else {
+      if (index + i >= plan_.size()) {
+        break;
+      }
+      advise(plan_[index + i], true);
+    }
+  }
+}
+
+void PlannedFileReader::advise(const ByteRange & range, bool will_need)
+{
+  if (http_) {
+    // Blocks which have been read are evicted by the block cache itself.
+    if (will_need) {
+      http_->prefetch(range.offset, range.length);
+    }
+    return;
+  }
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fileno(file_), off_t(range.offset), off_t(range.length),
+                will_need ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+#else
+  (void)range;
+  (void)will_need;
+#endif
+}
+
+}  // namespace rosbag2_storage_mcap::internal
@@ -0,0 +1,121 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "rosbag2_storage_mcap/split_handoff.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace rosbag2_storage_mcap::internal
+{
+// Split `path`, without its extension, into the recording it belongs to and its split index;
+// false if it does not end in `_<index>`.
+static bool parse_split_path(const std::string & path, std::string & recording, uint64_t & index)
+{
+  const std::filesystem::path file(path);
+  const std::string stem = file.stem().string();
+  const auto separator = stem.find_last_of('_');
+  if (separator == std::string::npos || separator + 1 == stem.size() ||
+      stem.find_first_not_of("0123456789", separator + 1) != std::string::npos ||
+      stem.size() - separator > 20) {
+    return false;
+  }
+  recording = (file.parent_path() / stem.substr(0, separator)).string();
+  index = std::stoull(stem.substr(separator + 1));
+  return true;
+}
+
+SplitHandoff & SplitHandoff::instance()
+{
+  static SplitHandoff handoff;
+  return handoff;
+}
+
+void SplitHandoff::put(const std::string & path, const SplitTopics & topics)
+{
+  std::string recording;
+  uint64_t index = 0;
+  if (!parse_split_path(path, recording, index)) {
+    return;
+  }
+  std::unordered_set<mcap::SchemaId> referenced;
+  for (const auto & channel : topics.channels) {
+    referenced.insert(channel->schemaId);
+  }
+  auto renumbered = std::make_shared<SplitTopics>();
+  std::unordered_map<mcap::SchemaId, mcap::SchemaId> schema_ids;
+  for (const auto & schema : topics.schemas) {
+    if (referenced.count(schema->id) == 0) {
+      continue;
+    }
+    auto copy = std::make_shared<mcap::Schema>(*schema);
+    copy->id = mcap::SchemaId(renumbered->schemas.size() + 1);
+    schema_ids.emplace(schema->id, copy->id);
+    renumbered->schemas.push_back(std::move(copy));
+  }
+  for (const auto & channel : topics.channels) {
+    auto copy = std::make_shared<mcap::Channel>(*channel);
+    copy->id = mcap::ChannelId(renumbered->channels.size() + 1);
+    const auto schema_it = schema_ids.find(channel->schemaId);
+    copy->schemaId = schema_it != schema_ids.end() ? schema_it->second : 0;
+    renumbered->channels.push_back(std::move(copy));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_[recording] = Entry{index, next_sequence_++, std::move(renumbered)};
+  if (entries_.size() > MAX_RECORDINGS) {
+    entries_.erase(std::min_element(entries_.begin(), entries_.end(),
+                                    [](const auto & a, const auto & b) {
+                                      return a.second.sequence < b.second.sequence;
+                                    }));
+  }
+}
+
+std::shared_ptr<const SplitTopics> SplitHandoff::take(const std::string & path)
+{
+  std::string recording;
+  uint64_t index = 0;
+  if (!parse_split_path(path, recording, index) || index == 0) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto entry_it = entries_.find(recording);
+  if (entry_it == entries_.end()) {
+    return nullptr;
+  }
+  if (entry_it->second.split_index + 1 != index) {
+    // The recording has gone past the file which left them.
+    if (entry_it->second.split_index + 1 < index) {
+      entries_.erase(entry_it);
+    }
+    return nullptr;
+  }
+  auto topics = std::move(entry_it->second.topics);
+  entries_.erase(entry_it);
+  return topics;
+}
+
+void SplitHandoff::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+}
+
+}  // namespace rosbag2_storage_mcap::internal
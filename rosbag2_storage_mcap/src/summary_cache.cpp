@@ -0,0 +1,128 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/summary_cache.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace rosbag2_storage_mcap::internal
+{
+// Number of summaries kept alive after their last reader has closed.
+static constexpr size_t DEFAULT_SUMMARY_CACHE_CAPACITY = 16;
+
+FileIdentity FileIdentity::of(const std::string & path)
+{
+  const auto canonical = std::filesystem::weakly_canonical(path);
+  FileIdentity id;
+  id.path = canonical.string();
+  id.size = uint64_t(std::filesystem::file_size(canonical));
+  id.mtime = int64_t(std::filesystem::last_write_time(canonical).time_since_epoch().count());
+  return id;
+}
+
+std::shared_ptr<ParsedSummary> ParsedSummary::from_reader(const mcap::McapReader & reader)
+{
+  auto summary = std::make_shared<ParsedSummary>();
+  summary->schemas = reader.schemas();
+  summary->channels = reader.channels();
+  summary->chunk_indexes = reader.chunkIndexes();
+  summary->metadata_indexes = reader.metadataIndexes();
+  summary->statistics = reader.statistics();
+  // Chunks without messages, such as those holding only schemas and channels, have no message
+  // indexes and a start time after their end time.
+  const auto & chunk_indexes = summary->chunk_indexes;
+  summary->has_message_indexes =
+    std::any_of(chunk_indexes.begin(), chunk_indexes.end(),
+                [](const auto & index) { return index.messageIndexLength > 0; }) &&
+    std::all_of(chunk_indexes.begin(), chunk_indexes.end(), [](const auto & index) {
+      return index.messageIndexLength > 0 || index.messageStartTime > index.messageEndTime;
+    });
+  return summary;
+}
+
+mcap::SchemaPtr ParsedSummary::schema(mcap::SchemaId id) const
+{
+  const auto it = schemas.find(id);
+  return it == schemas.end() ? nullptr : it->second;
+}
+
+mcap::ChannelPtr ParsedSummary::channel(mcap::ChannelId id) const
+{
+  const auto it = channels.find(id);
+  return it == channels.end() ? nullptr : it->second;
+}
+
+SummaryCache & SummaryCache::instance()
+{
+  static SummaryCache cache{DEFAULT_SUMMARY_CACHE_CAPACITY};
+  return cache;
+}
+
+SummaryCache::SummaryCache(size_t capacity)
+    : capacity_(capacity)
+{
+}
+
+std::shared_ptr<const ParsedSummary> SummaryCache::get_or_load(const FileIdentity & file,
+                                                               const Loader & load)
+{
+  std::promise<std::shared_ptr<const ParsedSummary>> promise;
+  Entry entry;
+  bool loading = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = index_.find(file);
+    if (it != index_.end()) {
+      entries_.splice(entries_.begin(), entries_, it->second);
+      entry = it->second->second;
+    } else {
+      entry = promise.get_future().share();
+      entries_.emplace_front(file, entry);
+      index_[file] = entries_.begin();
+      while (entries_.size() > capacity_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+      }
+      loading = true;
+    }
+  }
+
+  if (loading) {
+    try {
+      promise.set_value(load());
+    } catch (...) {
+      promise.set_exception(std::current_exception());
+      std::lock_guard<std::mutex> lock(mutex_);
+      const auto it = index_.find(file);
+      if (it != index_.end()) {
+        entries_.erase(it->second);
+        index_.erase(it);
+      }
+    }
+  }
+  return entry.get();
+}
+
+void SummaryCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  index_.clear();
+}
+
+}  // namespace rosbag2_storage_mcap::internal
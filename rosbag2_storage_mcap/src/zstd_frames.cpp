@@ -0,0 +1,195 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "rosbag2_storage_mcap/zstd_frames.hpp"
+
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace rosbag2_storage_mcap::internal
+{
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+// Frame index layout: a skippable frame (magic, 4 bytes; length of what follows, 4 bytes) holding
+// FRAME_INDEX_TAG (4 bytes), the frame count (4 bytes), then the compressed and decompressed size
+// of each frame (8 bytes each). The frames follow it in order.
+static constexpr uint32_t SKIPPABLE_MAGIC_MASK = 0xfffffff0;
+static constexpr uint32_t SKIPPABLE_MAGIC = 0x184d2a50;
+static constexpr uint32_t FRAME_INDEX_MAGIC = SKIPPABLE_MAGIC | 0xe;
+static constexpr uint32_t FRAME_INDEX_TAG = 0x58444946;  // "FIDX"
+static constexpr uint64_t FRAME_INDEX_ENTRY_SIZE = 16;
+
+static uint64_t read_uint(const std::byte * data, size_t width)
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < width; ++i) {
+    value |= uint64_t(data[i]) << (8 * i);
+  }
+  return value;
+}
+
+static void write_uint(std::byte * data, uint64_t value, size_t width)
+{
+  for (size_t i = 0; i < width; ++i) {
+    data[i] = std::byte(value >> (8 * i));
+  }
+}
+
+// The level mcap::ZStdWriter compresses with.
+static int zstd_level(mcap::CompressionLevel level)
+{
+  switch (level) {
+    case mcap::CompressionLevel::Fastest:
+      return -5;
+    case mcap::CompressionLevel::Fast:
+      return -3;
+    case mcap::CompressionLevel::Slow:
+      return 5;
+    case mcap::CompressionLevel::Slowest:
+      return 19;
+    default:
+      return 1;
+  }
+}
+#endif
+
+mcap::Status compress_zstd_frames(const std::byte * data, uint64_t size, uint64_t frame_size,
+                                  mcap::CompressionLevel level, mcap::ByteArray * output)
+{
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+  if (frame_size == 0 || frame_size >= size) {
+    frame_size = std::max<uint64_t>(size, 1);
+  }
+  const uint64_t frame_count = std::max<uint64_t>((size + frame_size - 1) / frame_size, 1);
+  const uint64_t index_size = frame_count > 1 ? 8 + 8 + FRAME_INDEX_ENTRY_SIZE * frame_count : 0;
+  output->resize(index_size + frame_count * ZSTD_compressBound(size_t(frame_size)));
+  uint64_t written = index_size;
+  for (uint64_t i = 0; i < frame_count; ++i) {
+    const uint64_t offset = i * frame_size;
+    const uint64_t part = std::min(frame_size, size - offset);
+    const size_t compressed = ZSTD_compress(output->data() + written, output->size() - written,
+                                            data + offset, size_t(part), zstd_level(level));
+    if (ZSTD_isError(compressed)) {
+      return mcap::Status{mcap::StatusCode::UnsupportedCompression,
+                          std::string("zstd compression failed: ") +
+                            ZSTD_getErrorName(compressed)};
+    }
+    if (index_size > 0) {
+      std::byte * entry = output->data() + 16 + FRAME_INDEX_ENTRY_SIZE * i;
+      write_uint(entry, compressed, 8);
+      write_uint(entry + 8, part, 8);
+    }
+    written += compressed;
+  }
+  if (index_size > 0) {
+    write_uint(output->data(), FRAME_INDEX_MAGIC, 4);
+    write_uint(output->data() + 4, index_size - 8, 4);
+    write_uint(output->data() + 8, FRAME_INDEX_TAG, 4);
+    write_uint(output->data() + 12, frame_count, 4);
+  }
+  output->resize(written);
+  return mcap::Status{};
+#else
+  (void)data;
+  (void)size;
+  (void)frame_size;
+  (void)level;
+  (void)output;
+  return mcap::Status{mcap::StatusCode::UnsupportedCompression, "zstd support is not built in"};
+#endif
+}
+
+bool read_zstd_frame_index(const std::byte * data, uint64_t compressed_size,
+                           std::vector<ZstdFrame> * frames)
+{
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+  if (compressed_size < 16 || read_uint(data, 4) != FRAME_INDEX_MAGIC ||
+      read_uint(data + 8, 4) != FRAME_INDEX_TAG) {
+    return false;
+  }
+  const uint64_t index_length = read_uint(data + 4, 4);
+  const uint64_t frame_count = read_uint(data + 12, 4);
+  if (index_length != 8 + FRAME_INDEX_ENTRY_SIZE * frame_count ||
+      8 + index_length > compressed_size) {
+    return false;
+  }
+  frames->clear();
+  uint64_t compressed_offset = 8 + index_length;
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < frame_count; ++i) {
+    const std::byte * entry = data + 16 + FRAME_INDEX_ENTRY_SIZE * i;
+    ZstdFrame frame{compressed_offset, read_uint(entry, 8), offset, read_uint(entry + 8, 8)};
+    if (frame.compressed_size > compressed_size - compressed_offset) {
+      return false;
+    }
+    frames->push_back(frame);
+    compressed_offset += frame.compressed_size;
+    offset += frame.size;
+  }
+  return compressed_offset == compressed_size;
+#else
+  (void)data;
+  (void)compressed_size;
+  (void)frames;
+  return false;
+#endif
+}
+
+bool find_zstd_frames(const std::byte * data, uint64_t compressed_size,
+                      uint64_t uncompressed_size, std::vector<ZstdFrame> * frames)
+{
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+  if (!read_zstd_frame_index(data, compressed_size, frames)) {
+    frames->clear();
+    uint64_t compressed_offset = 0;
+    uint64_t offset = 0;
+    while (compressed_offset < compressed_size) {
+      const std::byte * frame = data + compressed_offset;
+      const size_t remaining = size_t(compressed_size - compressed_offset);
+      const size_t frame_compressed_size = ZSTD_findFrameCompressedSize(frame, remaining);
+      if (ZSTD_isError(frame_compressed_size)) {
+        return false;
+      }
+      // Skippable frames decompress to nothing.
+      if (remaining < 4 || (read_uint(frame, 4) & SKIPPABLE_MAGIC_MASK) != SKIPPABLE_MAGIC) {
+        const unsigned long long frame_size = ZSTD_getFrameContentSize(frame, remaining);
+        if (frame_size == ZSTD_CONTENTSIZE_UNKNOWN || frame_size == ZSTD_CONTENTSIZE_ERROR) {
+          return false;
+        }
+        frames->push_back({compressed_offset, frame_compressed_size, offset, frame_size});
+        offset += frame_size;
+      }
+      compressed_offset += frame_compressed_size;
+    }
+  }
+  uint64_t size = 0;
+  for (const auto & frame : *frames) {
+    size += frame.size;
+  }
+  return frames->size() >= 2 && size == uncompressed_size;
+#else
+  (void)data;
+  (void)compressed_size;
+  (void)uncompressed_size;
+  (void)frames;
+  return false;
+#endif
+}
+
+}  // namespace rosbag2_storage_mcap::internal
@@ -0,0 +1,110 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures how create_topic(), closing a file and opening it again scale with the number of
+// topics, writing one message per topic. Usage: benchmark_topic_count [directory]
+
+#include "rosbag2_storage_mcap/mcap_storage.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+using rosbag2_storage::storage_interfaces::IOFlag;
+using rosbag2_storage_plugins::MCAPStorage;
+using Clock = std::chrono::steady_clock;
+
+static double milliseconds_since(Clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+int main(int argc, char ** argv)
+{
+  const auto directory = argc > 1 ? std::filesystem::path(argv[1])
+                                  : std::filesystem::temp_directory_path() /
+                                      "rosbag2_storage_mcap_benchmark_topic_count";
+  std::filesystem::create_directories(directory);
+
+  const std::vector<std::string> types = {"std_msgs/msg/String", "std_msgs/msg/Header",
+                                          "std_msgs/msg/Float64", "std_msgs/msg/ColorRGBA"};
+  // Most topics of a fleet share a handful of QoS profiles.
+  const std::string qos =
+    "- history: 3\n  depth: 0\n  reliability: 1\n  durability: 2\n  deadline:\n    sec: "
+    "2147483647\n    nsec: 4294967295\n  lifespan:\n    sec: 2147483647\n    nsec: "
+    "4294967295\n  liveliness: 1\n  liveliness_lease_duration:\n    sec: 2147483647\n    nsec: "
+    "4294967295\n  avoid_ros_namespace_conventions: false";
+
+  std::array<uint8_t, 16> payload{};
+  rcutils_uint8_array_t serialized_data{};
+  serialized_data.buffer = payload.data();
+  serialized_data.buffer_length = payload.size();
+  serialized_data.buffer_capacity = payload.size();
+
+  std::printf("%8s %18s %12s %12s %18s\n", "topics", "create_topic (ms)", "close (ms)",
+              "open (ms)", "get_metadata (ms)");
+  for (const size_t topic_count : {100, 1000, 5000, 10000, 20000}) {
+    const auto uri = (directory / ("topics_" + std::to_string(topic_count))).string();
+    std::filesystem::remove(uri + ".mcap");
+
+    auto writer = std::make_unique<MCAPStorage>();
+    writer->open(uri, IOFlag::READ_WRITE);
+    std::vector<std::string> names;
+    names.reserve(topic_count);
+    for (size_t i = 0; i < topic_count; ++i) {
+      names.push_back("/robot_" + std::to_string(i / 10) + "/topic_" + std::to_string(i % 10));
+    }
+    auto start = Clock::now();
+    for (size_t i = 0; i < topic_count; ++i) {
+      rosbag2_storage::TopicMetadata topic;
+      topic.name = names[i];
+      topic.type = types[i % types.size()];
+      topic.serialization_format = "cdr";
+      topic.offered_qos_profiles = qos;
+      writer->create_topic(topic);
+    }
+    const double create_ms = milliseconds_since(start);
+    for (size_t i = 0; i < topic_count; ++i) {
+      auto message = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+      message->serialized_data =
+        std::shared_ptr<rcutils_uint8_array_t>(&serialized_data, [](rcutils_uint8_array_t *) {});
+      message->time_stamp = rcutils_time_point_value_t(i);
+      message->topic_name = names[i];
+      writer->write(message);
+    }
+    start = Clock::now();
+    writer.reset();
+    const double close_ms = milliseconds_since(start);
+
+    start = Clock::now();
+    MCAPStorage reader;
+    reader.open(uri + ".mcap", IOFlag::READ_ONLY);
+    const double open_ms = milliseconds_since(start);
+    start = Clock::now();
+    const auto metadata = reader.get_metadata();
+    const double metadata_ms = milliseconds_since(start);
+    if (metadata.topics_with_message_count.size() != topic_count) {
+      std::fprintf(stderr, "expected %zu topics, read %zu\n", topic_count,
+                   metadata.topics_with_message_count.size());
+      return 1;
+    }
+    std::printf("%8zu %18.2f %12.2f %12.2f %18.2f\n", topic_count, create_ms, close_ms, open_ms,
+                metadata_ms);
+  }
+  return 0;
+}
@@ -0,0 +1,132 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/activity_histogram.hpp"
+
+#include <gmock/gmock.h>
+
+using rosbag2_storage_mcap::ActivityHistogram;
+using testing::ElementsAre;
+using testing::Key;
+
+TEST(test_activity_histogram, counts_messages_and_bytes_per_bucket)
+{
+  ActivityHistogram histogram{100};
+  histogram.add("/a", 250, 10);
+  histogram.add("/a", 299, 5);
+  histogram.add("/a", 520, 1);
+  // Out of order messages extend the histogram backwards.
+  histogram.add("/a", 120, 7);
+  histogram.add("/b", 1000, 3);
+
+  const auto & a = histogram.topics().at("/a");
+  EXPECT_THAT(a.buckets, ElementsAre(Key(100u), Key(200u), Key(500u)));
+  EXPECT_EQ(a.buckets.at(100).message_count, 1u);
+  EXPECT_EQ(a.buckets.at(100).byte_count, 7u);
+  EXPECT_EQ(a.buckets.at(200).message_count, 2u);
+  EXPECT_EQ(a.buckets.at(200).byte_count, 15u);
+  EXPECT_EQ(a.buckets.at(500).message_count, 1u);
+
+  const auto & b = histogram.topics().at("/b");
+  EXPECT_THAT(b.buckets, ElementsAre(Key(1000u)));
+}
+
+TEST(test_activity_histogram, keeps_far_apart_log_times_sparse)
+{
+  ActivityHistogram histogram{1000000000};
+  // A message stamped 0, or with a negative stamp cast to unsigned, next to wall clock times.
+  histogram.add("/a", 1700000000000000000, 1);
+  histogram.add("/a", 0, 1);
+  histogram.add("/a", uint64_t(-1), 1);
+  histogram.add("/a", 1700000001000000000, 1);
+
+  const auto & a = histogram.topics().at("/a");
+  EXPECT_EQ(a.buckets.size(), 4u);
+  const auto parsed = ActivityHistogram::from_metadata(histogram.to_metadata());
+  ASSERT_TRUE(parsed.has_value());
+  EXPECT_EQ(parsed->topics().at("/a").buckets.size(), 4u);
+  EXPECT_EQ(histogram.to_metadata().metadata.at("/a"),
+            "0:1/1,1700000000000000000:1/1,1/1,18446744073000000000:1/1");
+}
+
+TEST(test_activity_histogram, merges_histograms_with_the_same_bucket_duration)
+{
+  ActivityHistogram histogram{100};
+  histogram.add("/a", 150, 10);
+  ActivityHistogram appended{100};
+  appended.add("/a", 120, 5);
+  appended.add("/a", 300, 1);
+  appended.add("/b", 0, 2);
+
+  ASSERT_TRUE(histogram.merge(appended));
+  const auto & a = histogram.topics().at("/a");
+  EXPECT_THAT(a.buckets, ElementsAre(Key(100u), Key(300u)));
+  EXPECT_EQ(a.buckets.at(100).message_count, 2u);
+  EXPECT_EQ(a.buckets.at(100).byte_count, 15u);
+  EXPECT_THAT(histogram.topics().at("/b").buckets, ElementsAre(Key(0u)));
+
+  ActivityHistogram coarser{1000};
+  coarser.add("/a", 0, 1);
+  EXPECT_FALSE(histogram.merge(coarser));
+  EXPECT_EQ(histogram.topics().at("/a").buckets.at(100).message_count, 2u);
+}
+
+TEST(test_activity_histogram, round_trips_through_metadata)
+{
+  ActivityHistogram histogram{1000000000};
+  histogram.add("/a", 1500000000, 100);
+  histogram.add("/a", 3500000000, 200);
+  histogram.add("/b", 0, 1);
+
+  const auto metadata = histogram.to_metadata();
+  EXPECT_EQ(metadata.name, ActivityHistogram::METADATA_NAME);
+  const auto parsed = ActivityHistogram::from_metadata(metadata);
+  ASSERT_TRUE(parsed.has_value());
+  EXPECT_EQ(parsed->bucket_duration(), 1000000000u);
+  ASSERT_EQ(parsed->topics().size(), 2u);
+  for (const auto & [topic, series] : histogram.topics()) {
+    const auto & parsed_series = parsed->topics().at(topic);
+    ASSERT_EQ(parsed_series.buckets.size(), series.buckets.size());
+    for (const auto & [start, bucket] : series.buckets) {
+      EXPECT_EQ(parsed_series.buckets.at(start).message_count, bucket.message_count);
+      EXPECT_EQ(parsed_series.buckets.at(start).byte_count, bucket.byte_count);
+    }
+  }
+}
+
+TEST(test_activity_histogram, rejects_malformed_metadata)
+{
+  mcap::Metadata metadata;
+  metadata.name = "other";
+  EXPECT_FALSE(ActivityHistogram::from_metadata(metadata).has_value());
+
+  metadata.name = ActivityHistogram::METADATA_NAME;
+  EXPECT_FALSE(ActivityHistogram::from_metadata(metadata).has_value());
+
+  metadata.metadata["bucket_duration"] = "100";
+  metadata.metadata["/a"] = "0:1/2,x";
+  EXPECT_FALSE(ActivityHistogram::from_metadata(metadata).has_value());
+
+  metadata.metadata["/a"] = "1/2";
+  EXPECT_FALSE(ActivityHistogram::from_metadata(metadata).has_value());
+
+  metadata.metadata["/a"] = "50:1/2";
+  EXPECT_FALSE(ActivityHistogram::from_metadata(metadata).has_value());
+
+  // Dense, with an empty bucket, as written by earlier versions.
+  metadata.metadata["/a"] = "0:1/2,0/0,3/4";
+  const auto parsed = ActivityHistogram::from_metadata(metadata);
+  ASSERT_TRUE(parsed.has_value());
+  EXPECT_THAT(parsed->topics().at("/a").buckets, ElementsAre(Key(0u), Key(200u)));
+}
@@ -0,0 +1,68 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/byte_shuffle.hpp"
+
+#include <gmock/gmock.h>
+
+#include <string>
+#include <vector>
+
+using rosbag2_storage_mcap::internal::byte_shuffle;
+using rosbag2_storage_mcap::internal::byte_unshuffle;
+
+namespace
+{
+std::string shuffle(const std::string & input, uint32_t element_size)
+{
+  std::string output(input.size(), '\0');
+  byte_shuffle(reinterpret_cast<const std::byte *>(input.data()), input.size(), element_size,
+               reinterpret_cast<std::byte *>(output.data()));
+  return output;
+}
+
+std::string unshuffle(const std::string & input, uint32_t element_size)
+{
+  std::string output(input.size(), '\0');
+  byte_unshuffle(reinterpret_cast<const std::byte *>(input.data()), input.size(), element_size,
+                 reinterpret_cast<std::byte *>(output.data()));
+  return output;
+}
+}  // namespace
+
+TEST(test_byte_shuffle, groups_bytes_of_each_lane)
+{
+  EXPECT_EQ(shuffle("aAbBcC", 2), "abcABC");
+  EXPECT_EQ(shuffle("a1A!b2B@", 4), "ab12AB!@");
+  // Trailing bytes which do not fill an element are kept in place.
+  EXPECT_EQ(shuffle("abcABCxy", 3), "aAbBcCxy");
+  EXPECT_EQ(shuffle("abc", 4), "abc");
+  EXPECT_EQ(shuffle("abcdef", 1), "abcdef");
+}
+
+TEST(test_byte_shuffle, round_trips_every_element_size)
+{
+  std::string payload;
+  for (int i = 0; i < 1003; ++i) {
+    payload += char(i * 7 + i / 13);
+  }
+  for (uint32_t element_size = 1;
+       element_size <= rosbag2_storage_mcap::internal::MAX_SHUFFLE_ELEMENT_SIZE; ++element_size) {
+    const auto shuffled = shuffle(payload, element_size);
+    if (element_size > 1) {
+      EXPECT_NE(shuffled, payload) << element_size;
+    }
+    EXPECT_EQ(unshuffle(shuffled, element_size), payload) << element_size;
+  }
+}
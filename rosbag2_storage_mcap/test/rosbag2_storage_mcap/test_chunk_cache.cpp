@@ -0,0 +1,180 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/chunk_cache.hpp"
+
+#include <gmock/gmock.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using rosbag2_storage_mcap::internal::ChunkCache;
+using rosbag2_storage_mcap::internal::ChunkKey;
+using rosbag2_storage_mcap::internal::ChunkRecords;
+
+static ChunkKey make_key(uint64_t chunk_offset)
+{
+  ChunkKey key;
+  key.file.path = "/a.mcap";
+  key.file.size = 1000;
+  key.file.mtime = 1;
+  key.chunk_offset = chunk_offset;
+  return key;
+}
+
+static ChunkCache::Loader loader_of_size(size_t size, int * loads)
+{
+  return [size, loads](mcap::ByteArray * records) {
+    (*loads)++;
+    records->resize(size);
+    return mcap::Status{};
+  };
+}
+
+TEST(test_chunk_cache, shares_chunk_between_readers)
+{
+  ChunkCache cache{1000};
+  int loads = 0;
+  ChunkRecords first;
+  ChunkRecords second;
+  ASSERT_TRUE(cache.get_or_load(make_key(8), loader_of_size(100, &loads), &first).ok());
+  ASSERT_TRUE(cache.get_or_load(make_key(8), loader_of_size(100, &loads), &second).ok());
+  EXPECT_EQ(loads, 1);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(cache.size(), 100u);
+
+  ChunkRecords other;
+  ASSERT_TRUE(cache.get_or_load(make_key(200), loader_of_size(100, &loads), &other).ok());
+  EXPECT_EQ(loads, 2);
+  EXPECT_NE(first, other);
+}
+
+TEST(test_chunk_cache, evicts_least_recently_used_by_size)
+{
+  ChunkCache cache{250};
+  int loads = 0;
+  ChunkRecords records;
+  cache.get_or_load(make_key(1), loader_of_size(100, &loads), &records);
+  cache.get_or_load(make_key(2), loader_of_size(100, &loads), &records);
+  cache.get_or_load(make_key(1), loader_of_size(100, &loads), &records);
+  cache.get_or_load(make_key(3), loader_of_size(100, &loads), &records);
+  EXPECT_EQ(loads, 3);
+  EXPECT_EQ(cache.size(), 200u);
+  // Chunk 2 was the least recently used.
+  cache.get_or_load(make_key(1), loader_of_size(100, &loads), &records);
+  EXPECT_EQ(loads, 3);
+  cache.get_or_load(make_key(2), loader_of_size(100, &loads), &records);
+  EXPECT_EQ(loads, 4);
+
+  // Evicted chunks stay valid for readers still holding them.
+  ChunkRecords large;
+  cache.get_or_load(make_key(4), loader_of_size(1000, &loads), &large);
+  ASSERT_NE(large, nullptr);
+  EXPECT_EQ(large->size(), 1000u);
+  EXPECT_EQ(cache.size(), 0u);
+}
+
+TEST(test_chunk_cache, reserve_only_grows)
+{
+  ChunkCache cache{100};
+  cache.reserve(50);
+  EXPECT_EQ(cache.capacity(), 100u);
+  cache.reserve(500);
+  EXPECT_EQ(cache.capacity(), 500u);
+}
+
+TEST(test_chunk_cache, failed_load_is_not_cached)
+{
+  ChunkCache cache{1000};
+  ChunkRecords records;
+  auto status = cache.get_or_load(
+    make_key(1),
+    [](mcap::ByteArray *) {
+      return mcap::Status{mcap::StatusCode::DecompressionFailed, "bad chunk"};
+    },
+    &records);
+  EXPECT_FALSE(status.ok());
+  EXPECT_EQ(records, nullptr);
+
+  int loads = 0;
+  EXPECT_TRUE(cache.get_or_load(make_key(1), loader_of_size(10, &loads), &records).ok());
+  EXPECT_EQ(loads, 1);
+  EXPECT_NE(records, nullptr);
+}
+
+TEST(test_chunk_cache, verifies_records_cached_without_a_check)
+{
+  ChunkCache cache{1000};
+  int loads = 0;
+  int verifications = 0;
+  bool corrupt = false;
+  ChunkCache::Verifier verify = [&](const mcap::ByteArray &) {
+    verifications++;
+    return corrupt ? mcap::Status{mcap::StatusCode::InvalidRecord, "bad crc"} : mcap::Status{};
+  };
+  ChunkRecords records;
+
+  // Records loaded without a check are verified once, by the first reader asking for it.
+  ASSERT_TRUE(cache.get_or_load(make_key(1), loader_of_size(10, &loads), &records).ok());
+  ASSERT_TRUE(cache.get_or_load(make_key(1), loader_of_size(10, &loads), &records, verify).ok());
+  ASSERT_TRUE(cache.get_or_load(make_key(1), loader_of_size(10, &loads), &records, verify).ok());
+  EXPECT_EQ(loads, 1);
+  EXPECT_EQ(verifications, 1);
+
+  // Records from a loader which checks them are not verified again.
+  ASSERT_TRUE(cache.get_or_load(make_key(2), loader_of_size(10, &loads), &records, verify).ok());
+  ASSERT_TRUE(cache.get_or_load(make_key(2), loader_of_size(10, &loads), &records, verify).ok());
+  EXPECT_EQ(loads, 2);
+  EXPECT_EQ(verifications, 1);
+
+  // Records failing the check are dropped, and loaded again by the next reader.
+  corrupt = true;
+  ASSERT_TRUE(cache.get_or_load(make_key(3), loader_of_size(10, &loads), &records).ok());
+  EXPECT_FALSE(cache.get_or_load(make_key(3), loader_of_size(10, &loads), &records, verify).ok());
+  EXPECT_EQ(records, nullptr);
+  EXPECT_EQ(cache.size(), 20u);
+  ASSERT_TRUE(cache.get_or_load(make_key(3), loader_of_size(10, &loads), &records).ok());
+  EXPECT_EQ(loads, 4);
+}
+
+TEST(test_chunk_cache, concurrent_readers_decompress_once)
+{
+  ChunkCache cache{1000};
+  std::atomic<int> loads{0};
+  std::vector<std::thread> threads;
+  std::vector<ChunkRecords> results(8);
+  for (size_t i = 0; i < results.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      cache.get_or_load(
+        make_key(1),
+        [&](mcap::ByteArray * records) {
+          loads++;
+          std::this_thread::sleep_for(std::chrono::milliseconds(50));
+          records->resize(10);
+          return mcap::Status{};
+        },
+        &results[i]);
+    });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(loads.load(), 1);
+  for (const auto & result : results) {
+    EXPECT_NE(result, nullptr);
+    EXPECT_EQ(result, results[0]);
+  }
+}
@@ -0,0 +1,415 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rcpputils/filesystem_helper.hpp"
+#include "rosbag2_storage_mcap/chunk_reader.hpp"
+#include "rosbag2_storage_mcap/index_spill.hpp"
+#include "rosbag2_storage_mcap/read_planner.hpp"
+#include "rosbag2_storage_mcap/zstd_frames.hpp"
+#include "rosbag2_test_common/temporary_directory_fixture.hpp"
+
+#include <gmock/gmock.h>
+
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+#include <zstd.h>
+#endif
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+using rosbag2_storage_mcap::internal::ChunkCache;
+using rosbag2_storage_mcap::internal::ChunkedMessageReader;
+using rosbag2_storage_mcap::internal::ChunkRecords;
+using rosbag2_storage_mcap::internal::DownsampleOptions;
+using rosbag2_storage_mcap::internal::MessageSelection;
+using rosbag2_storage_mcap::internal::PlannedFileReader;
+using rosbag2_storage_mcap::internal::SpillingChunkWriter;
+using rosbag2_storage_mcap::internal::WorkerPool;
+
+class ChunkReaderFixture : public rosbag2_test_common::TemporaryDirectoryFixture
+{
+public:
+  // Write messages with the given log times on two channels, alternating, with a chunk size small
+  // enough that each chunk holds a couple of messages.
+  void write_file(const std::vector<mcap::Timestamp> & log_times,
+                  mcap::Compression compression = mcap::Compression::Zstd)
+  {
+    path_ = (rcpputils::fs::path(temporary_dir_path_) / "test.mcap").string();
+    mcap::McapWriter writer;
+    mcap::McapWriterOptions options("test");
+    options.compression = compression;
+    options.chunkSize = 64;
+    ASSERT_TRUE(writer.open(path_, options).ok());
+
+    mcap::Schema schema;
+    schema.name = "schema";
+    writer.addSchema(schema);
+    for (const char * topic : {"/a", "/b"}) {
+      mcap::Channel channel;
+      channel.topic = topic;
+      channel.messageEncoding = "cdr";
+      channel.schemaId = schema.id;
+      writer.addChannel(channel);
+      channel_ids_.push_back(channel.id);
+    }
+
+    const std::string payload = "payload";
+    for (size_t i = 0; i < log_times.size(); ++i) {
+      mcap::Message message;
+      message.channelId = channel_ids_[i % 2];
+      message.sequence = uint32_t(i);
+      message.logTime = log_times[i];
+      message.publishTime = log_times[i];
+      message.dataSize = payload.size();
+      message.data = reinterpret_cast<const std::byte *>(payload.data());
+      ASSERT_TRUE(writer.write(message).ok());
+    }
+    writer.close();
+
+    ASSERT_TRUE(reader_.open(path_).ok());
+    ASSERT_TRUE(reader_.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+    ASSERT_GT(reader_.chunkIndexes().size(), 1u);
+  }
+
+  std::vector<mcap::Timestamp> read_all(ChunkedMessageReader::Options options)
+  {
+    ChunkedMessageReader chunked_reader(*reader_.dataSource(), reader_.chunkIndexes(),
+                                        std::move(options));
+    std::vector<mcap::Timestamp> log_times;
+    while (const auto * message = chunked_reader.next()) {
+      EXPECT_EQ(std::string(reinterpret_cast<const char *>(message->data), message->dataSize),
+                "payload");
+      log_times.push_back(message->logTime);
+    }
+    EXPECT_TRUE(chunked_reader.status().ok()) << chunked_reader.status().message;
+    return log_times;
+  }
+
+  // Change the last payload byte of the chunk at `chunk_offset`, written without compression, so
+  // that the chunk still parses but no longer matches its CRC.
+  void corrupt_chunk(uint64_t chunk_offset)
+  {
+    for (const auto & chunk_index : reader_.chunkIndexes()) {
+      if (chunk_index.chunkStartOffset == chunk_offset) {
+        std::FILE * file = std::fopen(path_.c_str(), "r+b");
+        ASSERT_NE(file, nullptr);
+        std::fseek(file, long(chunk_offset + chunk_index.chunkLength - 1), SEEK_SET);
+        std::fputc('D', file);
+        std::fclose(file);
+      }
+    }
+  }
+
+  std::string path_;
+  std::vector<mcap::ChannelId> channel_ids_;
+  mcap::McapReader reader_;
+};
+
+TEST_F(ChunkReaderFixture, reads_in_file_order_from_start_time)
+{
+  write_file({10, 20, 30, 40, 50, 60, 70, 80});
+  ChunkedMessageReader::Options options;
+  options.start_time = 45;
+  EXPECT_EQ(read_all(options), (std::vector<mcap::Timestamp>{50, 60, 70, 80}));
+}
+
+TEST_F(ChunkReaderFixture, merges_overlapping_chunks_in_log_time_order)
+{
+  write_file({50, 10, 60, 20, 70, 30, 80, 40});
+  ChunkedMessageReader::Options options;
+  options.read_order = ChunkedMessageReader::ReadOrder::LogTimeOrder;
+  EXPECT_EQ(read_all(options), (std::vector<mcap::Timestamp>{10, 20, 30, 40, 50, 60, 70, 80}));
+
+  options.read_order = ChunkedMessageReader::ReadOrder::ReverseLogTimeOrder;
+  EXPECT_EQ(read_all(options), (std::vector<mcap::Timestamp>{80, 70, 60, 50, 40, 30, 20, 10}));
+}
+
+TEST_F(ChunkReaderFixture, filters_by_channel)
+{
+  write_file({10, 20, 30, 40, 50, 60});
+  ChunkedMessageReader::Options options;
+  options.read_order = ChunkedMessageReader::ReadOrder::LogTimeOrder;
+  const auto channel_id = channel_ids_[1];
+  options.channel_filter = [channel_id](mcap::ChannelId id) { return id == channel_id; };
+  EXPECT_EQ(read_all(options), (std::vector<mcap::Timestamp>{20, 40, 60}));
+}
+
+TEST_F(ChunkReaderFixture, decodes_on_workers_in_the_same_order)
+{
+  write_file({50, 10, 60, 20, 70, 30, 80, 40, 90, 100, 110, 120});
+  for (auto read_order :
+       {ChunkedMessageReader::ReadOrder::FileOrder, ChunkedMessageReader::ReadOrder::LogTimeOrder,
+        ChunkedMessageReader::ReadOrder::ReverseLogTimeOrder}) {
+    ChunkedMessageReader::Options options;
+    options.read_order = read_order;
+    options.start_time = 20;
+    const auto expected = read_all(options);
+    ASSERT_FALSE(expected.empty());
+
+    options.workers = std::make_shared<WorkerPool>(3);
+    EXPECT_EQ(read_all(options), expected);
+  }
+}
+
+TEST_F(ChunkReaderFixture, stops_decoding_when_destroyed_early)
+{
+  write_file({10, 20, 30, 40, 50, 60, 70, 80});
+  ChunkedMessageReader::Options options;
+  options.workers = std::make_shared<WorkerPool>(2);
+  ChunkedMessageReader chunked_reader(*reader_.dataSource(), reader_.chunkIndexes(), options);
+  ASSERT_NE(chunked_reader.next(), nullptr);
+}
+
+TEST_F(ChunkReaderFixture, reads_only_selected_messages)
+{
+  write_file({10, 20, 30, 40, 50, 60, 70, 80, 90, 100, 110, 120});
+  const auto channel_id = channel_ids_[0];
+  auto channel_filter = [channel_id](mcap::ChannelId id) { return id == channel_id; };
+
+  // Channel 0 has messages at 10, 30, ..., 110; keep at most one per 35ns.
+  DownsampleOptions downsample;
+  downsample.max_rate = 1e9 / 35;
+  auto selection = std::make_shared<MessageSelection>();
+  ASSERT_TRUE(rosbag2_storage_mcap::internal::select_messages(*reader_.dataSource(),
+                                                              reader_.chunkIndexes(), 0,
+                                                              channel_filter, downsample,
+                                                              selection.get())
+                .ok());
+
+  ChunkedMessageReader::Options options;
+  options.read_order = ChunkedMessageReader::ReadOrder::LogTimeOrder;
+  options.channel_filter = channel_filter;
+  options.selection = selection;
+  EXPECT_EQ(read_all(options), (std::vector<mcap::Timestamp>{10, 50, 90}));
+
+  // Chunks without a selected message are not read.
+  ChunkedMessageReader chunked_reader(*reader_.dataSource(), reader_.chunkIndexes(), options);
+  EXPECT_EQ(chunked_reader.chunks().size(), selection->size());
+  EXPECT_LT(chunked_reader.chunks().size(), reader_.chunkIndexes().size());
+
+  downsample.max_rate = 0;
+  downsample.every_nth = 2;
+  ASSERT_TRUE(rosbag2_storage_mcap::internal::select_messages(*reader_.dataSource(),
+                                                              reader_.chunkIndexes(), 0,
+                                                              channel_filter, downsample,
+                                                              selection.get())
+                .ok());
+  EXPECT_EQ(read_all(options), (std::vector<mcap::Timestamp>{10, 50, 90}));
+}
+
+TEST_F(ChunkReaderFixture, checks_chunk_crcs_inline_or_in_the_background)
+{
+  write_file({10, 20, 30, 40, 50, 60, 70, 80}, mcap::Compression::None);
+  const uint64_t corrupt_offset = reader_.chunkIndexes()[1].chunkStartOffset;
+  corrupt_chunk(corrupt_offset);
+
+  // Skipping the check delivers the corrupt payload.
+  {
+    ChunkedMessageReader chunked_reader(*reader_.dataSource(), reader_.chunkIndexes(), {});
+    size_t count = 0;
+    while (chunked_reader.next()) {
+      count++;
+    }
+    EXPECT_TRUE(chunked_reader.status().ok());
+    EXPECT_EQ(count, 8u);
+  }
+
+  ChunkedMessageReader::Options options;
+  options.crc_check = rosbag2_storage_mcap::internal::ChunkCrcCheck::Inline;
+  for (const bool background : {false, true}) {
+    if (background) {
+      options.crc_check = rosbag2_storage_mcap::internal::ChunkCrcCheck::Background;
+      options.crc_workers = std::make_shared<WorkerPool>(1);
+    }
+    ChunkedMessageReader chunked_reader(*reader_.dataSource(), reader_.chunkIndexes(), options);
+    std::vector<std::string> payloads;
+    while (const auto * message = chunked_reader.next()) {
+      payloads.emplace_back(reinterpret_cast<const char *>(message->data), message->dataSize);
+    }
+    EXPECT_FALSE(chunked_reader.status().ok());
+    EXPECT_THAT(chunked_reader.status().message,
+                testing::HasSubstr("offset " + std::to_string(corrupt_offset)));
+    if (!background) {
+      // No message of the corrupt chunk is delivered.
+      EXPECT_THAT(payloads, testing::Each(testing::Eq("payload")));
+    }
+  }
+}
+
+TEST_F(ChunkReaderFixture, checks_chunks_cached_by_readers_which_skip_the_check)
+{
+  write_file({10, 20, 30, 40, 50, 60, 70, 80}, mcap::Compression::None);
+  const uint64_t corrupt_offset = reader_.chunkIndexes()[1].chunkStartOffset;
+  corrupt_chunk(corrupt_offset);
+
+  ChunkCache cache{1 << 20};
+  ChunkedMessageReader::Options options;
+  options.load_chunk = [this, &cache](const mcap::ChunkIndex & chunk_index,
+                                      const ChunkCache::Loader & load,
+                                      const ChunkCache::Verifier & verify, ChunkRecords * records) {
+    rosbag2_storage_mcap::internal::ChunkKey key;
+    key.file.path = path_;
+    key.chunk_offset = chunk_index.chunkStartOffset;
+    return cache.get_or_load(key, load, records, verify);
+  };
+  // Fills the cache with every chunk, unchecked.
+  {
+    ChunkedMessageReader chunked_reader(*reader_.dataSource(), reader_.chunkIndexes(), options);
+    while (chunked_reader.next()) {
+    }
+    ASSERT_TRUE(chunked_reader.status().ok());
+  }
+
+  for (const bool background : {true, false}) {
+    options.crc_check = background ? rosbag2_storage_mcap::internal::ChunkCrcCheck::Background
+                                   : rosbag2_storage_mcap::internal::ChunkCrcCheck::Inline;
+    options.crc_workers = background ? std::make_shared<WorkerPool>(1) : nullptr;
+    ChunkedMessageReader chunked_reader(*reader_.dataSource(), reader_.chunkIndexes(), options);
+    while (chunked_reader.next()) {
+    }
+    EXPECT_THAT(chunked_reader.status().message,
+                testing::HasSubstr("offset " + std::to_string(corrupt_offset)));
+  }
+}
+
+TEST_F(ChunkReaderFixture, verifies_chunk_crcs_on_several_threads)
+{
+  write_file({10, 20, 30, 40, 50, 60, 70, 80, 90, 100, 110, 120}, mcap::Compression::None);
+  const auto & chunk_indexes = reader_.chunkIndexes();
+  const uint64_t corrupt_offset = chunk_indexes[chunk_indexes.size() - 2].chunkStartOffset;
+  corrupt_chunk(corrupt_offset);
+
+  std::atomic<size_t> opened{0};
+  auto open_data_source = [this, &opened](const std::vector<const mcap::ChunkIndex *> & chunks)
+    -> std::unique_ptr<mcap::IReadable> {
+    EXPECT_FALSE(chunks.empty());
+    auto data_source = std::make_unique<PlannedFileReader>(PlannedFileReader::Options{});
+    if (!data_source->open(path_).ok()) {
+      return nullptr;
+    }
+    opened++;
+    return data_source;
+  };
+  rosbag2_storage_mcap::internal::ChunkCrcReport report;
+  ASSERT_TRUE(
+    rosbag2_storage_mcap::internal::verify_chunk_crcs(chunk_indexes, 3, open_data_source, &report)
+      .ok());
+  EXPECT_EQ(opened, 3u);
+  EXPECT_EQ(report.chunk_count, chunk_indexes.size());
+  EXPECT_EQ(report.unchecked_chunk_count, 0u);
+  EXPECT_EQ(report.corrupt_chunk_offsets, std::vector<uint64_t>{corrupt_offset});
+}
+
+#ifndef MCAP_COMPRESSION_NO_ZSTD
+TEST(test_chunk_reader, decompresses_zstd_frames_on_workers)
+{
+  std::string uncompressed;
+  std::string compressed;
+  for (const char c : {'a', 'b', 'c'}) {
+    const std::string part(1000, c);
+    std::string frame(ZSTD_compressBound(part.size()), '\0');
+    const size_t frame_size =
+      ZSTD_compress(frame.data(), frame.size(), part.data(), part.size(), 1);
+    ASSERT_FALSE(ZSTD_isError(frame_size));
+    uncompressed += part;
+    compressed += frame.substr(0, frame_size);
+  }
+  const auto * data = reinterpret_cast<const std::byte *>(compressed.data());
+
+  WorkerPool frame_workers(2);
+  mcap::ByteArray records;
+  ASSERT_TRUE(rosbag2_storage_mcap::internal::decompress_chunk("zstd", data, compressed.size(),
+                                                               uncompressed.size(), &records,
+                                                               &frame_workers)
+                .ok());
+  EXPECT_EQ(std::string(reinterpret_cast<const char *>(records.data()), records.size()),
+            uncompressed);
+
+  // A size mismatch is reported as it is without workers.
+  EXPECT_FALSE(rosbag2_storage_mcap::internal::decompress_chunk("zstd", data, compressed.size(),
+                                                                uncompressed.size() + 1, &records,
+                                                                &frame_workers)
+                 .ok());
+}
+
+TEST_F(ChunkReaderFixture, decompresses_the_frames_of_chunks_written_as_several_frames)
+{
+  path_ = (rcpputils::fs::path(temporary_dir_path_) / "framed.mcap").string();
+  mcap::McapWriterOptions options("test");
+  options.compression = mcap::Compression::Zstd;
+  options.chunkSize = 64 * 1024;
+  SpillingChunkWriter output(options, "", SpillingChunkWriter::DEFAULT_MEMORY_LIMIT, 4096);
+  ASSERT_TRUE(output.open(path_).ok());
+  mcap::McapWriter writer;
+  writer.open(output, SpillingChunkWriter::writer_options(options));
+  mcap::Schema schema;
+  schema.name = "schema";
+  writer.addSchema(schema);
+  mcap::Channel channel;
+  channel.topic = "/a";
+  channel.messageEncoding = "cdr";
+  channel.schemaId = schema.id;
+  writer.addChannel(channel);
+  std::vector<std::string> payloads;
+  for (uint32_t i = 0; i < 200; ++i) {
+    payloads.push_back("payload " + std::to_string(i) + std::string(1000, char('a' + i % 26)));
+    mcap::Message message;
+    message.channelId = channel.id;
+    message.sequence = i;
+    message.logTime = i;
+    message.publishTime = i;
+    message.dataSize = payloads.back().size();
+    message.data = reinterpret_cast<const std::byte *>(payloads.back().data());
+    ASSERT_TRUE(writer.write(message).ok());
+  }
+  writer.close();
+
+  ASSERT_TRUE(reader_.open(path_).ok());
+  ASSERT_TRUE(reader_.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+  ASSERT_FALSE(reader_.chunkIndexes().empty());
+  for (const auto & chunk_index : reader_.chunkIndexes()) {
+    rosbag2_storage_mcap::internal::CompressedChunk chunk;
+    ASSERT_TRUE(rosbag2_storage_mcap::internal::read_compressed_chunk(*reader_.dataSource(),
+                                                                      chunk_index, &chunk)
+                  .ok());
+    EXPECT_EQ(chunk.compression, "zstd");
+    // The frames are found from their index.
+    std::vector<rosbag2_storage_mcap::internal::ZstdFrame> frames;
+    ASSERT_TRUE(rosbag2_storage_mcap::internal::read_zstd_frame_index(
+      chunk.data.data(), chunk.data.size(), &frames));
+    EXPECT_GT(frames.size(), 1u);
+    for (const auto & frame : frames) {
+      EXPECT_LE(frame.size, 4096u);
+    }
+  }
+
+  ChunkedMessageReader::Options read_options;
+  read_options.frame_workers = std::make_shared<WorkerPool>(3);
+  read_options.crc_check = rosbag2_storage_mcap::internal::ChunkCrcCheck::Inline;
+  ChunkedMessageReader chunked_reader(*reader_.dataSource(), reader_.chunkIndexes(),
+                                      read_options);
+  size_t count = 0;
+  while (const auto * message = chunked_reader.next()) {
+    ASSERT_LT(count, payloads.size());
+    EXPECT_EQ(std::string(reinterpret_cast<const char *>(message->data), message->dataSize),
+              payloads[count]);
+    count++;
+  }
+  EXPECT_TRUE(chunked_reader.status().ok()) << chunked_reader.status().message;
+  EXPECT_EQ(count, payloads.size());
+}
+#endif
@@ -0,0 +1,50 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/crc32.hpp"
+
+#include <gmock/gmock.h>
+
+#include <string>
+
+using rosbag2_storage_mcap::internal::crc32;
+using rosbag2_storage_mcap::internal::crc32_update;
+using rosbag2_storage_mcap::internal::CRC32_INIT;
+
+static const std::byte * bytes(const std::string & data)
+{
+  return reinterpret_cast<const std::byte *>(data.data());
+}
+
+TEST(test_crc32, matches_known_values)
+{
+  EXPECT_EQ(crc32(nullptr, 0), 0u);
+  EXPECT_EQ(crc32(bytes("123456789"), 9), 0xCBF43926u);
+  const std::string fox = "The quick brown fox jumps over the lazy dog";
+  EXPECT_EQ(crc32(bytes(fox), fox.size()), 0x414FA339u);
+}
+
+TEST(test_crc32, continues_across_updates_of_any_size)
+{
+  std::string data;
+  for (int i = 0; i < 1000; ++i) {
+    data.push_back(char(i * 31 + 7));
+  }
+  const uint32_t expected = crc32(bytes(data), data.size());
+  for (size_t split : {1u, 3u, 8u, 13u, 500u, 999u}) {
+    uint32_t crc = crc32_update(CRC32_INIT, bytes(data), split);
+    crc = crc32_update(crc, bytes(data) + split, data.size() - split);
+    EXPECT_EQ(crc ^ 0xffffffff, expected) << split;
+  }
+}
@@ -0,0 +1,73 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rcpputils/filesystem_helper.hpp"
+#include "rosbag2_storage_mcap/file_migrator.hpp"
+#include "rosbag2_test_common/temporary_directory_fixture.hpp"
+
+#include <gmock/gmock.h>
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+using rosbag2_storage_mcap::internal::FileMigrator;
+using TemporaryDirectoryFixture = rosbag2_test_common::TemporaryDirectoryFixture;
+
+static std::string read_file(const std::string & path)
+{
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+TEST_F(TemporaryDirectoryFixture, migrator_moves_file_to_new_directory)
+{
+  const auto source = (rcpputils::fs::path(temporary_dir_path_) / "scratch.mcap").string();
+  const auto destination =
+    (rcpputils::fs::path(temporary_dir_path_) / "bulk" / "nested" / "bag.mcap").string();
+  std::string contents;
+  for (size_t i = 0; i < 300000; ++i) {
+    contents += char(i * 7);
+  }
+  {
+    std::ofstream out(source, std::ios::binary);
+    out << contents;
+  }
+
+  auto & migrator = FileMigrator::instance();
+  const auto start = std::chrono::steady_clock::now();
+  migrator.migrate(source, destination, 1000000);
+  EXPECT_EQ(migrator.backlog_bytes(), contents.size());
+  migrator.wait_until_idle();
+  // 300 kB at 1 MB/s.
+  EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(250));
+
+  EXPECT_EQ(migrator.backlog_bytes(), 0u);
+  EXPECT_FALSE(rcpputils::fs::exists(source));
+  EXPECT_FALSE(rcpputils::fs::exists(destination + ".part"));
+  EXPECT_EQ(read_file(destination), contents);
+}
+
+TEST_F(TemporaryDirectoryFixture, migrator_keeps_destination_untouched_on_failure)
+{
+  const auto source = (rcpputils::fs::path(temporary_dir_path_) / "missing.mcap").string();
+  const auto destination = (rcpputils::fs::path(temporary_dir_path_) / "bag.mcap").string();
+
+  auto & migrator = FileMigrator::instance();
+  migrator.migrate(source, destination, 0);
+  migrator.wait_until_idle();
+  EXPECT_FALSE(rcpputils::fs::exists(destination));
+  EXPECT_FALSE(rcpputils::fs::exists(destination + ".part"));
+}
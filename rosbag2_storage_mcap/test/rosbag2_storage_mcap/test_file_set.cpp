@@ -0,0 +1,110 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rcpputils/filesystem_helper.hpp"
+#include "rosbag2_storage_mcap/file_set.hpp"
+#include "rosbag2_test_common/temporary_directory_fixture.hpp"
+
+#include <gmock/gmock.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using rosbag2_storage_mcap::internal::FileSetManifest;
+using rosbag2_storage_mcap::internal::ParallelFileWriter;
+using TemporaryDirectoryFixture = rosbag2_test_common::TemporaryDirectoryFixture;
+
+TEST(test_file_set, manifest_round_trips_through_metadata)
+{
+  FileSetManifest manifest;
+  manifest.files = {"a/bag_0.0.mcap", "/mnt/disk1/bag_0.1.mcap"};
+  const auto metadata = manifest.to_metadata();
+  EXPECT_EQ(metadata.name, FileSetManifest::METADATA_NAME);
+  auto parsed = FileSetManifest::from_metadata(metadata);
+  ASSERT_TRUE(parsed.has_value());
+  EXPECT_EQ(parsed->files, manifest.files);
+  EXPECT_TRUE(parsed->topic_patterns.empty());
+
+  manifest.topic_patterns = {"/camera/.*", ""};
+  parsed = FileSetManifest::from_metadata(manifest.to_metadata());
+  ASSERT_TRUE(parsed.has_value());
+  EXPECT_EQ(parsed->topic_patterns, manifest.topic_patterns);
+}
+
+TEST(test_file_set, rejects_malformed_manifest)
+{
+  mcap::Metadata metadata;
+  metadata.name = "other";
+  EXPECT_FALSE(FileSetManifest::from_metadata(metadata).has_value());
+
+  metadata.name = FileSetManifest::METADATA_NAME;
+  EXPECT_FALSE(FileSetManifest::from_metadata(metadata).has_value());
+
+  metadata.metadata["file_count"] = "2";
+  metadata.metadata["file.0"] = "a.mcap";
+  EXPECT_FALSE(FileSetManifest::from_metadata(metadata).has_value());
+
+  metadata.metadata["file.1"] = "b.mcap";
+  EXPECT_TRUE(FileSetManifest::from_metadata(metadata).has_value());
+}
+
+TEST_F(TemporaryDirectoryFixture, parallel_writer_writes_each_file_in_order)
+{
+  std::vector<std::string> paths;
+  for (const char * name : {"a.mcap", "b.mcap"}) {
+    paths.push_back((rcpputils::fs::path(temporary_dir_path_) / name).string());
+  }
+  {
+    // A tiny queue makes write() wait for the writer threads.
+    ParallelFileWriter writer{16};
+    ASSERT_TRUE(writer.open(paths, mcap::McapWriterOptions("test")).ok());
+    mcap::Schema schema;
+    schema.name = "schema";
+    writer.add_schema(schema);
+    mcap::Channel channel;
+    channel.topic = "/a";
+    channel.messageEncoding = "cdr";
+    channel.schemaId = schema.id;
+    writer.add_channel(channel);
+
+    for (size_t i = 0; i < 100; ++i) {
+      auto payload = std::make_shared<std::string>("payload " + std::to_string(i));
+      mcap::Message message;
+      message.channelId = channel.id;
+      message.logTime = i;
+      message.publishTime = i;
+      message.dataSize = payload->size();
+      message.data = reinterpret_cast<const std::byte *>(payload->data());
+      ASSERT_TRUE(writer.write(i % 2, message, payload).ok());
+    }
+    EXPECT_TRUE(writer.close().ok());
+  }
+
+  for (size_t file = 0; file < paths.size(); ++file) {
+    mcap::McapReader reader;
+    ASSERT_TRUE(reader.open(paths[file]).ok());
+    std::vector<mcap::Timestamp> log_times;
+    for (const auto & view : reader.readMessages()) {
+      EXPECT_EQ(std::string(reinterpret_cast<const char *>(view.message.data),
+                            view.message.dataSize),
+                "payload " + std::to_string(view.message.logTime));
+      log_times.push_back(view.message.logTime);
+    }
+    ASSERT_EQ(log_times.size(), 50u);
+    for (size_t i = 0; i < log_times.size(); ++i) {
+      EXPECT_EQ(log_times[i], 2 * i + file);
+    }
+  }
+}
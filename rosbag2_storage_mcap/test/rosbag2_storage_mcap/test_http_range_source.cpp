@@ -0,0 +1,334 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rcpputils/filesystem_helper.hpp"
+#include "rosbag2_storage_mcap/http_range_source.hpp"
+#include "rosbag2_storage_mcap/read_planner.hpp"
+#include "rosbag2_test_common/temporary_directory_fixture.hpp"
+
+#include <gmock/gmock.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using rosbag2_storage_mcap::internal::HttpRangeSource;
+using rosbag2_storage_mcap::internal::PlannedFileReader;
+using TemporaryDirectoryFixture = rosbag2_test_common::TemporaryDirectoryFixture;
+
+namespace
+{
+/// Serves one file over HTTP/1.1 on a local port, answering "Range: bytes=a-b" requests and
+/// checking "If-Match" preconditions.
+class LocalHttpServer
+{
+public:
+  explicit LocalHttpServer(std::string content, bool support_ranges = true,
+                           bool send_etag = true)
+      : content_(std::move(content))
+      , support_ranges_(support_ranges)
+      , send_etag_(send_etag)
+  {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener_, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    socklen_t length = sizeof(address);
+    getsockname(listener_, reinterpret_cast<sockaddr *>(&address), &length);
+    port_ = ntohs(address.sin_port);
+    listen(listener_, 16);
+    accept_thread_ = std::thread([this]() { accept_connections(); });
+  }
+
+  ~LocalHttpServer()
+  {
+    shutdown(listener_, SHUT_RDWR);
+    close(listener_);
+    accept_thread_.join();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const int connection : connections_) {
+      shutdown(connection, SHUT_RDWR);
+    }
+    for (auto & thread : threads_) {
+      thread.join();
+    }
+    for (const int connection : connections_) {
+      close(connection);
+    }
+  }
+
+  std::string url(const std::string & name = "file.mcap") const
+  {
+    return "http://127.0.0.1:" + std::to_string(port_) + "/" + name;
+  }
+
+  /// Replace the file, as a new version with the ETag `etag`.
+  void replace(std::string content, std::string etag)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    content_ = std::move(content);
+    etag_ = std::move(etag);
+  }
+
+private:
+  void accept_connections()
+  {
+    while (true) {
+      const int connection = accept(listener_, nullptr, nullptr);
+      if (connection < 0) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      connections_.push_back(connection);
+      threads_.emplace_back([this, connection]() { serve(connection); });
+    }
+  }
+
+  void serve(int connection)
+  {
+    std::string received;
+    char buffer[4096];
+    while (true) {
+      const auto header_end = received.find("\r\n\r\n");
+      if (header_end == std::string::npos) {
+        const auto count = recv(connection, buffer, sizeof(buffer), 0);
+        if (count <= 0) {
+          return;
+        }
+        received.append(buffer, size_t(count));
+        continue;
+      }
+      const std::string request = received.substr(0, header_end);
+      received.erase(0, header_end + 4);
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      const std::string content = content_;
+      const std::string etag = etag_;
+      lock.unlock();
+      std::string response;
+      const auto range = request.find("Range: bytes=");
+      const auto if_match = request.find("If-Match: ");
+      if (send_etag_ && if_match != std::string::npos &&
+          request.substr(if_match + 10, request.find("\r\n", if_match) - if_match - 10) != etag) {
+        response = "HTTP/1.1 412 Precondition Failed\r\nContent-Length: 0\r\n\r\n";
+      } else if (support_ranges_ && range != std::string::npos) {
+        const auto dash = request.find('-', range);
+        const size_t first = std::stoul(request.substr(range + 13, dash - range - 13));
+        const size_t last = std::min(size_t(std::stoul(request.substr(dash + 1))),
+                                     content.size() - 1);
+        response = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " +
+                   std::to_string(first) + "-" + std::to_string(last) + "/" +
+                   std::to_string(content.size()) + (send_etag_ ? "\r\nETag: " + etag : "") +
+                   "\r\nContent-Length: " + std::to_string(last - first + 1) + "\r\n\r\n" +
+                   content.substr(first, last - first + 1);
+      } else {
+        response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(content.size()) +
+                   "\r\n\r\n" + content;
+      }
+      if (send(connection, response.data(), response.size(), MSG_NOSIGNAL) < 0) {
+        return;
+      }
+    }
+  }
+
+  std::string content_;
+  std::string etag_ = "\"v1\"";
+  bool support_ranges_;
+  bool send_etag_;
+  int listener_ = -1;
+  uint16_t port_ = 0;
+  std::thread accept_thread_;
+  std::mutex mutex_;
+  std::vector<int> connections_;
+  std::vector<std::thread> threads_;
+};
+
+std::string make_content(size_t size)
+{
+  std::string content;
+  for (size_t i = 0; i < size; ++i) {
+    content += char(i * 31 + i / 256);
+  }
+  return content;
+}
+
+std::string read_range(HttpRangeSource & source, uint64_t offset, uint64_t length)
+{
+  std::string data(length, '\0');
+  EXPECT_TRUE(source.read(offset, length, reinterpret_cast<std::byte *>(data.data())));
+  return data;
+}
+}  // namespace
+
+TEST(test_http_range_source, recognizes_http_urls)
+{
+  EXPECT_TRUE(rosbag2_storage_mcap::internal::is_http_url("http://host/bag.mcap"));
+  EXPECT_TRUE(rosbag2_storage_mcap::internal::is_http_url("https://host/bag.mcap"));
+  EXPECT_FALSE(rosbag2_storage_mcap::internal::is_http_url("/data/http/bag.mcap"));
+  EXPECT_FALSE(rosbag2_storage_mcap::internal::is_http_url("bag.mcap"));
+}
+
+TEST(test_http_range_source, reads_ranges_through_block_cache)
+{
+  const auto content = make_content(10000);
+  LocalHttpServer server(content);
+  HttpRangeSource::Options options;
+  options.block_size = 1024;
+  std::shared_ptr<HttpRangeSource> source;
+  ASSERT_TRUE(HttpRangeSource::open_shared(server.url(), options, source).ok());
+  EXPECT_EQ(source->size(), content.size());
+  EXPECT_EQ(source->version(), "\"v1\"");
+
+  // Blocks 0 to 3 are fetched with a single request.
+  EXPECT_EQ(read_range(*source, 1000, 3000), content.substr(1000, 3000));
+  EXPECT_EQ(source->request_count(), 2u);
+  EXPECT_EQ(read_range(*source, 2000, 100), content.substr(2000, 100));
+  EXPECT_EQ(source->request_count(), 2u);
+  // The last block is short.
+  EXPECT_EQ(read_range(*source, 9000, 1000), content.substr(9000, 1000));
+  std::string out_of_range(10, '\0');
+  EXPECT_FALSE(source->read(9995, 10, reinterpret_cast<std::byte *>(out_of_range.data())));
+
+  // Readers of the same URL share the source.
+  std::shared_ptr<HttpRangeSource> other;
+  ASSERT_TRUE(HttpRangeSource::open_shared(server.url(), options, other).ok());
+  EXPECT_EQ(other, source);
+}
+
+TEST(test_http_range_source, evicts_blocks_beyond_memory_cache_size)
+{
+  const auto content = make_content(8192);
+  LocalHttpServer server(content);
+  HttpRangeSource::Options options;
+  options.block_size = 1024;
+  options.memory_cache_size = 2048;
+  std::shared_ptr<HttpRangeSource> source;
+  ASSERT_TRUE(HttpRangeSource::open_shared(server.url(), options, source).ok());
+
+  EXPECT_EQ(read_range(*source, 0, 8192), content);
+  const auto requests = source->request_count();
+  EXPECT_EQ(read_range(*source, 7168, 1024), content.substr(7168));
+  EXPECT_EQ(source->request_count(), requests);
+  EXPECT_EQ(read_range(*source, 0, 1024), content.substr(0, 1024));
+  EXPECT_EQ(source->request_count(), requests + 1);
+}
+
+TEST(test_http_range_source, fails_reads_of_file_replaced_on_server)
+{
+  const auto content = make_content(4096);
+  LocalHttpServer server(content);
+  HttpRangeSource::Options options;
+  options.block_size = 1024;
+  std::shared_ptr<HttpRangeSource> source;
+  ASSERT_TRUE(HttpRangeSource::open_shared(server.url(), options, source).ok());
+  EXPECT_EQ(read_range(*source, 0, 1024), content.substr(0, 1024));
+
+  auto replacement = content;
+  std::reverse(replacement.begin(), replacement.end());
+  server.replace(replacement, "\"v2\"");
+  // Blocks of the old version are only served from the cache, never mixed with the new one.
+  std::string data(1024, '\0');
+  EXPECT_FALSE(source->read(1024, 1024, reinterpret_cast<std::byte *>(data.data())));
+  EXPECT_EQ(read_range(*source, 0, 1024), content.substr(0, 1024));
+
+  // Opening the URL again reads the new version from a source of its own.
+  std::shared_ptr<HttpRangeSource> replaced;
+  ASSERT_TRUE(HttpRangeSource::open_shared(server.url(), options, replaced).ok());
+  EXPECT_NE(replaced, source);
+  EXPECT_EQ(replaced->version(), "\"v2\"");
+  EXPECT_EQ(read_range(*replaced, 1024, 1024), replacement.substr(1024, 1024));
+}
+
+TEST_F(TemporaryDirectoryFixture, http_range_source_reuses_disk_cache)
+{
+  const auto content = make_content(5000);
+  LocalHttpServer server(content);
+  HttpRangeSource::Options options;
+  options.block_size = 1024;
+  options.cache_directory = (rcpputils::fs::path(temporary_dir_path_) / "cache").string();
+  {
+    std::shared_ptr<HttpRangeSource> source;
+    ASSERT_TRUE(HttpRangeSource::open_shared(server.url(), options, source).ok());
+    EXPECT_EQ(read_range(*source, 0, 5000), content);
+  }
+  std::shared_ptr<HttpRangeSource> source;
+  ASSERT_TRUE(HttpRangeSource::open_shared(server.url(), options, source).ok());
+  EXPECT_EQ(read_range(*source, 0, 5000), content);
+  // Only the request finding the size of the file.
+  EXPECT_EQ(source->request_count(), 1u);
+}
+
+TEST_F(TemporaryDirectoryFixture, http_range_source_does_not_cache_unversioned_file_on_disk)
+{
+  const auto content = make_content(5000);
+  LocalHttpServer server(content, true, false);
+  HttpRangeSource::Options options;
+  options.block_size = 1024;
+  options.cache_directory = (rcpputils::fs::path(temporary_dir_path_) / "cache").string();
+  for (int run = 0; run < 2; ++run) {
+    std::shared_ptr<HttpRangeSource> source;
+    ASSERT_TRUE(HttpRangeSource::open_shared(server.url(), options, source).ok());
+    EXPECT_EQ(source->version(), "");
+    EXPECT_EQ(read_range(*source, 0, 5000), content);
+    // Without an ETag or Last-Modified time, a replaced file could not be told apart.
+    EXPECT_GT(source->request_count(), 1u);
+  }
+}
+
+TEST(test_http_range_source, rejects_server_without_range_support)
+{
+  LocalHttpServer server(make_content(100), false);
+  std::shared_ptr<HttpRangeSource> source;
+  EXPECT_FALSE(HttpRangeSource::open_shared(server.url(), {}, source).ok());
+  EXPECT_EQ(source, nullptr);
+}
+
+TEST(test_http_range_source, planned_reader_prefetches_upcoming_ranges)
+{
+  const auto content = make_content(64 * 1024);
+  LocalHttpServer server(content);
+  PlannedFileReader::Options options;
+  options.coalesce_gap = 0;
+  options.read_ahead = 1;
+  options.http.block_size = 4096;
+  PlannedFileReader reader(options);
+  ASSERT_TRUE(reader.open(server.url()).ok());
+  EXPECT_EQ(reader.size(), content.size());
+  reader.set_plan({{0, 8192}, {32768, 8192}});
+
+  std::byte * data = nullptr;
+  ASSERT_EQ(reader.read(&data, 100, 50), 50u);
+  EXPECT_EQ(std::string(reinterpret_cast<const char *>(data), 50), content.substr(100, 50));
+
+  // The next planned range is downloaded in the background.
+  std::shared_ptr<HttpRangeSource> source;
+  ASSERT_TRUE(HttpRangeSource::open_shared(server.url(), {}, source).ok());
+  for (int i = 0; i < 500 && source->request_count() < 3; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_EQ(source->request_count(), 3u);
+  ASSERT_EQ(reader.read(&data, 32768, 8192), 8192u);
+  EXPECT_EQ(std::string(reinterpret_cast<const char *>(data), 8192), content.substr(32768, 8192));
+  EXPECT_EQ(source->request_count(), 3u);
+}
@@ -0,0 +1,379 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/crc32.hpp"
+#include "rosbag2_storage_mcap/index_spill.hpp"
+#include "rosbag2_storage_mcap/summary_cache.hpp"
+#include "rosbag2_test_common/temporary_directory_fixture.hpp"
+
+#include <gmock/gmock.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+using rosbag2_storage_mcap::internal::SpillingChunkWriter;
+
+class IndexSpillFixture : public rosbag2_test_common::TemporaryDirectoryFixture
+{
+public:
+  IndexSpillFixture()
+      : options_("test")
+  {
+    options_.chunkSize = 256;
+    options_.noChunkCRC = false;
+    options_.enableDataCRC = true;
+  }
+
+  // Write 500 messages on two channels, with a metadata record in the middle.
+  void write_messages(mcap::McapWriter & writer)
+  {
+    mcap::Schema schema;
+    schema.name = "schema";
+    writer.addSchema(schema);
+    std::vector<mcap::ChannelId> channel_ids;
+    for (const char * topic : {"/a", "/b"}) {
+      mcap::Channel channel;
+      channel.topic = topic;
+      channel.messageEncoding = "cdr";
+      channel.schemaId = schema.id;
+      writer.addChannel(channel);
+      channel_ids.push_back(channel.id);
+    }
+    const std::string payload(20, 'x');
+    for (uint32_t i = 0; i < 500; ++i) {
+      mcap::Message message;
+      message.channelId = channel_ids[i % 2];
+      message.sequence = i;
+      message.logTime = 1000 + i;
+      message.publishTime = message.logTime;
+      message.dataSize = payload.size();
+      message.data = reinterpret_cast<const std::byte *>(payload.data());
+      ASSERT_TRUE(writer.write(message).ok());
+      if (i == 250) {
+        ASSERT_TRUE(writer.write(mcap::Metadata{"middle", {{"key", "value"}}}).ok());
+      }
+    }
+  }
+
+  std::string path(const std::string & name) const
+  {
+    return (std::filesystem::path(temporary_dir_path_) / name).string();
+  }
+
+  mcap::McapWriterOptions options_;
+};
+
+TEST_F(IndexSpillFixture, writes_the_same_indexes_as_the_mcap_writer)
+{
+  mcap::McapWriter expected_writer;
+  ASSERT_TRUE(expected_writer.open(path("expected.mcap"), options_).ok());
+  write_messages(expected_writer);
+  expected_writer.close();
+
+  // Spill every chunk index as soon as it is written.
+  SpillingChunkWriter output(options_, temporary_dir_path_, 0);
+  ASSERT_TRUE(output.open(path("spilled.mcap")).ok());
+  mcap::McapWriter writer;
+  writer.open(output, SpillingChunkWriter::writer_options(options_));
+  write_messages(writer);
+  writer.close();
+  EXPECT_TRUE(output.status().ok());
+  EXPECT_GT(output.spilled_size(), 0u);
+  EXPECT_FALSE(std::filesystem::exists(path("spilled.mcap.chunk_index.tmp")));
+
+  mcap::McapReader expected;
+  ASSERT_TRUE(expected.open(path("expected.mcap")).ok());
+  ASSERT_TRUE(expected.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+  mcap::McapReader reader;
+  ASSERT_TRUE(reader.open(path("spilled.mcap")).ok());
+  ASSERT_TRUE(reader.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+
+  ASSERT_GT(expected.chunkIndexes().size(), 10u);
+  ASSERT_EQ(reader.chunkIndexes().size(), expected.chunkIndexes().size());
+  for (size_t i = 0; i < reader.chunkIndexes().size(); ++i) {
+    const auto & index = reader.chunkIndexes()[i];
+    const auto & expected_index = expected.chunkIndexes()[i];
+    EXPECT_EQ(index.messageStartTime, expected_index.messageStartTime);
+    EXPECT_EQ(index.messageEndTime, expected_index.messageEndTime);
+    EXPECT_EQ(index.uncompressedSize, expected_index.uncompressedSize);
+    EXPECT_EQ(index.messageIndexOffsets.size(), expected_index.messageIndexOffsets.size());
+  }
+  ASSERT_TRUE(reader.statistics().has_value());
+  EXPECT_EQ(reader.statistics()->chunkCount, expected.statistics()->chunkCount);
+  EXPECT_EQ(reader.statistics()->messageCount, 500u);
+  ASSERT_EQ(reader.metadataIndexes().size(), 1u);
+  mcap::Record record;
+  ASSERT_TRUE(mcap::McapReader::ReadRecord(*reader.dataSource(),
+                                           reader.metadataIndexes().begin()->second.offset, &record)
+                .ok());
+  EXPECT_EQ(record.opcode, mcap::OpCode::Metadata);
+
+  mcap::ReadMessageOptions read_options;
+  read_options.readOrder = mcap::ReadMessageOptions::ReadOrder::LogTimeOrder;
+  std::vector<uint32_t> sequences;
+  for (const auto & view : reader.readMessages([](const mcap::Status &) {}, read_options)) {
+    sequences.push_back(view.message.sequence);
+  }
+  ASSERT_EQ(sequences.size(), 500u);
+  for (uint32_t i = 0; i < sequences.size(); ++i) {
+    EXPECT_EQ(sequences[i], i);
+  }
+}
+
+TEST_F(IndexSpillFixture, keeps_small_indexes_in_memory)
+{
+  SpillingChunkWriter output(options_, "");
+  ASSERT_TRUE(output.open(path("small.mcap")).ok());
+  mcap::McapWriter writer;
+  writer.open(output, SpillingChunkWriter::writer_options(options_));
+  write_messages(writer);
+  writer.close();
+  EXPECT_EQ(output.spilled_size(), 0u);
+
+  mcap::McapReader reader;
+  ASSERT_TRUE(reader.open(path("small.mcap")).ok());
+  ASSERT_TRUE(reader.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+  EXPECT_GT(reader.chunkIndexes().size(), 10u);
+  EXPECT_EQ(reader.statistics()->chunkCount, reader.chunkIndexes().size());
+}
+
+TEST_F(IndexSpillFixture, writes_a_message_as_a_chunk_of_its_own)
+{
+  options_.compression = mcap::Compression::Zstd;
+  SpillingChunkWriter output(options_, "");
+  ASSERT_TRUE(output.open(path("large.mcap")).ok());
+  mcap::McapWriter writer;
+  writer.open(output, SpillingChunkWriter::writer_options(options_));
+  write_messages(writer);
+  // Compressible, but stored as it is.
+  const std::string payload(10000, 'z');
+  mcap::Message message;
+  message.channelId = 1;
+  message.sequence = 500;
+  message.logTime = 2000;
+  message.publishTime = message.logTime;
+  message.dataSize = payload.size();
+  message.data = reinterpret_cast<const std::byte *>(payload.data());
+  ASSERT_TRUE(output.write_chunk(message).ok());
+  writer.close();
+
+  mcap::McapReader reader;
+  ASSERT_TRUE(reader.open(path("large.mcap")).ok());
+  ASSERT_TRUE(reader.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+  const auto & index = reader.chunkIndexes().back();
+  EXPECT_EQ(index.compression, "");
+  EXPECT_EQ(index.uncompressedSize, 9 + 22 + payload.size());
+  EXPECT_EQ(index.messageStartTime, 2000u);
+  EXPECT_EQ(index.messageEndTime, 2000u);
+  EXPECT_EQ(index.messageIndexOffsets.size(), 1u);
+  mcap::Record record;
+  mcap::Chunk chunk;
+  ASSERT_TRUE(
+    mcap::McapReader::ReadRecord(*reader.dataSource(), index.chunkStartOffset, &record).ok());
+  ASSERT_TRUE(mcap::McapReader::ParseChunk(record, &chunk).ok());
+  EXPECT_EQ(chunk.uncompressedCrc,
+            rosbag2_storage_mcap::internal::crc32(chunk.records, chunk.uncompressedSize));
+  // Counted although the McapWriter never saw it.
+  ASSERT_TRUE(reader.statistics().has_value());
+  EXPECT_EQ(reader.statistics()->messageCount, 501u);
+  EXPECT_EQ(reader.statistics()->messageEndTime, 2000u);
+  EXPECT_EQ(reader.statistics()->channelMessageCounts.at(1), 251u);
+  EXPECT_EQ(reader.statistics()->chunkCount, reader.chunkIndexes().size());
+
+  mcap::ReadMessageOptions read_options;
+  read_options.readOrder = mcap::ReadMessageOptions::ReadOrder::LogTimeOrder;
+  std::string last_payload;
+  size_t count = 0;
+  for (const auto & view : reader.readMessages([](const mcap::Status &) {}, read_options)) {
+    last_payload.assign(reinterpret_cast<const char *>(view.message.data), view.message.dataSize);
+    ++count;
+  }
+  EXPECT_EQ(count, 501u);
+  EXPECT_EQ(last_payload, payload);
+}
+
+TEST_F(IndexSpillFixture, appends_to_an_existing_file)
+{
+  mcap::McapWriter first_writer;
+  ASSERT_TRUE(first_writer.open(path("appended.mcap"), options_).ok());
+  write_messages(first_writer);
+  first_writer.close();
+  mcap::McapReader first;
+  ASSERT_TRUE(first.open(path("appended.mcap")).ok());
+  ASSERT_TRUE(first.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+  const size_t first_chunk_count = first.chunkIndexes().size();
+  first.close();
+
+  SpillingChunkWriter output(options_, "");
+  SpillingChunkWriter::ExistingFile existing;
+  ASSERT_TRUE(output.open_append(path("appended.mcap"), existing).ok());
+  ASSERT_EQ(existing.schemas.size(), 1u);
+  ASSERT_EQ(existing.channels.size(), 2u);
+  ASSERT_TRUE(existing.statistics.has_value());
+  EXPECT_EQ(existing.statistics->messageCount, 500u);
+
+  mcap::McapWriter writer;
+  writer.open(output, SpillingChunkWriter::writer_options(options_));
+  for (const auto & existing_schema : existing.schemas) {
+    mcap::Schema schema = *existing_schema;
+    writer.addSchema(schema);
+    ASSERT_EQ(schema.id, existing_schema->id);
+  }
+  for (const auto & existing_channel : existing.channels) {
+    mcap::Channel channel = *existing_channel;
+    writer.addChannel(channel);
+    ASSERT_EQ(channel.id, existing_channel->id);
+  }
+  // Continue on the second channel, where the first file left off.
+  const std::string payload(20, 'y');
+  for (uint32_t i = 500; i < 600; ++i) {
+    mcap::Message message;
+    message.channelId = existing.channels[1]->id;
+    message.sequence = i;
+    message.logTime = 1000 + i;
+    message.publishTime = message.logTime;
+    message.dataSize = payload.size();
+    message.data = reinterpret_cast<const std::byte *>(payload.data());
+    ASSERT_TRUE(writer.write(message).ok());
+  }
+  ASSERT_TRUE(writer.write(mcap::Metadata{"appended", {}}).ok());
+  writer.close();
+
+  mcap::McapReader reader;
+  ASSERT_TRUE(reader.open(path("appended.mcap")).ok());
+  ASSERT_TRUE(reader.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+  EXPECT_EQ(reader.schemas().size(), 1u);
+  EXPECT_EQ(reader.channels().size(), 2u);
+  EXPECT_GT(reader.chunkIndexes().size(), first_chunk_count);
+  EXPECT_EQ(reader.metadataIndexes().size(), 2u);
+  ASSERT_TRUE(reader.statistics().has_value());
+  EXPECT_EQ(reader.statistics()->messageCount, 600u);
+  EXPECT_EQ(reader.statistics()->chunkCount, reader.chunkIndexes().size());
+  EXPECT_EQ(reader.statistics()->messageStartTime, 1000u);
+  EXPECT_EQ(reader.statistics()->messageEndTime, 1599u);
+  EXPECT_EQ(reader.statistics()->channelMessageCounts.at(existing.channels[1]->id), 350u);
+
+  mcap::ReadMessageOptions read_options;
+  read_options.readOrder = mcap::ReadMessageOptions::ReadOrder::LogTimeOrder;
+  std::vector<uint32_t> sequences;
+  for (const auto & view : reader.readMessages([](const mcap::Status &) {}, read_options)) {
+    sequences.push_back(view.message.sequence);
+  }
+  ASSERT_EQ(sequences.size(), 600u);
+  for (uint32_t i = 0; i < sequences.size(); ++i) {
+    EXPECT_EQ(sequences[i], i);
+  }
+}
+
+TEST_F(IndexSpillFixture, appends_to_a_file_without_summary)
+{
+  // Cut off at the DataEnd record, as by a crash after the last chunk was written, and a few bytes
+  // before it, in the middle of the last message index of the last chunk.
+  for (const uint64_t cut : {0u, 5u}) {
+    const auto file = path("truncated_" + std::to_string(cut) + ".mcap");
+    mcap::McapWriter first_writer;
+    ASSERT_TRUE(first_writer.open(file, options_).ok());
+    write_messages(first_writer);
+    first_writer.close();
+    mcap::McapReader first;
+    ASSERT_TRUE(first.open(file).ok());
+    ASSERT_TRUE(first.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+    const uint64_t data_end = first.footer()->summaryStart - (9 + 4);
+    first.close();
+    std::filesystem::resize_file(file, data_end - cut);
+
+    SpillingChunkWriter output(options_, "");
+    SpillingChunkWriter::ExistingFile existing;
+    ASSERT_TRUE(output.open_append(file, existing).ok());
+    mcap::McapWriter writer;
+    writer.open(output, SpillingChunkWriter::writer_options(options_));
+    for (const auto & existing_schema : existing.schemas) {
+      mcap::Schema schema = *existing_schema;
+      writer.addSchema(schema);
+    }
+    for (const auto & existing_channel : existing.channels) {
+      mcap::Channel channel = *existing_channel;
+      writer.addChannel(channel);
+    }
+    const std::string payload(20, 'y');
+    for (uint32_t i = 500; i < 600; ++i) {
+      mcap::Message message;
+      message.channelId = existing.channels[i % 2]->id;
+      message.sequence = i;
+      message.logTime = 1000 + i;
+      message.publishTime = message.logTime;
+      message.dataSize = payload.size();
+      message.data = reinterpret_cast<const std::byte *>(payload.data());
+      ASSERT_TRUE(writer.write(message).ok());
+    }
+    writer.close();
+
+    mcap::McapReader reader;
+    ASSERT_TRUE(reader.open(file).ok());
+    ASSERT_TRUE(reader.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+    size_t unindexed_chunks = 0;
+    for (const auto & index : reader.chunkIndexes()) {
+      unindexed_chunks += index.messageIndexOffsets.empty() ? 1 : 0;
+    }
+    // Only the chunk whose message indexes were cut may be missing some, and is left unindexed.
+    EXPECT_EQ(unindexed_chunks, cut == 0 ? 0u : 1u);
+    EXPECT_EQ(rosbag2_storage_mcap::internal::ParsedSummary::from_reader(reader)
+                ->has_message_indexes,
+              cut == 0);
+
+    mcap::ReadMessageOptions read_options;
+    read_options.readOrder = mcap::ReadMessageOptions::ReadOrder::LogTimeOrder;
+    std::vector<uint32_t> sequences;
+    for (const auto & view : reader.readMessages([](const mcap::Status &) {}, read_options)) {
+      sequences.push_back(view.message.sequence);
+    }
+    ASSERT_EQ(sequences.size(), 600u);
+    for (uint32_t i = 0; i < sequences.size(); ++i) {
+      EXPECT_EQ(sequences[i], i);
+    }
+  }
+}
+
+TEST_F(IndexSpillFixture, replaces_named_metadata_when_appending)
+{
+  mcap::McapWriter first_writer;
+  ASSERT_TRUE(first_writer.open(path("replaced.mcap"), options_).ok());
+  write_messages(first_writer);
+  first_writer.close();
+
+  SpillingChunkWriter output(options_, "");
+  SpillingChunkWriter::ExistingFile existing;
+  ASSERT_TRUE(output.open_append(path("replaced.mcap"), existing, {"middle"}).ok());
+  ASSERT_EQ(existing.metadata.size(), 1u);
+  EXPECT_EQ(existing.metadata[0].metadata.at("key"), "value");
+
+  mcap::McapWriter writer;
+  writer.open(output, SpillingChunkWriter::writer_options(options_));
+  ASSERT_TRUE(writer.write(mcap::Metadata{"middle", {{"key", "updated"}}}).ok());
+  writer.close();
+
+  mcap::McapReader reader;
+  ASSERT_TRUE(reader.open(path("replaced.mcap")).ok());
+  ASSERT_TRUE(reader.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+  ASSERT_EQ(reader.metadataIndexes().count("middle"), 1u);
+  mcap::Record record;
+  mcap::Metadata metadata;
+  ASSERT_TRUE(mcap::McapReader::ReadRecord(*reader.dataSource(),
+                                           reader.metadataIndexes().find("middle")->second.offset,
+                                           &record)
+                .ok());
+  ASSERT_TRUE(mcap::McapReader::ParseMetadata(record, &metadata).ok());
+  EXPECT_EQ(metadata.metadata.at("key"), "updated");
+}
@@ -15,10 +15,16 @@
 #include "rclcpp/serialization.hpp"
 #include "rclcpp/serialized_message.hpp"
 #include "rcpputils/filesystem_helper.hpp"
+#include "rcutils/allocator.h"
 #include "rosbag2_cpp/reader.hpp"
 #include "rosbag2_cpp/readers/sequential_reader.hpp"
 #include "rosbag2_cpp/writer.hpp"
 #include "rosbag2_cpp/writers/sequential_writer.hpp"
+#include "rosbag2_storage_mcap/chunk_reader.hpp"
+#include "rosbag2_storage_mcap/file_migrator.hpp"
+#include "rosbag2_storage_mcap/mcap_storage.hpp"
+#include "rosbag2_storage_mcap/payload_codec.hpp"
+#include "rosbag2_storage_mcap/payload_dedup.hpp"
 #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
   #include "rosbag2_storage/storage_options.hpp"
 using StorageOptions = rosbag2_storage::StorageOptions;
@@ -31,12 +37,59 @@ using StorageOptions = rosbag2_cpp::StorageOptions;
 
 #include <gmock/gmock.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 using namespace ::testing;  // NOLINT
 using TemporaryDirectoryFixture = rosbag2_test_common::TemporaryDirectoryFixture;
 
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+// Write `count` String messages to `topic_name`, with timestamps `timestamp_step` apart.
+static void write_string_messages(const std::string & uri, const std::string & storage_config_uri,
+                                  const std::string & topic_name, size_t count,
+                                  rcutils_time_point_value_t timestamp_step)
+{
+  StorageOptions options;
+  options.uri = uri;
+  options.storage_id = "mcap";
+  options.storage_config_uri = storage_config_uri;
+  rosbag2_storage::TopicMetadata topic_metadata;
+  topic_metadata.name = topic_name;
+  topic_metadata.type = "std_msgs/msg/String";
+
+  rosbag2_cpp::Writer writer{std::make_unique<rosbag2_cpp::writers::SequentialWriter>()};
+  #ifndef ROSBAG2_STORAGE_MCAP_WRITER_CREATES_DIRECTORY
+  rcpputils::fs::create_directories(rcpputils::fs::path(uri));
+  #endif
+  writer.open(options, rosbag2_cpp::ConverterOptions{});
+  writer.create_topic(topic_metadata);
+
+  rclcpp::Serialization<std_msgs::msg::String> serialization;
+  for (size_t i = 0; i < count; ++i) {
+    std_msgs::msg::String msg;
+    msg.data = "Test Message " + std::to_string(i);
+    auto serialized_msg = std::make_shared<rclcpp::SerializedMessage>();
+    serialization.serialize_message(&msg, serialized_msg.get());
+
+    auto serialized_bag_msg = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+    // Keep serialized_msg alive for as long as the bag message references its buffer.
+    serialized_bag_msg->serialized_data = std::shared_ptr<rcutils_uint8_array_t>(
+      &serialized_msg->get_rcl_serialized_message(),
+      [serialized_msg](rcutils_uint8_array_t * /* data */) {});
+    serialized_bag_msg->time_stamp = rcutils_time_point_value_t(i) * timestamp_step;
+    serialized_bag_msg->topic_name = topic_name;
+    writer.write(serialized_bag_msg);
+  }
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
 TEST_F(TemporaryDirectoryFixture, can_write_and_read_basic_mcap_file)
 {
   auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
@@ -170,3 +223,1007 @@ TEST_F(TemporaryDirectoryFixture, can_write_mcap_with_zstd_configured_from_yaml)
   }
 }
 #endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#if defined(ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS) && \
+  defined(ROSBAG2_STORAGE_MCAP_OVERRIDE_SEEK_METHOD)
+TEST_F(TemporaryDirectoryFixture, can_seek_in_mcap_without_message_index)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_no_message_index.yaml",
+                        "test_topic", 200, 10);
+
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  rosbag2_cpp::Reader reader{std::make_unique<rosbag2_cpp::readers::SequentialReader>()};
+  reader.open(options, rosbag2_cpp::ConverterOptions{});
+
+  reader.seek(1000);
+  ASSERT_TRUE(reader.has_next());
+  EXPECT_EQ(reader.read_next()->time_stamp, 1000);
+  size_t remaining = 1;
+  while (reader.has_next()) {
+    auto msg = reader.read_next();
+    EXPECT_GT(msg->time_stamp, 1000);
+    remaining++;
+  }
+  EXPECT_EQ(remaining, 100u);
+
+  reader.seek(0);
+  ASSERT_TRUE(reader.has_next());
+  EXPECT_EQ(reader.read_next()->time_stamp, 0);
+}
+#endif
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_query_message_counts_from_index)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  write_string_messages(uri.string(), "", "test_topic", 200, 10);
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+
+  auto stats = storage.get_indexed_topic_stats("test_topic");
+  EXPECT_EQ(stats.message_count, 200u);
+  EXPECT_EQ(stats.first_time, 0);
+  EXPECT_EQ(stats.last_time, 1990);
+
+  stats = storage.get_indexed_topic_stats("test_topic", 1000, 1495);
+  EXPECT_EQ(stats.message_count, 50u);
+  EXPECT_EQ(stats.first_time, 1000);
+  EXPECT_EQ(stats.last_time, 1490);
+
+  EXPECT_EQ(storage.get_indexed_topic_stats("other_topic").message_count, 0u);
+
+  EXPECT_EQ(storage.get_indexed_message_histogram("test_topic", 0, 1999, 500),
+            (std::vector<uint64_t>{50, 50, 50, 50}));
+  EXPECT_EQ(storage.get_indexed_message_histogram("test_topic", 1000, 1204, 100),
+            (std::vector<uint64_t>{10, 10, 1}));
+
+  // Queries do not move the read position.
+  ASSERT_TRUE(storage.has_next());
+  EXPECT_EQ(storage.read_next()->time_stamp, 0);
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_read_activity_histogram_written_at_close)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_histogram.yaml",
+                        "test_topic", 200, 10);
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+
+  const auto histogram = storage.get_activity_histogram();
+  ASSERT_TRUE(histogram.has_value());
+  EXPECT_EQ(histogram->bucket_duration(), 500u);
+  const auto & series = histogram->topics().at("test_topic");
+  EXPECT_THAT(series.buckets, ElementsAre(Key(0u), Key(500u), Key(1000u), Key(1500u)));
+  for (const auto & [start, bucket] : series.buckets) {
+    EXPECT_EQ(bucket.message_count, 50u);
+    EXPECT_GT(bucket.byte_count, 0u);
+  }
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_read_messages_by_ordinal)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_small_chunks.yaml",
+                        "test_topic", 200, 10);
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+
+  auto messages = storage.read_messages_by_ordinal("test_topic", 150);
+  ASSERT_EQ(messages.size(), 1u);
+  EXPECT_EQ(messages[0]->time_stamp, 1500);
+  EXPECT_EQ(messages[0]->topic_name, "test_topic");
+
+  // A range spanning several chunks.
+  messages = storage.read_messages_by_ordinal("test_topic", 20, 100);
+  ASSERT_EQ(messages.size(), 100u);
+  for (size_t i = 0; i < messages.size(); ++i) {
+    EXPECT_EQ(messages[i]->time_stamp, rcutils_time_point_value_t(20 + i) * 10);
+  }
+
+  EXPECT_EQ(storage.read_messages_by_ordinal("test_topic", 195, 10).size(), 5u);
+  EXPECT_TRUE(storage.read_messages_by_ordinal("test_topic", 200).empty());
+  EXPECT_TRUE(storage.read_messages_by_ordinal("other_topic", 0).empty());
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_read_downsampled_messages)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_small_chunks.yaml",
+                        "test_topic", 200, 10);
+
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  options.storage_config_uri = config_path + "/mcap_reader_options_downsample.yaml";
+  rosbag2_cpp::Reader reader{std::make_unique<rosbag2_cpp::readers::SequentialReader>()};
+  reader.open(options, rosbag2_cpp::ConverterOptions{});
+
+  std::vector<rcutils_time_point_value_t> timestamps;
+  while (reader.has_next()) {
+    timestamps.push_back(reader.read_next()->time_stamp);
+  }
+  ASSERT_EQ(timestamps.size(), 20u);
+  for (size_t i = 0; i < timestamps.size(); ++i) {
+    EXPECT_EQ(timestamps[i], rcutils_time_point_value_t(i) * 100);
+  }
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_get_metadata_without_statistics)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_no_statistics.yaml",
+                        "test_topic", 200, 10);
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+
+  const auto metadata = storage.get_metadata();
+  EXPECT_EQ(metadata.message_count, 200u);
+  EXPECT_EQ(metadata.starting_time.time_since_epoch(), std::chrono::nanoseconds(0));
+  EXPECT_EQ(metadata.duration, std::chrono::nanoseconds(1990));
+  ASSERT_EQ(metadata.topics_with_message_count.size(), 1u);
+  EXPECT_EQ(metadata.topics_with_message_count[0].topic_metadata.name, "test_topic");
+  EXPECT_EQ(metadata.topics_with_message_count[0].message_count, 200u);
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_write_and_read_striped_recording)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_striped.yaml",
+                        "test_topic", 200, 10);
+  EXPECT_TRUE((uri / "stripe_a" / "bag_0.0.mcap").is_regular_file());
+  EXPECT_TRUE((uri / "stripe_b" / "bag_0.1.mcap").is_regular_file());
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+
+  const auto metadata = storage.get_metadata();
+  EXPECT_EQ(metadata.message_count, 200u);
+  EXPECT_EQ(metadata.duration, std::chrono::nanoseconds(1990));
+  ASSERT_EQ(metadata.topics_with_message_count.size(), 1u);
+  EXPECT_EQ(metadata.topics_with_message_count[0].message_count, 200u);
+
+  // Messages from both stripes are merged back in log time order.
+  std::vector<rcutils_time_point_value_t> timestamps;
+  while (storage.has_next()) {
+    timestamps.push_back(storage.read_next()->time_stamp);
+  }
+  ASSERT_EQ(timestamps.size(), 200u);
+  for (size_t i = 0; i < timestamps.size(); ++i) {
+    EXPECT_EQ(timestamps[i], rcutils_time_point_value_t(i) * 10);
+  }
+
+  storage.seek(1000);
+  ASSERT_TRUE(storage.has_next());
+  EXPECT_EQ(storage.read_next()->time_stamp, 1000);
+  EXPECT_EQ(storage.get_indexed_topic_stats("test_topic").message_count, 200u);
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_write_and_read_sharded_recording)
+{
+  const auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  const std::vector<std::string> topics = {"/camera/image", "/imu"};
+  {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    StorageOptions options;
+    options.uri = uri.string();
+    options.storage_id = "mcap";
+    options.storage_config_uri = config_path + "/mcap_writer_options_sharded.yaml";
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE);
+    for (const auto & topic : topics) {
+      rosbag2_storage::TopicMetadata topic_metadata;
+      topic_metadata.name = topic;
+      topic_metadata.type = "std_msgs/msg/String";
+      storage.create_topic(topic_metadata);
+    }
+
+    rclcpp::Serialization<std_msgs::msg::String> serialization;
+    for (size_t i = 0; i < 100; ++i) {
+      std_msgs::msg::String msg;
+      msg.data = "Test Message " + std::to_string(i);
+      auto serialized_msg = std::make_shared<rclcpp::SerializedMessage>();
+      serialization.serialize_message(&msg, serialized_msg.get());
+      auto serialized_bag_msg = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+      serialized_bag_msg->serialized_data = std::shared_ptr<rcutils_uint8_array_t>(
+        &serialized_msg->get_rcl_serialized_message(),
+        [serialized_msg](rcutils_uint8_array_t * /* data */) {});
+      serialized_bag_msg->time_stamp = rcutils_time_point_value_t(i) * 10;
+      serialized_bag_msg->topic_name = topics[i % 2];
+      storage.write(serialized_bag_msg);
+    }
+  }
+
+  StorageOptions options;
+  options.uri = (rcpputils::fs::path(temporary_dir_path_) / "bag.mcap").string();
+  options.storage_id = "mcap";
+  rosbag2_storage_plugins::MCAPStorage storage;
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+  const auto metadata = storage.get_metadata();
+  EXPECT_EQ(metadata.message_count, 100u);
+  ASSERT_EQ(metadata.topics_with_message_count.size(), 2u);
+
+  std::vector<rcutils_time_point_value_t> timestamps;
+  while (storage.has_next()) {
+    timestamps.push_back(storage.read_next()->time_stamp);
+  }
+  ASSERT_EQ(timestamps.size(), 100u);
+  for (size_t i = 0; i < timestamps.size(); ++i) {
+    EXPECT_EQ(timestamps[i], rcutils_time_point_value_t(i) * 10);
+  }
+
+  rosbag2_storage::StorageFilter filter;
+  filter.topics = {"/imu"};
+  storage.set_filter(filter);
+  size_t imu_count = 0;
+  while (storage.has_next()) {
+    EXPECT_EQ(storage.read_next()->topic_name, "/imu");
+    imu_count++;
+  }
+  EXPECT_EQ(imu_count, 50u);
+
+  // Each topic is in a single shard, so it can be read by ordinal.
+  const auto messages = storage.read_messages_by_ordinal("/imu", 10);
+  ASSERT_EQ(messages.size(), 1u);
+  EXPECT_EQ(messages[0]->time_stamp, 210);
+
+  // Camera topics were assigned to the first shard, which can be read on its own.
+  rosbag2_storage_plugins::MCAPStorage shard;
+  options.uri = (rcpputils::fs::path(temporary_dir_path_) / "bag.0.mcap").string();
+  shard.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+  const auto shard_topics = shard.get_all_topics_and_types();
+  ASSERT_EQ(shard_topics.size(), 1u);
+  EXPECT_EQ(shard_topics[0].name, "/camera/image");
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_write_through_scratch_directory)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const auto scratch = rcpputils::fs::path(temporary_dir_path_) / "scratch";
+  const auto config = rcpputils::fs::path(temporary_dir_path_) / "tiered.yaml";
+  {
+    std::ofstream out(config.string());
+    out << "scratchDirectory: " << scratch.string() << "\n"
+        << "scratchMaxBacklog: 1000000\n";
+  }
+  write_string_messages(uri.string(), config.string(), "test_topic", 100, 10);
+  rosbag2_storage_mcap::internal::FileMigrator::instance().wait_until_idle();
+  EXPECT_TRUE(expected_bag.is_regular_file());
+  EXPECT_FALSE((scratch / "bag_0.mcap").exists());
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+  EXPECT_EQ(storage.get_metadata().message_count, 100u);
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_read_raw_compressed_chunks)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_small_chunks.yaml",
+                        "test_topic", 200, 10);
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+
+  const auto & channels = storage.get_mcap_channels();
+  ASSERT_EQ(channels.size(), 1u);
+  const auto channel_id = channels.begin()->first;
+  EXPECT_EQ(channels.begin()->second->topic, "test_topic");
+  EXPECT_EQ(storage.get_mcap_schemas().count(channels.begin()->second->schemaId), 1u);
+
+  std::vector<uint64_t> offsets;
+  storage.read_raw_chunks([&](const rosbag2_storage_plugins::MCAPStorage::RawChunk & chunk) {
+    offsets.push_back(chunk.index.chunkStartOffset);
+    EXPECT_EQ(chunk.index.compression, "zstd");
+    EXPECT_EQ(chunk.data.size(), chunk.index.compressedSize);
+    EXPECT_EQ(chunk.index.messageIndexOffsets.count(channel_id), 1u);
+    // The payload decompresses to the records written.
+    mcap::ByteArray records;
+    EXPECT_TRUE(rosbag2_storage_mcap::internal::decompress_chunk(
+                  chunk.index.compression, chunk.data.data(), chunk.data.size(),
+                  chunk.index.uncompressedSize, &records)
+                  .ok());
+    EXPECT_EQ(records.size(), chunk.index.uncompressedSize);
+    return true;
+  });
+  EXPECT_GT(offsets.size(), 1u);
+  EXPECT_TRUE(std::is_sorted(offsets.begin(), offsets.end()));
+
+  // Stopping early, and selecting by time.
+  size_t visited = 0;
+  storage.read_raw_chunks([&](const auto &) { return ++visited < 2; });
+  EXPECT_EQ(visited, 2u);
+  storage.read_raw_chunks(
+    [&](const rosbag2_storage_plugins::MCAPStorage::RawChunk & chunk) {
+      EXPECT_GE(chunk.index.messageEndTime, 1000u);
+      EXPECT_LE(chunk.index.messageStartTime, 1100u);
+      return true;
+    },
+    1000, 1100);
+
+  rosbag2_storage::StorageFilter filter;
+  filter.topics = {"other_topic"};
+  storage.set_filter(filter);
+  storage.read_raw_chunks([](const auto &) {
+    ADD_FAILURE() << "no chunk holds other_topic";
+    return true;
+  });
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, writes_large_messages_in_their_own_chunks)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  // Written by the storage itself, which adds the extension to the path it is given.
+  auto expected_bag = rcpputils::fs::path(temporary_dir_path_) / "bag.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    StorageOptions options;
+    options.uri = uri.string();
+    options.storage_id = "mcap";
+    options.storage_config_uri = config_path + "/mcap_writer_options_large_messages.yaml";
+  #ifndef ROSBAG2_STORAGE_MCAP_WRITER_CREATES_DIRECTORY
+    rcpputils::fs::create_directories(uri);
+  #endif
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE);
+    rosbag2_storage::TopicMetadata topic_metadata;
+    topic_metadata.name = "test_topic";
+    topic_metadata.type = "std_msgs/msg/String";
+    storage.create_topic(topic_metadata);
+
+    for (size_t i = 0; i < 10; ++i) {
+      // Message 5 is over the threshold.
+      auto payload = std::make_shared<std::vector<uint8_t>>(i == 5 ? 10000 : 10, uint8_t(i));
+      auto message = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+      message->serialized_data = std::shared_ptr<rcutils_uint8_array_t>(
+        new rcutils_uint8_array_t{payload->data(), payload->size(), payload->size(),
+                                  rcutils_get_default_allocator()},
+        [payload](rcutils_uint8_array_t * data) { delete data; });
+      message->time_stamp = rcutils_time_point_value_t(i);
+      message->topic_name = "test_topic";
+      storage.write(message);
+    }
+  }
+
+  mcap::McapReader reader;
+  ASSERT_TRUE(reader.open(expected_bag.string()).ok());
+  ASSERT_TRUE(reader.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+  std::vector<std::pair<mcap::Timestamp, mcap::Timestamp>> chunk_times;
+  for (const auto & chunk_index : reader.chunkIndexes()) {
+    chunk_times.emplace_back(chunk_index.messageStartTime, chunk_index.messageEndTime);
+  }
+  EXPECT_THAT(chunk_times, ElementsAre(Pair(0u, 4u), Pair(5u, 5u), Pair(6u, 9u)));
+  // Written straight from the message buffer, uncompressed although it would compress well.
+  EXPECT_EQ(reader.chunkIndexes()[1].compression, "");
+  EXPECT_EQ(reader.chunkIndexes()[1].uncompressedSize, 9u + 22u + 10000u);
+  ASSERT_TRUE(reader.statistics().has_value());
+  EXPECT_EQ(reader.statistics()->messageCount, 10u);
+  std::vector<size_t> sizes;
+  for (const auto & view : reader.readMessages()) {
+    sizes.push_back(view.message.dataSize);
+    EXPECT_EQ(view.message.data[0], std::byte(view.message.logTime));
+  }
+  EXPECT_THAT(sizes, ElementsAre(10u, 10u, 10u, 10u, 10u, 10000u, 10u, 10u, 10u, 10u));
+}
+
+TEST_F(TemporaryDirectoryFixture, deduplicates_repeated_payloads)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  // Written by the storage itself, which adds the extension to the path it is given.
+  auto expected_bag = rcpputils::fs::path(temporary_dir_path_) / "bag.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  // The payload of each message: a run of 4 then a run of 6.
+  auto expected_payload = [](size_t i) { return std::string(100, i < 4 ? 'a' : 'b'); };
+  {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    StorageOptions options;
+    options.uri = uri.string();
+    options.storage_id = "mcap";
+    options.storage_config_uri = config_path + "/mcap_writer_options_dedup.yaml";
+  #ifndef ROSBAG2_STORAGE_MCAP_WRITER_CREATES_DIRECTORY
+    rcpputils::fs::create_directories(uri);
+  #endif
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE);
+    rosbag2_storage::TopicMetadata topic_metadata;
+    topic_metadata.name = "test_topic";
+    topic_metadata.type = "std_msgs/msg/String";
+    storage.create_topic(topic_metadata);
+
+    for (size_t i = 0; i < 10; ++i) {
+      auto payload = std::make_shared<std::string>(expected_payload(i));
+      auto message = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+      message->serialized_data = std::shared_ptr<rcutils_uint8_array_t>(
+        new rcutils_uint8_array_t{reinterpret_cast<uint8_t *>(payload->data()), payload->size(),
+                                  payload->size(), rcutils_get_default_allocator()},
+        [payload](rcutils_uint8_array_t * data) { delete data; });
+      message->time_stamp = rcutils_time_point_value_t(i);
+      message->topic_name = "test_topic";
+      storage.write(message);
+    }
+  }
+
+  // All but the first message of each run are stored as references.
+  {
+    mcap::McapReader reader;
+    ASSERT_TRUE(reader.open(expected_bag.string()).ok());
+    size_t reference_count = 0;
+    for (const auto & view : reader.readMessages()) {
+      if (view.channel->messageEncoding ==
+          rosbag2_storage_mcap::internal::PAYLOAD_REFERENCE_ENCODING) {
+        EXPECT_EQ(view.message.dataSize, rosbag2_storage_mcap::internal::PAYLOAD_REFERENCE_SIZE);
+        reference_count++;
+      }
+    }
+    EXPECT_EQ(reference_count, 8u);
+  }
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+  const auto metadata = storage.get_metadata();
+  ASSERT_EQ(metadata.topics_with_message_count.size(), 1u);
+  EXPECT_EQ(metadata.topics_with_message_count[0].topic_metadata.name, "test_topic");
+  EXPECT_EQ(metadata.topics_with_message_count[0].message_count, 10u);
+
+  auto payload_of = [](const rosbag2_storage::SerializedBagMessage & message) {
+    return std::string(reinterpret_cast<const char *>(message.serialized_data->buffer),
+                       message.serialized_data->buffer_length);
+  };
+  // The message referred to by the first one read after a seek has not been read.
+  storage.seek(7);
+  ASSERT_TRUE(storage.has_next());
+  EXPECT_EQ(payload_of(*storage.read_next()), expected_payload(7));
+
+  storage.seek(0);
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(storage.has_next());
+    const auto message = storage.read_next();
+    EXPECT_EQ(message->time_stamp, rcutils_time_point_value_t(i));
+    EXPECT_EQ(message->topic_name, "test_topic");
+    EXPECT_EQ(payload_of(*message), expected_payload(i));
+  }
+  EXPECT_FALSE(storage.has_next());
+  const auto by_ordinal = storage.read_messages_by_ordinal("test_topic", 2, 3);
+  ASSERT_EQ(by_ordinal.size(), 3u);
+  for (size_t i = 0; i < by_ordinal.size(); ++i) {
+    EXPECT_EQ(payload_of(*by_ordinal[i]), expected_payload(i + 2));
+  }
+}
+
+TEST_F(TemporaryDirectoryFixture, byte_shuffles_payloads_of_configured_types)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_byte_shuffle.yaml",
+                        "test_topic", 10, 1);
+
+  rclcpp::Serialization<std_msgs::msg::String> serialization;
+  {
+    // The payloads are stored shuffled, with the element size in the channel metadata.
+    mcap::McapReader reader;
+    ASSERT_TRUE(reader.open(expected_bag.string()).ok());
+    size_t message_count = 0;
+    for (const auto & view : reader.readMessages()) {
+      EXPECT_EQ(view.channel->metadata.at(rosbag2_storage_mcap::internal::BYTE_SHUFFLE_METADATA),
+                "4");
+      std_msgs::msg::String msg;
+      msg.data = "Test Message " + std::to_string(message_count++);
+      rclcpp::SerializedMessage serialized_msg;
+      serialization.serialize_message(&msg, &serialized_msg);
+      const auto & expected = serialized_msg.get_rcl_serialized_message();
+      ASSERT_EQ(view.message.dataSize, expected.buffer_length);
+      EXPECT_NE(std::memcmp(view.message.data, expected.buffer, expected.buffer_length), 0);
+    }
+    EXPECT_EQ(message_count, 10u);
+  }
+
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  rosbag2_cpp::Reader reader{std::make_unique<rosbag2_cpp::readers::SequentialReader>()};
+  reader.open(options, rosbag2_cpp::ConverterOptions{});
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(reader.has_next());
+    std_msgs::msg::String msg;
+    rclcpp::SerializedMessage serialized_msg(*reader.read_next()->serialized_data);
+    serialization.deserialize_message(&serialized_msg, &msg);
+    EXPECT_EQ(msg.data, "Test Message " + std::to_string(i));
+  }
+  EXPECT_FALSE(reader.has_next());
+}
+
+namespace
+{
+// Stores payloads reversed, after a marker byte.
+class ReverseCodec : public rosbag2_storage_mcap::PayloadCodec
+{
+public:
+  bool encode(const std::byte * data, size_t size, std::vector<std::byte> & encoded) const override
+  {
+    encoded.assign(1, std::byte{'R'});
+    encoded.insert(encoded.end(), std::reverse_iterator(data + size), std::reverse_iterator(data));
+    return true;
+  }
+
+  bool decode(const std::byte * data, size_t size, std::vector<std::byte> & decoded) const override
+  {
+    if (size == 0 || data[0] != std::byte{'R'}) {
+      return false;
+    }
+    decoded.assign(std::reverse_iterator(data + size), std::reverse_iterator(data + 1));
+    return true;
+  }
+};
+}  // namespace
+
+TEST_F(TemporaryDirectoryFixture, encodes_payloads_with_registered_codec)
+{
+  rosbag2_storage_mcap::PayloadCodecRegistry::instance().add("test_mcap_storage.reverse",
+                                                             std::make_shared<ReverseCodec>());
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_payload_codec.yaml",
+                        "test_topic", 10, 1);
+
+  {
+    // The codec is recorded in the channel metadata, and the payloads are stored encoded.
+    mcap::McapReader reader;
+    ASSERT_TRUE(reader.open(expected_bag.string()).ok());
+    size_t message_count = 0;
+    for (const auto & view : reader.readMessages()) {
+      EXPECT_EQ(view.channel->metadata.at(rosbag2_storage_mcap::PayloadCodecRegistry::METADATA_KEY),
+                "test_mcap_storage.reverse");
+      ASSERT_GT(view.message.dataSize, 0u);
+      EXPECT_EQ(view.message.data[0], std::byte{'R'});
+      message_count++;
+    }
+    EXPECT_EQ(message_count, 10u);
+  }
+
+  rclcpp::Serialization<std_msgs::msg::String> serialization;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  rosbag2_cpp::Reader reader{std::make_unique<rosbag2_cpp::readers::SequentialReader>()};
+  reader.open(options, rosbag2_cpp::ConverterOptions{});
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(reader.has_next());
+    std_msgs::msg::String msg;
+    rclcpp::SerializedMessage serialized_msg(*reader.read_next()->serialized_data);
+    serialization.deserialize_message(&serialized_msg, &msg);
+    EXPECT_EQ(msg.data, "Test Message " + std::to_string(i));
+  }
+  EXPECT_FALSE(reader.has_next());
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, detects_chunks_failing_their_crc)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_chunk_crc.yaml",
+                        "test_topic", 200, 10);
+
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  mcap::ChunkIndex corrupt_chunk;
+  {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+    const auto report = storage.verify_chunk_crcs(2);
+    EXPECT_GT(report.chunk_count, 2u);
+    EXPECT_EQ(report.unchecked_chunk_count, 0u);
+    EXPECT_TRUE(report.corrupt_chunk_offsets.empty());
+    size_t visited = 0;
+    storage.read_raw_chunks([&](const rosbag2_storage_plugins::MCAPStorage::RawChunk & chunk) {
+      corrupt_chunk = chunk.index;
+      return ++visited < 2;
+    });
+  }
+  // Change the last byte of a payload of the second chunk, which still parses.
+  {
+    std::fstream file(expected_bag.string(), std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(std::streamoff(corrupt_chunk.chunkStartOffset + corrupt_chunk.chunkLength - 1));
+    file.put('D');
+  }
+
+  {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+    const auto report = storage.verify_chunk_crcs(2);
+    EXPECT_EQ(report.corrupt_chunk_offsets,
+              std::vector<uint64_t>{corrupt_chunk.chunkStartOffset});
+  }
+
+  // Reading stops at the corrupt chunk when checking inline, and reads through it otherwise.
+  for (const bool check : {false, true}) {
+    options.storage_config_uri =
+      check ? config_path + "/mcap_reader_options_inline_crc.yaml" : std::string();
+    rosbag2_storage_plugins::MCAPStorage storage;
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+    size_t count = 0;
+    while (storage.has_next()) {
+      storage.read_next();
+      count++;
+    }
+    if (check) {
+      EXPECT_GT(count, 0u);
+      EXPECT_LT(count, 200u);
+    } else {
+      EXPECT_EQ(count, 200u);
+    }
+  }
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, keeps_the_channel_of_a_topic_created_again)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  // Written by the storage itself, which adds the extension to the path it is given.
+  auto expected_bag = rcpputils::fs::path(temporary_dir_path_) / "bag.mcap";
+  {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    StorageOptions options;
+    options.uri = uri.string();
+    options.storage_id = "mcap";
+  #ifndef ROSBAG2_STORAGE_MCAP_WRITER_CREATES_DIRECTORY
+    rcpputils::fs::create_directories(uri);
+  #endif
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE);
+    rosbag2_storage::TopicMetadata topic_metadata;
+    topic_metadata.name = "test_topic";
+    topic_metadata.type = "std_msgs/msg/String";
+    topic_metadata.serialization_format = "cdr";
+    topic_metadata.offered_qos_profiles = "qos";
+    storage.create_topic(topic_metadata);
+
+    auto payload = std::make_shared<std::vector<uint8_t>>(10, uint8_t(1));
+    auto message = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+    message->serialized_data = std::shared_ptr<rcutils_uint8_array_t>(
+      new rcutils_uint8_array_t{payload->data(), payload->size(), payload->size(),
+                                rcutils_get_default_allocator()},
+      [payload](rcutils_uint8_array_t * data) { delete data; });
+    message->topic_name = "test_topic";
+    storage.write(message);
+
+    storage.remove_topic(topic_metadata);
+    EXPECT_THROW(storage.write(message), std::runtime_error);
+    storage.create_topic(topic_metadata);
+    storage.write(message);
+  }
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+  EXPECT_EQ(storage.get_mcap_channels().size(), 1u);
+  const auto metadata = storage.get_metadata();
+  ASSERT_EQ(metadata.topics_with_message_count.size(), 1u);
+  EXPECT_EQ(metadata.topics_with_message_count[0].message_count, 2u);
+  EXPECT_EQ(metadata.topics_with_message_count[0].topic_metadata.offered_qos_profiles, "qos");
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, can_read_recording_with_spilled_indexes)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_spill_indexes.yaml",
+                        "test_topic", 200, 10);
+  EXPECT_FALSE(rcpputils::fs::path(expected_bag.string() + ".chunk_index.tmp").exists());
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+  EXPECT_EQ(storage.get_metadata().message_count, 200u);
+
+  auto messages = storage.read_messages_by_ordinal("test_topic", 20, 100);
+  ASSERT_EQ(messages.size(), 100u);
+  for (size_t i = 0; i < messages.size(); ++i) {
+    EXPECT_EQ(messages[i]->time_stamp, rcutils_time_point_value_t(20 + i) * 10);
+  }
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, appends_to_an_existing_file)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_small_chunks.yaml",
+                        "test_topic", 200, 10);
+  {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    StorageOptions options;
+    options.uri = (uri / "bag_0").string();
+    options.storage_id = "mcap";
+    options.storage_config_uri = config_path + "/mcap_writer_options_small_chunks.yaml";
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::APPEND);
+
+    auto message = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+    message->topic_name = "test_topic";
+    // Topics of the file must be created before being written to, as in a new file.
+    EXPECT_THROW(storage.write(message), std::runtime_error);
+    rosbag2_storage::TopicMetadata topic_metadata;
+    topic_metadata.name = "test_topic";
+    topic_metadata.type = "std_msgs/msg/String";
+    storage.create_topic(topic_metadata);
+
+    rclcpp::Serialization<std_msgs::msg::String> serialization;
+    for (size_t i = 200; i < 300; ++i) {
+      std_msgs::msg::String msg;
+      msg.data = "Test Message " + std::to_string(i);
+      auto serialized_msg = std::make_shared<rclcpp::SerializedMessage>();
+      serialization.serialize_message(&msg, serialized_msg.get());
+      message->serialized_data = std::shared_ptr<rcutils_uint8_array_t>(
+        &serialized_msg->get_rcl_serialized_message(),
+        [serialized_msg](rcutils_uint8_array_t * /* data */) {});
+      message->time_stamp = rcutils_time_point_value_t(i) * 10;
+      storage.write(message);
+    }
+  }
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+  EXPECT_EQ(storage.get_mcap_channels().size(), 1u);
+  const auto metadata = storage.get_metadata();
+  EXPECT_EQ(metadata.message_count, 300u);
+  EXPECT_EQ(metadata.duration, std::chrono::nanoseconds(2990));
+
+  // Across the end of the original file.
+  auto messages = storage.read_messages_by_ordinal("test_topic", 190, 20);
+  ASSERT_EQ(messages.size(), 20u);
+  rclcpp::Serialization<std_msgs::msg::String> serialization;
+  for (size_t i = 0; i < messages.size(); ++i) {
+    EXPECT_EQ(messages[i]->time_stamp, rcutils_time_point_value_t(190 + i) * 10);
+    std_msgs::msg::String msg;
+    rclcpp::SerializedMessage serialized_msg(*messages[i]->serialized_data);
+    serialization.deserialize_message(&serialized_msg, &msg);
+    EXPECT_EQ(msg.data, "Test Message " + std::to_string(190 + i));
+  }
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, continues_the_activity_histogram_when_appending)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  auto expected_bag = uri / "bag_0.mcap";
+  const std::string config_path = _TEST_RESOURCES_DIR_PATH;
+  write_string_messages(uri.string(), config_path + "/mcap_writer_options_histogram.yaml",
+                        "test_topic", 200, 10);
+  {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    StorageOptions options;
+    options.uri = (uri / "bag_0").string();
+    options.storage_id = "mcap";
+    // Without a bucket duration configured, the histogram of the file is continued all the same.
+    options.storage_config_uri = config_path + "/mcap_writer_options_small_chunks.yaml";
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::APPEND);
+    rosbag2_storage::TopicMetadata topic_metadata;
+    topic_metadata.name = "test_topic";
+    topic_metadata.type = "std_msgs/msg/String";
+    storage.create_topic(topic_metadata);
+
+    rclcpp::Serialization<std_msgs::msg::String> serialization;
+    auto message = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+    message->topic_name = "test_topic";
+    for (size_t i = 200; i < 300; ++i) {
+      std_msgs::msg::String msg;
+      msg.data = "Test Message " + std::to_string(i);
+      auto serialized_msg = std::make_shared<rclcpp::SerializedMessage>();
+      serialization.serialize_message(&msg, serialized_msg.get());
+      message->serialized_data = std::shared_ptr<rcutils_uint8_array_t>(
+        &serialized_msg->get_rcl_serialized_message(),
+        [serialized_msg](rcutils_uint8_array_t * /* data */) {});
+      message->time_stamp = rcutils_time_point_value_t(i) * 10;
+      storage.write(message);
+    }
+  }
+
+  // Only the merged histogram is indexed.
+  {
+    mcap::McapReader reader;
+    ASSERT_TRUE(reader.open(expected_bag.string()).ok());
+    ASSERT_TRUE(reader.readSummary(mcap::ReadSummaryMethod::NoFallbackScan).ok());
+    EXPECT_EQ(
+      reader.metadataIndexes().count(rosbag2_storage_mcap::ActivityHistogram::METADATA_NAME), 1u);
+  }
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = expected_bag.string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+  const auto histogram = storage.get_activity_histogram();
+  ASSERT_TRUE(histogram.has_value());
+  EXPECT_EQ(histogram->bucket_duration(), 500u);
+  const auto & series = histogram->topics().at("test_topic");
+  EXPECT_THAT(series.buckets, ElementsAre(Key(0u), Key(500u), Key(1000u), Key(1500u), Key(2000u),
+                                          Key(2500u)));
+  for (const auto & [start, bucket] : series.buckets) {
+    EXPECT_EQ(bucket.message_count, 50u);
+  }
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, takes_the_schemas_of_the_previous_split_file)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  rcpputils::fs::create_directories(uri);
+  rosbag2_storage::TopicMetadata topic_metadata;
+  topic_metadata.name = "test_topic";
+  topic_metadata.type = "std_msgs/msg/String";
+  topic_metadata.serialization_format = "cdr";
+  rosbag2_storage::TopicMetadata removed_topic_metadata = topic_metadata;
+  removed_topic_metadata.name = "removed_topic";
+  removed_topic_metadata.type = "std_msgs/msg/Bool";
+
+  auto payload = std::make_shared<std::vector<uint8_t>>(10, uint8_t(1));
+  auto message = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+  message->serialized_data = std::shared_ptr<rcutils_uint8_array_t>(
+    new rcutils_uint8_array_t{payload->data(), payload->size(), payload->size(),
+                              rcutils_get_default_allocator()},
+    [payload](rcutils_uint8_array_t * data) { delete data; });
+  message->topic_name = "test_topic";
+  // As rosbag2 does on split: every topic is created again in each file.
+  for (const char * file : {"bag_0", "bag_1"}) {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    StorageOptions options;
+    options.uri = (uri / file).string();
+    options.storage_id = "mcap";
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE);
+    storage.create_topic(removed_topic_metadata);
+    storage.create_topic(topic_metadata);
+    storage.write(message);
+    storage.remove_topic(removed_topic_metadata);
+  }
+
+  std::vector<mcap::SchemaPtr> schemas;
+  std::vector<mcap::ChannelPtr> channels;
+  for (const char * file : {"bag_0.mcap", "bag_1.mcap"}) {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    StorageOptions options;
+    options.uri = (uri / file).string();
+    options.storage_id = "mcap";
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+    EXPECT_EQ(storage.get_metadata().message_count, 1u);
+    for (const auto & [id, channel] : storage.get_mcap_channels()) {
+      if (channel->topic == "test_topic") {
+        channels.push_back(channel);
+        schemas.push_back(storage.get_mcap_schemas().at(channel->schemaId));
+      }
+    }
+  }
+  ASSERT_EQ(channels.size(), 2u);
+  // The removed topic is not handed on, so the topic comes first in the second file.
+  EXPECT_EQ(channels[0]->id, 2u);
+  EXPECT_EQ(channels[1]->id, 1u);
+  EXPECT_EQ(schemas[1]->name, "std_msgs/msg/String");
+  EXPECT_FALSE(schemas[1]->data.empty());
+  EXPECT_EQ(schemas[1]->data, schemas[0]->data);
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+
+#ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
+TEST_F(TemporaryDirectoryFixture, gives_a_new_channel_to_a_split_topic_with_other_qos)
+{
+  auto uri = rcpputils::fs::path(temporary_dir_path_) / "bag";
+  rcpputils::fs::create_directories(uri);
+  rosbag2_storage::TopicMetadata topic_metadata;
+  topic_metadata.name = "test_topic";
+  topic_metadata.type = "std_msgs/msg/String";
+  topic_metadata.serialization_format = "cdr";
+
+  auto payload = std::make_shared<std::vector<uint8_t>>(10, uint8_t(1));
+  auto message = std::make_shared<rosbag2_storage::SerializedBagMessage>();
+  message->serialized_data = std::shared_ptr<rcutils_uint8_array_t>(
+    new rcutils_uint8_array_t{payload->data(), payload->size(), payload->size(),
+                              rcutils_get_default_allocator()},
+    [payload](rcutils_uint8_array_t * data) { delete data; });
+  message->topic_name = "test_topic";
+  for (const char * file : {"bag_0", "bag_1"}) {
+    rosbag2_storage_plugins::MCAPStorage storage;
+    StorageOptions options;
+    options.uri = (uri / file).string();
+    options.storage_id = "mcap";
+    storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_WRITE);
+    topic_metadata.offered_qos_profiles = std::string("qos of ") + file;
+    storage.create_topic(topic_metadata);
+    storage.write(message);
+  }
+
+  rosbag2_storage_plugins::MCAPStorage storage;
+  StorageOptions options;
+  options.uri = (uri / "bag_1.mcap").string();
+  options.storage_id = "mcap";
+  storage.open(options, rosbag2_storage::storage_interfaces::IOFlag::READ_ONLY);
+  // The channel handed on from the first file stays, without messages.
+  std::map<std::string, size_t> message_counts;
+  for (const auto & topic : storage.get_metadata().topics_with_message_count) {
+    EXPECT_EQ(topic.topic_metadata.name, "test_topic");
+    message_counts[topic.topic_metadata.offered_qos_profiles] = topic.message_count;
+  }
+  EXPECT_THAT(message_counts, ElementsAre(Pair("qos of bag_0", 0u), Pair("qos of bag_1", 1u)));
+}
+#endif  // #ifdef ROSBAG2_STORAGE_MCAP_HAS_STORAGE_OPTIONS
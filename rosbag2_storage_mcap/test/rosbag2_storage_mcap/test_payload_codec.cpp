@@ -0,0 +1,81 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rcpputils/shared_library.hpp"
+#include "rosbag2_storage_mcap/payload_codec.hpp"
+
+#include <gmock/gmock.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using rosbag2_storage_mcap::PayloadCodec;
+using rosbag2_storage_mcap::PayloadCodecRegistry;
+
+namespace
+{
+class CopyCodec : public PayloadCodec
+{
+public:
+  bool encode(const std::byte * data, size_t size, std::vector<std::byte> & encoded) const override
+  {
+    encoded.assign(data, data + size);
+    return true;
+  }
+
+  bool decode(const std::byte * data, size_t size, std::vector<std::byte> & decoded) const override
+  {
+    decoded.assign(data, data + size);
+    return true;
+  }
+};
+}  // namespace
+
+TEST(test_payload_codec, finds_registered_codecs_by_name)
+{
+  auto & registry = PayloadCodecRegistry::instance();
+  EXPECT_EQ(registry.find("test_payload_codec.copy"), nullptr);
+
+  const auto codec = std::make_shared<CopyCodec>();
+  registry.add("test_payload_codec.copy", codec);
+  EXPECT_EQ(registry.find("test_payload_codec.copy"), codec);
+  EXPECT_EQ(registry.find("test_payload_codec.other"), nullptr);
+
+  // Registering a name again replaces its codec.
+  const auto replacement = std::make_shared<CopyCodec>();
+  registry.add("test_payload_codec.copy", replacement);
+  EXPECT_EQ(registry.find("test_payload_codec.copy"), replacement);
+  EXPECT_EQ(&PayloadCodecRegistry::instance(), &registry);
+}
+
+TEST(test_payload_codec, finds_codecs_registered_by_loaded_libraries)
+{
+  auto & registry = PayloadCodecRegistry::instance();
+  EXPECT_EQ(registry.find("test_payload_codec.xor"), nullptr);
+
+  // Never unloaded, since the registry keeps the codec for the rest of the process.
+  new rcpputils::SharedLibrary(XOR_PAYLOAD_CODEC_LIBRARY);
+  const auto codec = registry.find("test_payload_codec.xor");
+  ASSERT_NE(codec, nullptr);
+
+  const std::string payload = "payload";
+  const auto * data = reinterpret_cast<const std::byte *>(payload.data());
+  std::vector<std::byte> encoded;
+  ASSERT_TRUE(codec->encode(data, payload.size(), encoded));
+  EXPECT_NE(encoded, std::vector<std::byte>(data, data + payload.size()));
+  std::vector<std::byte> decoded;
+  ASSERT_TRUE(codec->decode(encoded.data(), encoded.size(), decoded));
+  EXPECT_EQ(decoded, std::vector<std::byte>(data, data + payload.size()));
+}
@@ -0,0 +1,90 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/payload_dedup.hpp"
+
+#include <gmock/gmock.h>
+
+#include <string>
+
+using rosbag2_storage_mcap::internal::hash_payload;
+using rosbag2_storage_mcap::internal::PayloadDeduplicator;
+using rosbag2_storage_mcap::internal::PayloadReference;
+
+namespace
+{
+mcap::Message make_message(const std::string & payload, mcap::Timestamp log_time)
+{
+  mcap::Message message;
+  message.logTime = log_time;
+  message.data = reinterpret_cast<const std::byte *>(payload.data());
+  message.dataSize = payload.size();
+  return message;
+}
+}  // namespace
+
+TEST(test_payload_dedup, hashes_every_byte)
+{
+  const std::string payload = "0123456789abcdefghijk";
+  const auto * data = reinterpret_cast<const std::byte *>(payload.data());
+  const auto hash = hash_payload(data, payload.size());
+  EXPECT_EQ(hash_payload(data, payload.size()), hash);
+  for (size_t i = 0; i < payload.size(); ++i) {
+    auto changed = payload;
+    changed[i] ^= 1;
+    EXPECT_NE(hash_payload(reinterpret_cast<const std::byte *>(changed.data()), changed.size()),
+              hash);
+  }
+  EXPECT_NE(hash_payload(data, payload.size() - 1), hash);
+}
+
+TEST(test_payload_dedup, references_round_trip)
+{
+  const PayloadReference reference{1234567890123, 0xfedcba9876543210};
+  const auto encoded = reference.encode();
+  const auto decoded = PayloadReference::decode(encoded.data(), encoded.size());
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_EQ(decoded->log_time, reference.log_time);
+  EXPECT_EQ(decoded->hash, reference.hash);
+  EXPECT_FALSE(PayloadReference::decode(encoded.data(), encoded.size() - 1).has_value());
+}
+
+TEST(test_payload_dedup, references_first_of_repeated_payloads)
+{
+  const std::string state = "the same state, republished";
+  const std::string other = "another state, republished..";
+  PayloadDeduplicator deduplicator;
+  EXPECT_FALSE(deduplicator.add("/a", make_message(state, 1)).has_value());
+  // Topics are deduplicated separately.
+  EXPECT_FALSE(deduplicator.add("/b", make_message(state, 2)).has_value());
+  for (mcap::Timestamp time = 3; time < 6; ++time) {
+    const auto reference = deduplicator.add("/a", make_message(state, time));
+    ASSERT_TRUE(reference.has_value());
+    EXPECT_EQ(reference->log_time, 1u);
+    EXPECT_EQ(reference->hash,
+              hash_payload(reinterpret_cast<const std::byte *>(state.data()), state.size()));
+  }
+  // A new payload starts a new run, even if it goes back to an earlier one.
+  EXPECT_FALSE(deduplicator.add("/a", make_message(other, 6)).has_value());
+  EXPECT_FALSE(deduplicator.add("/a", make_message(state, 7)).has_value());
+  EXPECT_EQ(deduplicator.add("/a", make_message(state, 8))->log_time, 7u);
+}
+
+TEST(test_payload_dedup, keeps_payloads_no_larger_than_a_reference)
+{
+  const std::string small = "0123456789abcdef";
+  PayloadDeduplicator deduplicator;
+  EXPECT_FALSE(deduplicator.add("/a", make_message(small, 1)).has_value());
+  EXPECT_FALSE(deduplicator.add("/a", make_message(small, 2)).has_value());
+}
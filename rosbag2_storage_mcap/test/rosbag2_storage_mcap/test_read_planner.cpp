@@ -0,0 +1,91 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rcpputils/filesystem_helper.hpp"
+#include "rosbag2_storage_mcap/read_planner.hpp"
+#include "rosbag2_test_common/temporary_directory_fixture.hpp"
+
+#include <gmock/gmock.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+using rosbag2_storage_mcap::internal::ByteRange;
+using rosbag2_storage_mcap::internal::coalesce_ranges;
+using rosbag2_storage_mcap::internal::PlannedFileReader;
+using TemporaryDirectoryFixture = rosbag2_test_common::TemporaryDirectoryFixture;
+
+static std::vector<std::pair<uint64_t, uint64_t>> as_pairs(const std::vector<ByteRange> & ranges)
+{
+  std::vector<std::pair<uint64_t, uint64_t>> out;
+  for (const auto & range : ranges) {
+    out.emplace_back(range.offset, range.length);
+  }
+  return out;
+}
+
+TEST(test_read_planner, merges_nearby_ranges)
+{
+  auto coalesced = coalesce_ranges({{300, 50}, {0, 100}, {110, 100}, {1000, 10}}, 100, 1000);
+  EXPECT_THAT(as_pairs(coalesced),
+              ::testing::ElementsAre(std::make_pair(0u, 350u), std::make_pair(1000u, 10u)));
+}
+
+TEST(test_read_planner, does_not_merge_beyond_max_length)
+{
+  auto coalesced = coalesce_ranges({{0, 100}, {100, 100}, {200, 100}, {300, 500}}, 0, 200);
+  EXPECT_THAT(as_pairs(coalesced),
+              ::testing::ElementsAre(std::make_pair(0u, 200u), std::make_pair(200u, 100u),
+                                     std::make_pair(300u, 500u)));
+}
+
+TEST_F(TemporaryDirectoryFixture, planned_reads_return_file_contents)
+{
+  const auto path = (rcpputils::fs::path(temporary_dir_path_) / "data.bin").string();
+  std::string contents;
+  for (int i = 0; i < 4096; ++i) {
+    contents.push_back(char(i % 251));
+  }
+  {
+    std::ofstream file{path, std::ios::binary};
+    file << contents;
+  }
+
+  PlannedFileReader::Options options;
+  options.coalesce_gap = 64;
+  options.drop_behind = true;
+  PlannedFileReader reader{options};
+  ASSERT_TRUE(reader.open(path).ok());
+  EXPECT_EQ(reader.size(), contents.size());
+  reader.set_plan({{100, 100}, {250, 100}, {3000, 500}});
+  ASSERT_EQ(reader.plan().size(), 2u);
+
+  auto expect_read = [&](uint64_t offset, uint64_t size) {
+    std::byte * data = nullptr;
+    ASSERT_EQ(reader.read(&data, offset, size), size);
+    EXPECT_EQ(std::string(reinterpret_cast<const char *>(data), size),
+              contents.substr(offset, size));
+  };
+  // Inside the first coalesced range, outside the plan, and inside the second range.
+  expect_read(100, 9);
+  expect_read(260, 80);
+  expect_read(10, 20);
+  expect_read(3100, 400);
+  expect_read(150, 10);
+
+  std::byte * data = nullptr;
+  EXPECT_EQ(reader.read(&data, 4000, 500), 96u);
+  EXPECT_EQ(reader.read(&data, 5000, 10), 0u);
+}
@@ -0,0 +1,103 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "rosbag2_storage_mcap/split_handoff.hpp"
+
+#include <gmock/gmock.h>
+
+#include <memory>
+#include <string>
+
+using rosbag2_storage_mcap::internal::SplitHandoff;
+using rosbag2_storage_mcap::internal::SplitTopics;
+
+static SplitTopics make_topics()
+{
+  // Schema 1 is no longer used by any channel.
+  SplitTopics topics;
+  for (mcap::SchemaId id : {1, 2}) {
+    auto schema = std::make_shared<mcap::Schema>();
+    schema->id = id;
+    schema->name = "schema" + std::to_string(id);
+    topics.schemas.push_back(schema);
+  }
+  for (mcap::ChannelId id : {2, 4}) {
+    auto channel = std::make_shared<mcap::Channel>();
+    channel->id = id;
+    channel->topic = "topic" + std::to_string(id);
+    channel->schemaId = id == 2 ? 2 : 0;
+    topics.channels.push_back(channel);
+  }
+  return topics;
+}
+
+TEST(test_split_handoff, renumbers_the_topics_of_the_previous_file)
+{
+  SplitHandoff handoff;
+  handoff.put("/bags/rec/rec_3.mcap", make_topics());
+
+  const auto topics = handoff.take("/bags/rec/rec_4.mcap");
+  ASSERT_NE(topics, nullptr);
+  ASSERT_EQ(topics->schemas.size(), 1u);
+  EXPECT_EQ(topics->schemas[0]->id, 1u);
+  EXPECT_EQ(topics->schemas[0]->name, "schema2");
+  ASSERT_EQ(topics->channels.size(), 2u);
+  EXPECT_EQ(topics->channels[0]->id, 1u);
+  EXPECT_EQ(topics->channels[0]->topic, "topic2");
+  EXPECT_EQ(topics->channels[0]->schemaId, 1u);
+  EXPECT_EQ(topics->channels[1]->id, 2u);
+  EXPECT_EQ(topics->channels[1]->schemaId, 0u);
+
+  // Taken once.
+  EXPECT_EQ(handoff.take("/bags/rec/rec_4.mcap"), nullptr);
+}
+
+TEST(test_split_handoff, only_hands_on_to_the_next_file_of_the_recording)
+{
+  SplitHandoff handoff;
+  handoff.put("/bags/rec/rec_3.mcap", make_topics());
+  handoff.put("/bags/rec/rec.mcap", make_topics());
+  EXPECT_EQ(handoff.take("/bags/rec/rec_5.mcap"), nullptr);
+  EXPECT_EQ(handoff.take("/bags/other/rec_4.mcap"), nullptr);
+  EXPECT_EQ(handoff.take("/bags/rec/other_4.mcap"), nullptr);
+  EXPECT_EQ(handoff.take("/bags/rec/rec_0.mcap"), nullptr);
+
+  // A later file of the recording replaces the topics of the earlier one.
+  handoff.put("/bags/rec/rec_4.mcap", make_topics());
+  EXPECT_EQ(handoff.take("/bags/rec/rec_4.mcap"), nullptr);
+  EXPECT_NE(handoff.take("/bags/rec/rec_5.mcap"), nullptr);
+
+  handoff.put("/bags/rec/rec_5.mcap", make_topics());
+  handoff.clear();
+  EXPECT_EQ(handoff.take("/bags/rec/rec_6.mcap"), nullptr);
+}
+
+TEST(test_split_handoff, drops_topics_no_file_takes)
+{
+  SplitHandoff handoff;
+  // A later file of the recording drops the topics the next file did not take.
+  handoff.put("/bags/rec/rec_3.mcap", make_topics());
+  EXPECT_EQ(handoff.take("/bags/rec/rec_6.mcap"), nullptr);
+  EXPECT_EQ(handoff.take("/bags/rec/rec_4.mcap"), nullptr);
+
+  // The topics of the last files of finished recordings are dropped, oldest first.
+  for (size_t i = 0; i <= SplitHandoff::MAX_RECORDINGS; ++i) {
+    handoff.put("/bags/rec" + std::to_string(i) + "/rec_0.mcap", make_topics());
+  }
+  EXPECT_EQ(handoff.take("/bags/rec0/rec_1.mcap"), nullptr);
+  for (size_t i = 1; i <= SplitHandoff::MAX_RECORDINGS; ++i) {
+    EXPECT_NE(handoff.take("/bags/rec" + std::to_string(i) + "/rec_1.mcap"), nullptr);
+  }
+}
@@ -0,0 +1,116 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rosbag2_storage_mcap/summary_cache.hpp"
+
+#include <gmock/gmock.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using rosbag2_storage_mcap::internal::FileIdentity;
+using rosbag2_storage_mcap::internal::ParsedSummary;
+using rosbag2_storage_mcap::internal::SummaryCache;
+
+static FileIdentity make_identity(const std::string & path, uint64_t size, int64_t mtime)
+{
+  FileIdentity id;
+  id.path = path;
+  id.size = size;
+  id.mtime = mtime;
+  return id;
+}
+
+TEST(test_summary_cache, shares_summary_for_same_file)
+{
+  SummaryCache cache{4};
+  int loads = 0;
+  auto load = [&]() {
+    loads++;
+    return std::make_shared<const ParsedSummary>();
+  };
+  auto first = cache.get_or_load(make_identity("/a.mcap", 10, 1), load);
+  auto second = cache.get_or_load(make_identity("/a.mcap", 10, 1), load);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(loads, 1);
+
+  // A modified file is a different entry.
+  auto modified = cache.get_or_load(make_identity("/a.mcap", 10, 2), load);
+  EXPECT_NE(first, modified);
+  auto resized = cache.get_or_load(make_identity("/a.mcap", 11, 1), load);
+  EXPECT_NE(first, resized);
+  EXPECT_EQ(loads, 3);
+}
+
+TEST(test_summary_cache, evicts_least_recently_used)
+{
+  SummaryCache cache{2};
+  int loads = 0;
+  auto load = [&]() {
+    loads++;
+    return std::make_shared<const ParsedSummary>();
+  };
+  cache.get_or_load(make_identity("/a.mcap", 1, 1), load);
+  cache.get_or_load(make_identity("/b.mcap", 1, 1), load);
+  cache.get_or_load(make_identity("/a.mcap", 1, 1), load);
+  cache.get_or_load(make_identity("/c.mcap", 1, 1), load);
+  EXPECT_EQ(loads, 3);
+  // /b.mcap was the least recently used entry.
+  cache.get_or_load(make_identity("/a.mcap", 1, 1), load);
+  EXPECT_EQ(loads, 3);
+  cache.get_or_load(make_identity("/b.mcap", 1, 1), load);
+  EXPECT_EQ(loads, 4);
+}
+
+TEST(test_summary_cache, failed_load_is_not_cached)
+{
+  SummaryCache cache{4};
+  const auto id = make_identity("/a.mcap", 1, 1);
+  EXPECT_THROW(cache.get_or_load(id,
+                                 []() -> std::shared_ptr<const ParsedSummary> {
+                                   throw std::runtime_error("bad file");
+                                 }),
+               std::runtime_error);
+  auto summary = cache.get_or_load(id, []() { return std::make_shared<const ParsedSummary>(); });
+  EXPECT_NE(summary, nullptr);
+}
+
+TEST(test_summary_cache, concurrent_readers_load_once)
+{
+  SummaryCache cache{4};
+  std::atomic<int> loads{0};
+  const auto id = make_identity("/a.mcap", 1, 1);
+  std::vector<std::thread> threads;
+  std::vector<std::shared_ptr<const ParsedSummary>> results(8);
+  for (size_t i = 0; i < results.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      results[i] = cache.get_or_load(id, [&]() {
+        loads++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        return std::make_shared<const ParsedSummary>();
+      });
+    });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(loads.load(), 1);
+  for (const auto & result : results) {
+    EXPECT_EQ(result, results[0]);
+  }
+}
@@ -0,0 +1,52 @@
+// Copyright 2022, Foxglove Technologies. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// A library providing a payload codec, as a package depending on rosbag2_storage_mcap would write
+// it: the codec is registered when the library is loaded.
+
+#include "rosbag2_storage_mcap/payload_codec.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace
+{
+class XorCodec final : public rosbag2_storage_mcap::PayloadCodec
+{
+public:
+  bool encode(const std::byte * data, size_t size, std::vector<std::byte> & encoded) const override
+  {
+    encoded.resize(size);
+    for (size_t i = 0; i < size; ++i) {
+      encoded[i] = data[i] ^ std::byte{0x5a};
+    }
+    return true;
+  }
+
+  bool decode(const std::byte * data, size_t size, std::vector<std::byte> & decoded) const override
+  {
+    return encode(data, size, decoded);
+  }
+};
+
+struct Registration
+{
+  Registration()
+  {
+    rosbag2_storage_mcap::PayloadCodecRegistry::instance().add("test_payload_codec.xor",
+                                                               std::make_shared<XorCodec>());
+  }
+} registration;
+}  // namespace